@@ -0,0 +1,979 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "network.h"
+#include "rpc.h"
+#include "wire.h"
+
+/**
+ * @file lookup_sim.c
+ * @brief Lookup benchmark on a simulated Kademlia network
+ *
+ * Simulates a network of fake peers on 127.0.0.2, each one answering FIND_NODE
+ * and FIND_VALUE over UDP from a Kademlia routing table of its own, after a
+ * fixed delay. A fraction of the peers is dead and never answers. A node is
+ * started on top of it, bootstrapped with a few live peers, and driven through
+ * its command line to run one lookup after the other:
+ *
+ * - find_value downloads random keys held by the K_VALUE live peers closest to
+ *   them, and counts how many were found
+ * - store uploads random files, and counts how many of the K_VALUE live peers
+ *   closest to each file the node connected to for the replication
+ *
+ * Each command is timed until the node reports its end. Its RPCs are counted
+ * by the simulated network, which also tells whether a holder returned the
+ * key. The hop count is read from the log line the node prints at the end of
+ * a lookup, when it prints one.
+ *
+ *   ./lookup_sim -n 1000 -x 0.1 -r 20 -l 30 -m store
+ *
+ */
+
+/**
+ * @brief The first port of the fake peers, each one has the next
+ *
+ */
+#define SIM_BASE_PORT 20000
+
+/**
+ * @brief How many bootstrap peers the node is told about
+ *
+ */
+#define SIM_BOOTSTRAP_PEERS 3
+
+/**
+ * @brief How long a single command may run on the node
+ *
+ */
+#define SIM_COMMAND_TIMEOUT_MS (60 * 1000)
+
+/**
+ * @brief What the node is asked to do for each lookup
+ *
+ */
+enum SimMode { MODE_FIND_VALUE, MODE_STORE };
+
+/**
+ * @brief The settings of a simulation run
+ *
+ */
+struct SimConfig {
+  int peers;
+  double dead;
+  int rtt_ms;
+  int lookups;
+  enum SimMode mode;
+  const char *node;
+  unsigned seed;
+};
+
+/**
+ * @brief A fake peer of the simulated network
+ *
+ */
+struct SimPeer {
+  HashID id;
+  struct sockaddr_in addr;
+  int udp_fd;
+  int tcp_fd;
+  bool dead;
+
+  /**
+   * @brief Holds the key of the current find_value lookup
+   *
+   */
+  bool holder;
+
+  /**
+   * @brief The node connected to it during the current store lookup
+   *
+   */
+  bool connected;
+
+  /**
+   * @brief The peers of its routing table, at most K_VALUE per bucket
+   *
+   */
+  int *known;
+  int known_count;
+};
+
+/**
+ * @brief A response held back until the simulated delay has passed
+ *
+ */
+struct SimReply {
+  struct SimReply *next;
+  long due;
+  int fd;
+  struct sockaddr_in to;
+  size_t length;
+  char data[MAX_RPC_PACKET_SIZE];
+};
+
+/**
+ * @brief The whole simulated network, served by a thread of its own
+ *
+ */
+struct SimNetwork {
+  const struct SimConfig *config;
+  struct SimPeer *peers;
+  int epoll_fd;
+  pthread_t thread;
+
+  /**
+   * @brief Protects the flags of the peers and the counts of the lookup
+   *
+   */
+  pthread_mutex_t lock;
+
+  /**
+   * @brief The lookup RPCs received since the start of the current lookup
+   *
+   */
+  int requests;
+
+  /**
+   * @brief A holder returned the key during the current lookup
+   *
+   */
+  bool found;
+
+  /**
+   * @brief Responses in the order they are due, as every delay is the same
+   *
+   */
+  struct SimReply *head;
+  struct SimReply *tail;
+};
+
+/**
+ * @brief The measurements of a single lookup
+ *
+ */
+struct SimLookup {
+  long time_ns;
+  int rpcs;
+  int hops;
+  bool found;
+  int closest_connected;
+};
+
+/**
+ * @brief Reads the output of the node line by line
+ *
+ */
+struct LineReader {
+  int fd;
+  size_t length;
+  char data[4096];
+};
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void random_id(HashID id) {
+  for (size_t i = 0; i < sizeof(HashID); i++)
+    id[i] = (uint8_t)(lrand48() >> 8);
+}
+
+/**
+ * @brief Compares the distances of two IDs to a target
+ *
+ * @return int Negative if a is closer, positive if b is closer
+ */
+static int compare_distance(const HashID target, const HashID a,
+                            const HashID b) {
+  for (size_t i = 0; i < sizeof(HashID); i++) {
+    uint8_t da = a[i] ^ target[i];
+    uint8_t db = b[i] ^ target[i];
+
+    if (da != db)
+      return da < db ? -1 : 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief The Kademlia bucket of a peer, the length of the prefix shared with us
+ *
+ */
+static int shared_prefix(const HashID a, const HashID b) {
+  for (size_t i = 0; i < sizeof(HashID); i++) {
+    uint8_t x = a[i] ^ b[i];
+
+    if (x)
+      return i * 8 + __builtin_clz(x) - 24;
+  }
+
+  return sizeof(HashID) * 8;
+}
+
+/**
+ * @brief Selects the peers closest to a target among some candidates
+ *
+ * @param out Receives the indices of the closest peers, closest first
+ * @return int How many peers were selected, at most count
+ */
+static int closest_peers(const struct SimPeer *peers, const int *candidates,
+                         int candidate_count, const HashID target,
+                         bool live_only, int *out, int count) {
+  int selected = 0;
+
+  for (int c = 0; c < candidate_count; c++) {
+    int j = candidates ? candidates[c] : c;
+
+    if (live_only && peers[j].dead)
+      continue;
+
+    int pos = selected < count ? selected++ : count;
+    while (pos > 0 &&
+           compare_distance(target, peers[j].id, peers[out[pos - 1]].id) < 0) {
+      if (pos < count)
+        out[pos] = out[pos - 1];
+      pos--;
+    }
+
+    if (pos < count)
+      out[pos] = j;
+  }
+
+  return selected;
+}
+
+/**
+ * @brief Fills the routing table of every peer with at most K_VALUE random
+ * peers for each length of the prefix shared with them
+ *
+ */
+static int build_routing_tables(struct SimPeer *peers, int count) {
+  int buckets = sizeof(HashID) * 8 + 1;
+  int *table = malloc(buckets * K_VALUE * sizeof(int));
+  int *seen = malloc(buckets * sizeof(int));
+
+  if (!table || !seen) {
+    free(table);
+    free(seen);
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    memset(seen, 0, buckets * sizeof(int));
+
+    for (int j = 0; j < count; j++) {
+      if (j == i)
+        continue;
+
+      int bucket = shared_prefix(peers[i].id, peers[j].id);
+      int slot = seen[bucket]++;
+
+      // Reservoir sampling keeps each peer of the bucket equally likely
+      if (slot >= K_VALUE)
+        slot = lrand48() % (slot + 1);
+
+      if (slot < K_VALUE)
+        table[bucket * K_VALUE + slot] = j;
+    }
+
+    peers[i].known = malloc(count * sizeof(int));
+    if (!peers[i].known)
+      return -1;
+
+    for (int b = 0; b < buckets; b++) {
+      int n = seen[b] < K_VALUE ? seen[b] : K_VALUE;
+
+      for (int s = 0; s < n; s++)
+        peers[i].known[peers[i].known_count++] = table[b * K_VALUE + s];
+    }
+  }
+
+  free(table);
+  free(seen);
+  return 0;
+}
+
+static void fill_rpc_peer(const struct SimPeer *peer, struct RPCPeer *out) {
+  memset(out, 0, sizeof(*out));
+  memcpy(out->peer_id, peer->id, sizeof(HashID));
+  out->peer_addr = peer->addr;
+}
+
+/**
+ * @brief Builds the response of a fake peer to a lookup RPC
+ *
+ * @return size_t The size of the response, 0 if the request isn't answered
+ */
+static size_t answer(struct SimNetwork *net, int index, const char *request,
+                     size_t length, char *response) {
+  char message[MAX_RPC_PACKET_SIZE];
+  const struct RPCFind *find = (const struct RPCFind *)message;
+  struct SimPeer *peer = &net->peers[index];
+
+  if (length < sizeof(struct RPCMessageHeader))
+    return 0;
+
+  pthread_mutex_lock(&net->lock);
+  net->requests++;
+  pthread_mutex_unlock(&net->lock);
+
+  if (peer->dead ||
+      wire_decode(request, length, message, sizeof(message)) == 0 ||
+      (find->header.call_type != FIND_NODE &&
+       find->header.call_type != FIND_VALUE))
+    return 0;
+
+  int closest[K_VALUE];
+  int count = closest_peers(net->peers, peer->known, peer->known_count,
+                            find->key, false, closest, K_VALUE);
+
+  // Answered in the version of the request, as the node does
+  struct RPCMessageHeader header = {.magic_number = RPC_MAGIC,
+                                    .version = find->header.version,
+                                    .request_id = find->header.request_id};
+
+  if (find->header.call_type == FIND_NODE) {
+    struct RPCFindNodeResponse node_response = {0};
+    struct RPCFindNodeResponse *out = &node_response;
+
+    out->header = header;
+    out->header.packet_size = sizeof(*out);
+    out->header.call_type = FIND_NODE_RESPONSE;
+    out->success = 1;
+    out->num_closest = count;
+
+    for (int i = 0; i < count; i++)
+      fill_rpc_peer(&net->peers[closest[i]], &out->closest[i]);
+
+    return wire_encode(out, response, MAX_RPC_PACKET_SIZE);
+  }
+
+  struct RPCFindValueResponse value_response = {0};
+  struct RPCFindValueResponse *out = &value_response;
+
+  out->header = header;
+  out->header.packet_size = sizeof(*out);
+  out->header.call_type = FIND_VALUE_RESPONSE;
+  out->success = 1;
+
+  pthread_mutex_lock(&net->lock);
+  bool holder = peer->holder;
+  net->found |= holder;
+  pthread_mutex_unlock(&net->lock);
+
+  // Holders return themselves as the only provider of the key
+  if (holder) {
+    out->found_key = 1;
+    memcpy(out->values.key, find->key, sizeof(HashID));
+    out->values.num_values = 1;
+    fill_rpc_peer(peer, &out->values.values[0]);
+
+    return wire_encode(out, response, MAX_RPC_PACKET_SIZE);
+  }
+
+  out->num_closest = count;
+
+  for (int i = 0; i < count; i++)
+    fill_rpc_peer(&net->peers[closest[i]], &out->closest[i]);
+
+  return wire_encode(out, response, MAX_RPC_PACKET_SIZE);
+}
+
+static void handle_datagram(struct SimNetwork *net, int index) {
+  struct SimPeer *peer = &net->peers[index];
+
+  while (true) {
+    struct SimReply *reply = malloc(sizeof(struct SimReply));
+    char request[MAX_RPC_PACKET_SIZE];
+    socklen_t addr_len = sizeof(reply->to);
+
+    if (!reply)
+      return;
+
+    ssize_t ret = recvfrom(peer->udp_fd, request, sizeof(request), 0,
+                           (struct sockaddr *)&reply->to, &addr_len);
+
+    if (ret < 0 ||
+        (reply->length = answer(net, index, request, ret, reply->data)) == 0) {
+      free(reply);
+
+      if (ret < 0)
+        return;
+
+      continue;
+    }
+
+    // The request took half of the round trip to get here, the response takes
+    // the other half
+    reply->fd = peer->udp_fd;
+    reply->due = now_ns() + net->config->rtt_ms * 1000000L;
+    reply->next = NULL;
+
+    if (net->tail)
+      net->tail->next = reply;
+    else
+      net->head = reply;
+
+    net->tail = reply;
+  }
+}
+
+static void handle_connection(struct SimNetwork *net, int index) {
+  struct SimPeer *peer = &net->peers[index];
+  int fd;
+
+  // Only the connection itself is measured, nothing is served on it
+  while ((fd = accept(peer->tcp_fd, NULL, NULL)) >= 0) {
+    close(fd);
+
+    pthread_mutex_lock(&net->lock);
+    peer->connected = true;
+    pthread_mutex_unlock(&net->lock);
+  }
+}
+
+static void *run_network(void *arg) {
+  struct SimNetwork *net = arg;
+  struct epoll_event events[64];
+
+  while (true) {
+    int timeout = 50;
+
+    if (net->head) {
+      long wait = net->head->due - now_ns();
+      timeout = wait > 0 ? (int)(wait / 1000000) + 1 : 0;
+    }
+
+    int count = epoll_wait(net->epoll_fd, events, 64, timeout);
+
+    for (int i = 0; i < count; i++) {
+      int index = events[i].data.u32 >> 1;
+
+      if (events[i].data.u32 & 1)
+        handle_connection(net, index);
+      else
+        handle_datagram(net, index);
+    }
+
+    long now = now_ns();
+
+    while (net->head && net->head->due <= now) {
+      struct SimReply *reply = net->head;
+
+      sendto(reply->fd, reply->data, reply->length, 0,
+             (const struct sockaddr *)&reply->to, sizeof(reply->to));
+
+      net->head = reply->next;
+      if (!net->head)
+        net->tail = NULL;
+
+      free(reply);
+    }
+  }
+
+  return NULL;
+}
+
+static int open_peer_socket(struct SimNetwork *net, int index, int type) {
+  struct SimPeer *peer = &net->peers[index];
+  int fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+  int one = 1;
+
+  if (fd < 0)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, (const struct sockaddr *)&peer->addr, sizeof(peer->addr)) < 0 ||
+      (type == SOCK_STREAM && listen(fd, 16) < 0)) {
+    close(fd);
+    return -1;
+  }
+
+  struct epoll_event event = {.events = EPOLLIN,
+                              .data.u32 = index << 1 | (type == SOCK_STREAM)};
+  epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+  return fd;
+}
+
+static int start_network(struct SimNetwork *net,
+                         const struct SimConfig *config) {
+  memset(net, 0, sizeof(*net));
+  net->config = config;
+  net->peers = calloc(config->peers, sizeof(struct SimPeer));
+  net->epoll_fd = epoll_create1(0);
+  pthread_mutex_init(&net->lock, NULL);
+
+  if (!net->peers || net->epoll_fd < 0)
+    return -1;
+
+  for (int i = 0; i < config->peers; i++) {
+    struct SimPeer *peer = &net->peers[i];
+
+    random_id(peer->id);
+    peer->dead = drand48() < config->dead;
+    peer->addr.sin_family = AF_INET;
+    peer->addr.sin_port = htons(SIM_BASE_PORT + i);
+    inet_pton(AF_INET, "127.0.0.2", &peer->addr.sin_addr);
+
+    peer->udp_fd = open_peer_socket(net, i, SOCK_DGRAM);
+    peer->tcp_fd = -1;
+
+    // Dead peers refuse the connections of the replication
+    if (config->mode == MODE_STORE && !peer->dead)
+      peer->tcp_fd = open_peer_socket(net, i, SOCK_STREAM);
+
+    if (peer->udp_fd < 0 ||
+        (config->mode == MODE_STORE && !peer->dead && peer->tcp_fd < 0)) {
+      fprintf(stderr, "Couldn't bind port %d: %s\n", SIM_BASE_PORT + i,
+              strerror(errno));
+      return -1;
+    }
+  }
+
+  if (build_routing_tables(net->peers, config->peers) != 0)
+    return -1;
+
+  return pthread_create(&net->thread, NULL, run_network, net);
+}
+
+/**
+ * @brief Starts the node in a directory of its own, with its log piped to us
+ *
+ * @param input Receives the end of the pipe to its command line
+ * @param log Receives the end of the pipe from its log
+ * @return pid_t The process of the node, negative on error
+ */
+static pid_t start_node(const char *node, const char *dir, int *input,
+                        int *log) {
+  int in_pipe[2], log_pipe[2];
+
+  if (pipe(in_pipe) < 0 || pipe(log_pipe) < 0)
+    return -1;
+
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(in_pipe[0], STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(log_pipe[1], STDERR_FILENO);
+
+    if (chdir(dir) < 0)
+      _exit(1);
+
+    setenv("NETWORK_THREADS", "1", 1);
+    execl(node, node, (char *)NULL);
+    _exit(1);
+  }
+
+  close(in_pipe[0]);
+  close(log_pipe[1]);
+
+  *input = in_pipe[1];
+  *log = log_pipe[0];
+
+  return pid;
+}
+
+/**
+ * @brief Reads the next line of the node's log
+ *
+ * @return int 0 on success, -1 on timeout or once the node has exited
+ */
+static int read_line(struct LineReader *reader, char *line, size_t size,
+                     int timeout_ms) {
+  long deadline = now_ns() + timeout_ms * 1000000L;
+
+  while (true) {
+    char *end = memchr(reader->data, '\n', reader->length);
+
+    if (end || reader->length == sizeof(reader->data)) {
+      size_t length = end ? (size_t)(end - reader->data) : reader->length;
+      size_t copied = length < size - 1 ? length : size - 1;
+
+      memcpy(line, reader->data, copied);
+      line[copied] = '\0';
+
+      size_t consumed = end ? length + 1 : length;
+      memmove(reader->data, reader->data + consumed,
+              reader->length - consumed);
+      reader->length -= consumed;
+
+      return 0;
+    }
+
+    long left = (deadline - now_ns()) / 1000000;
+    struct pollfd pfd = {.fd = reader->fd, .events = POLLIN};
+
+    if (left < 0 || poll(&pfd, 1, (int)left) <= 0)
+      return -1;
+
+    ssize_t ret = read(reader->fd, reader->data + reader->length,
+                       sizeof(reader->data) - reader->length);
+
+    if (ret <= 0)
+      return -1;
+
+    reader->length += ret;
+  }
+}
+
+/**
+ * @brief Tells the node about a few live peers, as their broadcasts would
+ *
+ */
+static void bootstrap(const struct SimNetwork *net) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in node = {.sin_family = AF_INET,
+                             .sin_port = htons(BROADCAST_PORT)};
+  inet_pton(AF_INET, "127.0.0.1", &node.sin_addr);
+
+  for (int sent = 0; sent < SIM_BOOTSTRAP_PEERS;) {
+    const struct SimPeer *peer = &net->peers[lrand48() % net->config->peers];
+
+    if (peer->dead)
+      continue;
+
+    struct RPCBroadcast broadcast = {.header = {.magic_number = RPC_MAGIC,
+                                                .version = RPC_VERSION,
+                                                .packet_size =
+                                                    sizeof(broadcast),
+                                                .call_type = BROADCAST}};
+    fill_rpc_peer(peer, &broadcast.peer);
+
+    char data[MAX_RPC_PACKET_SIZE];
+    size_t length = wire_encode(&broadcast, data, sizeof(data));
+
+    sendto(fd, data, length, 0, (const struct sockaddr *)&node, sizeof(node));
+    sent++;
+  }
+
+  close(fd);
+}
+
+static void hex_to_id(const char *hex, HashID id) {
+  for (size_t i = 0; i < sizeof(HashID); i++)
+    sscanf(hex + 2 * i, "%2hhx", &id[i]);
+}
+
+/**
+ * @brief Counts the K_VALUE live peers closest to a key the node connected to
+ *
+ */
+static int count_closest_connected(struct SimNetwork *net, const HashID key) {
+  int closest[K_VALUE];
+  int count = closest_peers(net->peers, NULL, net->config->peers, key, true,
+                            closest, K_VALUE);
+  int connected = 0;
+
+  pthread_mutex_lock(&net->lock);
+  for (int i = 0; i < count; i++)
+    connected += net->peers[closest[i]].connected;
+  pthread_mutex_unlock(&net->lock);
+
+  return connected;
+}
+
+/**
+ * @brief Runs a single lookup on the node and waits for the end of its command
+ *
+ * @return int 0 on success, -1 if the node didn't finish the command in time
+ */
+static int run_lookup(struct SimNetwork *net, const char *dir, int n,
+                      int input, struct LineReader *log,
+                      struct SimLookup *out) {
+  const struct SimConfig *config = net->config;
+  char command[512], path[256], line[1024];
+  HashID key;
+
+  memset(out, 0, sizeof(*out));
+  random_id(key);
+
+  pthread_mutex_lock(&net->lock);
+  for (int i = 0; i < config->peers; i++) {
+    net->peers[i].holder = false;
+    net->peers[i].connected = false;
+  }
+
+  net->requests = 0;
+  net->found = false;
+  pthread_mutex_unlock(&net->lock);
+
+  out->hops = -1;
+
+  if (config->mode == MODE_FIND_VALUE) {
+    int holders[K_VALUE];
+    int count = closest_peers(net->peers, NULL, config->peers, key, true,
+                              holders, K_VALUE);
+
+    pthread_mutex_lock(&net->lock);
+    for (int i = 0; i < count; i++)
+      net->peers[holders[i]].holder = true;
+    pthread_mutex_unlock(&net->lock);
+
+    char hex[2 * sizeof(HashID) + 1];
+    for (size_t i = 0; i < sizeof(HashID); i++)
+      sprintf(hex + 2 * i, "%02x", key[i]);
+
+    snprintf(path, sizeof(path), "%s/f%d.torrent", dir, n);
+    FILE *file = fopen(path, "w");
+    if (!file)
+      return -1;
+
+    fprintf(file, "magnet:?xt=urn:sha256:%s&dn=f%d&xl=10", hex, n);
+    fclose(file);
+
+    snprintf(command, sizeof(command), "3\n%s\n", path);
+  } else {
+    // The random contents give the file a random key
+    snprintf(path, sizeof(path), "%s/u%d.bin", dir, n);
+    FILE *file = fopen(path, "w");
+    if (!file)
+      return -1;
+
+    fwrite(key, sizeof(HashID), 1, file);
+    fclose(file);
+
+    snprintf(command, sizeof(command), "2\n%s\n", path);
+  }
+
+  // Drop what the node logged since the last command
+  while (read_line(log, line, sizeof(line), 0) == 0)
+    ;
+
+  long start = now_ns();
+  if (write(input, command, strlen(command)) < 0)
+    return -1;
+
+  bool done = false;
+
+  while (!done &&
+         read_line(log, line, sizeof(line), SIM_COMMAND_TIMEOUT_MS) == 0) {
+    const char *lookup = strstr(line, "Lookup ");
+    const char *magnet = strstr(line, "magnet:?xt=urn:sha256:");
+
+    if (lookup && strstr(lookup, "hops"))
+      sscanf(strstr(lookup, "after"), "after %*d RPCs and %d hops",
+             &out->hops);
+
+    // The magnet URI of an upload carries the key of the file
+    if (magnet && config->mode == MODE_STORE) {
+      hex_to_id(magnet + strlen("magnet:?xt=urn:sha256:"), key);
+      out->closest_connected = count_closest_connected(net, key);
+      done = true;
+    }
+
+    if (strstr(line, "Error while trying to") ||
+        (config->mode == MODE_FIND_VALUE &&
+         strstr(line, "File successfully downloaded")))
+      done = true;
+  }
+
+  out->time_ns = now_ns() - start;
+
+  pthread_mutex_lock(&net->lock);
+  out->rpcs = net->requests;
+  out->found = net->found;
+  pthread_mutex_unlock(&net->lock);
+
+  return done ? 0 : -1;
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_results(const struct SimConfig *config,
+                          const struct SimLookup *lookups, int count) {
+  long *times = malloc(count * sizeof(long));
+  double rpcs = 0, hops = 0;
+  int found = 0, closest = 0, all_closest = 0, reported = 0;
+
+  if (!times)
+    return;
+
+  for (int i = 0; i < count; i++) {
+    times[i] = lookups[i].time_ns;
+    rpcs += lookups[i].rpcs;
+    if (lookups[i].hops >= 0) {
+      hops += lookups[i].hops;
+      reported++;
+    }
+
+    found += lookups[i].found;
+    closest += lookups[i].closest_connected;
+    all_closest += lookups[i].closest_connected == K_VALUE;
+  }
+
+  qsort(times, count, sizeof(long), compare_long);
+
+  printf("%d peers (%.0f%% dead), %d ms RTT, %d %s lookups\n", config->peers,
+         config->dead * 100, config->rtt_ms, count,
+         config->mode == MODE_STORE ? "store" : "find_value");
+  printf("time: median %.0f ms, p90 %.0f ms\n", times[count / 2] / 1e6,
+         times[count * 9 / 10] / 1e6);
+  printf("RPCs: mean %.1f\n", rpcs / count);
+
+  if (reported > 0)
+    printf("hops: mean %.2f\n", hops / reported);
+
+  if (config->mode == MODE_FIND_VALUE)
+    printf("found: %d/%d\n", found, count);
+  else
+    printf("on the %d closest: mean %.2f, all of them in %d/%d\n", K_VALUE,
+           (double)closest / count, all_closest, count);
+
+  free(times);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-b node binary] [-n peers] [-x dead fraction] "
+          "[-r rtt ms] [-l lookups] [-m find_value|store] [-s seed]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct SimConfig config = {.peers = 1000,
+                             .dead = 0.1,
+                             .rtt_ms = 20,
+                             .lookups = 30,
+                             .mode = MODE_FIND_VALUE,
+                             .node = "./KademliaClient",
+                             .seed = 1};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:n:x:r:l:m:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      config.node = optarg;
+      break;
+    case 'n':
+      config.peers = atoi(optarg);
+      break;
+    case 'x':
+      config.dead = atof(optarg);
+      break;
+    case 'r':
+      config.rtt_ms = atoi(optarg);
+      break;
+    case 'l':
+      config.lookups = atoi(optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "find_value") == 0) {
+        config.mode = MODE_FIND_VALUE;
+      } else if (strcmp(optarg, "store") == 0) {
+        config.mode = MODE_STORE;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      config.seed = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (config.peers <= SIM_BOOTSTRAP_PEERS || config.lookups <= 0 ||
+      config.dead < 0 || config.dead >= 0.5 || config.rtt_ms < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  char node[512];
+  if (!realpath(config.node, node)) {
+    fprintf(stderr, "Node binary not found: %s\n", config.node);
+    return 1;
+  }
+
+  config.node = node;
+  srand48(config.seed);
+
+  // Every peer has a socket, or two for the store lookups
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  struct SimNetwork net;
+  if (start_network(&net, &config) != 0) {
+    fprintf(stderr, "Couldn't start the simulated network\n");
+    return 1;
+  }
+
+  char dir[] = "/tmp/lookup_sim.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  int input;
+  struct LineReader log = {0};
+  pid_t pid = start_node(config.node, dir, &input, &log.fd);
+  if (pid < 0) {
+    perror("start_node");
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // Give the node time to bind its sockets
+  usleep(700 * 1000);
+  bootstrap(&net);
+  usleep(300 * 1000);
+
+  struct SimLookup *lookups = calloc(config.lookups, sizeof(struct SimLookup));
+  int completed = 0;
+
+  while (lookups && completed < config.lookups) {
+    if (run_lookup(&net, dir, completed, input, &log, &lookups[completed]) !=
+        0) {
+      fprintf(stderr, "The node didn't finish lookup %d\n", completed);
+      break;
+    }
+
+    completed++;
+  }
+
+  // The menu entries move as the CLI grows, stop the node with a signal
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+
+  if (completed > 0)
+    print_results(&config, lookups, completed);
+
+  free(lookups);
+
+  return completed < config.lookups;
+}
@@ -0,0 +1,384 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "network.h"
+#include "rpc.h"
+
+/**
+ * @file rpc_bench.c
+ * @brief Loopback RPC benchmark for the network backends
+ *
+ * Opens a number of persistent connections to a running node, each one driven
+ * by its own thread, and sends RPC requests back to back on them. Every
+ * request waits for its response, so the numbers reflect the round trip
+ * through the network loop of the node. Prints the throughput and the latency
+ * percentiles over all the requests.
+ *
+ * Run the node with the backend to measure, e.g.:
+ *
+ *   DISABLE_CLI=1 NETWORK_BACKEND=poll ./KademliaClient
+ *   ./rpc_bench -c 16 -n 20000
+ *
+ * The transport is chosen with -m: persistent TCP connections (the default),
+ * a new TCP connection per request like an unpooled lookup hop, or the UDP
+ * transport with one datagram per request and response.
+ *
+ * With -d, each connection keeps several requests in flight instead of one.
+ * Responses are matched to their requests by request ID.
+ *
+ */
+
+/**
+ * @brief How requests are sent to the node
+ *
+ */
+enum BenchMode { MODE_PERSISTENT, MODE_CONNECT, MODE_UDP };
+
+/**
+ * @brief The settings of a benchmark run
+ *
+ */
+struct BenchConfig {
+  struct sockaddr_in addr;
+  int connections;
+  int requests;
+  enum RPCCallType call_type;
+  enum BenchMode mode;
+
+  /**
+   * @brief How many requests each connection keeps in flight
+   *
+   */
+  int depth;
+};
+
+/**
+ * @brief The state of a single benchmark connection
+ *
+ */
+struct BenchWorker {
+  const struct BenchConfig *config;
+  pthread_t thread;
+
+  /**
+   * @brief The latency of every request in nanoseconds
+   *
+   */
+  long *latencies;
+  int completed;
+  int failed;
+};
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int recv_exact(int fd, void *data, size_t len) {
+  size_t received = 0;
+
+  while (received < len) {
+    ssize_t ret = recv(fd, (char *)data + received, len - received, 0);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      return -1;
+
+    received += ret;
+  }
+
+  return 0;
+}
+
+static int send_exact(int fd, const void *data, size_t len) {
+  size_t sent = 0;
+
+  while (sent < len) {
+    ssize_t ret = send(fd, (const char *)data + sent, len - sent, MSG_NOSIGNAL);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      return -1;
+
+    sent += ret;
+  }
+
+  return 0;
+}
+
+static int open_socket(const struct BenchConfig *config) {
+  int type = config->mode == MODE_UDP ? SOCK_DGRAM : SOCK_STREAM;
+  int fd = socket(AF_INET, type, 0);
+
+  if (fd < 0 || connect(fd, (const struct sockaddr *)&config->addr,
+                        sizeof(config->addr)) < 0) {
+    perror("connect");
+
+    if (fd >= 0)
+      close(fd);
+
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * @brief Receives the next response, a whole datagram for the UDP transport
+ *
+ */
+static int recv_response(int fd, const struct BenchConfig *config,
+                         char *response, size_t response_size) {
+  if (config->mode != MODE_UDP)
+    return recv_exact(fd, response, response_size);
+
+  while (true) {
+    ssize_t ret = recv(fd, response, MAX_RPC_PACKET_SIZE, 0);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret < 0)
+      return -1;
+
+    if ((size_t)ret == response_size)
+      return 0;
+  }
+}
+
+static void *run_worker(void *arg) {
+  struct BenchWorker *worker = arg;
+  const struct BenchConfig *config = worker->config;
+
+  int fd = -1;
+  if (config->mode != MODE_CONNECT && (fd = open_socket(config)) < 0) {
+    worker->failed = config->requests;
+    return NULL;
+  }
+
+  // A lost datagram fails its request instead of stalling the run
+  struct timeval timeout = {.tv_sec = 1};
+  if (config->mode == MODE_UDP)
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  struct RPCFind request = {0};
+  size_t request_size = sizeof(struct RPCPing);
+  size_t response_size = sizeof(struct RPCResponse);
+
+  memcpy(request.header.magic_number, RPC_MAGIC, 4);
+  // The structures are sent as they are laid out in memory, as in version 1
+  request.header.version = RPC_LEGACY_VERSION;
+  request.header.call_type = config->call_type;
+
+  if (config->call_type == FIND_NODE) {
+    request_size = sizeof(struct RPCFind);
+    response_size = sizeof(struct RPCFindNodeResponse);
+    memset(request.key, 0x11, sizeof(request.key));
+  }
+
+  request.header.packet_size = request_size;
+
+  char response[MAX_RPC_PACKET_SIZE];
+
+  // Requests are numbered by their index, which is also their request ID
+  long *sent_at = malloc(config->requests * sizeof(long));
+  int depth = config->mode == MODE_CONNECT ? 1 : config->depth;
+  int sent = 0;
+
+  while (sent_at && worker->completed < config->requests) {
+    bool ok = true;
+
+    while (ok && sent < config->requests && sent - worker->completed < depth) {
+      if (config->mode == MODE_CONNECT && (fd = open_socket(config)) < 0) {
+        ok = false;
+        break;
+      }
+
+      request.header.request_id = sent;
+      sent_at[sent] = now_ns();
+      ok = send_exact(fd, &request, request_size) == 0;
+      sent++;
+    }
+
+    if (!ok || recv_response(fd, config, response, response_size) != 0)
+      break;
+
+    uint32_t id = ((const struct RPCMessageHeader *)response)->request_id;
+    if (id < (uint32_t)sent)
+      worker->latencies[worker->completed++] = now_ns() - sent_at[id];
+
+    if (config->mode == MODE_CONNECT) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  worker->failed = config->requests - worker->completed;
+  free(sent_at);
+
+  if (fd >= 0)
+    close(fd);
+
+  return NULL;
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-a address] [-p port] [-c connections] [-n requests] "
+          "[-t ping|find_node] [-m persistent|connect|udp] [-d depth]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct BenchConfig config = {.connections = 8,
+                               .requests = 10000,
+                               .call_type = PING,
+                               .depth = 1};
+  const char *address = "127.0.0.1";
+  int port = SERVER_PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:p:c:n:t:m:d:")) != -1) {
+    switch (opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      config.connections = atoi(optarg);
+      break;
+    case 'n':
+      config.requests = atoi(optarg);
+      break;
+    case 't':
+      if (strcmp(optarg, "ping") == 0) {
+        config.call_type = PING;
+      } else if (strcmp(optarg, "find_node") == 0) {
+        config.call_type = FIND_NODE;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      if (strcmp(optarg, "persistent") == 0) {
+        config.mode = MODE_PERSISTENT;
+      } else if (strcmp(optarg, "connect") == 0) {
+        config.mode = MODE_CONNECT;
+      } else if (strcmp(optarg, "udp") == 0) {
+        config.mode = MODE_UDP;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'd':
+      config.depth = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (config.connections <= 0 || config.requests <= 0 || config.depth <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  config.addr.sin_family = AF_INET;
+  config.addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &config.addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid address: %s\n", address);
+    return 1;
+  }
+
+  struct BenchWorker *workers =
+      calloc(config.connections, sizeof(struct BenchWorker));
+  if (!workers) {
+    perror("calloc");
+    return 1;
+  }
+
+  long start = now_ns();
+
+  for (int i = 0; i < config.connections; i++) {
+    workers[i].config = &config;
+    workers[i].latencies = malloc(config.requests * sizeof(long));
+
+    if (!workers[i].latencies) {
+      perror("malloc");
+      return 1;
+    }
+
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+
+  for (int i = 0; i < config.connections; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  double elapsed = (now_ns() - start) / 1e9;
+
+  size_t total = 0;
+  int failed = 0;
+  for (int i = 0; i < config.connections; i++) {
+    total += workers[i].completed;
+    failed += workers[i].failed;
+  }
+
+  long *latencies = malloc((total ? total : 1) * sizeof(long));
+  if (!latencies) {
+    perror("malloc");
+    return 1;
+  }
+
+  size_t offset = 0;
+  for (int i = 0; i < config.connections; i++) {
+    memcpy(latencies + offset, workers[i].latencies,
+           workers[i].completed * sizeof(long));
+    offset += workers[i].completed;
+    free(workers[i].latencies);
+  }
+
+  qsort(latencies, total, sizeof(long), compare_long);
+
+  printf("%zu requests (%d failed) over %d connections in %.2f s\n", total,
+         failed, config.connections, elapsed);
+
+  if (total > 0) {
+    printf("throughput: %.0f req/s\n", total / elapsed);
+    printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+           latencies[total - 1] / 1e3);
+  }
+
+  free(latencies);
+  free(workers);
+
+  return failed > 0;
+}
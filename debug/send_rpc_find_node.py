@@ -12,9 +12,10 @@ PING = 1
 STORE = 2
 FIND_NODE = 4
 RPC_MAGIC = b"KDMT"
+RPC_VERSION = 1
 
 HASH_SIZE = 32  # SHA256
-RPC_HEADER_FORMAT = "<4sii"  # magic, packet_size, call_type
+RPC_HEADER_FORMAT = "<4sBiiI"  # magic, version, packet_size, call_type, request_id
 RPC_HEADER_SIZE = struct.calcsize(RPC_HEADER_FORMAT)
 
 # struct RPCFind { RPCMessageHeader header; HashID key; }
@@ -32,7 +33,8 @@ def create_find_node_packet(filepath: str) -> bytes:
     key_hash = sha256_file(filepath)
 
     packet_size = RPC_FIND_SIZE
-    header = struct.pack(RPC_HEADER_FORMAT, RPC_MAGIC, packet_size, FIND_NODE)
+    header = struct.pack(RPC_HEADER_FORMAT, RPC_MAGIC, RPC_VERSION, packet_size,
+                         FIND_NODE, 1)
     packet = header + key_hash
     return packet
 
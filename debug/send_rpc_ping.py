@@ -1,5 +1,6 @@
 import socket
 import struct
+import sys
 
 # Server address
 SERVER_IP = "127.0.0.1"
@@ -14,23 +15,30 @@ STORE_RESPONSE = 32
 FIND_NODE_RESPONSE = 64
 FIND_VALUE_RESPONSE = 128
 
+RPC_VERSION = 1
+
 # struct RPCMessageHeader {
 #   char magic_number[4];
+#   uint8_t version;
 #   int packet_size;
 #   enum RPCCallType call_type;
+#   uint32_t request_id;
 # }
 
 #  - 4s  : 4-byte magic number
+#  - B   : 1-byte version
 #  - i   : 4-byte int (packet_size)
 #  - i   : 4-byte enum (call_type)
-RPC_HEADER_FORMAT = "<4sii"
+#  - I   : 4-byte request ID, copied into the response
+RPC_HEADER_FORMAT = "<4sBiiI"
 
-def create_ping_packet():
+def create_ping_packet(request_id: int = 1):
     magic = b"KDMT"
     call_type = PING
     packet_size = struct.calcsize(RPC_HEADER_FORMAT)
 
-    header = struct.pack(RPC_HEADER_FORMAT, magic, packet_size, call_type)
+    header = struct.pack(RPC_HEADER_FORMAT, magic, RPC_VERSION, packet_size,
+                         call_type, request_id)
     return header
 
 def send_rpc_request(data: bytes):
@@ -50,7 +58,25 @@ def send_rpc_request(data: bytes):
         except socket.timeout:
             print("No response received.")
 
+def send_rpc_datagram(data: bytes):
+    """Send the packet over the UDP transport, one message per datagram"""
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        sock.settimeout(2)
+        sock.sendto(data, (SERVER_IP, SERVER_PORT))
+        print(f"Sent {len(data)} bytes to {SERVER_IP}:{SERVER_PORT} over UDP")
+
+        try:
+            response, _ = sock.recvfrom(2048)
+            reply_id = struct.unpack(RPC_HEADER_FORMAT, response[:17])[4]
+            print(f"Received {len(response)} bytes for request {reply_id}: {response}")
+        except socket.timeout:
+            print("No response received.")
+
 if __name__ == "__main__":
     packet = create_ping_packet()
     print(f"Sending PING RPC ({len(packet)} bytes): {packet}")
-    send_rpc_request(packet)
+
+    if len(sys.argv) > 1 and sys.argv[1] == "udp":
+        send_rpc_datagram(packet)
+    else:
+        send_rpc_request(packet)
@@ -10,13 +10,14 @@ SERVER_PORT = 8182
 PING = 1
 STORE = 2
 RPC_MAGIC = b"KDMT"
+RPC_VERSION = 1
 
 # Sizes
 K_VALUE = 2           # match your C definition
 HASH_SIZE = 32        # SHA-256
 PEER_STRUCT_SIZE = 80  # placeholder: adjust if needed
-# struct RPCMessageHeader { 4s + int + int }
-RPC_HEADER_FORMAT = "<4sii"
+# struct RPCMessageHeader { 4s + uint8 version + int + int + uint32 request_id }
+RPC_HEADER_FORMAT = "<4sBiiI"
 RPC_HEADER_SIZE = struct.calcsize(RPC_HEADER_FORMAT)
 
 # struct RPCKeyValue { HashID key[32]; size_t num_values; RPCPeer values[K_VALUE] }
@@ -43,7 +44,8 @@ def create_store_packet(filepath: str) -> bytes:
     key_value = struct.pack(RPC_KEYVALUE_FORMAT, key_hash, num_values, values)
 
     packet_size = RPC_HEADER_SIZE + RPC_KEYVALUE_SIZE
-    header = struct.pack(RPC_HEADER_FORMAT, RPC_MAGIC, packet_size, STORE)
+    header = struct.pack(RPC_HEADER_FORMAT, RPC_MAGIC, RPC_VERSION, packet_size,
+                         STORE, 1)
 
     return header + key_value
 
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file admission.h
+ * @brief Admission control of the RPC requests received by a network thread
+ *
+ * Every RPC request goes through two checks before it is dispatched, both
+ * much cheaper than handling it.
+ *
+ * Each source address owns a token bucket refilled at RPC_RATE tokens per
+ * second, holding at most RPC_BURST of them. A request takes one token per
+ * key it carries, so a batched request costs as much as the single requests
+ * it replaces. A request finding too few tokens in the bucket of its source is
+ * dropped without touching the routing table or the storage. A batch larger
+ * than RPC_BURST needs a full bucket and empties it. Buckets are kept in a small hash table
+ * per network thread, a source that doesn't fit evicts the least recently
+ * seen one of its probe window and starts with a full bucket.
+ *
+ * Each round of the network loop, from one wait to the next, dispatches the
+ * requests of at most RPC_ROUND_BUDGET keys. A batched request admitted with
+ * less room left than it has keys ends the round. Once the budget is spent, the sockets with
+ * requests left are served again at the end of the next round, in the order
+ * they were put off, so a peer pipelining many requests can't hold the loop
+ * while others wait.
+ *
+ */
+
+/**
+ * @brief The number of bits of the index of the bucket table
+ *
+ */
+#define ADMISSION_TABLE_BITS 10
+
+/**
+ * @brief How many consecutive slots are searched for the bucket of a source
+ *
+ */
+#define ADMISSION_PROBE 4
+
+/**
+ * @brief The default number of requests per second a source may send,
+ * overridden by RPC_RATE
+ *
+ */
+#define DEFAULT_RPC_RATE 2000
+
+/**
+ * @brief The default number of requests a source may send in a burst,
+ * overridden by RPC_BURST
+ *
+ */
+#define DEFAULT_RPC_BURST 500
+
+/**
+ * @brief The default number of requests dispatched per round of the network
+ * loop, overridden by RPC_ROUND_BUDGET
+ *
+ */
+#define DEFAULT_RPC_ROUND_BUDGET 256
+
+/**
+ * @brief Counters of the admission decisions of every network thread
+ *
+ */
+struct AdmissionStats {
+  /**
+   * @brief The number of requests dispatched
+   *
+   */
+  uint64_t admitted;
+
+  /**
+   * @brief The number of requests dropped because their source exceeded its
+   * rate
+   *
+   */
+  uint64_t rate_limited;
+
+  /**
+   * @brief The number of times a socket was put off to the next round because
+   * the round budget was spent
+   *
+   */
+  uint64_t deferred;
+};
+
+/**
+ * @brief Reads the admission limits of the calling network thread from the
+ * environment
+ *
+ */
+void admission_init();
+
+/**
+ * @brief Starts a new round of the network loop, restoring the round budget
+ *
+ * @param now_ms The current time in milliseconds of timer_now_ms, used to
+ * refill the buckets during the round
+ */
+void admission_new_round(uint64_t now_ms);
+
+/**
+ * @brief Gets how many more keys may be dispatched in the current round
+ *
+ * @return size_t Returns the number of keys left in the round budget
+ */
+size_t admission_room();
+
+/**
+ * @brief Records that a socket with requests left was put off because the
+ * round budget was spent
+ *
+ */
+void admission_defer();
+
+/**
+ * @brief Takes a token per key of a request from the bucket of its source, and
+ * its keys from the round budget. Only call it while admission_room is not 0
+ *
+ * @param from The source of the request
+ * @param keys The number of keys of the request, 1 unless it is batched
+ * @return true The request may be dispatched
+ * @return false The source exceeded its rate, the request must be dropped
+ */
+bool admission_admit(const struct sockaddr_in *from, size_t keys);
+
+/**
+ * @brief Gets the counters summed over every network thread
+ *
+ * @param out_stats A pointer to memory where the counters will be stored
+ */
+void admission_get_stats(struct AdmissionStats *out_stats);
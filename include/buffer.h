@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @file buffer.h
+ * @brief Growable byte buffers used for socket input and output
+ *
+ * A buffer holds a contiguous range of readable bytes between a read offset and
+ * a write offset. Data is appended at the write offset and consumed from the
+ * read offset, the consumed space is reclaimed when more room is needed.
+ *
+ */
+
+/**
+ * @brief A growable byte buffer
+ *
+ */
+struct Buffer {
+  /**
+   * @brief The allocated memory, NULL until something is stored
+   *
+   */
+  char *data;
+
+  /**
+   * @brief Offset of the first readable byte
+   *
+   */
+  size_t start;
+
+  /**
+   * @brief Offset one past the last readable byte
+   *
+   */
+  size_t end;
+
+  /**
+   * @brief The number of bytes allocated for data
+   *
+   */
+  size_t capacity;
+};
+
+/**
+ * @brief Initializes an empty buffer
+ *
+ * @param buf The buffer to initialize
+ */
+void buffer_init(struct Buffer *buf);
+
+/**
+ * @brief Frees the memory held by a buffer and empties it
+ *
+ * @param buf The buffer to free
+ */
+void buffer_free(struct Buffer *buf);
+
+/**
+ * @brief Makes sure at least len bytes can be appended without reallocation
+ *
+ * @param buf The buffer to grow
+ * @param len The number of bytes that should be writable
+ * @return int Returns 0 if the space is available, a negative number otherwise
+ */
+int buffer_reserve(struct Buffer *buf, size_t len);
+
+/**
+ * @brief Appends data at the end of a buffer
+ *
+ * @param buf The buffer to append to
+ * @param src The data to append
+ * @param len The number of bytes to append
+ * @return int Returns 0 if the data was appended, a negative number otherwise
+ */
+int buffer_append(struct Buffer *buf, const void *src, size_t len);
+
+/**
+ * @brief Drops bytes from the front of a buffer
+ *
+ * @param buf The buffer to consume from
+ * @param len The number of bytes to drop
+ */
+void buffer_consume(struct Buffer *buf, size_t len);
+
+/**
+ * @brief Gets a pointer to the readable bytes of a buffer
+ *
+ * @param buf The buffer
+ * @return const char* Returns a pointer to the first readable byte
+ */
+const char *buffer_data(const struct Buffer *buf);
+
+/**
+ * @brief Gets the number of readable bytes in a buffer
+ *
+ * @param buf The buffer
+ * @return size_t Returns the number of readable bytes
+ */
+size_t buffer_length(const struct Buffer *buf);
+
+/**
+ * @brief Performs a single read from a file descriptor into a buffer
+ *
+ * @param buf The buffer to read into
+ * @param fd The file descriptor to read from
+ * @param max The maximum number of bytes to read
+ * @return ssize_t Returns the number of bytes read, 0 on EOF, a negative number
+ * if there was an error (errno is preserved)
+ */
+ssize_t buffer_read_fd(struct Buffer *buf, int fd, size_t max);
+
+/**
+ * @brief Performs a single write of the readable bytes of a buffer to a socket,
+ * consuming what was written
+ *
+ * @param buf The buffer to write from
+ * @param fd The socket to write to
+ * @return ssize_t Returns the number of bytes written, a negative number if
+ * there was an error (errno is preserved)
+ */
+ssize_t buffer_write_fd(struct Buffer *buf, int fd);
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rpc.h"
+
+/**
+ * @file call.h
+ * @brief Outstanding RPC requests of the client side
+ *
+ * A call table tracks the requests sent to other peers that are still waiting
+ * for a response. Each request gets an ID that the peer copies into its
+ * response, so many requests can be in flight at once, several of them on the
+ * same socket, and their responses can complete in any order.
+ *
+ * Requests sent as datagrams use one connected UDP socket per peer and are
+ * retransmitted with an exponential backoff. A peer that refuses datagrams is
+ * asked over TCP instead. Requests sent over TCP are pipelined on a single
+ * pooled connection per peer. The connection goes back to the pool once every
+ * response has been read.
+ *
+ * Requests are sent in RPC_VERSION to the peers that answered in it before,
+ * in RPC_LEGACY_VERSION to those that only answered in the older version. A
+ * peer that never answered is asked in RPC_VERSION. Its retransmissions
+ * carry the request in both versions, and so does the first datagram while
+ * other peers answered in RPC_LEGACY_VERSION recently. Over TCP, the request
+ * is sent again in RPC_LEGACY_VERSION after the peer closed the connection.
+ *
+ */
+
+/**
+ * @brief The number of bits of the index of the table of the protocol
+ * versions spoken by the peers called
+ *
+ */
+#define CALL_VERSION_BITS 10
+
+/**
+ * @brief How long a peer that answered in RPC_LEGACY_VERSION is asked in it,
+ * before it is asked in RPC_VERSION again in case it was upgraded, or the
+ * request in RPC_VERSION was just lost. Also how long the first datagram to
+ * a new peer is sent in both versions after such an answer
+ *
+ */
+#define CALL_LEGACY_PROBE_MS (10 * 60 * 1000)
+
+/**
+ * @brief The number of low bits of a request ID holding the slot of its call
+ *
+ */
+#define CALL_SLOT_BITS 6
+
+/**
+ * @brief The maximum number of calls a table holds at once
+ *
+ */
+#define CALL_MAX_PENDING (1 << CALL_SLOT_BITS)
+
+/**
+ * @brief The first retransmission timeout of a datagram request, doubled after
+ * each attempt
+ *
+ */
+#define CALL_RETRY_MS 250
+
+/**
+ * @brief How many times a datagram request is sent before giving up
+ *
+ */
+#define CALL_DATAGRAM_ATTEMPTS 3
+
+/**
+ * @brief Describes where a call stands
+ *
+ */
+enum CallState {
+  /**
+   * @brief The slot is unused
+   *
+   */
+  CALL_FREE,
+
+  /**
+   * @brief The request was sent and waits for its response
+   *
+   */
+  CALL_PENDING,
+
+  /**
+   * @brief The response was received
+   *
+   */
+  CALL_DONE,
+
+  /**
+   * @brief The peer couldn't be reached or didn't answer in time
+   *
+   */
+  CALL_FAILED
+};
+
+/**
+ * @brief A request sent to a peer and its outcome
+ *
+ */
+struct Call {
+  enum CallState state;
+
+  /**
+   * @brief The ID of the request, its low bits are the slot of the call
+   *
+   */
+  uint32_t request_id;
+
+  /**
+   * @brief The address of the peer
+   *
+   */
+  struct sockaddr_in addr;
+
+  /**
+   * @brief The index of the channel the request was sent on
+   *
+   */
+  size_t channel;
+
+  /**
+   * @brief How many times the request was sent on its channel
+   *
+   */
+  int attempts;
+
+  /**
+   * @brief Whether the request was already sent again on a fresh connection
+   * after a pooled one failed
+   *
+   */
+  bool retried;
+
+  /**
+   * @brief Whether the request has to be sent again on a fresh connection
+   *
+   */
+  bool resend;
+
+  /**
+   * @brief When the request times out or is retransmitted, in milliseconds of
+   * timer_now_ms
+   *
+   */
+  uint64_t deadline;
+
+  /**
+   * @brief Whether the request is sent again over TCP in RPC_LEGACY_VERSION,
+   * after a peer whose version is unknown closed the connection on it
+   *
+   */
+  bool legacy;
+
+  /**
+   * @brief The request structure, encoded in the version of the peer each
+   * time it is sent. It shares one allocation with the response, sized for
+   * both structures, so batched calls don't make every call larger
+   *
+   */
+  char *request;
+  size_t request_length;
+
+  /**
+   * @brief For CALL_DONE, the response structure, whatever version it came in
+   *
+   */
+  char *response;
+  size_t response_length;
+
+  /**
+   * @brief For CALL_FAILED, the errno describing the failure
+   *
+   */
+  int error;
+
+  /**
+   * @brief Data of the caller, left untouched
+   *
+   */
+  void *user;
+};
+
+struct CallChannel;
+
+/**
+ * @brief The calls of a client operation, such as a lookup
+ *
+ */
+struct CallTable {
+  /**
+   * @brief The calls, indexed by the low bits of their request IDs
+   *
+   */
+  struct Call *calls;
+
+  /**
+   * @brief The number of calls waiting for a response
+   *
+   */
+  size_t pending;
+
+  /**
+   * @brief The high bits of the next request ID, randomly seeded so that late
+   * responses to another table aren't mistaken for ours
+   *
+   */
+  uint32_t next_id;
+
+  /**
+   * @brief The slots of the completed calls not returned by call_wait yet, in
+   * completion order
+   *
+   */
+  size_t done[CALL_MAX_PENDING];
+  size_t done_head;
+  size_t done_count;
+
+  /**
+   * @brief The sockets to the peers, one per peer and transport
+   *
+   */
+  struct CallChannel *channels;
+  size_t channel_count;
+  size_t channel_capacity;
+
+  /**
+   * @brief One entry per channel, passed to poll
+   *
+   */
+  struct pollfd *pollfds;
+};
+
+/**
+ * @brief Initializes an empty call table
+ *
+ * @param table The table to initialize
+ * @return int Returns 0 if the table was initialized, a negative number if
+ * allocation failed
+ */
+int call_table_init(struct CallTable *table);
+
+/**
+ * @brief Frees a call table. Calls still pending are abandoned, the TCP
+ * connections with nothing left to read go back to the pool
+ *
+ * @param table The table to free
+ */
+void call_table_free(struct CallTable *table);
+
+/**
+ * @brief Sends a request to a peer. The request ID and the version are filled
+ * in, the rest of the request is sent as is
+ *
+ * @param table The table tracking the call
+ * @param addr The address of the peer
+ * @param request The RPC request structure
+ * @param length The length of the request
+ * @param datagram Whether the request is sent over UDP, only lookup RPCs are
+ * accepted as datagrams
+ * @param user Data of the caller, stored in the call
+ * @return struct Call* Returns the call, which completes through call_wait even
+ * if sending failed. NULL if the table is full, the request is invalid or
+ * allocation failed
+ */
+struct Call *call_start(struct CallTable *table, const struct sockaddr_in *addr,
+                        const void *request, size_t length, bool datagram,
+                        void *user);
+
+/**
+ * @brief Waits for the next call to complete, either with its response or
+ * with a failure
+ *
+ * @param table The table of the calls
+ * @return struct Call* Returns the completed call, which stays valid until
+ * call_finish. NULL once no call is pending
+ */
+struct Call *call_wait(struct CallTable *table);
+
+/**
+ * @brief Waits for the next call to complete, for a limited time
+ *
+ * @param table The table of the calls
+ * @param timeout_ms How long to wait at most in milliseconds, -1 to wait until
+ * a call completes
+ * @return struct Call* Returns the completed call, which stays valid until
+ * call_finish. NULL if no call completed in time or none is pending
+ */
+struct Call *call_wait_timeout(struct CallTable *table, int timeout_ms);
+
+/**
+ * @brief Releases the slot of a call returned by call_wait
+ *
+ * @param table The table of the call
+ * @param call The call
+ */
+void call_finish(struct CallTable *table, struct Call *call);
@@ -2,6 +2,13 @@
 
 #include "magnet.h"
 
+/**
+ * @brief The maximum number of network threads, set with the NETWORK_THREADS
+ * environment variable
+ *
+ */
+#define MAX_NETWORK_THREADS 64
+
 extern struct CommandQueue commands;
 
 /**
@@ -14,14 +21,16 @@ extern struct CommandQueue commands;
  */
 
 /**
- * @brief Initializes the state of the P2P client which runs on its own thread
+ * @brief Initializes the state of the P2P client which runs on its own network
+ * threads
  *
  */
 int start_client();
 
 /**
- * @brief Entry point of the P2P client thread
+ * @brief Entry point of a P2P network thread
  *
+ * @param arg The index of the network thread, cast to a pointer
  */
 void *init_client(void *arg);
 
@@ -55,6 +64,28 @@ int download_file(struct FileMagnet *file);
  */
 int upload_file(struct FileMagnet *file);
 
+/**
+ * @brief Uploads many files to the P2P network at once, each peer is sent the
+ * keys of all the files it stores together
+ *
+ * @param files The files to be uploaded
+ * @param count The number of files
+ * @return int Returns 0 if every file was uploaded successfully, a negative
+ * number otherwise
+ */
+int upload_files(struct FileMagnet **files, size_t count);
+
+/**
+ * @brief Downloads many files from the P2P network at once, the peers
+ * providing them are looked up together
+ *
+ * @param files The files to be downloaded
+ * @param count The number of files
+ * @return int Returns 0 if every file was downloaded successfully, a negative
+ * number otherwise
+ */
+int download_files(struct FileMagnet **files, size_t count);
+
 /**
  * @brief Prints out the current network status to the TTY
  *
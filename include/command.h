@@ -2,6 +2,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /**
  * @file command.h
@@ -12,6 +13,10 @@
  * thread. The frontend thread pushes commands to the queue whenever it needs
  * the client to do something.
  *
+ * Every push also signals an eventfd, which the primary network thread watches
+ * alongside its sockets. This lets the network loop sleep until there is
+ * actually something to do, instead of polling the queue periodically.
+ *
  */
 
 #define MAX_COMMANDS_PENDING 10
@@ -20,7 +25,14 @@
  * @brief Describes the different commands that can be issued to the P2P client
  *
  */
-enum CommandType { CMD_NONE, CMD_SHOW_STATUS, CMD_UPLOAD, CMD_DOWNLOAD };
+enum CommandType {
+  CMD_NONE,
+  CMD_SHOW_STATUS,
+  CMD_UPLOAD,
+  CMD_DOWNLOAD,
+  CMD_UPLOAD_MANY,
+  CMD_DOWNLOAD_MANY
+};
 
 /**
  * @brief Represents a single command to be issued to the P2P client
@@ -39,6 +51,14 @@ struct Command {
    */
   struct FileMagnet *file;
 
+  /**
+   * @brief For CMD_UPLOAD_MANY & CMD_DOWNLOAD_MANY, the information about the
+   * files
+   *
+   */
+  struct FileMagnet **files;
+  size_t file_count;
+
   /**
    * @brief Lock for acquiring the Command object
    *
@@ -74,6 +94,12 @@ struct CommandQueue {
   int tail;
   int count;
   pthread_mutex_t lock;
+
+  /**
+   * @brief An eventfd signalled whenever a command is pushed
+   *
+   */
+  int event_fd;
 };
 
 bool command_init(struct Command *cmd);
@@ -111,6 +137,14 @@ bool queue_push(struct CommandQueue *q, struct Command *cmd);
  */
 bool queue_pop(struct CommandQueue *q, struct Command **out_cmd);
 
+/**
+ * @brief Resets the eventfd of the queue, must be called by the consumer after
+ * it was woken up and before it pops the pending commands
+ *
+ * @param q The queue to reset the eventfd of
+ */
+void queue_clear_event(struct CommandQueue *q);
+
 /**
  * @brief Cleans up the state associated with a queue
  *
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "timer.h"
+
+struct HttpResponse;
+
+/**
+ * @file connection.h
+ * @brief Per-connection context objects for the network layer
+ *
+ * Every socket registered with the network loop (listen socket, broadcast and
+ * RPC datagram sockets, wakeup eventfds and accepted peer connections) is
+ * described by a struct Connection.
+ * The readiness backends hand these objects back to the loop, so the loop only
+ * ever touches the connections that actually have work to do.
+ *
+ * Peer connections are non-blocking. Incoming bytes are accumulated in a
+ * per-connection input buffer and parsed incrementally, outgoing bytes that
+ * can't be written right away are queued in an output buffer and flushed once
+ * the socket becomes writable again.
+ *
+ * Closed connections are kept on a per-thread free-list and reused along with
+ * their buffers, so accepting a connection usually doesn't allocate. Open
+ * connections are kept ordered by activity, which lets the network loop find
+ * the least recently active one in constant time when it has to evict.
+ *
+ */
+
+/**
+ * @brief Describes what a connection is used for
+ *
+ */
+enum ConnectionKind {
+  /**
+   * @brief The TCP socket accepting new peer connections
+   *
+   */
+  CONN_LISTEN,
+
+  /**
+   * @brief The UDP socket receiving broadcast discovery packets
+   *
+   */
+  CONN_BROADCAST,
+
+  /**
+   * @brief The UDP socket receiving RPC requests from remote peers
+   *
+   */
+  CONN_DATAGRAM,
+
+  /**
+   * @brief A TCP connection accepted from a remote peer
+   *
+   */
+  CONN_PEER,
+
+  /**
+   * @brief An eventfd used to wake the network loop up from another thread
+   *
+   */
+  CONN_NOTIFY
+};
+
+/**
+ * @brief Describes which part of a message a peer connection is waiting for
+ *
+ */
+enum ConnectionState {
+  /**
+   * @brief Waiting for the first 4 bytes of a message to tell RPC and HTTP
+   * apart
+   *
+   */
+  CONN_STATE_MAGIC,
+
+  /**
+   * @brief Waiting for a complete RPC message header
+   *
+   */
+  CONN_STATE_RPC_HEADER,
+
+  /**
+   * @brief Waiting for the rest of an RPC message
+   *
+   */
+  CONN_STATE_RPC_BODY,
+
+  /**
+   * @brief Waiting for the end of the HTTP request headers
+   *
+   */
+  CONN_STATE_HTTP_HEADERS,
+
+  /**
+   * @brief Receiving the body of an HTTP request
+   *
+   */
+  CONN_STATE_HTTP_BODY
+};
+
+/**
+ * @brief Represents a single socket managed by the network loop
+ *
+ */
+struct Connection {
+  /**
+   * @brief The socket file descriptor
+   *
+   */
+  int fd;
+
+  /**
+   * @brief What the connection is used for
+   *
+   */
+  enum ConnectionKind kind;
+
+  /**
+   * @brief The address of the remote end, zeroed for listening sockets
+   *
+   */
+  struct sockaddr_in addr;
+
+  /**
+   * @brief When data was last received on this connection, updated by
+   * connection_touch
+   *
+   */
+  time_t last_active;
+
+  /**
+   * @brief For peer connections, closes the connection once it stayed silent
+   * for too long
+   *
+   */
+  struct Timer idle_timer;
+
+  /**
+   * @brief Index of the connection in the poll backend array, -1 if unused
+   *
+   */
+  int poll_index;
+
+  /**
+   * @brief The events currently watched by the poller (enum PollerFlags)
+   *
+   */
+  uint32_t events;
+
+  /**
+   * @brief Which part of a message the parser is waiting for
+   *
+   */
+  enum ConnectionState state;
+
+  /**
+   * @brief For CONN_STATE_RPC_BODY, the size of the whole RPC message
+   *
+   */
+  size_t expected;
+
+  /**
+   * @brief Bytes received but not parsed yet
+   *
+   */
+  struct Buffer in;
+
+  /**
+   * @brief Bytes queued for sending
+   *
+   */
+  struct Buffer out;
+
+  /**
+   * @brief Bytes handed to the kernel by an asynchronous send that hasn't
+   * completed yet
+   *
+   */
+  struct Buffer sending;
+
+  /**
+   * @brief Whether output is only queued by connection_send and submitted by a
+   * completion-based poller, instead of being written right away
+   *
+   */
+  bool queue_output;
+
+  /**
+   * @brief State private to the poller backend, freed with the connection
+   *
+   */
+  void *backend_data;
+
+  /**
+   * @brief A file being sent after the output buffer, -1 if there is none
+   *
+   */
+  int stream_fd;
+
+  /**
+   * @brief The offset of the next byte to send from stream_fd
+   *
+   */
+  off_t stream_offset;
+
+  /**
+   * @brief The number of bytes left to send from stream_fd
+   *
+   */
+  size_t stream_remaining;
+
+  /**
+   * @brief For CONN_STATE_HTTP_BODY, the file receiving the body, -1 if the
+   * body is discarded
+   *
+   */
+  int body_fd;
+
+  /**
+   * @brief For CONN_STATE_HTTP_BODY, the number of body bytes left to receive
+   *
+   */
+  size_t body_remaining;
+
+  /**
+   * @brief For CONN_STATE_HTTP_BODY, the response to send once the whole body
+   * was received
+   *
+   */
+  const struct HttpResponse *body_response;
+
+  /**
+   * @brief Whether the current HTTP request asked for the connection to stay
+   * open after its response
+   *
+   */
+  bool keep_alive;
+
+  /**
+   * @brief Whether the connection should be closed once its output is flushed
+   *
+   */
+  bool close_after_write;
+
+  /**
+   * @brief Whether the connection hit an error and should be closed
+   *
+   */
+  bool closing;
+
+  /**
+   * @brief Whether the connection was closed during the current round of the
+   * network loop. Events of the round still pointing to it are skipped, it is
+   * only recycled once the round is over
+   *
+   */
+  bool closed;
+
+  /**
+   * @brief Whether the connection has requests left that the network loop put
+   * off to its next round
+   *
+   */
+  bool deferred;
+
+  /**
+   * @brief The next connection put off to the next round
+   *
+   */
+  struct Connection *next_deferred;
+
+  /**
+   * @brief The next connection in the list of open connections, or in the
+   * free-list once closed
+   *
+   */
+  struct Connection *next;
+
+  /**
+   * @brief The previous connection in the list of open connections
+   *
+   */
+  struct Connection *prev;
+};
+
+/**
+ * @brief Creates a new connection context for a socket and adds it to the list
+ * of open connections
+ *
+ * @param fd The socket file descriptor, ownership is transferred to the
+ * connection
+ * @param kind What the connection is used for
+ * @param addr May be NULL, the address of the remote end
+ * @return struct Connection* Returns the new connection, or NULL if allocation
+ * failed
+ */
+struct Connection *connection_open(int fd, enum ConnectionKind kind,
+                                   const struct sockaddr_in *addr);
+
+/**
+ * @brief Closes the socket of a connection and removes it from the list of
+ * open connections. The connection stays readable until
+ * connection_recycle_closed frees it
+ *
+ * @param conn The connection to close
+ */
+void connection_close(struct Connection *conn);
+
+/**
+ * @brief Frees the connections closed since the last call, or keeps them for
+ * reuse. Called once nothing refers to them anymore, at the end of each round
+ * of the network loop
+ *
+ */
+void connection_recycle_closed();
+
+/**
+ * @brief Closes every open connection of the calling network thread and
+ * releases the connections kept for reuse
+ *
+ */
+void connection_close_all();
+
+/**
+ * @brief Marks a connection as active, moving it to the front of the list of
+ * open connections
+ *
+ * @param conn The connection that received data
+ */
+void connection_touch(struct Connection *conn);
+
+/**
+ * @brief Gets the least recently active open connection of a kind that isn't
+ * already being closed
+ *
+ * @param kind The kind of connection to look for
+ * @return struct Connection* Returns the connection, or NULL if there is none
+ */
+struct Connection *connection_least_recent(enum ConnectionKind kind);
+
+/**
+ * @brief Gets the number of open peer connections of the calling network
+ * thread
+ *
+ * @return size_t Returns the number of open peer connections
+ */
+size_t connection_peer_count();
+
+/**
+ * @brief Sends data on a connection without blocking. Whatever can't be
+ * written immediately is queued and sent by connection_flush. Datagram sockets
+ * have no stream to write to, everything is queued and the network loop sends
+ * it as the response datagram
+ *
+ * @param conn The connection to send on
+ * @param data The data to send
+ * @param len The number of bytes to send
+ * @return int Returns 0 if the data was sent or queued, a negative number if
+ * the connection failed
+ */
+int connection_send(struct Connection *conn, const void *data, size_t len);
+
+/**
+ * @brief Queues the contents of a file to be sent after the data already
+ * queued on a connection
+ *
+ * @param conn The connection to send on
+ * @param fd The file to send, ownership is transferred to the connection
+ * @param len The number of bytes to send from the start of the file
+ * @return int Returns 0 if the file was queued, a negative number if the
+ * connection failed
+ */
+int connection_send_file(struct Connection *conn, int fd, size_t len);
+
+/**
+ * @brief Sends as much of the queued output as the socket accepts without
+ * blocking
+ *
+ * @param conn The connection to flush
+ * @return int Returns 0 if the connection is still usable, a negative number
+ * if it failed
+ */
+int connection_flush(struct Connection *conn);
+
+/**
+ * @brief Checks whether a connection still has output waiting to be sent
+ *
+ * @param conn The connection to check
+ * @return true Some output is still queued
+ * @return false Everything was sent
+ */
+bool connection_has_output(const struct Connection *conn);
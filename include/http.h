@@ -1,11 +1,13 @@
 #pragma once
 
-#include <poll.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "magnet.h"
 #include "shared.h"
 
+struct Connection;
+
 /**
  * @file http.h
  * @brief Implementation of HTTP client server interactions
@@ -19,15 +21,28 @@
 #define CHUNK_SIZE 4096
 
 /**
- * @brief Handles a HTTP request
+ * @brief Handles the headers of a HTTP request. If the request has a body, the
+ * connection is switched to CONN_STATE_HTTP_BODY and the body is passed to
+ * handle_http_body as it arrives
  *
- * @param sock The socket that sent the HTTP request
- * @param contents The contents of the HTTP request
- * @param length The length of the HTTP packet
+ * @param conn The connection that sent the HTTP request
+ * @param contents The request line and headers, including the final empty line
+ * @param length The length of the request line and headers
  */
-void handle_http_request(const struct pollfd *sock, const char *contents,
+void handle_http_request(struct Connection *conn, const char *contents,
                          size_t length);
 
+/**
+ * @brief Handles part of the body of a HTTP request
+ *
+ * @param conn The connection that sent the HTTP request
+ * @param contents The body bytes received so far
+ * @param length The number of body bytes received so far
+ * @return size_t Returns the number of bytes that were consumed
+ */
+size_t handle_http_body(struct Connection *conn, const char *contents,
+                        size_t length);
+
 /**
  * @brief Downloads a file by hash from the HTTP server served by peer
  *
@@ -38,11 +53,35 @@ void handle_http_request(const struct pollfd *sock, const char *contents,
 int download_http_file(const struct Peer *peer, const struct FileMagnet *file);
 
 /**
- * @brief Uploads a file contents to a peer node
+ * @brief Called by upload_http_files as soon as the upload to a peer ended,
+ * once its connection is back in the pool
+ *
+ * @param index The index of the peer in the array given to upload_http_files
+ * @param success Whether the peer confirmed the upload with a 2xx status
+ * @param arg The argument given to upload_http_files
+ */
+typedef void(UploadDoneFunc)(size_t index, bool success, void *arg);
+
+/**
+ * @brief Uploads a file to several peers at once, each over its own pooled
+ * connection. The uploads progress independently, so they take about as long
+ * as the slowest one. An upload making no progress for RPC_TIMEOUT_MS fails.
+ *
+ * The body is streamed from the file with sendfile, every upload keeping its
+ * own offset. Nothing is buffered in user space and the uploads share the
+ * pages the kernel cached for the file
  *
- * @param peer The peer to which the file should be uploaded
- * @param filename The name of the file to be uploaded
- * @return int
+ * @param peers The peers to which the file should be uploaded, NULL entries
+ * are skipped
+ * @param count The number of entries in peers, at most K_VALUE
+ * @param file The metadata of the file to be uploaded
+ * @param fd The file descriptor of the file, read from offset 0 without
+ * moving its position
+ * @param length The length of the file
+ * @param on_done May be NULL, called as each upload ends
+ * @param arg Passed to on_done
+ * @return size_t Returns the number of peers that confirmed the upload
  */
-int upload_http_file(const struct Peer *peer, const struct FileMagnet *file,
-                     const char *contents, size_t length);
+size_t upload_http_files(struct Peer *const *peers, size_t count,
+                         const struct FileMagnet *file, int fd, size_t length,
+                         UploadDoneFunc *on_done, void *arg);
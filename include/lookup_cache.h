@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peer.h"
+#include "shared.h"
+
+/**
+ * @file lookup_cache.h
+ * @brief Cache of the results of recent lookups
+ *
+ * A lookup for a target gives either the closest peers to it (FIND_NODE, for
+ * uploads) or the peers providing it (FIND_VALUE, for downloads). Both are
+ * kept for LOOKUP_CACHE_TTL seconds, so uploading or downloading the same key
+ * again, or retrying a download, doesn't traverse the network again.
+ *
+ * Entries live in a fixed table shared by every thread. A target that
+ * doesn't fit replaces the entry of its probe window that expires first. An
+ * entry is dropped as soon as one of its peers fails us, the next lookup for
+ * its target goes to the network.
+ *
+ * Lookups that miss the cache are also coalesced: while a thread looks a
+ * target up, other threads asking for the same target wait for its result
+ * instead of sending the same RPCs to the same peers.
+ *
+ */
+
+/**
+ * @brief The number of bits of the index of the cache table
+ *
+ */
+#define LOOKUP_CACHE_BITS 8
+
+/**
+ * @brief How many consecutive slots are searched for the entry of a target
+ *
+ */
+#define LOOKUP_CACHE_PROBE 4
+
+/**
+ * @brief The maximum number of lookups in flight that can be joined, more
+ * lookups run on their own
+ *
+ */
+#define LOOKUP_MAX_FLIGHTS 16
+
+/**
+ * @brief The default number of seconds a lookup result is used for,
+ * overridden by LOOKUP_CACHE_TTL
+ *
+ */
+#define DEFAULT_LOOKUP_CACHE_TTL 60
+
+/**
+ * @brief The kinds of lookup results
+ *
+ */
+enum LookupKind {
+  /**
+   * @brief The closest peers to the target
+   *
+   */
+  LOOKUP_CLOSEST,
+
+  /**
+   * @brief The peers providing the target
+   *
+   */
+  LOOKUP_PROVIDERS
+};
+
+/**
+ * @brief Counters of the uses of the cache
+ *
+ */
+struct LookupCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+
+  /**
+   * @brief The number of entries dropped because one of their peers failed
+   *
+   */
+  uint64_t invalidated;
+
+  /**
+   * @brief The number of lookups that traversed the network
+   *
+   */
+  uint64_t lookups;
+
+  /**
+   * @brief The number of lookups that waited for the same lookup in flight
+   * instead of traversing the network
+   *
+   */
+  uint64_t coalesced;
+};
+
+/**
+ * @brief A lookup in flight, joined by every thread asking for its target
+ * meanwhile
+ *
+ */
+struct LookupFlight;
+
+/**
+ * @brief Gets the cached result of a lookup
+ *
+ * @param target The target of the lookup
+ * @param kind The kind of result
+ * @param out_peers A pointer to memory where the peers will be copied
+ * @param max The maximum number of peers to copy
+ * @return size_t Returns the number of peers copied, 0 if there is no valid
+ * entry
+ */
+size_t lookup_cache_get(const HashID target, enum LookupKind kind,
+                        struct Peer *out_peers, size_t max);
+
+/**
+ * @brief Stores the result of a successful lookup, replacing the previous one
+ *
+ * @param target The target of the lookup
+ * @param kind The kind of result
+ * @param peers The peers found, NULL entries are skipped
+ * @param count The number of entries in peers, at most K_VALUE are kept
+ */
+void lookup_cache_put(const HashID target, enum LookupKind kind,
+                      struct Peer *const *peers, size_t count);
+
+/**
+ * @brief Drops every entry containing a peer, to be called when the peer
+ * couldn't be reached or failed a request
+ *
+ * @param peer_id The ID of the peer
+ */
+void lookup_cache_forget_peer(const HashID peer_id);
+
+/**
+ * @brief Joins the lookup in flight for a target, or starts one. Joining
+ * blocks until the lookup in flight ends
+ *
+ * @param target The target of the lookup
+ * @param kind The kind of result
+ * @param out_flight Set to the lookup to end with lookup_flight_end if the
+ * caller leads it, NULL if too many lookups are in flight to share it
+ * @param out_peers A pointer to memory where the peers found by the joined
+ * lookup will be copied
+ * @param max The maximum number of peers to copy
+ * @param out_count Set to the number of peers copied
+ * @param out_result Set to the result of the joined lookup
+ * @return true The caller leads the lookup and must traverse the network
+ * @return false Another lookup was joined, its result was copied
+ */
+bool lookup_flight_join(const HashID target, enum LookupKind kind,
+                        struct LookupFlight **out_flight,
+                        struct Peer *out_peers, size_t max, size_t *out_count,
+                        int *out_result);
+
+/**
+ * @brief Ends a lookup, handing its result to the threads that joined it
+ *
+ * @param flight The lookup, does nothing if NULL
+ * @param result The result of the lookup, 0 if it was successful
+ * @param peers The peers found, NULL entries are skipped
+ * @param count The number of entries in peers, at most K_VALUE are handed
+ */
+void lookup_flight_end(struct LookupFlight *flight, int result,
+                       struct Peer *const *peers, size_t count);
+
+/**
+ * @brief Gets the counters of the cache
+ *
+ * @param out_stats A pointer to memory where the counters will be stored
+ */
+void lookup_cache_get_stats(struct LookupCacheStats *out_stats);
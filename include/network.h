@@ -2,6 +2,7 @@
 
 #include <netinet/in.h>
 #include <poll.h>
+#include <sys/types.h>
 
 /**
  * @file network.h
@@ -18,37 +19,80 @@
 #define BROADCAST_PORT 8183
 
 /**
- * @brief Gets the contents of the entire RPC request according to the request
+ * @brief How long a peer gets to accept an outgoing connection
  *
- * @param sock The struct of the socket that sent the RPC request
- * @param buf A pointer to the buffer where data can be read into
- * @param out_size A pointer to store the size of the packet that was read
  */
-int get_rpc_request(const struct pollfd *sock, char *buf, size_t *out_size);
+#define CONNECT_TIMEOUT_MS 1000
 
 /**
- * @brief Initializes the network stack
+ * @brief How long a connected peer may stay silent in the middle of an
+ * exchange before it is given up on
  *
  */
-void init_network();
+#define RPC_TIMEOUT_MS (2 * 1000)
 
 /**
- * @brief Updates the network
+ * @brief Checks the RPC message at the start of some received bytes
+ *
+ * @param data The received bytes
+ * @param length The number of bytes received
+ * @return ssize_t Returns the size of the message once it was received whole,
+ * 0 if more bytes are needed, a negative number if the message is invalid or
+ * of an unknown protocol version
+ */
+ssize_t peek_rpc_message(const char *data, size_t length);
+
+/**
+ * @brief Initializes the network stack for the calling network thread. Each
+ * network thread runs its own loop and listen socket
+ *
+ * @param thread_index The index of the calling network thread, thread 0 is the
+ * primary thread which also handles frontend commands, discovery broadcasts and
+ * scheduled tasks
+ */
+void init_network(int thread_index);
+
+/**
+ * @brief Updates the network loop of the calling network thread
  *
  */
 void update_network();
 
 /**
- * @brief Stops and cleans up the network stack
+ * @brief Stops and cleans up the network stack of the calling network thread
  *
  */
 void stop_network();
 
 /**
- * @brief Connects to a peer
+ * @brief Wakes every network thread up from its wait, so it notices a stop
+ * request right away
+ *
+ */
+void wake_network();
+
+/**
+ * @brief Connects to a peer, giving it CONNECT_TIMEOUT_MS to accept. The socket
+ * is blocking and its reads and writes time out after RPC_TIMEOUT_MS
  *
  * @param addr The peer to connect to
  * @return int The socket fd if connection was successful, a negative number
  * otherwise
  */
 int connect_to_peer(const struct sockaddr_in *addr);
+
+/**
+ * @brief Connects to several peers at once. The connections are started
+ * together and share a single deadline, so unreachable peers cost the deadline
+ * once instead of one after the other. Connected sockets are set up like those
+ * of connect_to_peer
+ *
+ * @param addrs The peers to connect to
+ * @param count The number of peers
+ * @param out_fds Receives the socket of each peer, -1 for the peers that
+ * couldn't be reached before the deadline
+ * @param timeout_ms How long the peers get to accept
+ * @return size_t Returns the number of peers connected to
+ */
+size_t connect_to_peers(const struct sockaddr_in *addrs, size_t count,
+                        int *out_fds, int timeout_ms);
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Connection;
+
+/**
+ * @file poller.h
+ * @brief Readiness notification backends for the network layer
+ *
+ * This file defines a small interface over the kernel readiness APIs, so the
+ * network loop does not depend on a specific one. The poll backend keeps the
+ * historical behavior of handing every registered socket to the kernel on each
+ * wait. The epoll backend is edge-triggered and only reports the connections
+ * that are actually ready, its cost grows with activity instead of the number
+ * of registered sockets.
+ *
+ * The io_uring backend (only built when liburing is available) is
+ * completion-based: it accepts connections with a multishot accept, receives
+ * into provided buffers with a multishot recv and submits queued output as
+ * send operations, so most loop iterations cost a single system call. It still
+ * reports its completions through the same interface: received bytes are
+ * appended to the input buffer of the connection and reported as POLLER_IN,
+ * accepted sockets are fetched with poller_next_accepted.
+ *
+ */
+
+/**
+ * @brief The readiness API used by a poller
+ *
+ */
+enum PollerBackend { POLLER_POLL, POLLER_EPOLL, POLLER_URING };
+
+/**
+ * @brief Readiness flags, independent of the backend in use
+ *
+ */
+enum PollerFlags {
+  POLLER_IN = 1,
+  POLLER_OUT = 2,
+  POLLER_HUP = 4,
+  POLLER_ERR = 8
+};
+
+/**
+ * @brief A single readiness notification
+ *
+ */
+struct PollerEvent {
+  /**
+   * @brief The connection that is ready
+   *
+   */
+  struct Connection *conn;
+
+  /**
+   * @brief A combination of enum PollerFlags
+   *
+   */
+  uint32_t events;
+};
+
+/**
+ * @brief The state of a readiness backend
+ *
+ */
+struct Poller {
+  /**
+   * @brief The backend in use
+   *
+   */
+  enum PollerBackend backend;
+
+  /**
+   * @brief For POLLER_EPOLL, the epoll instance
+   *
+   */
+  int epoll_fd;
+
+  /**
+   * @brief For POLLER_POLL, the array handed to poll()
+   *
+   */
+  struct pollfd *fds;
+
+  /**
+   * @brief For POLLER_POLL, the connection owning each entry of fds
+   *
+   */
+  struct Connection **conns;
+
+  /**
+   * @brief For POLLER_POLL, the number of used entries in fds
+   *
+   */
+  size_t count;
+
+  /**
+   * @brief For POLLER_POLL, the number of allocated entries in fds
+   *
+   */
+  size_t capacity;
+
+  /**
+   * @brief For POLLER_URING, the ring and its provided buffers
+   *
+   */
+  void *uring;
+};
+
+/**
+ * @brief Parses a backend name as given in the configuration
+ *
+ * @param name The backend name ("poll", "epoll" or "io_uring"), may be NULL
+ * @param fallback The backend to use if the name is NULL or unknown
+ * @return enum PollerBackend Returns the selected backend
+ */
+enum PollerBackend poller_parse_backend(const char *name,
+                                        enum PollerBackend fallback);
+
+/**
+ * @brief Gets a printable name for a backend
+ *
+ * @param backend The backend
+ * @return const char* Returns the name of the backend
+ */
+const char *poller_backend_name(enum PollerBackend backend);
+
+/**
+ * @brief Initializes a poller
+ *
+ * @param poller The poller to initialize
+ * @param backend The readiness API to use
+ * @return int Returns 0 if the poller was initialized successfully, a negative
+ * number otherwise
+ */
+int poller_init(struct Poller *poller, enum PollerBackend backend);
+
+/**
+ * @brief Starts watching a connection
+ *
+ * @param poller The poller to register the connection with
+ * @param conn The connection to watch
+ * @param events A combination of POLLER_IN and POLLER_OUT
+ * @return int Returns 0 if the connection was registered, a negative number
+ * otherwise
+ */
+int poller_add(struct Poller *poller, struct Connection *conn,
+               uint32_t events);
+
+/**
+ * @brief Changes the events watched for a registered connection
+ *
+ * @param poller The poller the connection is registered with
+ * @param conn The connection to update
+ * @param events A combination of POLLER_IN and POLLER_OUT
+ * @return int Returns 0 if the connection was updated, a negative number
+ * otherwise
+ */
+int poller_modify(struct Poller *poller, struct Connection *conn,
+                  uint32_t events);
+
+/**
+ * @brief Stops watching a connection, must be called before closing its socket
+ *
+ * @param poller The poller the connection is registered with
+ * @param conn The connection to remove
+ * @return true The connection can be closed right away
+ * @return false The kernel still has operations in flight for the connection,
+ * the poller closes it once they completed
+ */
+bool poller_remove(struct Poller *poller, struct Connection *conn);
+
+/**
+ * @brief Checks whether the backend performs accept, receive and send itself
+ * instead of only reporting readiness
+ *
+ * @param poller The poller to check
+ * @return true The backend is completion-based
+ * @return false The backend only reports readiness
+ */
+bool poller_completes_io(const struct Poller *poller);
+
+/**
+ * @brief For completion-based backends, gets the next socket accepted on a
+ * listen connection that reported POLLER_IN
+ *
+ * @param poller The poller to get the socket from
+ * @return int Returns the accepted socket, a negative number if there are none
+ * left
+ */
+int poller_next_accepted(struct Poller *poller);
+
+/**
+ * @brief Waits for connections to become ready
+ *
+ * @param poller The poller to wait on
+ * @param out_events A pointer to memory where the notifications will be stored
+ * @param max_events The maximum number of notifications to return
+ * @param timeout_ms How long to wait at most in milliseconds, -1 to wait
+ * indefinitely
+ * @return int Returns the number of notifications stored, a negative number if
+ * there was an error
+ */
+int poller_wait(struct Poller *poller, struct PollerEvent *out_events,
+                int max_events, int timeout_ms);
+
+/**
+ * @brief Cleans up the resources of a poller
+ *
+ * @param poller The poller to clean up
+ */
+void poller_close(struct Poller *poller);
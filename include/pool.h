@@ -0,0 +1,86 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file pool.h
+ * @brief Pool of idle outbound connections to peers
+ *
+ * Outgoing RPC and HTTP exchanges borrow a connected socket from the pool and
+ * give it back once their exchange is complete, so consecutive exchanges with
+ * the same peer skip the TCP handshake. Each network thread has its own pool.
+ *
+ * An idle connection is checked before being handed out: if the peer closed
+ * it or sent something unexpected, it is discarded. Connections idle for
+ * longer than POOL_IDLE_MS are closed, well before the idle timeout of the
+ * remote end. The pool keeps at most POOL_MAX_PER_PEER idle connections per
+ * peer and POOL_MAX_IDLE in total, the least recently used one is closed to
+ * make room.
+ *
+ */
+
+/**
+ * @brief The maximum number of idle connections kept per network thread
+ *
+ */
+#define POOL_MAX_IDLE 64
+
+/**
+ * @brief The maximum number of idle connections kept to a single peer
+ *
+ */
+#define POOL_MAX_PER_PEER 2
+
+/**
+ * @brief How long a connection may stay idle in the pool before being closed
+ *
+ */
+#define POOL_IDLE_MS (20 * 1000)
+
+/**
+ * @brief Gets a connected socket to a peer, reusing a healthy idle connection
+ * when there is one and connecting otherwise
+ *
+ * @param addr The address of the peer
+ * @param out_reused May be NULL, set to whether the socket came from the pool
+ * @return int Returns the socket, or a negative number if connecting failed
+ */
+int pool_acquire(const struct sockaddr_in *addr, bool *out_reused);
+
+/**
+ * @brief Makes sure the pool holds a connection to each of several peers ahead
+ * of exchanges with them. The missing connections are established in parallel
+ * and share a single connection deadline
+ *
+ * @param addrs The addresses of the peers
+ * @param count The number of peers
+ * @param out_reachable Set for each peer to whether a connection is ready
+ * @param timeout_ms How long the connections may take in milliseconds
+ * @return size_t Returns the number of peers a connection is ready for
+ */
+size_t pool_connect(const struct sockaddr_in *addrs, size_t count,
+                    bool *out_reachable, int timeout_ms);
+
+/**
+ * @brief Gives a socket back to the pool once an exchange on it is complete.
+ * Only sockets with nothing left to read may be released
+ *
+ * @param addr The address of the peer the socket is connected to
+ * @param fd The socket, ownership is transferred to the pool
+ */
+void pool_release(const struct sockaddr_in *addr, int fd);
+
+/**
+ * @brief Closes the connections that stayed idle for too long
+ *
+ * @param now_ms The current time in milliseconds of timer_now_ms
+ */
+void pool_expire(uint64_t now_ms);
+
+/**
+ * @brief Closes every idle connection of the calling network thread
+ *
+ */
+void pool_close_all();
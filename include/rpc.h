@@ -1,10 +1,9 @@
 #pragma once
 
 // Kademlia RPC functions implementation
-#include <poll.h>
-
 #include "shared.h"
 
+struct Connection;
 struct FileMagnet;
 
 /**
@@ -14,6 +13,9 @@ struct FileMagnet;
  * This file defines all the main structures and functions used for the P2P peer
  * discovery and communication. It defines the structure of the different
  * Kademlia packets, and how data such as peer information should be serialized.
+ * The structures are the messages of RPC_LEGACY_VERSION as sent on the wire,
+ * other versions are decoded to them. The batched messages, which carry many
+ * keys at once, only exist in RPC_VERSION and only travel over TCP.
  *
  */
 
@@ -27,8 +29,85 @@ struct FileMagnet;
                   MAX(sizeof(struct RPCFindValueResponse),                     \
                       sizeof(struct RPCFindNodeResponse))))))
 
+/**
+ * @brief The size of the largest message structure, batched ones included.
+ * Datagrams never exceed MAX_RPC_PACKET_SIZE
+ *
+ */
+#define MAX_RPC_MESSAGE_SIZE                                                   \
+  MAX(MAX_RPC_PACKET_SIZE,                                                     \
+      MAX(sizeof(struct RPCStoreMulti),                                        \
+          MAX(sizeof(struct RPCFindMulti),                                     \
+              MAX(sizeof(struct RPCStoreMultiResponse),                        \
+                  sizeof(struct RPCFindValueMultiResponse)))))
+
 #define RPC_MAGIC "KDMT"
 
+/**
+ * @brief The version of the RPC protocol spoken by this node. Version 1 added
+ * request IDs, version 2 encodes messages compactly, see wire.h
+ *
+ */
+#define RPC_VERSION 2
+
+/**
+ * @brief The older version still understood, requests are answered in the
+ * version they came in. Messages of any other version are rejected
+ *
+ */
+#define RPC_LEGACY_VERSION 1
+
+/**
+ * @brief The default number of lookup RPCs kept in flight at once, overridden
+ * by LOOKUP_ALPHA
+ *
+ */
+#define DEFAULT_LOOKUP_ALPHA 3
+
+/**
+ * @brief How long a lookup waits for a response before moving on without it,
+ * as long as the first retransmission timeout of a datagram RPC
+ *
+ */
+#define LOOKUP_STALL_MS 250
+
+/**
+ * @brief The maximum number of keys looked up together by a batched lookup,
+ * each of them gets its own shortlist. More keys are looked up in several
+ * batches
+ *
+ */
+#define LOOKUP_BATCH_KEYS 128
+
+/**
+ * @brief How many seconds a peer that isn't one of the K_VALUE closest to a
+ * key it knows of serves a copy of the key-value pair, cached there by a
+ * lookup that found it farther away
+ *
+ */
+#define CACHED_VALUE_TTL 3600
+
+/**
+ * @brief How many times the lifetime of a cached copy is halved at most, once
+ * for each peer closer to the key beyond the K_VALUE closest
+ *
+ */
+#define CACHED_VALUE_HALVINGS 6
+
+/**
+ * @brief How long a lookup that found a value waits at most for the peer it
+ * caches the value on, to connect and acknowledge the STORE
+ *
+ */
+#define CACHE_STORE_TIMEOUT_MS 250
+
+/**
+ * @brief The maximum number of keys of a STORE_MULTI or FIND_VALUE_MULTI
+ * request
+ *
+ */
+#define RPC_BATCH_MAX 32
+
 #pragma pack(push, 1)
 
 enum RPCCallType {
@@ -40,7 +119,11 @@ enum RPCCallType {
   STORE_RESPONSE = 32,
   FIND_NODE_RESPONSE = 64,
   FIND_VALUE_RESPONSE = 128,
-  BROADCAST = 256
+  BROADCAST = 256,
+  STORE_MULTI = 512,
+  FIND_VALUE_MULTI = 1024,
+  STORE_MULTI_RESPONSE = 8192,
+  FIND_VALUE_MULTI_RESPONSE = 16384
 };
 
 struct RPCPeer {
@@ -57,8 +140,22 @@ struct RPCKeyValue {
 
 struct RPCMessageHeader {
   char magic_number[4];
+
+  /**
+   * @brief RPC_VERSION. It sits where older peers sent the low byte of the
+   * packet size, which never matches a version for their message sizes
+   *
+   */
+  uint8_t version;
   int packet_size;
   enum RPCCallType call_type;
+
+  /**
+   * @brief Chosen by the sender of a request and copied into its response, so
+   * several requests can be in flight on a socket and answered in any order
+   *
+   */
+  uint32_t request_id;
 };
 
 struct RPCPing {
@@ -73,6 +170,13 @@ struct RPCBroadcast {
 struct RPCStore {
   struct RPCMessageHeader header;
   struct RPCKeyValue key_value;
+
+  /**
+   * @brief Whether the pair is a copy cached along the path of a lookup,
+   * which expires, instead of a replica
+   *
+   */
+  uint8_t cached;
 };
 
 struct RPCFind {
@@ -102,16 +206,71 @@ struct RPCFindNodeResponse {
   struct RPCPeer closest[K_VALUE];
 };
 
+/**
+ * @brief Stores several key-value pairs at once
+ *
+ */
+struct RPCStoreMulti {
+  struct RPCMessageHeader header;
+  size_t num_values;
+  struct RPCKeyValue key_values[RPC_BATCH_MAX];
+};
+
+/**
+ * @brief Asks for several keys at once
+ *
+ */
+struct RPCFindMulti {
+  struct RPCMessageHeader header;
+  size_t num_keys;
+  HashID keys[RPC_BATCH_MAX];
+};
+
+/**
+ * @brief Whether each pair of a STORE_MULTI request was stored, in the order
+ * of the request
+ *
+ */
+struct RPCStoreMultiResponse {
+  struct RPCMessageHeader header;
+  size_t num_results;
+  uint8_t success[RPC_BATCH_MAX];
+};
+
+/**
+ * @brief The answer for one key of a FIND_VALUE_MULTI request. Unlike a
+ * FIND_VALUE response, the closest peers are listed even when the value was
+ * found, so the same request serves lookups for the closest peers
+ *
+ */
+struct RPCValueResult {
+  uint8_t found_key;
+  struct RPCKeyValue values;
+  size_t num_closest;
+  struct RPCPeer closest[K_VALUE];
+};
+
+/**
+ * @brief The answers for each key of a FIND_VALUE_MULTI request, in the order
+ * of the request
+ *
+ */
+struct RPCFindValueMultiResponse {
+  struct RPCMessageHeader header;
+  size_t num_results;
+  struct RPCValueResult results[RPC_BATCH_MAX];
+};
+
 #pragma pack(pop)
 
 /**
  * @brief Handles a RPC request
  *
- * @param sock The socket that sent the RPC request
+ * @param conn The connection that sent the RPC request
  * @param contents The RPC request packet
  * @param length The length of the RPC request
  */
-void handle_rpc_request(const struct pollfd *sock, char *contents, size_t length);
+void handle_rpc_request(struct Connection *conn, char *contents, size_t length);
 
 /**
  * @brief Handles uploading a file to the P2P network
@@ -126,3 +285,27 @@ int handle_rpc_upload(struct FileMagnet *file);
  * @param file The metadata about the file to upload
  */
 int handle_rpc_download(struct FileMagnet *file);
+
+/**
+ * @brief Handles uploading many files to the P2P network at once. The lookups
+ * of their keys run together and the STOREs are grouped by peer, so each peer
+ * is sent a few batched requests instead of one per file
+ *
+ * @param files The metadata about the files to upload
+ * @param count The number of files
+ * @return int Returns 0 if every file was uploaded, a negative number
+ * otherwise
+ */
+int handle_rpc_upload_many(struct FileMagnet *const *files, size_t count);
+
+/**
+ * @brief Handles downloading many files from the P2P network at once. The
+ * lookups of their keys run together, each peer is asked for the keys it is
+ * close to in batched requests
+ *
+ * @param files The metadata about the files to download
+ * @param count The number of files
+ * @return int Returns 0 if every file was downloaded, a negative number
+ * otherwise
+ */
+int handle_rpc_download_many(struct FileMagnet *const *files, size_t count);
@@ -1,16 +0,0 @@
-#pragma once
-
-/**
- * @file schedule.h
- * @brief This file defines structures for schedule task
- *
- */
-
-typedef void(ScheduledFunc)(void);
-
-struct Schedule {
-  const char *name;
-  time_t next_run;
-  int interval_secs;
-  ScheduledFunc *func;
-};
\ No newline at end of file
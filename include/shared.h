@@ -58,32 +58,6 @@ void die(int val, const char *str);
  */
 ssize_t recv_all(int fd, void *dst, size_t len);
 
-/**
- * @brief Repeatedly peeks from a file descriptor until all requested data is
- * peeked or there is an error. This avoids consuming from the internal kernel
- * buffer
- *
- * @param fd The file descriptor to read from
- * @param dst A buffer pointing to the memory where the data should be stored
- * @param len The number of bytes to be read
- * @return size_t Returns how many bytes were actually read
- */
-ssize_t recv_all_peek(int fd, void *dst, size_t len);
-
-/**
- * @brief Repeatedly reads from a file descriptor until we reached max length or
- * the pattern is encountered or there is an error
- *
- * @param fd The file descriptor to read from
- * @param dst A buffer pointing to the memory where the data should be stored
- * @param len The number of bytes to be read
- * @param pattern The pattern upon which reading should be stopped
- * @param pattern_len The length of the pattern
- * @return size_t Returns how many bytes were actually read
- */
-ssize_t recv_until(int fd, void *dst, size_t len, const char *pattern,
-                   size_t pattern_len);
-
 /**
  * @brief Repeatedly sends to a file descriptor until all request data is sent
  * or there is an error
@@ -168,6 +142,26 @@ int get_own_id(HashID out);
  */
 int create_own_peer(struct Peer *out_peer);
 
+/**
+ * @brief Calculate the XOR distance between two HashID
+ * @param result Buffer where the result is stored
+ * @param id1 First HashID
+ * @param id2 Second HashID
+ */
+void dist_hash(HashID result, const HashID id1, const HashID id2);
+
+/**
+ * @brief Compare two distances/hashes (produced by dist_hash)
+ *  It returns:
+ *      - -1 if dist1 < dist2
+ *      - 1 if dist1 > dist2
+ *      - 0 if dist1 = dist2
+ * @param dist1 First distance to compare
+ * @param dist2 Second distance to compare
+ * @return int Comparaison result: -1,0,1
+ */
+int compare_hashes(const HashID dist1, const HashID dist2);
+
 /**
  * @brief Converts the SHA-256 hash to a hex string.
  *
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peer.h"
+#include "shared.h"
+
+/**
+ * @file shortlist.h
+ * @brief The candidates of a lookup, ordered by distance to its target
+ *
+ * A shortlist keeps the SHORTLIST_CAPACITY closest peers heard of during a
+ * lookup, inline in a fixed array. Their slots never move, so a slot can be
+ * handed to an RPC and found again when the response arrives. A separate
+ * array of slot numbers keeps them sorted by XOR distance to the target, a
+ * new peer is placed by binary search. Once the shortlist is full, a closer
+ * peer replaces the farthest candidate that isn't waiting for a response,
+ * stalled or not.
+ *
+ * The IDs of every peer added are remembered in an open-addressed set, so a
+ * peer returned by several responses is recognized in constant time, even
+ * after it was pushed out of the shortlist.
+ *
+ */
+
+/**
+ * @brief The maximum number of candidates a shortlist holds
+ *
+ */
+#define SHORTLIST_CAPACITY (K_VALUE * 8)
+
+/**
+ * @brief The number of bits of the index of the set of IDs already seen
+ *
+ */
+#define SHORTLIST_SEEN_BITS 9
+
+/**
+ * @brief Describes where a candidate stands
+ *
+ */
+enum CandidateState {
+  /**
+   * @brief The candidate wasn't asked yet
+   *
+   */
+  CANDIDATE_NEW,
+
+  /**
+   * @brief An RPC to the candidate waits for its response
+   *
+   */
+  CANDIDATE_IN_FLIGHT,
+
+  /**
+   * @brief An RPC to the candidate still waits for its response, but it took
+   * so long that the lookup moved on without it
+   *
+   */
+  CANDIDATE_STALLED,
+
+  /**
+   * @brief The candidate answered
+   *
+   */
+  CANDIDATE_ANSWERED,
+
+  /**
+   * @brief The candidate couldn't be reached or didn't answer in time
+   *
+   */
+  CANDIDATE_FAILED
+};
+
+/**
+ * @brief A peer met during a lookup
+ *
+ */
+struct Candidate {
+  struct Peer peer;
+
+  /**
+   * @brief The XOR distance between the peer and the target
+   *
+   */
+  HashID distance;
+
+  enum CandidateState state;
+
+  /**
+   * @brief For CANDIDATE_IN_FLIGHT, when the RPC is considered stalled, in
+   * milliseconds of timer_now_ms
+   *
+   */
+  uint64_t stall_at;
+
+  /**
+   * @brief How many RPCs in a row led to the peer, 1 for the peers the lookup
+   * started from
+   *
+   */
+  unsigned hops;
+};
+
+/**
+ * @brief The candidates of a lookup
+ *
+ */
+struct Shortlist {
+  HashID target;
+
+  /**
+   * @brief The candidates, in the order they were added
+   *
+   */
+  struct Candidate slots[SHORTLIST_CAPACITY];
+
+  /**
+   * @brief The slots of the candidates, the closest to the target first
+   *
+   */
+  uint8_t order[SHORTLIST_CAPACITY];
+  size_t count;
+
+  /**
+   * @brief The IDs of every peer added, zeroed entries are free
+   *
+   */
+  HashID seen[1 << SHORTLIST_SEEN_BITS];
+  size_t seen_count;
+};
+
+/**
+ * @brief Initializes an empty shortlist
+ *
+ * @param list The shortlist to initialize
+ * @param target The target of the lookup
+ */
+void shortlist_init(struct Shortlist *list, const HashID target);
+
+/**
+ * @brief Adds a peer to a shortlist, unless it was already added or it is
+ * farther than every candidate of a full shortlist
+ *
+ * @param list The shortlist
+ * @param peer The peer to add, copied into the shortlist
+ * @return struct Candidate* Returns the new candidate, NULL if the peer
+ * wasn't added
+ */
+struct Candidate *shortlist_add(struct Shortlist *list,
+                                const struct Peer *peer);
+
+/**
+ * @brief Gets a candidate by its rank in distance to the target
+ *
+ * @param list The shortlist
+ * @param rank The rank of the candidate, 0 for the closest one, less than
+ * list->count
+ * @return struct Candidate* Returns the candidate
+ */
+struct Candidate *shortlist_get(struct Shortlist *list, size_t rank);
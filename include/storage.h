@@ -25,20 +25,27 @@ struct KeyValuePair {
 };
 
 /**
- * @brief Queries a key from the client storage
+ * @brief Queries a key from the client storage. The storage may be accessed by
+ * several network threads, so the pair is copied out. Expired pairs aren't
+ * found
  *
  * @param key The key to be queried for in the client storage
- * @return const struct KeyValuePair* Returns the key-value pair if it exists,
- * NULL otherwise
+ * @param out A pointer to memory where the key-value pair should be copied
+ * @return int Returns 0 if the key-value pair exists, a negative number
+ * otherwise
  */
-const struct KeyValuePair *storage_get_value(HashID key);
+int storage_get_value(const HashID key, struct KeyValuePair *out);
 
 /**
- * @brief Stores a key-value pair in the client storage
+ * @brief Stores a key-value pair in the client storage. A pair already stored
+ * is kept, but gains the providers it doesn't list yet, up to K_VALUE of them,
+ * and takes the later expiry of both
  *
  * @param value The key-value pair to be stored into the client storage
+ * @param ttl_ms How long the pair is served for in milliseconds, 0 if it never
+ * expires
  */
-void storage_put_value(const struct KeyValuePair *value);
+void storage_put_value(const struct KeyValuePair *value, uint64_t ttl_ms);
 
 /**
  * @brief Serializes a KeyValuePair to a RPCKeyValue
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file timer.h
+ * @brief Hierarchical timing wheel driven by the network loop
+ *
+ * Timers are sorted into a wheel of 4 levels of 64 slots. The first level has a
+ * resolution of 1 millisecond, each following level covers 64 times the range
+ * of the previous one, so the wheel spans about 4.6 hours. Timers further away
+ * are parked in the last level and sorted again once it turns.
+ *
+ * Inserting and cancelling a timer are O(1), they only link or unlink it from a
+ * slot list. When the wheel advances, the slots of the higher levels are
+ * cascaded into the lower ones as time reaches them, and the timers of the
+ * current first level slot are fired. The network loop computes its wait
+ * timeout from the next expiry, so it only wakes up when a timer is due.
+ *
+ */
+
+/**
+ * @brief The number of bits of the time covered by each level of the wheel
+ *
+ */
+#define TIMER_LEVEL_BITS 6
+
+/**
+ * @brief The number of slots of each level of the wheel
+ *
+ */
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+/**
+ * @brief The number of levels of the wheel
+ *
+ */
+#define TIMER_LEVELS 4
+
+struct Timer;
+struct TimerWheel;
+
+/**
+ * @brief A function called when a timer expires. The timer may be started
+ * again or freed from within the function
+ *
+ */
+typedef void(TimerFunc)(struct Timer *timer, void *arg);
+
+/**
+ * @brief A single timer, usually embedded in the object it belongs to
+ *
+ */
+struct Timer {
+  /**
+   * @brief When the timer expires, in milliseconds of the monotonic clock
+   *
+   */
+  uint64_t expires;
+
+  /**
+   * @brief For periodic timers, the delay between two expiries in
+   * milliseconds, 0 for one-shot timers
+   *
+   */
+  uint64_t interval;
+
+  /**
+   * @brief The function called when the timer expires
+   *
+   */
+  TimerFunc *func;
+
+  /**
+   * @brief The argument passed to func
+   *
+   */
+  void *arg;
+
+  /**
+   * @brief The wheel the timer was started in
+   *
+   */
+  struct TimerWheel *wheel;
+
+  /**
+   * @brief The head of the slot list the timer is linked in, NULL if the timer
+   * isn't pending
+   *
+   */
+  struct Timer **slot;
+
+  /**
+   * @brief The next timer in the same slot
+   *
+   */
+  struct Timer *next;
+
+  /**
+   * @brief The previous timer in the same slot
+   *
+   */
+  struct Timer *prev;
+};
+
+/**
+ * @brief The timing wheel of a network thread
+ *
+ */
+struct TimerWheel {
+  /**
+   * @brief The next millisecond the wheel will process
+   *
+   */
+  uint64_t now;
+
+  /**
+   * @brief The number of pending timers
+   *
+   */
+  uint64_t count;
+
+  /**
+   * @brief The slot lists of every level
+   *
+   */
+  struct Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/**
+ * @brief Gets the current time of the monotonic clock used by timers
+ *
+ * @return uint64_t Returns the time in milliseconds
+ */
+uint64_t timer_now_ms();
+
+/**
+ * @brief Initializes an empty timing wheel
+ *
+ * @param wheel The wheel to initialize
+ * @param now_ms The current time in milliseconds
+ */
+void timer_wheel_init(struct TimerWheel *wheel, uint64_t now_ms);
+
+/**
+ * @brief Initializes a timer, it must be initialized before being started or
+ * cancelled
+ *
+ * @param timer The timer to initialize
+ * @param func The function to call when the timer expires
+ * @param arg The argument to pass to func
+ */
+void timer_init(struct Timer *timer, TimerFunc *func, void *arg);
+
+/**
+ * @brief Starts a timer, or restarts it if it was already pending
+ *
+ * @param wheel The wheel to insert the timer in
+ * @param timer The timer to start
+ * @param delay_ms How long to wait before the first expiry in milliseconds
+ * @param interval_ms The delay between the following expiries in
+ * milliseconds, 0 for a one-shot timer
+ */
+void timer_start(struct TimerWheel *wheel, struct Timer *timer,
+                 uint64_t delay_ms, uint64_t interval_ms);
+
+/**
+ * @brief Stops a timer if it is pending
+ *
+ * @param timer The timer to stop
+ */
+void timer_cancel(struct Timer *timer);
+
+/**
+ * @brief Checks whether a timer is waiting to expire
+ *
+ * @param timer The timer to check
+ * @return true The timer is pending
+ * @return false The timer isn't started or already expired
+ */
+bool timer_pending(const struct Timer *timer);
+
+/**
+ * @brief Fires every timer that expired up to the given time
+ *
+ * @param wheel The wheel to advance
+ * @param now_ms The current time in milliseconds
+ */
+void timer_wheel_advance(struct TimerWheel *wheel, uint64_t now_ms);
+
+/**
+ * @brief Computes how long to wait until the next timer expires
+ *
+ * @param wheel The wheel to check
+ * @param now_ms The current time in milliseconds
+ * @return int Returns the delay in milliseconds, -1 if no timer is pending
+ */
+int timer_wheel_timeout(const struct TimerWheel *wheel, uint64_t now_ms);
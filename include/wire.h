@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "rpc.h"
+
+/**
+ * @file wire.h
+ * @brief Encoding of the RPC messages on the wire
+ *
+ * The message structures of rpc.h are what the rest of the node works with.
+ * Version 1 of the protocol sends them as they are laid out in memory.
+ * Version 2 encodes them explicitly, integers in network byte order:
+ *
+ * - A 13 byte header: the magic number, the version, the call type as the
+ *   index of its bit, a byte of flags, the length of the whole message on 16
+ *   bits and the request ID on 32 bits
+ * - Peers as their ID, IPv4 address and port, 38 bytes. Public keys are only
+ *   sent if one of the peers of the message has one, WIRE_FLAG_PEER_KEYS
+ * - Counts as varints, only the peers actually listed are sent
+ * - The booleans of responses as flags, the value of a FIND_VALUE response
+ *   only when it was found
+ * - The entries of batched messages one after the other after their count,
+ *   each result of a batched response starting with its own byte of flags
+ *
+ * Batched messages have no version 1 encoding.
+ *
+ * The magic number and the version keep their offsets, so nodes speaking
+ * version 1 reject version 2 messages instead of misreading them.
+ *
+ */
+
+/**
+ * @brief The size of the header of a version 2 message
+ *
+ */
+#define WIRE_HEADER_SIZE 13
+
+/**
+ * @brief The response reports a success
+ *
+ */
+#define WIRE_FLAG_SUCCESS 0x01
+
+/**
+ * @brief The FIND_VALUE response carries the value
+ *
+ */
+#define WIRE_FLAG_FOUND_KEY 0x02
+
+/**
+ * @brief Every peer of the message is followed by its public key
+ *
+ */
+#define WIRE_FLAG_PEER_KEYS 0x04
+
+/**
+ * @brief The STORE request carries a copy cached along a lookup path
+ *
+ */
+#define WIRE_FLAG_CACHED 0x08
+
+/**
+ * @brief Gets the size of the structure of a message type
+ *
+ * @param type The call type
+ * @return size_t Returns the size, 0 for an unknown type
+ */
+size_t wire_structure_size(enum RPCCallType type);
+
+/**
+ * @brief Gets the size of the message starting at some received bytes, as
+ * soon as its header arrived
+ *
+ * @param data The received bytes
+ * @param length The number of bytes received
+ * @return ssize_t Returns the size of the message on the wire, 0 if more bytes
+ * are needed to know it, a negative number if the header is invalid or of an
+ * unknown protocol version
+ */
+ssize_t wire_message_size(const char *data, size_t length);
+
+/**
+ * @brief Gets how many keys a request carries, without decoding it
+ *
+ * @param data The message
+ * @param length The length of the message
+ * @return size_t Returns the count of a batched request, at most
+ * RPC_BATCH_MAX, 1 for any other message
+ */
+size_t wire_request_keys(const char *data, size_t length);
+
+/**
+ * @brief Reads the header of a message of either version
+ *
+ * @param data The message
+ * @param length The length of the message
+ * @param out A pointer to memory where the header will be stored, with the
+ * version the message was sent in and its size on the wire
+ * @return true The header is valid
+ * @return false The header is invalid
+ */
+bool wire_read_header(const char *data, size_t length,
+                      struct RPCMessageHeader *out);
+
+/**
+ * @brief Encodes a message in the version set in its header
+ *
+ * @param message The message structure, its packet_size being the size of
+ * the structure
+ * @param out A pointer to memory where the encoded message will be stored
+ * @param max The size of out
+ * @return size_t Returns the size of the encoded message, 0 if the message is
+ * invalid, doesn't fit or doesn't exist in its version
+ */
+size_t wire_encode(const void *message, char *out, size_t max);
+
+/**
+ * @brief Decodes a message of either version into its structure. Counts
+ * larger than the structure holds are rejected
+ *
+ * @param data The message
+ * @param length The length of the message
+ * @param out A pointer to memory where the structure will be stored, with
+ * the version the message was sent in
+ * @param max The size of out
+ * @return size_t Returns the size of the structure, 0 if the message is
+ * malformed
+ */
+size_t wire_decode(const char *data, size_t length, void *out, size_t max);
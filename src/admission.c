@@ -0,0 +1,164 @@
+#include "admission.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+/**
+ * @brief The token bucket of a source address
+ *
+ */
+struct SourceBucket {
+  in_addr_t addr;
+
+  /**
+   * @brief The tokens left, in thousandths of a token so that refills of less
+   * than a token per millisecond aren't lost
+   *
+   */
+  uint32_t tokens;
+
+  /**
+   * @brief When the bucket was last refilled, in milliseconds of timer_now_ms
+   *
+   */
+  uint64_t refilled;
+};
+
+#define ADMISSION_TABLE_SIZE (1 << ADMISSION_TABLE_BITS)
+
+static __thread struct SourceBucket buckets[ADMISSION_TABLE_SIZE];
+
+static __thread uint32_t rate = DEFAULT_RPC_RATE;
+static __thread uint32_t burst = DEFAULT_RPC_BURST;
+static __thread size_t round_budget = DEFAULT_RPC_ROUND_BUDGET;
+
+/**
+ * @brief The keys left in the budget of the current round
+ *
+ */
+static __thread size_t round_room = DEFAULT_RPC_ROUND_BUDGET;
+
+/**
+ * @brief The time the current round started at, in milliseconds of
+ * timer_now_ms
+ *
+ */
+static __thread uint64_t round_now = 0;
+
+// Shared by every network thread, only read by the status command
+static atomic_uint_fast64_t admitted = 0;
+static atomic_uint_fast64_t rate_limited = 0;
+static atomic_uint_fast64_t deferred = 0;
+
+/**
+ * @brief Reads a positive limit from the environment
+ *
+ * @param name The name of the variable
+ * @param fallback The value to use if the variable is unset
+ * @return long Returns the limit, 0 if the variable is set to 0
+ */
+static long read_limit(const char *name, long fallback) {
+  char *env = getenv(name);
+  if (!env)
+    return fallback;
+
+  long value = strtol(env, NULL, 10);
+  if (value < 0) {
+    log_msg(LOG_WARN, "%s must not be negative, using %ld", name, fallback);
+    return fallback;
+  }
+
+  return value;
+}
+
+void admission_init() {
+  rate = (uint32_t)read_limit("RPC_RATE", DEFAULT_RPC_RATE);
+  burst = (uint32_t)read_limit("RPC_BURST", DEFAULT_RPC_BURST);
+  round_budget = (size_t)read_limit("RPC_ROUND_BUDGET",
+                                    DEFAULT_RPC_ROUND_BUDGET);
+
+  // A bucket must hold at least the token a request takes, and the tokens are
+  // counted in thousandths in 32 bits
+  if (burst < 1)
+    burst = 1;
+  if (burst > UINT32_MAX / 1000)
+    burst = UINT32_MAX / 1000;
+
+  round_room = round_budget > 0 ? round_budget : SIZE_MAX;
+}
+
+void admission_new_round(uint64_t now_ms) {
+  round_room = round_budget > 0 ? round_budget : SIZE_MAX;
+  round_now = now_ms;
+}
+
+size_t admission_room() { return round_room; }
+
+void admission_defer() {
+  atomic_fetch_add_explicit(&deferred, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Finds the bucket of a source, replacing the least recently refilled
+ * bucket of its probe window if the source has none
+ *
+ * @param addr The source address
+ * @return struct SourceBucket* Returns the bucket
+ */
+static struct SourceBucket *find_bucket(in_addr_t addr) {
+  // Multiplicative hashing, the top bits are the best mixed
+  uint32_t index =
+      ((uint32_t)addr * 2654435761u) >> (32 - ADMISSION_TABLE_BITS);
+  struct SourceBucket *oldest = NULL;
+
+  for (size_t i = 0; i < ADMISSION_PROBE; i++) {
+    struct SourceBucket *bucket =
+        &buckets[(index + i) & (ADMISSION_TABLE_SIZE - 1)];
+
+    if (bucket->refilled != 0 && bucket->addr == addr)
+      return bucket;
+
+    if (!oldest || bucket->refilled < oldest->refilled)
+      oldest = bucket;
+  }
+
+  *oldest = (struct SourceBucket){
+      .addr = addr, .tokens = burst * 1000, .refilled = round_now};
+  return oldest;
+}
+
+bool admission_admit(const struct sockaddr_in *from, size_t keys) {
+  if (rate > 0) {
+    struct SourceBucket *bucket = find_bucket(from->sin_addr.s_addr);
+
+    // A token per 1000 / rate milliseconds, i.e. rate thousandths per
+    // millisecond
+    uint64_t refill = (round_now - bucket->refilled) * rate;
+    uint64_t tokens = bucket->tokens + refill;
+    bucket->tokens = tokens < burst * 1000 ? (uint32_t)tokens : burst * 1000;
+    bucket->refilled = round_now;
+
+    // A batch larger than the bucket would never fit, it takes all of it
+    uint32_t cost = (keys < burst ? (uint32_t)keys : burst) * 1000;
+
+    if (bucket->tokens < cost) {
+      atomic_fetch_add_explicit(&rate_limited, 1, memory_order_relaxed);
+      return false;
+    }
+
+    bucket->tokens -= cost;
+  }
+
+  round_room -= keys < round_room ? keys : round_room;
+  atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+  return true;
+}
+
+void admission_get_stats(struct AdmissionStats *out_stats) {
+  out_stats->admitted = atomic_load_explicit(&admitted, memory_order_relaxed);
+  out_stats->rate_limited =
+      atomic_load_explicit(&rate_limited, memory_order_relaxed);
+  out_stats->deferred = atomic_load_explicit(&deferred, memory_order_relaxed);
+}
@@ -14,7 +14,8 @@
  *
  * @param distance The distance from our node
  * @return int Returns the bucket to choose for this distance, or -1 if the node
- * is ourselves
+ * is ourselves. Peers sharing BUCKET_COUNT - 1 or more leading bits with us
+ * all go to the last bucket
  */
 static int get_bucket_index(const HashID distance) {
   for (int byte = 0; byte < sizeof(HashID); byte++) {
@@ -22,7 +23,8 @@ static int get_bucket_index(const HashID distance) {
     for (int bit = 0; bit < 8; bit++) {
       if (byte_value & (0x80 >> bit)) {
         // log_msg(LOG_WARN, "byte is %d and bit is %d", byte, bit);
-        return byte * 8 + bit;
+        int index = byte * 8 + bit;
+        return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
       }
     }
   }
@@ -0,0 +1,122 @@
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+void buffer_init(struct Buffer *buf) {
+  if (!buf)
+    return;
+
+  buf->data = NULL;
+  buf->start = 0;
+  buf->end = 0;
+  buf->capacity = 0;
+}
+
+void buffer_free(struct Buffer *buf) {
+  if (!buf)
+    return;
+
+  free(buf->data);
+  buffer_init(buf);
+}
+
+int buffer_reserve(struct Buffer *buf, size_t len) {
+  if (!buf)
+    return -1;
+
+  if (buf->capacity - buf->end >= len)
+    return 0;
+
+  // Reclaim the consumed space at the front before growing
+  if (buf->start > 0) {
+    memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+    buf->end -= buf->start;
+    buf->start = 0;
+
+    if (buf->capacity - buf->end >= len)
+      return 0;
+  }
+
+  size_t capacity = buf->capacity ? buf->capacity : 1024;
+  while (capacity - buf->end < len)
+    capacity *= 2;
+
+  char *data = realloc(buf->data, capacity);
+  pointer_not_null(data, "buffer_reserve realloc error");
+  if (!data)
+    return -1;
+
+  buf->data = data;
+  buf->capacity = capacity;
+
+  return 0;
+}
+
+int buffer_append(struct Buffer *buf, const void *src, size_t len) {
+  if (!buf || (!src && len > 0))
+    return -1;
+
+  if (buffer_reserve(buf, len) != 0)
+    return -1;
+
+  memcpy(buf->data + buf->end, src, len);
+  buf->end += len;
+
+  return 0;
+}
+
+void buffer_consume(struct Buffer *buf, size_t len) {
+  if (!buf)
+    return;
+
+  if (len >= buf->end - buf->start) {
+    buf->start = 0;
+    buf->end = 0;
+    return;
+  }
+
+  buf->start += len;
+}
+
+const char *buffer_data(const struct Buffer *buf) {
+  return buf->data + buf->start;
+}
+
+size_t buffer_length(const struct Buffer *buf) {
+  return buf->end - buf->start;
+}
+
+ssize_t buffer_read_fd(struct Buffer *buf, int fd, size_t max) {
+  if (buffer_reserve(buf, max) != 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  ssize_t ret;
+  do {
+    ret = read(fd, buf->data + buf->end, max);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret > 0)
+    buf->end += ret;
+
+  return ret;
+}
+
+ssize_t buffer_write_fd(struct Buffer *buf, int fd) {
+  ssize_t ret;
+  do {
+    ret = send(fd, buffer_data(buf), buffer_length(buf), MSG_NOSIGNAL);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret > 0)
+    buffer_consume(buf, ret);
+
+  return ret;
+}
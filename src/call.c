@@ -0,0 +1,814 @@
+#include "call.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "log.h"
+#include "network.h"
+#include "pool.h"
+#include "shared.h"
+#include "timer.h"
+#include "wire.h"
+
+#define CALL_SLOT_MASK (CALL_MAX_PENDING - 1)
+
+/**
+ * @brief The protocol version a peer answered in
+ *
+ */
+struct PeerVersion {
+  struct sockaddr_in addr;
+
+  /**
+   * @brief The newest version the peer answered in, 0 for a free slot
+   *
+   */
+  uint8_t version;
+
+  /**
+   * @brief For RPC_LEGACY_VERSION, when the peer is asked in RPC_VERSION
+   * first again, in milliseconds of timer_now_ms
+   *
+   */
+  uint64_t probe_at;
+};
+
+/**
+ * @brief The versions spoken by the peers called, shared by every thread and
+ * indexed by a hash of the address of the peer. A peer replaces the one
+ * sharing its slot, which is asked in RPC_VERSION first again
+ *
+ */
+static struct PeerVersion peer_versions[1 << CALL_VERSION_BITS];
+static pthread_mutex_t peer_versions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief When a peer last answered in RPC_LEGACY_VERSION, in milliseconds of
+ * timer_now_ms, 0 if none did
+ *
+ */
+static uint64_t legacy_answered_at = 0;
+
+/**
+ * @brief A socket to a peer shared by the calls sent to it
+ *
+ */
+struct CallChannel {
+  struct sockaddr_in addr;
+
+  /**
+   * @brief The socket, -1 until the first request is sent or after it failed
+   *
+   */
+  int fd;
+
+  bool datagram;
+
+  /**
+   * @brief For TCP, whether the connection came from the pool
+   *
+   */
+  bool reused;
+
+  /**
+   * @brief For TCP, whether the connection may go back to the pool. A request
+   * that timed out may still be answered later
+   *
+   */
+  bool reusable;
+
+  /**
+   * @brief The number of pending calls sent on the channel
+   *
+   */
+  size_t outstanding;
+
+  /**
+   * @brief For TCP, the bytes received but not parsed yet
+   *
+   */
+  struct Buffer in;
+};
+
+int call_table_init(struct CallTable *table) {
+  if (!table)
+    return -1;
+
+  memset(table, 0, sizeof(struct CallTable));
+
+  table->calls = calloc(CALL_MAX_PENDING, sizeof(struct Call));
+  if (!table->calls) {
+    log_msg(LOG_ERROR, "call_table_init calloc error");
+    return -1;
+  }
+
+  if (getrandom(&table->next_id, sizeof(table->next_id), 0) < 0)
+    table->next_id = (uint32_t)timer_now_ms();
+
+  return 0;
+}
+
+void call_table_free(struct CallTable *table) {
+  if (!table)
+    return;
+
+  for (size_t i = 0; i < table->channel_count; i++) {
+    struct CallChannel *channel = &table->channels[i];
+
+    if (channel->fd >= 0) {
+      if (!channel->datagram && channel->reusable &&
+          channel->outstanding == 0 && buffer_length(&channel->in) == 0)
+        pool_release(&channel->addr, channel->fd);
+      else
+        close(channel->fd);
+    }
+
+    buffer_free(&channel->in);
+  }
+
+  // Abandoned calls still hold their messages
+  for (size_t i = 0; i < CALL_MAX_PENDING; i++)
+    free(table->calls[i].request);
+
+  free(table->channels);
+  free(table->pollfds);
+  free(table->calls);
+  memset(table, 0, sizeof(struct CallTable));
+}
+
+/**
+ * @brief Gets the slot of a peer in the table of versions
+ *
+ * @param addr The address of the peer
+ * @return struct PeerVersion* Returns the slot, which may hold another peer
+ */
+static struct PeerVersion *version_slot(const struct sockaddr_in *addr) {
+  uint32_t hash = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16);
+
+  // Multiplicative hashing, the top bits are the best mixed
+  hash *= 2654435761u;
+
+  return &peer_versions[hash >> (32 - CALL_VERSION_BITS)];
+}
+
+/**
+ * @brief Gets the version a peer answered in
+ *
+ * @param addr The address of the peer
+ * @return uint8_t Returns the version, 0 if it is unknown or the peer is due
+ * to be probed in RPC_VERSION again
+ */
+static uint8_t peer_version(const struct sockaddr_in *addr) {
+  pthread_mutex_lock(&peer_versions_lock);
+
+  struct PeerVersion *slot = version_slot(addr);
+  uint8_t version = 0;
+
+  if (slot->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+      slot->addr.sin_port == addr->sin_port &&
+      (slot->version != RPC_LEGACY_VERSION || timer_now_ms() < slot->probe_at))
+    version = slot->version;
+
+  pthread_mutex_unlock(&peer_versions_lock);
+
+  return version;
+}
+
+/**
+ * @brief Remembers the version a peer answered in. A peer that answered in
+ * RPC_VERSION keeps being asked in it, until its slot is taken
+ *
+ * @param addr The address of the peer
+ * @param version The version of its response
+ */
+static void learn_version(const struct sockaddr_in *addr, uint8_t version) {
+  pthread_mutex_lock(&peer_versions_lock);
+
+  struct PeerVersion *slot = version_slot(addr);
+
+  if (slot->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+      slot->addr.sin_port != addr->sin_port ||
+      version > slot->version || timer_now_ms() >= slot->probe_at) {
+    slot->addr = *addr;
+    slot->version = version;
+    slot->probe_at = timer_now_ms() + CALL_LEGACY_PROBE_MS;
+  }
+
+  if (version == RPC_LEGACY_VERSION)
+    legacy_answered_at = timer_now_ms();
+
+  pthread_mutex_unlock(&peer_versions_lock);
+}
+
+/**
+ * @brief Checks whether peers speaking only the older version are still
+ * around
+ *
+ * @return true A peer answered in RPC_LEGACY_VERSION in the last
+ * CALL_LEGACY_PROBE_MS
+ * @return false No peer did
+ */
+static bool legacy_peers_seen() {
+  pthread_mutex_lock(&peer_versions_lock);
+  bool seen = legacy_answered_at != 0 &&
+              timer_now_ms() < legacy_answered_at + CALL_LEGACY_PROBE_MS;
+  pthread_mutex_unlock(&peer_versions_lock);
+
+  return seen;
+}
+
+/**
+ * @brief Gets the channel to a peer over a transport, adding it if it doesn't
+ * exist yet. The socket of a new channel is only opened when a request is sent
+ *
+ * @param table The table of the channel
+ * @param addr The address of the peer
+ * @param datagram Whether the channel uses UDP
+ * @return ssize_t Returns the index of the channel, -1 if allocation failed
+ */
+static ssize_t get_channel(struct CallTable *table,
+                           const struct sockaddr_in *addr, bool datagram) {
+  for (size_t i = 0; i < table->channel_count; i++) {
+    struct CallChannel *channel = &table->channels[i];
+
+    if (channel->datagram == datagram &&
+        channel->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+        channel->addr.sin_port == addr->sin_port)
+      return i;
+  }
+
+  if (table->channel_count == table->channel_capacity) {
+    size_t capacity = table->channel_capacity ? table->channel_capacity * 2 : 8;
+
+    struct CallChannel *channels =
+        realloc(table->channels, capacity * sizeof(struct CallChannel));
+    if (!channels)
+      return -1;
+    table->channels = channels;
+
+    struct pollfd *pollfds =
+        realloc(table->pollfds, capacity * sizeof(struct pollfd));
+    if (!pollfds)
+      return -1;
+    table->pollfds = pollfds;
+
+    table->channel_capacity = capacity;
+  }
+
+  struct CallChannel *channel = &table->channels[table->channel_count];
+  memset(channel, 0, sizeof(struct CallChannel));
+  channel->addr = *addr;
+  channel->fd = -1;
+  channel->datagram = datagram;
+  buffer_init(&channel->in);
+
+  return table->channel_count++;
+}
+
+/**
+ * @brief Opens the socket of a channel if it isn't open yet
+ *
+ * @param channel The channel
+ * @return int Returns 0 if the socket is open, a negative number with errno
+ * set otherwise
+ */
+static int open_channel(struct CallChannel *channel) {
+  if (channel->fd >= 0)
+    return 0;
+
+  if (!channel->datagram) {
+    channel->fd = pool_acquire(&channel->addr, &channel->reused);
+    channel->reusable = true;
+    buffer_consume(&channel->in, buffer_length(&channel->in));
+
+    if (channel->fd < 0) {
+      errno = EHOSTUNREACH;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  // Connecting filters out datagrams from other peers and reports an ICMP
+  // port unreachable as ECONNREFUSED
+  if (connect(fd, (const struct sockaddr *)&channel->addr,
+              sizeof(channel->addr)) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  channel->fd = fd;
+  return 0;
+}
+
+/**
+ * @brief Completes a call with its response or failure and queues it for
+ * call_wait
+ *
+ * @param table The table of the call
+ * @param call The call
+ * @param state CALL_DONE or CALL_FAILED
+ */
+static void complete_call(struct CallTable *table, struct Call *call,
+                          enum CallState state) {
+  call->state = state;
+  call->resend = false;
+  table->channels[call->channel].outstanding--;
+  table->pending--;
+
+  size_t tail = (table->done_head + table->done_count) & CALL_SLOT_MASK;
+  table->done[tail] = call - table->calls;
+  table->done_count++;
+}
+
+/**
+ * @brief Fails a call
+ *
+ * @param table The table of the call
+ * @param call The call
+ * @param error The errno describing the failure
+ */
+static void fail_call(struct CallTable *table, struct Call *call, int error) {
+  log_msg(LOG_DEBUG, "Request %u to %s:%d failed: %s", call->request_id,
+          inet_ntoa(call->addr.sin_addr), ntohs(call->addr.sin_port),
+          strerror(error));
+
+  call->error = error;
+  complete_call(table, call, CALL_FAILED);
+}
+
+static void send_call(struct CallTable *table, struct Call *call);
+
+/**
+ * @brief Closes a TCP channel that failed. Calls sent on a pooled connection
+ * may have raced the peer closing it, and calls to a peer whose version is
+ * unknown may have been rejected, they are sent once more on a fresh
+ * connection. The others fail
+ *
+ * @param table The table of the channel
+ * @param index The index of the channel
+ * @param error The errno describing the failure
+ */
+static void break_channel(struct CallTable *table, size_t index, int error) {
+  struct CallChannel *channel = &table->channels[index];
+  bool reused = channel->reused;
+
+  close(channel->fd);
+  channel->fd = -1;
+  buffer_consume(&channel->in, buffer_length(&channel->in));
+
+  // Sort the calls out before sending anything, a resend may break the new
+  // connection too
+  for (size_t i = 0; i < CALL_MAX_PENDING; i++) {
+    struct Call *call = &table->calls[i];
+
+    if (call->state != CALL_PENDING || call->channel != index)
+      continue;
+
+    if (reused && !call->retried) {
+      call->retried = true;
+      call->resend = true;
+      call->attempts = 0;
+    } else if (!call->legacy && peer_version(&call->addr) == 0) {
+      // Peers speaking only the older version close the connection on
+      // messages they don't understand
+      call->legacy = true;
+      call->resend = true;
+      call->attempts = 0;
+    } else {
+      fail_call(table, call, error);
+    }
+  }
+
+  for (size_t i = 0; i < CALL_MAX_PENDING; i++) {
+    struct Call *call = &table->calls[i];
+
+    if (call->state == CALL_PENDING && call->resend) {
+      call->resend = false;
+      send_call(table, call);
+    }
+  }
+}
+
+/**
+ * @brief Moves a call from UDP to TCP after the peer refused datagrams
+ *
+ * @param table The table of the call
+ * @param call The call
+ */
+static void switch_to_stream(struct CallTable *table, struct Call *call) {
+  ssize_t index = get_channel(table, &call->addr, false);
+
+  if (index < 0) {
+    fail_call(table, call, ENOMEM);
+    return;
+  }
+
+  table->channels[call->channel].outstanding--;
+  table->channels[index].outstanding++;
+  call->channel = index;
+  call->attempts = 0;
+
+  send_call(table, call);
+}
+
+/**
+ * @brief Encodes the request of a call in a version and sends it on its
+ * channel
+ *
+ * @param channel The open channel of the call
+ * @param call The call
+ * @param version The version to send the request in
+ * @return int Returns 0 if the request was sent, a negative number with errno
+ * set otherwise
+ */
+static int send_request(struct CallChannel *channel, struct Call *call,
+                        uint8_t version) {
+  ((struct RPCMessageHeader *)call->request)->version = version;
+
+  char data[MAX_RPC_MESSAGE_SIZE];
+  size_t length = wire_encode(call->request, data, sizeof(data));
+
+  if (length == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (channel->datagram)
+    return send(channel->fd, data, length, 0) < 0 ? -1 : 0;
+
+  return send_all(channel->fd, data, length);
+}
+
+/**
+ * @brief Sends or retransmits the request of a call on its channel and sets
+ * its next deadline
+ *
+ * @param table The table of the call
+ * @param call The call
+ */
+static void send_call(struct CallTable *table, struct Call *call) {
+  struct CallChannel *channel = &table->channels[call->channel];
+
+  if (open_channel(channel) < 0) {
+    fail_call(table, call, errno);
+    return;
+  }
+
+  uint8_t version = peer_version(&call->addr);
+  bool both = false;
+
+  if (version == 0 && channel->datagram) {
+    // While peers answering in the older version are around, a peer that
+    // never answered gets the request in both versions at once, it answers
+    // the one it understands. A newer peer answers the first one, the second
+    // one is a retransmission to it
+    version = RPC_VERSION;
+    both = call->attempts > 0 || legacy_peers_seen();
+  } else if (version == 0) {
+    version = call->legacy ? RPC_LEGACY_VERSION : RPC_VERSION;
+  }
+
+  if (channel->datagram) {
+    if (send_request(channel, call, version) < 0 ||
+        (both && send_request(channel, call, RPC_LEGACY_VERSION) < 0)) {
+      if (errno == ECONNREFUSED)
+        switch_to_stream(table, call);
+      else
+        fail_call(table, call, errno);
+      return;
+    }
+
+    // The retransmission timeout doubles with each attempt
+    uint64_t timeout = (uint64_t)CALL_RETRY_MS << call->attempts;
+    call->deadline = timer_now_ms() + timeout;
+    call->attempts++;
+    return;
+  }
+
+  if (send_request(channel, call, version) < 0) {
+    if (errno == EINVAL)
+      fail_call(table, call, errno);
+    else
+      break_channel(table, call->channel, errno);
+    return;
+  }
+
+  call->deadline = timer_now_ms() + RPC_TIMEOUT_MS;
+  call->attempts++;
+}
+
+struct Call *call_start(struct CallTable *table, const struct sockaddr_in *addr,
+                        const void *request, size_t length, bool datagram,
+                        void *user) {
+  if (!table || !table->calls || !addr || !request ||
+      length < sizeof(struct RPCMessageHeader) ||
+      length > MAX_RPC_MESSAGE_SIZE ||
+      ((const struct RPCMessageHeader *)request)->packet_size != (int)length)
+    return NULL;
+
+  // Each response type is its request type shifted by four bits
+  enum RPCCallType request_type =
+      ((const struct RPCMessageHeader *)request)->call_type;
+  size_t response_size = wire_structure_size(request_type << 4);
+
+  struct Call *call = NULL;
+
+  for (size_t i = 0; i < CALL_MAX_PENDING; i++) {
+    if (table->calls[i].state == CALL_FREE) {
+      call = &table->calls[i];
+      break;
+    }
+  }
+
+  ssize_t channel = call ? get_channel(table, addr, datagram) : -1;
+  if (channel < 0)
+    return NULL;
+
+  char *messages = malloc(length + response_size);
+  if (!messages) {
+    log_msg(LOG_ERROR, "call_start malloc error");
+    return NULL;
+  }
+
+  size_t slot = call - table->calls;
+
+  memset(call, 0, sizeof(struct Call));
+  call->state = CALL_PENDING;
+  call->request = messages;
+  call->response = messages + length;
+  call->request_id = (table->next_id++ << CALL_SLOT_BITS) | slot;
+  call->addr = *addr;
+  call->channel = channel;
+  call->user = user;
+
+  memcpy(call->request, request, length);
+  call->request_length = length;
+  ((struct RPCMessageHeader *)call->request)->request_id = call->request_id;
+
+  table->channels[channel].outstanding++;
+  table->pending++;
+
+  send_call(table, call);
+  return call;
+}
+
+/**
+ * @brief Completes the call a response belongs to. Responses to calls that
+ * already completed, to other tables, of the wrong type or malformed are
+ * ignored
+ *
+ * @param table The table of the channel
+ * @param index The index of the channel the response came from
+ * @param data The response message
+ * @param length The length of the response
+ */
+static void handle_response(struct CallTable *table, size_t index,
+                            const char *data, size_t length) {
+  struct RPCMessageHeader header;
+  if (!wire_read_header(data, length, &header))
+    return;
+
+  struct Call *call = &table->calls[header.request_id & CALL_SLOT_MASK];
+
+  if (call->state != CALL_PENDING || call->request_id != header.request_id ||
+      call->channel != index)
+    return;
+
+  // Each response type is its request type shifted by four bits, the
+  // response buffer was sized for it
+  const struct RPCMessageHeader *request =
+      (const struct RPCMessageHeader *)call->request;
+  if (header.call_type != request->call_type << 4)
+    return;
+
+  size_t size = wire_decode(data, length, call->response,
+                            wire_structure_size(header.call_type));
+  if (size == 0)
+    return;
+
+  learn_version(&call->addr, header.version);
+
+  call->response_length = size;
+  complete_call(table, call, CALL_DONE);
+}
+
+/**
+ * @brief Reads the datagrams waiting on a UDP channel
+ *
+ * @param table The table of the channel
+ * @param index The index of the channel
+ */
+static void read_datagrams(struct CallTable *table, size_t index) {
+  struct CallChannel *channel = &table->channels[index];
+  char data[MAX_RPC_PACKET_SIZE];
+
+  while (true) {
+    ssize_t received =
+        recv(channel->fd, data, sizeof(data), MSG_DONTWAIT | MSG_TRUNC);
+
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+
+      int err = errno;
+
+      for (size_t i = 0; i < CALL_MAX_PENDING; i++) {
+        struct Call *call = &table->calls[i];
+
+        if (call->state != CALL_PENDING || call->channel != index)
+          continue;
+
+        if (err == ECONNREFUSED)
+          switch_to_stream(table, call);
+        else
+          fail_call(table, call, err);
+      }
+
+      return;
+    }
+
+    // Truncated or malformed datagrams are dropped, the request is
+    // retransmitted
+    if ((size_t)received <= sizeof(data) &&
+        peek_rpc_message(data, received) == received)
+      handle_response(table, index, data, received);
+  }
+}
+
+/**
+ * @brief Reads what a TCP channel received and completes the calls whose
+ * responses arrived whole
+ *
+ * @param table The table of the channel
+ * @param index The index of the channel
+ */
+static void read_stream(struct CallTable *table, size_t index) {
+  struct CallChannel *channel = &table->channels[index];
+  ssize_t received = buffer_read_fd(&channel->in, channel->fd, BUF_SIZE);
+
+  if (received < 0 && errno == EINTR)
+    return;
+
+  if (received <= 0) {
+    break_channel(table, index, received == 0 ? ECONNRESET : errno);
+    return;
+  }
+
+  while (true) {
+    const char *data = buffer_data(&channel->in);
+    ssize_t size = peek_rpc_message(data, buffer_length(&channel->in));
+
+    if (size == 0)
+      return;
+
+    if (size < 0) {
+      log_msg(LOG_ERROR, "Invalid RPC response from %s:%d",
+              inet_ntoa(channel->addr.sin_addr), ntohs(channel->addr.sin_port));
+      break_channel(table, index, EPROTO);
+      return;
+    }
+
+    handle_response(table, index, data, size);
+    buffer_consume(&channel->in, size);
+  }
+}
+
+/**
+ * @brief Retransmits or fails the calls whose deadline passed
+ *
+ * @param table The table of the calls
+ * @param now The current time in milliseconds of timer_now_ms
+ * @return int Returns the time until the next deadline in milliseconds, -1 if
+ * no call is pending
+ */
+static int expire_calls(struct CallTable *table, uint64_t now) {
+  uint64_t next = UINT64_MAX;
+
+  for (size_t i = 0; i < CALL_MAX_PENDING; i++) {
+    struct Call *call = &table->calls[i];
+
+    if (call->state != CALL_PENDING)
+      continue;
+
+    if (call->deadline <= now) {
+      struct CallChannel *channel = &table->channels[call->channel];
+
+      if (channel->datagram && call->attempts < CALL_DATAGRAM_ATTEMPTS) {
+        log_msg(LOG_DEBUG, "Retransmitting request %u to %s:%d",
+                call->request_id, inet_ntoa(call->addr.sin_addr),
+                ntohs(call->addr.sin_port));
+        send_call(table, call);
+      } else {
+        // The response may still come later and would be read as the next
+        // one, so the connection can't be pooled anymore
+        channel->reusable = false;
+        fail_call(table, call, ETIMEDOUT);
+      }
+    }
+
+    if (call->state == CALL_PENDING && call->deadline < next)
+      next = call->deadline;
+  }
+
+  if (next == UINT64_MAX)
+    return -1;
+
+  return next > now ? (int)(next - now) : 0;
+}
+
+struct Call *call_wait(struct CallTable *table) {
+  return call_wait_timeout(table, -1);
+}
+
+struct Call *call_wait_timeout(struct CallTable *table, int timeout_ms) {
+  if (!table || !table->calls)
+    return NULL;
+
+  uint64_t deadline = timer_now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+
+  while (table->done_count == 0 && table->pending > 0) {
+    uint64_t now = timer_now_ms();
+    int timeout = expire_calls(table, now);
+
+    if (table->done_count > 0 || timeout < 0)
+      break;
+
+    if (timeout_ms >= 0) {
+      if (now >= deadline)
+        break;
+
+      if (timeout > (int)(deadline - now))
+        timeout = (int)(deadline - now);
+    }
+
+    // Sockets without pending calls have a negative fd and are skipped by poll
+    for (size_t i = 0; i < table->channel_count; i++) {
+      struct CallChannel *channel = &table->channels[i];
+
+      table->pollfds[i].fd = channel->outstanding > 0 ? channel->fd : -1;
+      table->pollfds[i].events = POLLIN;
+      table->pollfds[i].revents = 0;
+    }
+
+    int ready = poll(table->pollfds, table->channel_count, timeout);
+
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+
+      log_msg(LOG_ERROR, "call_wait: poll() failed: %s", strerror(errno));
+      return NULL;
+    }
+
+    // Reading may add channels, only the polled ones are looked at
+    size_t polled = table->channel_count;
+
+    for (size_t i = 0; i < polled && ready > 0; i++) {
+      if (table->pollfds[i].fd < 0 || table->pollfds[i].revents == 0)
+        continue;
+
+      ready--;
+
+      if (table->channels[i].datagram)
+        read_datagrams(table, i);
+      else
+        read_stream(table, i);
+    }
+  }
+
+  if (table->done_count == 0)
+    return NULL;
+
+  struct Call *call = &table->calls[table->done[table->done_head]];
+  table->done_head = (table->done_head + 1) & CALL_SLOT_MASK;
+  table->done_count--;
+
+  return call;
+}
+
+void call_finish(struct CallTable *table, struct Call *call) {
+  if (!table || !call)
+    return;
+
+  free(call->request);
+  call->request = NULL;
+  call->response = NULL;
+  call->state = CALL_FREE;
+}
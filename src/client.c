@@ -2,6 +2,8 @@
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
 #include "client.h"
@@ -23,10 +25,16 @@ atomic_bool thread_request_stop = ATOMIC_VAR_INIT(false);
 atomic_bool thread_running = ATOMIC_VAR_INIT(false);
 
 /**
- * @brief The secondary P2P thread
+ * @brief The P2P network threads, the first one is the primary thread
  *
  */
-pthread_t p2p_thread;
+pthread_t p2p_threads[MAX_NETWORK_THREADS];
+
+/**
+ * @brief The number of P2P network threads that were started
+ *
+ */
+int p2p_thread_count = 0;
 
 /**
  * @brief The queue for issuing commands from frontend to P2P client
@@ -43,25 +51,49 @@ int start_client() {
     return -1;
   }
 
-  // Start P2P client thread
+  int thread_count = 1;
+  char *env = getenv("NETWORK_THREADS");
+  if (env) {
+    thread_count = (int)strtol(env, NULL, 10);
+
+    if (thread_count < 1 || thread_count > MAX_NETWORK_THREADS) {
+      log_msg(LOG_WARN, "NETWORK_THREADS must be between 1 and %d, using 1",
+              MAX_NETWORK_THREADS);
+      thread_count = 1;
+    }
+  }
+
+  // Start P2P client threads
   atomic_store(&thread_running, true);
-  int res = pthread_create(&p2p_thread, NULL, init_client, NULL);
-  log_msg(LOG_INFO, "pthread_create result: %d", res);
 
-  if (res != 0) {
-    perror("pthread_create failed");
-    atomic_store(&thread_running, false);
-    return -1;
+  for (int i = 0; i < thread_count; i++) {
+    int res = pthread_create(&p2p_threads[i], NULL, init_client,
+                             (void *)(intptr_t)i);
+    log_msg(LOG_INFO, "pthread_create result: %d", res);
+
+    if (res != 0) {
+      perror("pthread_create failed");
+
+      // Without the primary thread, nobody would handle our commands
+      if (i == 0) {
+        atomic_store(&thread_running, false);
+        return -1;
+      }
+
+      break;
+    }
+
+    p2p_thread_count++;
   }
 
   return 0;
 }
 
 void *init_client(void *arg) {
-  // We are on the secondary thread, set a specific log color for this one
+  // We are on a network thread, set a specific log color for those
   log_set_thread_color(LOG_COLOR_MAGENTA);
 
-  init_network();
+  init_network((int)(intptr_t)arg);
 
   update_client();
 
@@ -83,8 +115,12 @@ void update_client() {
 void stop_client() {
   log_msg(LOG_INFO, "Stopping P2P client");
   atomic_store(&thread_running, false);
+  wake_network();
+
+  for (int i = 0; i < p2p_thread_count; i++)
+    pthread_join(p2p_threads[i], NULL);
+  p2p_thread_count = 0;
 
-  pthread_join(p2p_thread, NULL);
   log_msg(LOG_INFO, "Stopped P2P client (main thread)");
 
   queue_destroy(&commands);
@@ -148,6 +184,66 @@ int upload_file(struct FileMagnet *file) {
   return result;
 }
 
+int upload_files(struct FileMagnet **files, size_t count) {
+  struct Command *c = malloc(sizeof(struct Command));
+  pointer_not_null(c, "upload_files command malloc error");
+
+  if (!command_init(c)) {
+    free(c);
+    return -1;
+  }
+
+  c->cmd_type = CMD_UPLOAD_MANY;
+  c->files = files;
+  c->file_count = count;
+
+  queue_push(&commands, c);
+
+  // Acquire the lock
+  pthread_mutex_lock(&c->lock);
+  // Condition variable to wait for command result from network thread
+  while (!c->done) {
+    pthread_cond_wait(&c->cond, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  int result = c->result;
+  command_destroy(c);
+  free(c);
+
+  return result;
+}
+
+int download_files(struct FileMagnet **files, size_t count) {
+  struct Command *c = malloc(sizeof(struct Command));
+  pointer_not_null(c, "download_files command malloc error");
+
+  if (!command_init(c)) {
+    free(c);
+    return -1;
+  }
+
+  c->cmd_type = CMD_DOWNLOAD_MANY;
+  c->files = files;
+  c->file_count = count;
+
+  queue_push(&commands, c);
+
+  // Acquire the lock
+  pthread_mutex_lock(&c->lock);
+  // Condition variable to wait for command result from network thread
+  while (!c->done) {
+    pthread_cond_wait(&c->cond, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  int result = c->result;
+  command_destroy(c);
+  free(c);
+
+  return result;
+}
+
 int show_network_status() {
   log_msg(LOG_INFO, "Showing network status");
 
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "command.h"
 
@@ -41,7 +43,19 @@ int queue_init(struct CommandQueue *q) {
   q->tail = 0;
   q->count = 0;
 
-  return pthread_mutex_init(&q->lock, NULL);
+  q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->event_fd < 0) {
+    perror("eventfd");
+    return -1;
+  }
+
+  int ret = pthread_mutex_init(&q->lock, NULL);
+  if (ret != 0) {
+    close(q->event_fd);
+    q->event_fd = -1;
+  }
+
+  return ret;
 }
 
 bool queue_push(struct CommandQueue *q, struct Command *cmd) {
@@ -61,6 +75,9 @@ bool queue_push(struct CommandQueue *q, struct Command *cmd) {
 
   pthread_mutex_unlock(&q->lock);
 
+  // Wake the network loop up, the counter can't overflow with so few commands
+  eventfd_write(q->event_fd, 1);
+
   return true;
 }
 
@@ -83,10 +100,22 @@ bool queue_pop(struct CommandQueue *q, struct Command **out_cmd) {
   return true;
 }
 
+void queue_clear_event(struct CommandQueue *q) {
+  if (!q)
+    return;
+
+  eventfd_t value;
+  eventfd_read(q->event_fd, &value);
+}
+
 void queue_destroy(struct CommandQueue *q) {
   if (!q)
     return;
 
+  if (q->event_fd >= 0)
+    close(q->event_fd);
+  q->event_fd = -1;
+
   pthread_mutex_destroy(&q->lock);
   q->head = 0;
   q->tail = 0;
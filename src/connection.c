@@ -0,0 +1,365 @@
+#include "connection.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "shared.h"
+
+/**
+ * @brief The maximum number of closed connections kept for reuse per thread
+ *
+ */
+#define MAX_FREE_CONNECTIONS 256
+
+/**
+ * @brief Buffers larger than this are released when a connection is recycled
+ * instead of being kept for the next one
+ *
+ */
+#define MAX_RECYCLED_BUFFER (64 * 1024)
+
+/**
+ * @brief The head of the list of open connections, each network thread owns
+ * the connections it accepted. The list is ordered from the most to the least
+ * recently active connection
+ *
+ */
+static __thread struct Connection *open_connections = NULL;
+
+/**
+ * @brief The tail of the list of open connections
+ *
+ */
+static __thread struct Connection *open_tail = NULL;
+
+/**
+ * @brief The number of open peer connections
+ *
+ */
+static __thread size_t peer_count = 0;
+
+/**
+ * @brief Closed connections kept for reuse, linked through their next field
+ *
+ */
+static __thread struct Connection *free_connections = NULL;
+static __thread size_t free_count = 0;
+
+/**
+ * @brief Connections closed during the current round of the network loop,
+ * linked through their next field
+ *
+ */
+static __thread struct Connection *closed_connections = NULL;
+
+/**
+ * @brief Inserts a connection at the head of the list of open connections
+ *
+ * @param conn The connection to insert
+ */
+static void list_push_front(struct Connection *conn) {
+  conn->prev = NULL;
+  conn->next = open_connections;
+
+  if (open_connections)
+    open_connections->prev = conn;
+  else
+    open_tail = conn;
+
+  open_connections = conn;
+}
+
+/**
+ * @brief Removes a connection from the list of open connections
+ *
+ * @param conn The connection to remove
+ */
+static void list_remove(struct Connection *conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    open_connections = conn->next;
+
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  else
+    open_tail = conn->prev;
+
+  conn->next = NULL;
+  conn->prev = NULL;
+}
+
+/**
+ * @brief Empties a buffer of a recycled connection, keeping its memory unless
+ * it grew large
+ *
+ * @param buf The buffer to reset
+ */
+static void recycle_buffer(struct Buffer *buf) {
+  if (buf->capacity > MAX_RECYCLED_BUFFER)
+    buffer_free(buf);
+  else
+    buffer_consume(buf, buffer_length(buf));
+}
+
+struct Connection *connection_open(int fd, enum ConnectionKind kind,
+                                   const struct sockaddr_in *addr) {
+  struct Connection *conn = free_connections;
+
+  // Reuse a closed connection along with its buffers when there is one
+  if (conn) {
+    free_connections = conn->next;
+    free_count--;
+
+    struct Buffer in = conn->in, out = conn->out, sending = conn->sending;
+    memset(conn, 0, sizeof(struct Connection));
+    conn->in = in;
+    conn->out = out;
+    conn->sending = sending;
+  } else {
+    conn = calloc(1, sizeof(struct Connection));
+    pointer_not_null(conn, "connection_open calloc error");
+
+    if (!conn)
+      return NULL;
+
+    buffer_init(&conn->in);
+    buffer_init(&conn->out);
+    buffer_init(&conn->sending);
+  }
+
+  conn->fd = fd;
+  conn->kind = kind;
+  conn->last_active = time(NULL);
+  conn->poll_index = -1;
+  conn->state = CONN_STATE_MAGIC;
+  conn->stream_fd = -1;
+  conn->body_fd = -1;
+
+  if (addr)
+    memcpy(&conn->addr, addr, sizeof(struct sockaddr_in));
+
+  list_push_front(conn);
+
+  if (kind == CONN_PEER)
+    peer_count++;
+
+  return conn;
+}
+
+void connection_close(struct Connection *conn) {
+  if (!conn)
+    return;
+
+  list_remove(conn);
+  timer_cancel(&conn->idle_timer);
+
+  if (conn->kind == CONN_PEER)
+    peer_count--;
+
+  log_msg(LOG_DEBUG, "Closing connection with fd: %d", conn->fd);
+
+  close(conn->fd);
+
+  if (conn->stream_fd >= 0)
+    close(conn->stream_fd);
+
+  if (conn->body_fd >= 0)
+    close(conn->body_fd);
+
+  free(conn->backend_data);
+  conn->backend_data = NULL;
+
+  // Events of the current round may still point to the connection
+  conn->closed = true;
+  conn->next = closed_connections;
+  closed_connections = conn;
+}
+
+void connection_recycle_closed() {
+  while (closed_connections) {
+    struct Connection *conn = closed_connections;
+    closed_connections = conn->next;
+
+    if (free_count < MAX_FREE_CONNECTIONS) {
+      recycle_buffer(&conn->in);
+      recycle_buffer(&conn->out);
+      recycle_buffer(&conn->sending);
+
+      conn->next = free_connections;
+      free_connections = conn;
+      free_count++;
+      continue;
+    }
+
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    buffer_free(&conn->sending);
+    free(conn);
+  }
+}
+
+void connection_close_all() {
+  while (open_connections)
+    connection_close(open_connections);
+
+  connection_recycle_closed();
+
+  while (free_connections) {
+    struct Connection *conn = free_connections;
+    free_connections = conn->next;
+
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    buffer_free(&conn->sending);
+    free(conn);
+  }
+
+  free_count = 0;
+}
+
+void connection_touch(struct Connection *conn) {
+  if (!conn)
+    return;
+
+  conn->last_active = time(NULL);
+
+  if (conn != open_connections) {
+    list_remove(conn);
+    list_push_front(conn);
+  }
+}
+
+struct Connection *connection_least_recent(enum ConnectionKind kind) {
+  for (struct Connection *conn = open_tail; conn; conn = conn->prev) {
+    if (conn->kind == kind && !conn->closing && !conn->closed)
+      return conn;
+  }
+
+  return NULL;
+}
+
+size_t connection_peer_count() { return peer_count; }
+
+int connection_send(struct Connection *conn, const void *data, size_t len) {
+  if (!conn || conn->closing)
+    return -1;
+
+  if (conn->kind == CONN_DATAGRAM)
+    return buffer_append(&conn->out, data, len);
+
+  size_t sent = 0;
+
+  // Write directly when nothing is queued, this avoids a copy in the common
+  // case of small responses
+  if (!conn->queue_output && !connection_has_output(conn)) {
+    while (sent < len) {
+      ssize_t ret = send(conn->fd, (const char *)data + sent, len - sent,
+                         MSG_NOSIGNAL);
+
+      if (ret < 0) {
+        if (errno == EINTR)
+          continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+
+        log_msg(LOG_WARN, "connection_send: send failed on fd %d: %s",
+                conn->fd, strerror(errno));
+        conn->closing = true;
+        return -1;
+      }
+
+      sent += ret;
+    }
+  }
+
+  if (sent < len &&
+      buffer_append(&conn->out, (const char *)data + sent, len - sent) != 0) {
+    conn->closing = true;
+    return -1;
+  }
+
+  return 0;
+}
+
+int connection_send_file(struct Connection *conn, int fd, size_t len) {
+  if (!conn || conn->closing || conn->stream_fd >= 0) {
+    close(fd);
+    return -1;
+  }
+
+  conn->stream_fd = fd;
+  conn->stream_offset = 0;
+  conn->stream_remaining = len;
+
+  return connection_flush(conn);
+}
+
+int connection_flush(struct Connection *conn) {
+  if (!conn || conn->closing)
+    return -1;
+
+  // The poller submits the queued bytes itself, the file can only follow once
+  // they were all sent
+  if (conn->queue_output &&
+      (buffer_length(&conn->out) > 0 || buffer_length(&conn->sending) > 0))
+    return 0;
+
+  while (buffer_length(&conn->out) > 0) {
+    if (buffer_write_fd(&conn->out, conn->fd) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+
+      log_msg(LOG_WARN, "connection_flush: send failed on fd %d: %s",
+              conn->fd, strerror(errno));
+      conn->closing = true;
+      return -1;
+    }
+  }
+
+  while (conn->stream_fd >= 0 && conn->stream_remaining > 0) {
+    ssize_t ret = sendfile(conn->fd, conn->stream_fd, &conn->stream_offset,
+                           conn->stream_remaining);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+
+      log_msg(LOG_WARN, "connection_flush: sendfile failed on fd %d: %s",
+              conn->fd, strerror(errno));
+      conn->closing = true;
+      return -1;
+    }
+
+    // The file got truncated while we were sending it
+    if (ret == 0) {
+      log_msg(LOG_WARN, "connection_flush: file ended early on fd %d",
+              conn->fd);
+      conn->closing = true;
+      return -1;
+    }
+
+    conn->stream_remaining -= ret;
+  }
+
+  if (conn->stream_fd >= 0) {
+    close(conn->stream_fd);
+    conn->stream_fd = -1;
+  }
+
+  return 0;
+}
+
+bool connection_has_output(const struct Connection *conn) {
+  return buffer_length(&conn->out) > 0 || buffer_length(&conn->sending) > 0 ||
+         conn->stream_fd >= 0;
+}
@@ -1,233 +1,387 @@
+#define _GNU_SOURCE
+
 #include "http.h"
 
 #include <ctype.h>
 #include <errno.h>
-#include <poll.h>
-#define _GNU_SOURCE
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
+#include "connection.h"
 #include "log.h"
 #include "network.h"
 #include "peer.h"
+#include "pool.h"
 #include "shared.h"
+#include "timer.h"
+
+/**
+ * @brief A canned response with a short plain text body
+ *
+ */
+struct HttpResponse {
+  const char *status;
+
+  /**
+   * @brief Additional header lines, each ending with CRLF
+   *
+   */
+  const char *headers;
+  const char *body;
+};
+
+static const struct HttpResponse not_found = {"404 Not Found", "",
+                                              "404 Not Found"};
+
+static const struct HttpResponse method_not_allowed = {
+    "405 Method Not Allowed", "Allow: GET, PUT\r\n", "405 Method Not Allowed"};
+
+static const struct HttpResponse file_created = {"201 Created", "",
+                                                 "File uploaded successfully"};
 
-static const char *not_found = "HTTP/1.1 404 Not Found\r\n"
-                               "Content-Type: text/plain\r\n"
-                               "Content-Length: 13\r\n"
-                               "\r\n"
-                               "404 Not Found";
-
-static const char *method_not_allowed = "HTTP/1.1 405 Method Not Allowed\r\n"
-                                        "Content-Type: text/plain\r\n"
-                                        "Content-Length: 23\r\n"
-                                        "Allow: GET, PUT\r\n"
-                                        "\r\n"
-                                        "405 Method Not Allowed";
-
-static const char *file_created = "HTTP/1.1 201 Created\r\n"
-                                  "Content-Type: text/plain\r\n"
-                                  "Content-Length: 24\r\n"
-                                  "Connection: close\r\n"
-                                  "\r\n"
-                                  "File uploaded successfully";
-
-static const char *internal_server_error =
-    "HTTP/1.1 500 Internal Server Error\r\n"
-    "Content-Type: text/plain\r\n"
-    "Content-Length: 21\r\n"
-    "Connection: close\r\n"
-    "\r\n"
-    "Internal Server Error";
-
-static const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
-                                 "Content-Type: text/plain\r\n"
-                                 "Content-Length: 12\r\n"
-                                 "Connection: close\r\n"
-                                 "\r\n"
-                                 "Bad Request";
+static const struct HttpResponse internal_server_error = {
+    "500 Internal Server Error", "", "Internal Server Error"};
+
+static const struct HttpResponse bad_request = {"400 Bad Request", "",
+                                                "Bad Request"};
+
+/**
+ * @brief Gets the value of the Connection header of a response
+ *
+ * @param conn The connection the response is sent on
+ * @return const char* Returns the header value
+ */
+static const char *connection_header(const struct Connection *conn) {
+  return conn->keep_alive ? "keep-alive" : "close";
+}
+
+/**
+ * @brief Queues a complete response. The connection is closed once it is sent
+ * unless the request asked to keep it open
+ *
+ * @param conn The connection to respond on
+ * @param response The response to send
+ */
+static void send_http_response(struct Connection *conn,
+                               const struct HttpResponse *response) {
+  char buf[512];
+  int len = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "Connection: %s\r\n"
+                     "\r\n"
+                     "%s",
+                     response->status, strlen(response->body),
+                     response->headers, connection_header(conn),
+                     response->body);
+
+  connection_send(conn, buf, len);
+  conn->close_after_write = !conn->keep_alive;
+}
+
+/**
+ * @brief Queues an error response to a request whose body won't be read, the
+ * connection can't be reused after it
+ *
+ * @param conn The connection to respond on
+ * @param response The response to send
+ */
+static void reject_http_request(struct Connection *conn,
+                                const struct HttpResponse *response) {
+  conn->keep_alive = false;
+  send_http_response(conn, response);
+}
 
 /**
  * @brief Sends a file back over HTTP
  *
- * @param sock The peer socket to which to send the file
+ * @param conn The peer connection to which to send the file
  * @param filename The name of the file to send
  */
-static void send_http_file(const struct pollfd *sock, const char *filename) {
+static void send_http_file(struct Connection *conn, const char *filename) {
   char full_path[512] = {0};
   snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR, filename);
 
-  FILE *file = fopen(full_path, "rb");
+  int file_fd = open(full_path, O_RDONLY | O_CLOEXEC);
 
   // If file not present on server
-  if (file == NULL) {
-    send_all(sock->fd, not_found, strlen(not_found));
+  if (file_fd < 0) {
+    send_http_response(conn, &not_found);
     return;
   }
 
-  fseek(file, 0, SEEK_END);
-  long size = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  struct stat st = {0};
+  if (fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(file_fd);
+    send_http_response(conn, &not_found);
+    return;
+  }
 
   char header[512] = {0};
   snprintf(header, sizeof(header),
            "HTTP/1.1 200 OK\r\n"
            "Content-Type: application/octet-stream\r\n"
            "Content-Length: %ld\r\n"
-           "Connection: close\r\n"
+           "Connection: %s\r\n"
            "\r\n",
-           size);
+           (long)st.st_size, connection_header(conn));
 
-  send_all(sock->fd, header, strlen(header));
+  connection_send(conn, header, strlen(header));
 
-  char buffer[BUF_SIZE] = {0};
-  size_t bytes_read;
-  while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-    send_all(sock->fd, buffer, bytes_read);
+  // The file is sent from the network loop as the socket becomes writable
+  connection_send_file(conn, file_fd, st.st_size);
+  conn->close_after_write = !conn->keep_alive;
+}
+
+/**
+ * @brief Finishes receiving the body of a PUT request and sends the response
+ *
+ * @param conn The connection that sent the PUT request
+ */
+static void finish_http_body(struct Connection *conn) {
+  if (conn->body_fd >= 0) {
+    close(conn->body_fd);
+    conn->body_fd = -1;
   }
 
-  fclose(file);
+  conn->state = CONN_STATE_MAGIC;
+  send_http_response(conn, conn->body_response);
 }
 
-static void receive_http_file(const struct pollfd *sock, const char *filename,
-                              const char *headers, size_t header_len) {
+static void receive_http_file(struct Connection *conn, const char *filename,
+                              const char *headers) {
   char full_path[512] = {0};
   snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR, filename);
 
-  // Make sure upload directory exists
-  struct stat st = {0};
-  if (stat(UPLOAD_DIR, &st) == -1) {
-    if (mkdir(UPLOAD_DIR, 0755) == -1) {
-      log_msg(LOG_ERROR, "Failed to create upload directory: %s",
-              strerror(errno));
-      send_all(sock->fd, internal_server_error, strlen(internal_server_error));
-      return;
-    }
-  }
-
   const char *cl_hdr = strcasestr_portable(headers, "Content-Length:");
   size_t content_length = 0;
 
   if (!cl_hdr) {
     log_msg(LOG_ERROR, "Missing Content-Length in PUT request");
-    send_all(sock->fd, bad_request, strlen(bad_request));
+    reject_http_request(conn, &bad_request);
     return;
   }
 
   if (sscanf(cl_hdr, "Content-Length: %zu", &content_length) != 1) {
     log_msg(LOG_ERROR, "Invalid Content-Length in PUT request");
-    send_all(sock->fd, bad_request, strlen(bad_request));
+    reject_http_request(conn, &bad_request);
     return;
   }
 
   log_msg(LOG_INFO, "Receiving file '%s' (%zu bytes)", filename,
           content_length);
 
-  FILE *file = fopen(full_path, "wb");
-  if (!file) {
-    log_msg(LOG_ERROR, "Cannot create file %s: %s", full_path, strerror(errno));
-    send_all(sock->fd, internal_server_error, strlen(internal_server_error));
-    return;
-  }
+  // The body is always read in full so the client gets to see our response,
+  // on errors it is simply discarded
+  conn->state = CONN_STATE_HTTP_BODY;
+  conn->body_fd = -1;
+  conn->body_remaining = content_length;
+  conn->body_response = &file_created;
 
-  const char *body_start = strstr(headers, "\r\n\r\n");
-  if (body_start) {
-    body_start += 4;
-    size_t body_bytes_in_buf = 0;
-    if (headers + header_len > body_start) {
-      body_bytes_in_buf = (size_t)(headers + header_len - body_start);
-    }
-    if (body_bytes_in_buf > 0) {
-      size_t to_write = body_bytes_in_buf < content_length ? body_bytes_in_buf
-                                                           : content_length;
-      if (fwrite(body_start, 1, to_write, file) != to_write) {
-        log_msg(LOG_ERROR, "Error writing initial body bytes to file");
-        fclose(file);
-        send_all(sock->fd, internal_server_error,
-                 strlen(internal_server_error));
-        return;
-      }
-      content_length -= to_write;
+  // Make sure upload directory exists
+  struct stat st = {0};
+  if (stat(UPLOAD_DIR, &st) == -1) {
+    if (mkdir(UPLOAD_DIR, 0755) == -1) {
+      log_msg(LOG_ERROR, "Failed to create upload directory: %s",
+              strerror(errno));
+      conn->body_response = &internal_server_error;
     }
-  } else {
-    log_msg(LOG_WARN, "No header terminator found in headers buffer");
   }
 
-  char buffer[CHUNK_SIZE];
-  while (content_length > 0) {
-    size_t to_recv =
-        content_length < sizeof(buffer) ? content_length : sizeof(buffer);
-    ssize_t n = recv_all(sock->fd, buffer, to_recv);
-    if (n < 0) {
-      if (errno == EINTR)
-        continue;
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-        continue;
-      log_msg(LOG_ERROR, "recv error: %s", strerror(errno));
-      send_all(sock->fd, internal_server_error, strlen(internal_server_error));
-      fclose(file);
-      return;
-    }
-    if (n == 0) {
-      log_msg(LOG_WARN,
-              "Connection closed while receiving file (remaining=%zu)",
-              content_length);
-      break;
-    }
-    if ((size_t)n > 0) {
-      if (fwrite(buffer, 1, n, file) != (size_t)n) {
-        log_msg(LOG_ERROR, "Error writing to file during upload");
-        send_all(sock->fd, internal_server_error,
-                 strlen(internal_server_error));
-        fclose(file);
-        return;
-      }
-      content_length -= (size_t)n;
+  if (conn->body_response == &file_created) {
+    conn->body_fd =
+        open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (conn->body_fd < 0) {
+      log_msg(LOG_ERROR, "Cannot create file %s: %s", full_path,
+              strerror(errno));
+      conn->body_response = &internal_server_error;
     }
   }
 
-  fclose(file);
-  log_msg(LOG_INFO, "File '%s' uploaded successfully", full_path);
-
-  // Send back success response
-  send_all(sock->fd, file_created, strlen(file_created));
+  if (content_length == 0)
+    finish_http_body(conn);
 }
 
-void handle_http_request(const struct pollfd *sock, const char *contents,
+void handle_http_request(struct Connection *conn, const char *contents,
                          size_t length) {
   log_msg(LOG_INFO, "Handling HTTP request\n");
 
+  // Work on a NUL-terminated copy so the headers can be searched safely
+  char headers[HTTP_HEADER_SIZE + 1] = {0};
+  size_t headers_len = length < HTTP_HEADER_SIZE ? length : HTTP_HEADER_SIZE;
+  memcpy(headers, contents, headers_len);
+
+  // HTTP/1.1 connections stay open unless the client asks otherwise
+  conn->keep_alive = strstr(headers, " HTTP/1.1\r\n") != NULL;
+
+  const char *connection = strcasestr_portable(headers, "\r\nConnection:");
+  if (connection) {
+    connection += strlen("\r\nConnection:");
+    connection += strspn(connection, " \t");
+
+    if (strncasecmp(connection, "close", 5) == 0)
+      conn->keep_alive = false;
+    else if (strncasecmp(connection, "keep-alive", 10) == 0)
+      conn->keep_alive = true;
+  }
+
   char path[256] = {0};
-  if (memcmp(contents, "GET ", 4) == 0) {
-    sscanf(contents, "GET %255s", path);
+  if (memcmp(headers, "GET ", 4) == 0) {
+    sscanf(headers, "GET %255s", path);
 
     // Strip leading '/'
     char *file_path = path + 1;
     if (strlen(file_path) == 0) {
-      send_all(sock->fd, not_found, strlen(not_found));
+      send_http_response(conn, &not_found);
       return;
     }
 
     log_msg(LOG_INFO, "GET Request file path: %s\n", file_path);
 
-    send_http_file(sock, file_path);
-  } else if (memcmp(contents, "PUT ", 4) == 0) {
-    sscanf(contents, "PUT %255s", path);
+    send_http_file(conn, file_path);
+  } else if (memcmp(headers, "PUT ", 4) == 0) {
+    sscanf(headers, "PUT %255s", path);
 
     // Strip leading '/'
     char *file_path = path + 1;
     if (strlen(file_path) == 0) {
-      send_all(sock->fd, not_found, strlen(not_found));
+      reject_http_request(conn, &not_found);
       return;
     }
 
     log_msg(LOG_INFO, "PUT Request file path: %s\n", file_path);
 
-    receive_http_file(sock, file_path, contents, length);
+    receive_http_file(conn, file_path, headers);
   } else {
-    send_all(sock->fd, method_not_allowed, strlen(method_not_allowed));
+    reject_http_request(conn, &method_not_allowed);
+  }
+}
+
+size_t handle_http_body(struct Connection *conn, const char *contents,
+                        size_t length) {
+  size_t to_write =
+      length < conn->body_remaining ? length : conn->body_remaining;
+
+  if (conn->body_fd >= 0 && send_all(conn->body_fd, contents, to_write) < 0) {
+    log_msg(LOG_ERROR, "Error writing to file during upload");
+    close(conn->body_fd);
+    conn->body_fd = -1;
+    conn->body_response = &internal_server_error;
+  }
+
+  conn->body_remaining -= to_write;
+
+  if (conn->body_remaining == 0) {
+    if (conn->body_response == &file_created)
+      log_msg(LOG_INFO, "File uploaded successfully");
+
+    finish_http_body(conn);
+  }
+
+  return to_write;
+}
+
+/**
+ * @brief Reads the headers of an HTTP response from a blocking socket. The
+ * response is read in chunks, so the start of the body may follow the headers
+ *
+ * @param fd The socket to read from
+ * @param dst The buffer receiving the response, at least HTTP_HEADER_SIZE bytes
+ * @param out_length Set to the number of bytes read into dst
+ * @return ssize_t Returns the length of the headers including the blank line
+ * ending them, a negative number if the socket failed or they are too large
+ */
+static ssize_t recv_http_headers(int fd, char *dst, size_t *out_length) {
+  const char *pattern = "\r\n\r\n";
+  const size_t pattern_len = strlen(pattern);
+  size_t length = 0;
+
+  while (length < HTTP_HEADER_SIZE) {
+    ssize_t ret = recv(fd, dst + length, HTTP_HEADER_SIZE - length, 0);
+
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+      return -1;
+
+    // Only the new bytes can complete the pattern, along with the few before
+    size_t from = length >= pattern_len ? length - pattern_len + 1 : 0;
+    length += ret;
+
+    const char *end = memmem(dst + from, length - from, pattern, pattern_len);
+    if (end) {
+      *out_length = length;
+      return end - dst + pattern_len;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Sends an HTTP request to a peer over a pooled connection and reads the
+ * headers of the response. A pooled connection the peer closed in the meantime
+ * is replaced by a new one
+ *
+ * @param addr The address of the peer
+ * @param request The NUL-terminated request line and headers
+ * @param body May be NULL, the body of the request
+ * @param body_len The length of the body
+ * @param dst The buffer receiving the response, at least HTTP_HEADER_SIZE bytes
+ * @param out_length Set to the number of bytes read into dst
+ * @param out_header_len Set to the length of the response headers
+ * @return int Returns the socket, a negative number if the exchange failed
+ */
+static int send_http_request(const struct sockaddr_in *addr,
+                             const char *request, const char *body,
+                             size_t body_len, char *dst, size_t *out_length,
+                             ssize_t *out_header_len) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = false;
+    int fd = pool_acquire(addr, &reused);
+    if (fd < 0)
+      return -1;
+
+    if (send_all(fd, request, strlen(request)) >= 0 &&
+        (!body || send_all(fd, body, body_len) >= 0) &&
+        (*out_header_len = recv_http_headers(fd, dst, out_length)) > 0)
+      return fd;
+
+    close(fd);
+
+    // A new connection failing means the peer itself has a problem
+    if (!reused)
+      break;
   }
+
+  return -1;
+}
+
+/**
+ * @brief Ends an HTTP exchange. The connection goes back to the pool if the
+ * response was read in full and the peer keeps the connection open
+ *
+ * @param addr The address of the peer
+ * @param fd The socket of the exchange
+ * @param headers The NUL-terminated response headers
+ * @param complete Whether exactly the whole response was read
+ */
+static void end_http_exchange(const struct sockaddr_in *addr, int fd,
+                              const char *headers, bool complete) {
+  if (complete && !strcasestr_portable(headers, "\r\nConnection: close"))
+    pool_release(addr, fd);
+  else
+    close(fd);
 }
 
 int download_http_file(const struct Peer *peer, const struct FileMagnet *file) {
@@ -248,29 +402,23 @@ int download_http_file(const struct Peer *peer, const struct FileMagnet *file) {
   snprintf(request, 1024,
            "GET /%s HTTP/1.1\r\n"
            "Host: %s:%d\r\n"
-           "Connection: close\r\n\r\n",
+           "Connection: keep-alive\r\n\r\n",
            file->display_name, ip_str, port);
 
-  int peer_fd = connect_to_peer(&peer->peer_addr);
-  if (peer_fd == -1)
-    return -1;
-
-  char http_header[HTTP_HEADER_SIZE] = {0};
-
-  ssize_t bytes_send = send_all(peer_fd, request, strlen(request));
-  if (bytes_send < 0) {
-    log_msg(LOG_ERROR, "Error in download http_file 0 bytes send!");
-    close(peer_fd);
+  char response[HTTP_HEADER_SIZE];
+  size_t response_len = 0;
+  ssize_t header_len = 0;
+  int peer_fd = send_http_request(&peer->peer_addr, request, NULL, 0, response,
+                                  &response_len, &header_len);
+  if (peer_fd < 0) {
+    log_msg(LOG_ERROR, "Error in download http_file no response from peer");
     return -1;
   }
 
-  ssize_t header_bytes_read =
-      recv_until(peer_fd, http_header, sizeof(http_header), "\r\n\r\n", 4);
-  if (header_bytes_read <= 0) {
-    log_msg(LOG_ERROR, "Error in download http_file response is empty");
-    close(peer_fd);
-    return -1;
-  }
+  // Work on a NUL-terminated copy of the headers, the start of the body may
+  // follow them in the response
+  char http_header[HTTP_HEADER_SIZE + 1] = {0};
+  memcpy(http_header, response, header_len);
 
   if (strstr(http_header, "404 Not Found") != NULL) {
     log_msg(LOG_WARN, "Peer responded with 404 Not Found for file %s",
@@ -279,7 +427,6 @@ int download_http_file(const struct Peer *peer, const struct FileMagnet *file) {
     return -1;
   }
 
-  http_header[header_bytes_read] = '\0';
   char *content_length_buf =
       strcasestr_portable(http_header, "Content-Length:");
   size_t content_length = 0;
@@ -319,6 +466,16 @@ int download_http_file(const struct Peer *peer, const struct FileMagnet *file) {
     return -1;
   }
 
+  // Write the part of the body that was read along with the headers, anything
+  // past the body means the connection is out of step
+  size_t prefix_len = response_len - header_len;
+  bool complete = prefix_len <= content_length;
+  if (prefix_len > content_length)
+    prefix_len = content_length;
+
+  fwrite(response + header_len, 1, prefix_len, new_file);
+  content_length -= prefix_len;
+
   char buffer[CHUNK_SIZE];
   while (content_length > 0) {
     const size_t to_recv =
@@ -344,92 +501,335 @@ int download_http_file(const struct Peer *peer, const struct FileMagnet *file) {
   }
 
   fclose(new_file);
-  close(peer_fd);
+  end_http_exchange(&peer->peer_addr, peer_fd, http_header,
+                    complete && content_length == 0);
   log_msg(LOG_INFO, "Downloaded file saved to: %s", file_path);
 
   return 0;
 }
 
-int upload_http_file(const struct Peer *peer, const struct FileMagnet *file,
-                     const char *contents, size_t length) {
-  if (!peer || !contents || length == 0) {
-    log_msg(LOG_ERROR, "upload_http_file: invalid arguments");
-    return -1;
-  }
+/**
+ * @brief An upload run by upload_http_files
+ *
+ */
+struct PendingUpload {
+  const struct Peer *peer;
+
+  /**
+   * @brief The socket of the upload, -1 once it ended
+   *
+   */
+  int fd;
+
+  /**
+   * @brief How many connections were tried. A pooled connection failing
+   * before any response is replaced once, the peer may have closed it
+   *
+   */
+  int attempts;
+  bool reused;
+
+  char request[1024];
+  size_t request_len;
+
+  /**
+   * @brief The number of bytes of the request and the body sent
+   *
+   */
+  size_t sent;
+
+  char response[HTTP_HEADER_SIZE + 1];
+  size_t response_len;
+
+  /**
+   * @brief The length of the response headers, 0 until they are complete
+   *
+   */
+  size_t header_len;
+  size_t body_left;
+  int status;
+
+  /**
+   * @brief When the upload fails without progress, in milliseconds of
+   * timer_now_ms
+   *
+   */
+  uint64_t deadline;
+};
 
-  // Connect to the peer
-  int sock = connect_to_peer(&peer->peer_addr);
-  if (sock < 0) {
-    log_msg(LOG_ERROR, "upload_http_file: cannot connect to peer");
+/**
+ * @brief Gets a connection for an upload and starts it over
+ *
+ * @param upload The upload
+ * @return int Returns 0 if a connection is ready, a negative number otherwise
+ */
+static int start_upload(struct PendingUpload *upload) {
+  upload->fd = pool_acquire(&upload->peer->peer_addr, &upload->reused);
+  upload->attempts++;
+  upload->sent = 0;
+  upload->response_len = 0;
+  upload->header_len = 0;
+  upload->deadline = timer_now_ms() + RPC_TIMEOUT_MS;
+
+  if (upload->fd < 0)
     return -1;
+
+  // sendfile has no MSG_DONTWAIT, the socket itself must not block
+  fcntl(upload->fd, F_SETFL, fcntl(upload->fd, F_GETFL, 0) | O_NONBLOCK);
+  return 0;
+}
+
+/**
+ * @brief Sends as much of the request and the body of an upload as the socket
+ * takes without blocking
+ *
+ * @param upload The upload
+ * @param fd The file descriptor of the body
+ * @param length The length of the body
+ * @return int Returns 0 if the socket is still fine, a negative number
+ * otherwise
+ */
+static int send_upload(struct PendingUpload *upload, int fd, size_t length) {
+  if (upload->sent < upload->request_len) {
+    // The headers go out in the same segment as the start of the body
+    ssize_t ret = send(upload->fd, upload->request + upload->sent,
+                       upload->request_len - upload->sent,
+                       MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+
+    if (ret < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                        : -1;
+
+    upload->sent += ret;
+    if (upload->sent < upload->request_len)
+      return 0;
   }
 
-  // Build PUT request header
-  char request_header[1024];
-  snprintf(request_header, sizeof(request_header),
-           "PUT /%s HTTP/1.1\r\n"
-           "Host: %s:%d\r\n"
-           "Content-Type: application/octet-stream\r\n"
-           "Content-Length: %zu\r\n"
-           "Connection: close\r\n\r\n",
-           file->display_name, // use peer->display_name as filename
-           inet_ntoa(peer->peer_addr.sin_addr), // peer IP
-           ntohs(peer->peer_addr.sin_port), length);
-
-  // Send header
-  if (send_all(sock, request_header, strlen(request_header)) < 0) {
-    log_msg(LOG_ERROR, "upload_http_file: failed to send header");
-    close(sock);
+  off_t offset = upload->sent - upload->request_len;
+  ssize_t ret = sendfile(upload->fd, fd, &offset, length - (size_t)offset);
+
+  if (ret < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+  // The file got truncated while we were sending it
+  if (ret == 0) {
+    log_msg(LOG_WARN, "upload_http_files: file ended early");
     return -1;
   }
 
-  // Send file contents
-  if (send_all(sock, contents, length) < 0) {
-    log_msg(LOG_ERROR, "upload_http_file: failed to send file data");
-    close(sock);
-    return -1;
+  upload->sent += ret;
+  return 0;
+}
+
+/**
+ * @brief Reads what arrived of the response to an upload without blocking
+ *
+ * @param upload The upload
+ * @return int Returns 1 once the whole response was read, 0 while it is
+ * incomplete, a negative number if the socket failed
+ */
+static int recv_upload(struct PendingUpload *upload) {
+  if (upload->header_len == 0) {
+    ssize_t ret = recv(upload->fd, upload->response + upload->response_len,
+                       HTTP_HEADER_SIZE - upload->response_len, MSG_DONTWAIT);
+
+    if (ret < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                        : -1;
+    if (ret == 0)
+      return -1;
+
+    upload->response_len += ret;
+    upload->response[upload->response_len] = '\0';
+
+    char *end = strstr(upload->response, "\r\n\r\n");
+    if (!end)
+      return upload->response_len < HTTP_HEADER_SIZE ? 0 : -1;
+
+    upload->header_len = end - upload->response + 4;
+
+    if (sscanf(upload->response, "HTTP/%*d.%*d %d", &upload->status) != 1)
+      log_msg(LOG_WARN, "upload_http_files: cannot parse response status");
+
+    size_t content_length = 0;
+    char *cl = strcasestr_portable(upload->response, "Content-Length:");
+    if (cl)
+      sscanf(cl, "Content-Length: %zu", &content_length);
+
+    // Part of the body may have been read along with the headers, the rest
+    // is drained below
+    size_t prefix_len = upload->response_len - upload->header_len;
+    if (prefix_len > content_length)
+      return -1;
+
+    upload->body_left = content_length - prefix_len;
+    upload->response[upload->header_len] = '\0';
   }
 
-  char resp_header[HTTP_HEADER_SIZE];
-  ssize_t header_bytes =
-      recv_until(sock, resp_header, sizeof(resp_header), "\r\n\r\n", 4);
+  char rbuf[CHUNK_SIZE];
+  while (upload->body_left > 0) {
+    size_t to_recv =
+        upload->body_left < sizeof(rbuf) ? upload->body_left : sizeof(rbuf);
+    ssize_t ret = recv(upload->fd, rbuf, to_recv, MSG_DONTWAIT);
+
+    if (ret < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                        : -1;
+    if (ret == 0)
+      return -1;
 
-  if (header_bytes <= 0) {
-    log_msg(LOG_ERROR, "upload_http_file: failed to read response headers");
-    close(sock);
-    return -1;
+    upload->body_left -= ret;
   }
 
-  resp_header[header_bytes] = '\0';
-  log_msg(LOG_DEBUG, "upload_http_file: response headers:\n%s", resp_header);
+  return 1;
+}
+
+size_t upload_http_files(struct Peer *const *peers, size_t count,
+                         const struct FileMagnet *file, int fd, size_t length,
+                         UploadDoneFunc *on_done, void *arg) {
+  if (!peers || !file || fd < 0 || length == 0 || count > K_VALUE) {
+    log_msg(LOG_ERROR, "upload_http_files: invalid arguments");
+    return 0;
+  }
 
-  int status_code = 0;
-  if (sscanf(resp_header, "HTTP/%*d.%*d %d", &status_code) == 1) {
-    if (status_code >= 200 && status_code < 300) {
-      log_msg(LOG_INFO, "upload_http_file: success status %d", status_code);
-    } else {
-      log_msg(LOG_WARN, "upload_http_file: non-2xx response %d", status_code);
+  struct PendingUpload uploads[K_VALUE];
+  size_t active = 0;
+  size_t confirmed = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    struct PendingUpload *upload = &uploads[i];
+    *upload = (struct PendingUpload){.peer = peers[i], .fd = -1};
+
+    if (!peers[i])
+      continue;
+
+    upload->request_len = snprintf(
+        upload->request, sizeof(upload->request),
+        "PUT /%s HTTP/1.1\r\n"
+        "Host: %s:%d\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: keep-alive\r\n\r\n",
+        file->display_name, inet_ntoa(peers[i]->peer_addr.sin_addr),
+        ntohs(peers[i]->peer_addr.sin_port), length);
+
+    if (start_upload(upload) < 0) {
+      log_msg(LOG_ERROR, "upload_http_files: cannot connect to peer");
+      if (on_done)
+        on_done(i, false, arg);
+      continue;
     }
-  } else {
-    log_msg(LOG_WARN, "upload_http_file: cannot parse response status");
+
+    active++;
   }
 
-  char *cl = strcasestr_portable(resp_header, "Content-Length:");
-  if (cl) {
-    size_t resp_len = 0;
-    if (sscanf(cl, "Content-Length: %zu", &resp_len) == 1) {
-      size_t remaining = resp_len;
-      char rbuf[CHUNK_SIZE];
-      while (remaining > 0) {
-        size_t to_recv = remaining < sizeof(rbuf) ? remaining : sizeof(rbuf);
-        ssize_t rn = recv(sock, rbuf, to_recv, 0);
-        if (rn <= 0)
-          break;
-        remaining -= rn;
+  struct pollfd pollfds[K_VALUE];
+  size_t polled[K_VALUE];
+
+  while (active > 0) {
+    uint64_t now = timer_now_ms();
+    uint64_t next_deadline = UINT64_MAX;
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+      struct PendingUpload *upload = &uploads[i];
+      if (upload->fd < 0)
+        continue;
+
+      bool sending = upload->sent < upload->request_len + length;
+
+      // The response is read even while sending, a peer may refuse early
+      pollfds[n] = (struct pollfd){.fd = upload->fd,
+                                   .events = POLLIN | (sending ? POLLOUT : 0)};
+      polled[n++] = i;
+
+      if (upload->deadline < next_deadline)
+        next_deadline = upload->deadline;
+    }
+
+    int timeout = next_deadline > now ? (int)(next_deadline - now) : 0;
+    int ready = poll(pollfds, n, timeout);
+
+    if (ready < 0 && errno != EINTR) {
+      log_msg(LOG_ERROR, "upload_http_files: poll() failed: %s",
+              strerror(errno));
+      break;
+    }
+
+    now = timer_now_ms();
+
+    for (size_t j = 0; j < n; j++) {
+      size_t i = polled[j];
+      struct PendingUpload *upload = &uploads[i];
+      short revents = ready > 0 ? pollfds[j].revents : 0;
+      int result = 0;
+
+      if (revents & POLLOUT)
+        result = send_upload(upload, fd, length);
+
+      if (result == 0 && (revents & (POLLIN | POLLERR | POLLHUP)))
+        result = recv_upload(upload);
+
+      if (revents)
+        upload->deadline = now + RPC_TIMEOUT_MS;
+      else if (now >= upload->deadline)
+        result = -1;
+
+      if (result == 0)
+        continue;
+
+      if (result < 0) {
+        close(upload->fd);
+        upload->fd = -1;
+
+        // The peer may have closed a pooled connection while it was idle
+        if (upload->reused && upload->response_len == 0 &&
+            upload->attempts < 2 && start_upload(upload) == 0)
+          continue;
+
+        log_msg(LOG_ERROR, "upload_http_files: no response from peer");
+        active--;
+
+        if (on_done)
+          on_done(i, false, arg);
+        continue;
       }
+
+      bool success = upload->status >= 200 && upload->status < 300;
+      if (success) {
+        log_msg(LOG_INFO, "upload_http_files: success status %d",
+                upload->status);
+        confirmed++;
+      } else {
+        log_msg(LOG_WARN, "upload_http_files: non-2xx response %d",
+                upload->status);
+      }
+
+      // The pool hands out blocking sockets
+      fcntl(upload->fd, F_SETFL,
+            fcntl(upload->fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+      // A response arriving before the whole body was sent leaves the
+      // connection out of step
+      end_http_exchange(&upload->peer->peer_addr, upload->fd, upload->response,
+                        upload->sent == upload->request_len + length);
+      upload->fd = -1;
+      active--;
+
+      if (on_done)
+        on_done(i, success, arg);
     }
   }
 
-  close(sock);
-  return 0;
-}
\ No newline at end of file
+  // Only reached if poll failed
+  for (size_t i = 0; i < count; i++) {
+    if (uploads[i].fd < 0)
+      continue;
+
+    close(uploads[i].fd);
+    if (on_done)
+      on_done(i, false, arg);
+  }
+
+  return confirmed;
+}
@@ -77,22 +77,6 @@ struct Peer *remove_back(struct DList *list) {
   return tail_peer;
 }
 
-void dist_hash(HashID result, const HashID id1, const HashID id2) {
-  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-    result[i] = id1[i] ^ id2[i];
-  }
-}
-
-int compare_hashes(const HashID dist1, const HashID dist2) {
-  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-    if (dist1[i] < dist2[i])
-      return -1;
-    if (dist1[i] > dist2[i])
-      return 1;
-  }
-  return 0;
-}
-
 int find_nearest(const struct DList *list, const HashID id,
                  struct Peer **out_peers, size_t max_neighbors) {
   if (!list || !list->head || !out_peers || max_neighbors == 0)
@@ -34,7 +34,8 @@ void log_msg(enum LogLevel level, const char *fmt, ...) {
 
   // Time prefix
   time_t now = time(NULL);
-  struct tm *t = localtime(&now);
+  struct tm tm_now;
+  struct tm *t = localtime_r(&now, &tm_now);
   char timebuf[20];
   strftime(timebuf, sizeof(timebuf), "%H:%M:%S", t);
 
@@ -60,11 +61,16 @@ void log_msg(enum LogLevel level, const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
 
+  // Keep the lines of different threads from interleaving
+  flockfile(stderr);
+
   fprintf(stderr, "%s[%s]%s %s[%s]%s ", LEVEL_COLORS[level], level_str, reset,
           thread_color, timebuf, reset);
 
   vfprintf(stderr, fmt, args);
   fprintf(stderr, "\n");
 
+  funlockfile(stderr);
+
   va_end(args);
 }
@@ -0,0 +1,307 @@
+#include "lookup_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "timer.h"
+
+/**
+ * @brief The result of a lookup
+ *
+ */
+struct LookupEntry {
+  HashID target;
+  enum LookupKind kind;
+  size_t count;
+  struct Peer peers[K_VALUE];
+
+  /**
+   * @brief When the entry stops being used, in milliseconds of timer_now_ms,
+   * 0 for a free entry
+   *
+   */
+  uint64_t expires;
+};
+
+struct LookupFlight {
+  HashID target;
+  enum LookupKind kind;
+
+  /**
+   * @brief The thread traversing the network, it never waits for itself
+   *
+   */
+  pthread_t leader;
+
+  /**
+   * @brief Whether the flight is taken, until its lookup ended and every
+   * thread that joined it copied the result
+   *
+   */
+  bool in_use;
+  bool done;
+  size_t waiters;
+
+  int result;
+  size_t count;
+  struct Peer peers[K_VALUE];
+};
+
+#define LOOKUP_CACHE_SIZE (1 << LOOKUP_CACHE_BITS)
+
+static struct LookupEntry entries[LOOKUP_CACHE_SIZE];
+static struct LookupCacheStats stats = {0};
+
+/**
+ * @brief How long entries are used for in milliseconds, 0 if the cache is off
+ *
+ */
+static uint64_t ttl_ms = DEFAULT_LOOKUP_CACHE_TTL * 1000;
+
+static struct LookupFlight flights[LOOKUP_MAX_FLIGHTS];
+
+static pthread_once_t cache_ready = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signaled whenever a lookup in flight ends
+ *
+ */
+static pthread_cond_t flight_ended = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Reads the TTL of the entries from the environment
+ *
+ */
+static void lookup_cache_init() {
+  char *env = getenv("LOOKUP_CACHE_TTL");
+  if (!env)
+    return;
+
+  long ttl = strtol(env, NULL, 10);
+  if (ttl < 0) {
+    log_msg(LOG_WARN, "LOOKUP_CACHE_TTL must not be negative, using %d",
+            DEFAULT_LOOKUP_CACHE_TTL);
+    return;
+  }
+
+  ttl_ms = (uint64_t)ttl * 1000;
+}
+
+/**
+ * @brief Gets the first slot of the probe sequence of a target
+ *
+ */
+static size_t entry_index(const HashID target, enum LookupKind kind) {
+  uint64_t hash;
+  memcpy(&hash, target, sizeof(hash));
+
+  // Both kinds of results of a target get their own sequence
+  hash = (hash ^ kind) * 0x9E3779B97F4A7C15ull;
+
+  return hash >> (64 - LOOKUP_CACHE_BITS);
+}
+
+/**
+ * @brief Finds the entry of a target
+ *
+ * @param target The target
+ * @param kind The kind of result
+ * @param now The current time in milliseconds of timer_now_ms
+ * @param out_slot Set to the entry to replace if the target has none
+ * @return struct LookupEntry* Returns the entry, NULL if there is no valid one
+ */
+static struct LookupEntry *find_entry(const HashID target,
+                                      enum LookupKind kind, uint64_t now,
+                                      struct LookupEntry **out_slot) {
+  size_t index = entry_index(target, kind);
+  struct LookupEntry *slot = NULL;
+
+  for (size_t i = 0; i < LOOKUP_CACHE_PROBE; i++) {
+    struct LookupEntry *entry =
+        &entries[(index + i) & (LOOKUP_CACHE_SIZE - 1)];
+
+    if (entry->expires > now && entry->kind == kind &&
+        memcmp(entry->target, target, sizeof(HashID)) == 0)
+      return entry;
+
+    if (!slot || entry->expires < slot->expires)
+      slot = entry;
+  }
+
+  if (out_slot)
+    *out_slot = slot;
+
+  return NULL;
+}
+
+size_t lookup_cache_get(const HashID target, enum LookupKind kind,
+                        struct Peer *out_peers, size_t max) {
+  pthread_once(&cache_ready, lookup_cache_init);
+
+  size_t count = 0;
+
+  pthread_mutex_lock(&cache_lock);
+
+  struct LookupEntry *entry = find_entry(target, kind, timer_now_ms(), NULL);
+  if (entry) {
+    for (; count < entry->count && count < max; count++)
+      out_peers[count] = entry->peers[count];
+
+    stats.hits++;
+  } else {
+    stats.misses++;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return count;
+}
+
+void lookup_cache_put(const HashID target, enum LookupKind kind,
+                      struct Peer *const *peers, size_t count) {
+  pthread_once(&cache_ready, lookup_cache_init);
+
+  if (ttl_ms == 0)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+
+  uint64_t now = timer_now_ms();
+  struct LookupEntry *slot;
+  struct LookupEntry *entry = find_entry(target, kind, now, &slot);
+  if (!entry)
+    entry = slot;
+
+  memcpy(entry->target, target, sizeof(HashID));
+  entry->kind = kind;
+  entry->count = 0;
+
+  for (size_t i = 0; i < count && entry->count < K_VALUE; i++) {
+    if (peers[i])
+      entry->peers[entry->count++] = *peers[i];
+  }
+
+  // A result without peers isn't worth keeping
+  entry->expires = entry->count > 0 ? now + ttl_ms : 0;
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void lookup_cache_forget_peer(const HashID peer_id) {
+  pthread_mutex_lock(&cache_lock);
+
+  for (size_t i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+    struct LookupEntry *entry = &entries[i];
+
+    if (entry->expires == 0)
+      continue;
+
+    for (size_t j = 0; j < entry->count; j++) {
+      if (memcmp(entry->peers[j].peer_id, peer_id, sizeof(HashID)) == 0) {
+        entry->expires = 0;
+        stats.invalidated++;
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+bool lookup_flight_join(const HashID target, enum LookupKind kind,
+                        struct LookupFlight **out_flight,
+                        struct Peer *out_peers, size_t max, size_t *out_count,
+                        int *out_result) {
+  pthread_mutex_lock(&cache_lock);
+
+  struct LookupFlight *joined = NULL;
+  struct LookupFlight *free_flight = NULL;
+
+  for (size_t i = 0; i < LOOKUP_MAX_FLIGHTS; i++) {
+    struct LookupFlight *flight = &flights[i];
+
+    if (!flight->in_use) {
+      if (!free_flight)
+        free_flight = flight;
+      continue;
+    }
+
+    if (!flight->done && flight->kind == kind &&
+        !pthread_equal(flight->leader, pthread_self()) &&
+        memcmp(flight->target, target, sizeof(HashID)) == 0) {
+      joined = flight;
+      break;
+    }
+  }
+
+  if (!joined) {
+    if (free_flight) {
+      memcpy(free_flight->target, target, sizeof(HashID));
+      free_flight->kind = kind;
+      free_flight->leader = pthread_self();
+      free_flight->in_use = true;
+      free_flight->done = false;
+      free_flight->waiters = 0;
+    }
+
+    stats.lookups++;
+    pthread_mutex_unlock(&cache_lock);
+
+    *out_flight = free_flight;
+    return true;
+  }
+
+  stats.coalesced++;
+  joined->waiters++;
+
+  while (!joined->done)
+    pthread_cond_wait(&flight_ended, &cache_lock);
+
+  size_t count = 0;
+  for (; count < joined->count && count < max; count++)
+    out_peers[count] = joined->peers[count];
+
+  *out_count = count;
+  *out_result = joined->result;
+
+  // The last thread to copy the result frees the flight
+  if (--joined->waiters == 0)
+    joined->in_use = false;
+
+  pthread_mutex_unlock(&cache_lock);
+
+  *out_flight = NULL;
+  return false;
+}
+
+void lookup_flight_end(struct LookupFlight *flight, int result,
+                       struct Peer *const *peers, size_t count) {
+  if (!flight)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+
+  flight->result = result;
+  flight->count = 0;
+
+  for (size_t i = 0; i < count && flight->count < K_VALUE; i++) {
+    if (peers[i])
+      flight->peers[flight->count++] = *peers[i];
+  }
+
+  flight->done = true;
+  if (flight->waiters == 0)
+    flight->in_use = false;
+
+  pthread_cond_broadcast(&flight_ended);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void lookup_cache_get_stats(struct LookupCacheStats *out_stats) {
+  pthread_mutex_lock(&cache_lock);
+  *out_stats = stats;
+  pthread_mutex_unlock(&cache_lock);
+}
@@ -1,3 +1,4 @@
+#include <dirent.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -37,32 +38,29 @@ static int copy_file(const char *src_path, const char *dest_path) {
   return 0;
 }
 
-void cli_download_file() {
-  char magnet_link[FILENAME_SIZE] = {0};
-
-  printf("Enter filename of magnet to download: ");
-
-  if (fgets(magnet_link, sizeof(magnet_link), stdin) == NULL)
-    return;
-
-  magnet_link[strcspn(magnet_link, "\n")] = '\0';
-
+/**
+ * @brief Loads and parses a magnet file
+ *
+ * @param magnet_link The path of the magnet file
+ * @return struct FileMagnet* Returns the magnet, NULL if it couldn't be loaded
+ */
+static struct FileMagnet *load_magnet(const char *magnet_link) {
   struct stat st;
   if (stat(magnet_link, &st) != 0) {
     log_msg(LOG_ERROR, "File does not exist! Please entir valid filename.");
-    return;
+    return NULL;
   }
 
   if (S_ISDIR(st.st_mode)) {
     log_msg(LOG_ERROR, "Can't open directory as file");
-    return;
+    return NULL;
   }
 
   // Load magnet file contents from disk
   FILE *file = fopen(magnet_link, "r");
   if (file == NULL) {
     log_msg(LOG_ERROR, "File does not exist! Please enter valid filename.");
-    return;
+    return NULL;
   }
 
   // Get size, allocate memory and read contents into the buffer
@@ -72,18 +70,20 @@ void cli_download_file() {
   if (size < 0) {
     log_msg(LOG_ERROR, "Invalid file size or ftell failed");
     fclose(file);
-    return;
+    return NULL;
   }
 
   fseek(file, 0, SEEK_SET);
 
-  void *contents = malloc((size_t)size);
-  pointer_not_null(contents, "cli_download_file malloc error");
+  // The URI is matched as a string
+  char *contents = calloc((size_t)size + 1, 1);
+  pointer_not_null(contents, "load_magnet malloc error");
 
   if (fread(contents, 1, size, file) != (size_t)size) {
     log_msg(LOG_ERROR, "Couldn't read entire file from disk - read %zu", read);
     fclose(file);
-    return;
+    free(contents);
+    return NULL;
   }
   fclose(file);
 
@@ -94,9 +94,26 @@ void cli_download_file() {
   if (magnet == NULL) {
     log_msg(LOG_ERROR, "Error while parsing magnet link contents! Please use a "
                        "valid magnet file.\n");
-    return;
+    return NULL;
   }
 
+  return magnet;
+}
+
+void cli_download_file() {
+  char magnet_link[FILENAME_SIZE] = {0};
+
+  printf("Enter filename of magnet to download: ");
+
+  if (fgets(magnet_link, sizeof(magnet_link), stdin) == NULL)
+    return;
+
+  magnet_link[strcspn(magnet_link, "\n")] = '\0';
+
+  struct FileMagnet *magnet = load_magnet(magnet_link);
+  if (magnet == NULL)
+    return;
+
   int res = download_file(magnet);
   free_magnet(magnet);
 
@@ -108,44 +125,32 @@ void cli_download_file() {
   }
 }
 
-void cli_upload_file() {
-  char input_path[FILENAME_SIZE] = {0};
-
-  printf("Enter filename to upload (with optional path): ");
-
-  if (fgets(input_path, sizeof(input_path), stdin) == NULL)
-    return;
-
-  input_path[strcspn(input_path, "\n")] = '\0';
-
+/**
+ * @brief Creates the magnet of a file and copies the file to the upload
+ * directory, where it is served from
+ *
+ * @param input_path The path of the file
+ * @return struct FileMagnet* Returns the magnet, NULL if the file can't be
+ * uploaded
+ */
+static struct FileMagnet *prepare_upload(const char *input_path) {
   // Extract just the filename from the path
   const char *filename = strrchr(input_path, '/');
   filename = (filename) ? filename + 1 : input_path;
 
-  FILE *file = fopen(input_path, "r");
-  if (file == NULL) {
+  if (access(input_path, R_OK) != 0) {
     log_msg(
         LOG_ERROR,
         "File does not exist at path '%s'! Please enter a valid filename.\n",
         input_path);
-    return;
+    return NULL;
   }
 
-  // Get size, allocate memory and read contents into the buffer
-  fseek(file, 0, SEEK_END);
-  long size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  void *contents = malloc(size);
-
-  fread(contents, size, 1, file);
-  fclose(file);
-
   struct FileMagnet *magnet = create_magnet(input_path, strlen(input_path));
 
   if (magnet == NULL) {
     log_msg(LOG_ERROR, "Error while trying to create magnet link!\n");
-    return;
+    return NULL;
   }
 
   // Create the upload directory if not already present
@@ -155,7 +160,7 @@ void cli_upload_file() {
       log_msg(LOG_ERROR, "Failed to create upload directory %s: %s", upload_dir,
               strerror(errno));
       free_magnet(magnet);
-      return;
+      return NULL;
     }
   }
 
@@ -168,47 +173,208 @@ void cli_upload_file() {
     log_msg(LOG_INFO, "Copied uploaded file to: %s", new_path);
   }
 
+  return magnet;
+}
+
+/**
+ * @brief Saves the magnet of an uploaded file next to it in the upload
+ * directory
+ *
+ * @param magnet The magnet
+ */
+static void save_magnet(struct FileMagnet *magnet) {
+  const char upload_dir[] = "./upload";
+  char *magnet_uri = save_magnet_to_uri(magnet);
+
+  // Allocate new filename with ".torrent" appended
+  const char suffix[] = ".torrent";
+  char magnet_filename[512] = {0};
+  snprintf(magnet_filename, sizeof(magnet_filename), "%s/%s%s", upload_dir,
+           magnet->display_name, suffix);
+
+  log_msg(LOG_INFO, "Saving following magnet URI: %s", magnet_uri);
+
+  FILE *magnet_file = fopen(magnet_filename, "w+");
+  if (!magnet_file) {
+    log_msg(LOG_ERROR, "Error creating magnet file %s: %s", magnet_filename,
+            strerror(errno));
+    free(magnet_uri);
+    return;
+  }
+
+  size_t uri_size = strlen(magnet_uri);
+  size_t written = fwrite(magnet_uri, uri_size, 1, magnet_file);
+  fclose(magnet_file);
+  free(magnet_uri);
+
+  if (written < 1)
+    log_msg(LOG_ERROR, "Unable to write entire magnet URI to %s: %s",
+            magnet_filename, strerror(errno));
+  else
+    log_msg(LOG_INFO, "Magnet file saved to: %s", magnet_filename);
+}
+
+void cli_upload_file() {
+  char input_path[FILENAME_SIZE] = {0};
+
+  printf("Enter filename to upload (with optional path): ");
+
+  if (fgets(input_path, sizeof(input_path), stdin) == NULL)
+    return;
+
+  input_path[strcspn(input_path, "\n")] = '\0';
+
+  struct FileMagnet *magnet = prepare_upload(input_path);
+  if (magnet == NULL)
+    return;
+
   int res = upload_file(magnet);
-  free(contents);
 
   if (res == 0) {
     log_msg(LOG_INFO, "File successfully uploaded!\n");
+    save_magnet(magnet);
+  } else {
+    log_msg(LOG_ERROR,
+            "Error while trying to upload the file! Error code: %d\n", res);
+  }
 
-    char *magnet_uri = save_magnet_to_uri(magnet);
+  free_magnet(magnet);
+}
 
-    // Allocate new filename with ".torrent" appended
-    const char suffix[] = ".torrent";
-    char magnet_filename[512] = {0};
-    snprintf(magnet_filename, sizeof(magnet_filename), "%s/%s%s", upload_dir,
-             magnet->display_name, suffix);
+/**
+ * @brief Collects the magnets of the regular files of a directory
+ *
+ * @param dir_path The path of the directory
+ * @param suffix Only the files whose name ends with it are collected, NULL
+ * for every file
+ * @param upload Whether the files are prepared for upload, or are magnet
+ * files to load
+ * @param out_count Set to the number of magnets
+ * @return struct FileMagnet** Returns the magnets, NULL if the directory
+ * couldn't be read
+ */
+static struct FileMagnet **collect_magnets(const char *dir_path,
+                                           const char *suffix, bool upload,
+                                           size_t *out_count) {
+  DIR *dir = opendir(dir_path);
+  if (!dir) {
+    log_msg(LOG_ERROR, "Can't open directory '%s': %s", dir_path,
+            strerror(errno));
+    return NULL;
+  }
 
-    log_msg(LOG_INFO, "Saving following magnet URI: %s", magnet_uri);
+  struct FileMagnet **magnets = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  struct dirent *entry;
 
-    FILE *magnet_file = fopen(magnet_filename, "w+");
-    if (!magnet_file) {
-      log_msg(LOG_ERROR, "Error creating magnet file %s: %s", magnet_filename,
-              strerror(errno));
-      free(magnet_uri);
-      free_magnet(magnet);
-      return;
+  while ((entry = readdir(dir))) {
+    size_t name_len = strlen(entry->d_name);
+
+    if (entry->d_name[0] == '.')
+      continue;
+
+    if (suffix && (name_len < strlen(suffix) ||
+                   strcmp(entry->d_name + name_len - strlen(suffix),
+                          suffix) != 0))
+      continue;
+
+    char path[FILENAME_SIZE * 2] = {0};
+    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    struct FileMagnet *magnet =
+        upload ? prepare_upload(path) : load_magnet(path);
+    if (magnet == NULL)
+      continue;
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      magnets = realloc(magnets, capacity * sizeof(struct FileMagnet *));
+      pointer_not_null(magnets, "collect_magnets realloc error");
     }
 
-    size_t uri_size = strlen(magnet_uri);
-    size_t written = fwrite(magnet_uri, uri_size, 1, magnet_file);
-    fclose(magnet_file);
-    free(magnet_uri);
+    magnets[count++] = magnet;
+  }
 
-    if (written < 1)
-      log_msg(LOG_ERROR, "Unable to write entire magnet URI to %s: %s",
-              magnet_filename, strerror(errno));
-    else
-      log_msg(LOG_INFO, "Magnet file saved to: %s", magnet_filename);
-  } else {
+  closedir(dir);
+
+  *out_count = count;
+  return magnets;
+}
+
+void cli_upload_directory() {
+  char dir_path[FILENAME_SIZE] = {0};
+
+  printf("Enter directory to upload: ");
+
+  if (fgets(dir_path, sizeof(dir_path), stdin) == NULL)
+    return;
+
+  dir_path[strcspn(dir_path, "\n")] = '\0';
+
+  size_t count = 0;
+  struct FileMagnet **magnets = collect_magnets(dir_path, NULL, true, &count);
+
+  if (count == 0) {
+    log_msg(LOG_ERROR, "No file to upload in '%s'\n", dir_path);
+    free(magnets);
+    return;
+  }
+
+  int res = upload_files(magnets, count);
+
+  if (res == 0)
+    log_msg(LOG_INFO, "%zu files successfully uploaded!\n", count);
+  else
     log_msg(LOG_ERROR,
-            "Error while trying to upload the file! Error code: %d\n", res);
+            "Error while trying to upload some files! Error code: %d\n", res);
+
+  // A failure may concern a single file, the magnets of the others are needed
+  // all the same
+  for (size_t i = 0; i < count; i++) {
+    save_magnet(magnets[i]);
+    free_magnet(magnets[i]);
   }
 
-  free_magnet(magnet);
+  free(magnets);
+}
+
+void cli_download_directory() {
+  char dir_path[FILENAME_SIZE] = {0};
+
+  printf("Enter directory of magnets to download: ");
+
+  if (fgets(dir_path, sizeof(dir_path), stdin) == NULL)
+    return;
+
+  dir_path[strcspn(dir_path, "\n")] = '\0';
+
+  size_t count = 0;
+  struct FileMagnet **magnets =
+      collect_magnets(dir_path, ".torrent", false, &count);
+
+  if (count == 0) {
+    log_msg(LOG_ERROR, "No magnet file to download in '%s'\n", dir_path);
+    free(magnets);
+    return;
+  }
+
+  int res = download_files(magnets, count);
+
+  for (size_t i = 0; i < count; i++)
+    free_magnet(magnets[i]);
+  free(magnets);
+
+  if (res == 0)
+    log_msg(LOG_INFO, "%zu files successfully downloaded!\n", count);
+  else
+    log_msg(LOG_ERROR,
+            "Error while trying to download some files! Error code: %d\n",
+            res);
 }
 
 void cli_show_network_status() { show_network_status(); }
@@ -235,7 +401,9 @@ int main(int argc, char **argv) {
       printf("1. Show network status\n");
       printf("2. Upload file\n");
       printf("3. Download file\n");
-      printf("4. Exit\n");
+      printf("4. Upload directory\n");
+      printf("5. Download directory\n");
+      printf("6. Exit\n");
       printf("Enter your choice: ");
 
       if (fgets(input, sizeof(input), stdin) == NULL) {
@@ -269,12 +437,20 @@ int main(int argc, char **argv) {
         break;
 
       case 4:
+        cli_upload_directory();
+        break;
+
+      case 5:
+        cli_download_directory();
+        break;
+
+      case 6:
         log_msg(LOG_INFO, "Exiting program...\n");
         running = false;
         break;
 
       default:
-        log_msg(LOG_WARN, "Invalid choice! Please select 1-4.\n");
+        log_msg(LOG_WARN, "Invalid choice! Please select 1-6.\n");
         break;
       }
     }
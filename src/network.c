@@ -4,136 +4,305 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "client.h"
 #include "command.h"
+#include "connection.h"
 #include "http.h"
 #include "log.h"
+#include "lookup_cache.h"
 #include "peer.h"
+#include "poller.h"
+#include "pool.h"
 #include "rpc.h"
-#include "schedule.h"
 #include "shared.h"
+#include "timer.h"
+#include "wire.h"
 
-#define MAX_WAIT_CON 5
-#define MAX_SOCK 128
+/**
+ * @brief The default length of the queue of pending connections of a listen
+ * socket, overridden by LISTEN_BACKLOG
+ *
+ */
+#define DEFAULT_LISTEN_BACKLOG 512
+
+/**
+ * @brief The default maximum number of peer connections per network thread,
+ * overridden by MAX_CONNECTIONS
+ *
+ */
+#define DEFAULT_MAX_CONNECTIONS 1024
+
+/**
+ * @brief How long a peer connection must have been silent before it may be
+ * evicted to make room for a new one
+ *
+ */
+#define EVICT_IDLE_SECS 2
+
+/**
+ * @brief How long a peer connection may stay silent before it is closed
+ *
+ */
+#define IDLE_TIMEOUT_MS (60 * 1000)
+
+/**
+ * @brief The delay between two broadcast discovery requests
+ *
+ */
+#define DISCOVERY_INTERVAL_MS (30 * 1000)
+
+/**
+ * @brief The maximum number of readiness notifications handled per update
+ *
+ */
+#define MAX_EVENTS 64
+
+/**
+ * @brief The number of empty busy polls after which the thread yields the CPU
+ * between two polls instead of only pausing
+ *
+ */
+#define BUSY_POLL_RELAX_SPINS 64
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
 
 static const char http_pattern[] = "\r\n\r\n";
 
-static struct pollfd sock_array[MAX_SOCK] = {0};
-static char buf[BUF_SIZE] = {0};
-static int listen_fd = 0;
-static int broad_fd = 0;
-static void broadcast_discovery_request(void);
-static struct Schedule tasks[] = {
-    {"broadcast_discovery", 0, 30, broadcast_discovery_request},
-    {NULL, 0, 0, NULL}};
-
-int get_rpc_request(const struct pollfd *sock, char *buf, size_t *out_size) {
-  int sock_type = 0;
-  socklen_t optlen = sizeof(sock_type);
-  if (getsockopt(sock->fd, SOL_SOCKET, SO_TYPE, &sock_type, &optlen) < 0) {
-    perror("getsockopt");
-    return -1;
-  }
+// Every network thread runs its own loop with its own listen socket, so the
+// loop state is thread-local
+static __thread struct Poller poller = {0};
+static __thread int listen_fd = 0;
+static __thread int broad_fd = -1;
+static __thread struct Connection *broad_conn = NULL;
 
-  ssize_t received = 0;
+/**
+ * @brief The maximum number of datagrams read by a single recvmmsg call
+ *
+ */
+#define DATAGRAM_BATCH 32
 
-  if (sock_type == SOCK_STREAM) {
-    // TCP: read header first
-    received = recv_all(sock->fd, buf, sizeof(struct RPCMessageHeader));
-    if (received < sizeof(struct RPCMessageHeader)) {
-      log_msg(LOG_ERROR, "Failed to read RPC header");
-      return -1;
-    }
-  } else if (sock_type == SOCK_DGRAM) {
-    // UDP: single recvfrom will give entire datagram
-    struct sockaddr_in from_addr = {0};
-    socklen_t from_len = sizeof(from_addr);
-    received = recvfrom(sock->fd, buf, MAX_RPC_PACKET_SIZE, 0,
-                        (struct sockaddr *)&from_addr, &from_len);
-    if (received <= 0) {
-      perror("recvfrom");
-      return -1;
-    }
-  } else {
-    log_msg(LOG_ERROR, "Unknown socket type");
-    return -1;
-  }
+/**
+ * @brief Preallocated storage for a batch of datagrams received on a datagram
+ * socket
+ *
+ */
+struct DatagramBatch {
+  struct mmsghdr msgs[DATAGRAM_BATCH];
+  struct iovec iovs[DATAGRAM_BATCH];
+  struct sockaddr_in addrs[DATAGRAM_BATCH];
+  char data[DATAGRAM_BATCH][MAX_RPC_PACKET_SIZE];
+};
 
-  // Interpret header
-  struct RPCMessageHeader *header = (struct RPCMessageHeader *)buf;
-  // log_msg(LOG_INFO, "Packet size is: %d", header->packet_size);
+/**
+ * @brief The batch the datagram sockets of the calling thread are read into
+ *
+ */
+static __thread struct DatagramBatch *datagram_batch = NULL;
 
-  if (header->packet_size > MAX_RPC_PACKET_SIZE) {
-    log_msg(LOG_ERROR, "Packet too large! Discarding.");
-    return -1;
-  }
+/**
+ * @brief The number of bits of the index of the datagram reply cache
+ *
+ */
+#define DATAGRAM_REPLY_BITS 8
 
-  if (sock_type == SOCK_STREAM) {
-    // TCP: read rest of packet
-    received = recv_all(sock->fd, buf + sizeof(struct RPCMessageHeader),
-                        header->packet_size - sizeof(struct RPCMessageHeader));
-    if (received < 0) {
-      log_msg(LOG_ERROR, "Error reading full RPC request: %s", strerror(errno));
-      return -1;
-    }
-  } else {
-    // UDP: we already got the full packet in one recvfrom
-    if (received != header->packet_size) {
-      log_msg(LOG_WARN, "UDP packet size mismatch: got %zd, expected %u",
-              received, header->packet_size);
-      return -1;
-    }
-  }
+/**
+ * @brief How long a reply is kept to answer retransmissions of its request, it
+ * outlives the whole retransmission schedule of a client
+ *
+ */
+#define DATAGRAM_REPLY_TTL_MS (5 * 1000)
 
-  *out_size = received;
-  return 0;
-}
+/**
+ * @brief A reply sent over the UDP transport, kept so a retransmitted request
+ * is answered again without being handled twice
+ *
+ */
+struct DatagramReply {
+  struct sockaddr_in addr;
+  uint32_t request_id;
+
+  /**
+   * @brief When the reply stops being used, in milliseconds of timer_now_ms
+   *
+   */
+  uint64_t expires;
+  size_t length;
+  char data[MAX_RPC_PACKET_SIZE];
+};
 
 /**
- * @brief Gets the contents of the entire HTTP request before passing it to the
- * HTTP layer
+ * @brief The replies recently sent by the calling thread, indexed by a hash of
+ * the client address and request ID. A newer reply replaces an older one
+ * sharing its slot
  *
- * @param sock The struct of the socket that sent the HTTP request
- * @param buf A pointer to the buffer where data can be read into
  */
-static void get_http_request(const struct pollfd *sock, char *buf) {
-  log_msg(LOG_INFO, "Handling HTTP request");
+static __thread struct DatagramReply *datagram_replies = NULL;
 
-  ssize_t received =
-      recv_until(sock->fd, buf, BUF_SIZE, http_pattern, strlen(http_pattern));
+/**
+ * @brief Our own address, used to drop the broadcasts we sent ourselves. Zero
+ * until it could be resolved
+ *
+ */
+static __thread in_addr_t own_addr = 0;
+
+/**
+ * @brief The maximum number of peer connections of the calling thread
+ *
+ */
+static __thread size_t max_connections = DEFAULT_MAX_CONNECTIONS;
+
+/**
+ * @brief A descriptor kept open so one can be freed to accept and reject a
+ * connection when the process runs out of descriptors, -1 if unavailable
+ *
+ */
+static __thread int spare_fd = -1;
+
+/**
+ * @brief For the primary thread, the connection watching the eventfd of the
+ * command queue
+ *
+ */
+static __thread struct Connection *commands_conn = NULL;
+
+/**
+ * @brief An eventfd shared by every network thread, signalled to wake them up
+ * when they should stop. It is never read, so it stays readable once
+ * signalled, and lives as long as the process
+ *
+ */
+static int stop_fd = -1;
+static pthread_once_t stop_fd_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Whether the calling thread is the primary network thread. It is the
+ * only one handling frontend commands, discovery and scheduled tasks
+ *
+ */
+static __thread bool primary = false;
+
+/**
+ * @brief The connections with requests left once the budget of a round was
+ * spent, served first in the next round
+ *
+ */
+static __thread struct Connection *deferred_head = NULL;
+static __thread struct Connection *deferred_tail = NULL;
+static __thread size_t deferred_count = 0;
+
+/**
+ * @brief How long the loop keeps polling without blocking after the last
+ * event, in microseconds. 0 when busy polling is disabled, overridden by
+ * BUSY_POLL
+ *
+ */
+static __thread int busy_poll_us = 0;
+
+/**
+ * @brief Until when the loop busy polls, in microseconds of CLOCK_MONOTONIC
+ *
+ */
+static __thread uint64_t busy_until_us = 0;
+
+/**
+ * @brief The number of busy polls in a row that found nothing to do
+ *
+ */
+static __thread unsigned idle_spins = 0;
+
+/**
+ * @brief The timers of the calling network thread
+ *
+ */
+static __thread struct TimerWheel timers;
+
+/**
+ * @brief For the primary thread, the periodic broadcast discovery
+ *
+ */
+static __thread struct Timer discovery_timer;
 
-  if (received < 0) {
-    log_msg(LOG_ERROR,
-            "Error while trying to read entire HTTP request. Skipping...");
+/**
+ * @brief For the primary thread, periodically closes the outbound connections
+ * that stayed idle in the pool for too long
+ *
+ */
+static __thread struct Timer pool_timer;
+
+ssize_t peek_rpc_message(const char *data, size_t length) {
+  ssize_t size = wire_message_size(data, length);
+  if (size <= 0)
+    return size;
+
+  return length >= (size_t)size ? size : 0;
+}
+
+/**
+ * @brief Checks that a datagram holds exactly one RPC message
+ *
+ * @param data The contents of the datagram
+ * @param length The length of data
+ * @return true The datagram holds a whole message of a known protocol version
+ * @return false The datagram is malformed
+ */
+static bool is_rpc_datagram(const char *data, size_t length) {
+  return peek_rpc_message(data, length) == (ssize_t)length;
+}
+
+/**
+ * @brief Resolves and caches our own address for filtering broadcasts, if it
+ * isn't known yet
+ *
+ */
+static void refresh_own_addr() {
+  if (own_addr != 0)
     return;
-  }
 
-  handle_http_request(sock, buf, received);
+  char ip[INET_ADDRSTRLEN] = {0};
+  struct sockaddr_in addr;
+
+  if (get_primary_ip(ip, sizeof(ip), &addr) == 0)
+    own_addr = addr.sin_addr.s_addr;
 }
 
 /**
- * @brief Called in the network update loop. Sends a broadcast discovery request
+ * @brief Called by the discovery timer. Sends a broadcast discovery request
  *
+ * @param timer The discovery timer
+ * @param arg Unused
  */
-static void broadcast_discovery_request(void) {
+static void broadcast_discovery_request(struct Timer *timer, void *arg) {
   struct sockaddr_in server_addr = {0};
 
   server_addr.sin_family = AF_INET;
   server_addr.sin_port = htons(BROADCAST_PORT);
   server_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
 
+  // Every node on the network gets it and none answers, so it is sent in the
+  // version all of them understand
   struct RPCBroadcast request = {.header = {
                                      .magic_number = RPC_MAGIC,
+                                     .version = RPC_LEGACY_VERSION,
                                      .packet_size = sizeof(struct RPCBroadcast),
                                      .call_type = BROADCAST,
                                  }};
@@ -144,13 +313,16 @@ static void broadcast_discovery_request(void) {
     return;
   }
 
+  // The address may not have been known when the network started
+  refresh_own_addr();
+
   peer.peer_addr.sin_port = htons(SERVER_PORT);
 
   // Store the serialized peer in our request data
   serialize_rpc_peer(&peer, &request.peer);
 
   // Broadcast an RPC ping packet to everyone with our info
-  ssize_t sent = sendto(sock_array[1].fd, &request, sizeof(request), 0,
+  ssize_t sent = sendto(broad_fd, &request, sizeof(request), 0,
                         (struct sockaddr *)&server_addr, sizeof(server_addr));
 
   if (sent < 0)
@@ -158,140 +330,618 @@ static void broadcast_discovery_request(void) {
 }
 
 /**
- * @brief Called in the network update loop. Accepts incoming connections
+ * @brief Called periodically on the primary thread to close the outbound
+ * connections that stayed idle in the pool for too long
  *
+ * @param timer The pool timer
+ * @param arg Unused
  */
-static void handle_incoming() {
-  // Accept incoming connections
-  if (sock_array[0].revents & POLLIN) {
-    log_msg(LOG_INFO, "Accepting connection");
-    struct sockaddr_in client_addr = {0};
-    socklen_t size = sizeof(client_addr);
-
-    int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &size);
-    if (new_fd >= 0) {
-      int i = 0;
-      while (sock_array[i].fd != -1)
-        i++;
-
-      if (i < MAX_SOCK) {
-        sock_array[i].fd = new_fd;
-        sock_array[i].events = POLLIN;
-        sock_array[i].revents = 0;
-        log_msg(LOG_DEBUG, "Accepted connection with fd: %d", new_fd);
-        log_msg(LOG_DEBUG, "Stored at index: %d", i);
-      } else {
-        perror("Not enough space in buffer to allocate new connection");
-        close(new_fd);
-      }
-    } else
-      perror("Error while trying to accept new connection");
+static void expire_pooled_connections(struct Timer *timer, void *arg) {
+  pool_expire(timer_now_ms());
+}
+
+/**
+ * @brief Closes a peer connection and stops watching it
+ *
+ * @param conn The connection to close
+ */
+static void close_connection(struct Connection *conn) {
+  if (conn->closed)
+    return;
+
+  // The poller may close the socket later, the loop is done with it already
+  conn->closed = true;
+  timer_cancel(&conn->idle_timer);
+
+  if (conn->deferred) {
+    struct Connection *prev = NULL;
+    struct Connection **link = &deferred_head;
 
-    sock_array[0].revents = 0;
+    while (*link != conn) {
+      prev = *link;
+      link = &prev->next_deferred;
+    }
+
+    *link = conn->next_deferred;
+    if (deferred_tail == conn)
+      deferred_tail = prev;
+    deferred_count--;
+    conn->deferred = false;
   }
 
-  if (sock_array[1].revents && POLLIN) {
-    // log_msg(LOG_DEBUG, "Receiving data on broadcast port");
+  if (poller_remove(&poller, conn))
+    connection_close(conn);
+}
+
+/**
+ * @brief Called by the idle timer of a peer connection. Closes the connection
+ * unless a response is still being sent to it
+ *
+ * @param timer The idle timer of the connection
+ * @param arg The connection
+ */
+static void on_idle_timeout(struct Timer *timer, void *arg) {
+  struct Connection *conn = arg;
+
+  if (connection_has_output(conn)) {
+    timer_start(&timers, timer, IDLE_TIMEOUT_MS, 0);
+    return;
+  }
+
+  log_msg(LOG_DEBUG, "Closing idle connection with fd: %d", conn->fd);
+  close_connection(conn);
+}
+
+/**
+ * @brief Marks a peer connection as active and pushes its idle timeout back
+ *
+ * @param conn The connection that received data
+ */
+static void touch_connection(struct Connection *conn) {
+  connection_touch(conn);
+  timer_start(&timers, &conn->idle_timer, IDLE_TIMEOUT_MS, 0);
+}
+
+/**
+ * @brief Puts a connection off to the next round of the network loop, once
+ * the budget of the current round is spent
+ *
+ * @param conn The connection with requests left
+ */
+static void defer_connection(struct Connection *conn) {
+  if (conn->deferred)
+    return;
+
+  conn->deferred = true;
+  conn->next_deferred = NULL;
+
+  if (deferred_tail)
+    deferred_tail->next_deferred = conn;
+  else
+    deferred_head = conn;
+
+  deferred_tail = conn;
+  deferred_count++;
+  admission_defer();
+}
+
+/**
+ * @brief Gets the next pending incoming connection without blocking
+ *
+ * @param client_addr A pointer to memory where the address of the peer will be
+ * stored
+ * @return int Returns the accepted socket, or a negative number with errno set
+ */
+static int accept_next(struct sockaddr_in *client_addr) {
+  socklen_t size = sizeof(*client_addr);
+
+  // Completion-based backends already accepted the socket
+  if (poller_completes_io(&poller)) {
+    int fd = poller_next_accepted(&poller);
+
+    if (fd < 0)
+      errno = EAGAIN;
+    else
+      getpeername(fd, (struct sockaddr *)client_addr, &size);
+
+    return fd;
+  }
+
+  return accept4(listen_fd, (struct sockaddr *)client_addr, &size,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * @brief Checks whether a peer connection has no request in progress and
+ * nothing left to send
+ *
+ * @param conn The connection to check
+ * @param now The current time
+ * @return true The connection can be closed without losing work
+ * @return false The connection is in the middle of an exchange
+ */
+static bool is_idle(const struct Connection *conn, time_t now) {
+  return conn->state == CONN_STATE_MAGIC && buffer_length(&conn->in) == 0 &&
+         !connection_has_output(conn) &&
+         now - conn->last_active >= EVICT_IDLE_SECS;
+}
+
+/**
+ * @brief Makes room for a new peer connection by closing the least recently
+ * active one, if it is idle
+ *
+ * @return true A connection was evicted
+ * @return false Every connection is busy
+ */
+static bool evict_idle_connection() {
+  struct Connection *oldest = connection_least_recent(CONN_PEER);
 
+  if (!oldest || !is_idle(oldest, time(NULL)))
+    return false;
+
+  log_msg(LOG_INFO, "Evicting idle connection with fd: %d", oldest->fd);
+  close_connection(oldest);
+
+  return true;
+}
+
+/**
+ * @brief Accepts and immediately closes a pending connection while the process
+ * is out of descriptors, so the peer gets an answer and the backlog doesn't
+ * clog
+ *
+ * @return true A connection was rejected
+ * @return false There was no pending connection left, or no spare descriptor
+ */
+static bool reject_with_spare_fd() {
+  if (spare_fd < 0)
+    return false;
+
+  close(spare_fd);
+
+  int fd = accept_next(&(struct sockaddr_in){0});
+  if (fd >= 0)
+    close(fd);
+
+  spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  return fd >= 0;
+}
+
+/**
+ * @brief Called in the network update loop. Accepts every pending incoming
+ * connection
+ *
+ */
+static void handle_incoming() {
+  // The listen socket is non-blocking, drain the backlog since edge-triggered
+  // backends won't notify us again for connections that are already queued
+  while (true) {
     struct sockaddr_in client_addr = {0};
-    socklen_t size = sizeof(client_addr);
-
-    // Peek first 4 bytes to check magic
-    uint8_t peek_magic[4] = {0};
-    ssize_t recvd = recvfrom(sock_array[1].fd, peek_magic, sizeof(peek_magic),
-                             MSG_PEEK, (struct sockaddr *)&client_addr, &size);
-
-    char my_ip[INET_ADDRSTRLEN] = {0};
-    struct sockaddr_in my_addr;
-
-    if (get_primary_ip(my_ip, sizeof(my_ip), &my_addr) == 0) {
-      if (client_addr.sin_addr.s_addr == my_addr.sin_addr.s_addr) {
-        // This is our own broadcast, ignore
-        // log_msg(LOG_DEBUG, "Ignoring our own broadcast");
-        char discard[MAX_RPC_PACKET_SIZE];
-        // Make sure to consume data from the internal buffer
-        recvfrom(sock_array[1].fd, discard, sizeof(discard), 0, NULL, NULL);
-        sock_array[1].revents = 0;
+
+    int new_fd = accept_next(&client_addr);
+    if (new_fd < 0) {
+      if (errno == EINTR)
+        continue;
+
+      // Edge-triggered backends won't report the pending connections again,
+      // free a descriptor or turn them away until the backlog is empty
+      if (errno == EMFILE || errno == ENFILE) {
+        if (evict_idle_connection())
+          continue;
+
+        if (reject_with_spare_fd()) {
+          log_msg(LOG_WARN, "Out of file descriptors, rejected a connection");
+          continue;
+        }
+
         return;
       }
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error while trying to accept new connection");
+
+      return;
+    }
+
+    if (connection_peer_count() >= max_connections &&
+        !evict_idle_connection()) {
+      log_msg(LOG_WARN, "Connection limit of %zu reached, rejecting fd: %d",
+              max_connections, new_fd);
+      close(new_fd);
+      continue;
+    }
+
+    log_msg(LOG_INFO, "Accepting connection");
+
+    struct Connection *conn = connection_open(new_fd, CONN_PEER, &client_addr);
+    if (!conn) {
+      close(new_fd);
+      continue;
+    }
+
+    if (poller_add(&poller, conn, POLLER_IN) != 0) {
+      connection_close(conn);
+      continue;
     }
 
-    if (recvd < 4) {
-      log_msg(LOG_WARN, "Incomplete UDP magic from %s:%d",
-              inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-      sock_array[1].revents = 0;
+    timer_init(&conn->idle_timer, on_idle_timeout, conn);
+    timer_start(&timers, &conn->idle_timer, IDLE_TIMEOUT_MS, 0);
+
+    log_msg(LOG_DEBUG, "Accepted connection with fd: %d", new_fd);
+  }
+}
+
+/**
+ * @brief Checks a datagram received on the broadcast socket and dispatches it
+ * if it is a valid RPC message from another peer
+ *
+ * @param data The contents of the datagram
+ * @param length The length of the datagram
+ * @param flags The flags returned for the datagram by recvmmsg
+ * @param from The sender of the datagram
+ */
+static void handle_broadcast_datagram(char *data, size_t length, int flags,
+                                      const struct sockaddr_in *from) {
+  // This is our own broadcast, ignore
+  if (own_addr != 0 && from->sin_addr.s_addr == own_addr)
+    return;
+
+  // Datagrams larger than any RPC message were cut by the kernel
+  if ((flags & MSG_TRUNC) || !is_rpc_datagram(data, length)) {
+    log_msg(LOG_WARN, "Invalid RPC datagram from %s:%d",
+            inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    return;
+  }
+
+  if (!admission_admit(from, 1))
+    return;
+
+  handle_rpc_request(broad_conn, data, length);
+}
+
+/**
+ * @brief Sends a reply over the UDP transport. A reply that doesn't fit in the
+ * socket buffer is dropped, the client retransmits its request
+ *
+ * @param conn The datagram socket
+ * @param to The client to reply to
+ * @param data The RPC message of the reply
+ * @param length The length of the message
+ */
+static void send_datagram_reply(struct Connection *conn,
+                                const struct sockaddr_in *to, const char *data,
+                                size_t length) {
+  if (sendto(conn->fd, data, length, MSG_DONTWAIT, (const struct sockaddr *)to,
+             sizeof(*to)) < 0)
+    log_msg(LOG_DEBUG, "Dropped datagram reply to %s:%d: %s",
+            inet_ntoa(to->sin_addr), ntohs(to->sin_port), strerror(errno));
+}
+
+/**
+ * @brief Gets the reply cache slot of a request
+ *
+ * @param from The client that sent the request
+ * @param request_id The ID of the request
+ * @return struct DatagramReply* Returns the slot
+ */
+static struct DatagramReply *reply_slot(const struct sockaddr_in *from,
+                                        uint32_t request_id) {
+  uint32_t hash = from->sin_addr.s_addr ^ ((uint32_t)from->sin_port << 16) ^
+                  request_id;
+
+  // Multiplicative hashing, the top bits are the best mixed
+  hash *= 2654435761u;
+
+  return &datagram_replies[hash >> (32 - DATAGRAM_REPLY_BITS)];
+}
+
+/**
+ * @brief Checks a request received over the UDP transport, handles it and
+ * sends its reply back. A retransmitted request is answered with the reply
+ * already sent for it
+ *
+ * @param conn The datagram socket
+ * @param data The contents of the datagram
+ * @param length The length of the datagram
+ * @param flags The flags returned for the datagram by recvmmsg
+ * @param from The sender of the datagram
+ */
+static void handle_rpc_datagram(struct Connection *conn, char *data,
+                                size_t length, int flags,
+                                const struct sockaddr_in *from) {
+  if ((flags & MSG_TRUNC) || !is_rpc_datagram(data, length)) {
+    log_msg(LOG_WARN, "Invalid RPC datagram from %s:%d",
+            inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    return;
+  }
+
+  struct RPCMessageHeader header;
+  if (!wire_read_header(data, length, &header)) {
+    log_msg(LOG_WARN, "Invalid RPC datagram from %s:%d",
+            inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    return;
+  }
+
+  // Only the lookup RPCs are small enough to be served over UDP
+  if (header.call_type != PING && header.call_type != FIND_NODE &&
+      header.call_type != FIND_VALUE) {
+    log_msg(LOG_WARN, "RPC %d from %s:%d isn't allowed over UDP",
+            header.call_type, inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    return;
+  }
+
+  // Retransmissions count too, answering them isn't free either
+  if (!admission_admit(from, 1))
+    return;
+
+  uint32_t request_id = header.request_id;
+  struct DatagramReply *reply = reply_slot(from, request_id);
+  uint64_t now = timer_now_ms();
+
+  if (reply->expires > now && reply->request_id == request_id &&
+      reply->addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+      reply->addr.sin_port == from->sin_port) {
+    send_datagram_reply(conn, from, reply->data, reply->length);
+    return;
+  }
+
+  // The handler queues its response in the output buffer of the socket
+  handle_rpc_request(conn, data, length);
+
+  size_t reply_len = buffer_length(&conn->out);
+  if (reply_len == 0)
+    return;
+
+  if (reply_len <= sizeof(reply->data)) {
+    reply->addr = *from;
+    reply->request_id = request_id;
+    reply->expires = now + DATAGRAM_REPLY_TTL_MS;
+    reply->length = reply_len;
+    memcpy(reply->data, buffer_data(&conn->out), reply_len);
+  }
+
+  send_datagram_reply(conn, from, buffer_data(&conn->out), reply_len);
+  buffer_consume(&conn->out, reply_len);
+}
+
+/**
+ * @brief Called in the network update loop. Reads the datagrams waiting on a
+ * datagram socket in batches until it is drained, and handles them
+ *
+ * @param conn The broadcast or RPC datagram socket
+ */
+static void handle_datagrams(struct Connection *conn) {
+  struct DatagramBatch *batch = datagram_batch;
+
+  while (true) {
+    // Don't read more datagrams than the round may dispatch, the others wait
+    // in the socket until the next round
+    int count = DATAGRAM_BATCH;
+    if (admission_room() < (size_t)count)
+      count = (int)admission_room();
+
+    if (count == 0) {
+      defer_connection(conn);
       return;
     }
 
-    if (memcmp(peek_magic, RPC_MAGIC, 4) != 0) {
-      log_msg(LOG_WARN, "Invalid RPC magic from %s:%d",
-              inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-      // Consume/discard
-      char discard[1024];
-      recvfrom(sock_array[1].fd, discard, sizeof(discard), 0, NULL, NULL);
-      sock_array[1].revents = 0;
+    for (int i = 0; i < count; i++) {
+      batch->iovs[i].iov_base = batch->data[i];
+      batch->iovs[i].iov_len = sizeof(batch->data[i]);
+
+      memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+      batch->msgs[i].msg_hdr.msg_iovlen = 1;
+      batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    }
+
+    int received =
+        recvmmsg(conn->fd, batch->msgs, count, MSG_DONTWAIT, NULL);
+
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_msg(LOG_WARN, "recvmmsg failed on fd %d: %s", conn->fd,
+                strerror(errno));
       return;
     }
 
-    // Use get_rpc_request() to read the full packet into buf and process it
-    struct pollfd udp_sock = sock_array[1];
+    for (int i = 0; i < received; i++) {
+      char *data = batch->data[i];
+      size_t length = batch->msgs[i].msg_len;
+      int flags = batch->msgs[i].msg_hdr.msg_flags;
 
-    size_t packet_size = 0;
-    if (get_rpc_request(&udp_sock, buf, &packet_size) == 0) {
-      handle_rpc_request(&udp_sock, buf, packet_size);
+      if (conn->kind == CONN_BROADCAST)
+        handle_broadcast_datagram(data, length, flags, &batch->addrs[i]);
+      else
+        handle_rpc_datagram(conn, data, length, flags, &batch->addrs[i]);
     }
 
-    sock_array[1].revents = 0;
+    // A short batch means the socket ran out of datagrams
+    if (received < count)
+      return;
   }
 }
 
 /**
- * @brief Called in the network update loop. Handles requests from connected
- * peers
+ * @brief Parses and dispatches every complete message available in the input
+ * buffer of a connection. Incomplete messages are left in the buffer until more
+ * bytes arrive, so a slow peer never blocks the loop
  *
+ * @param conn The connection to process
  */
-static void handle_connected() {
-  // Handle existing connections
-  for (int i = 2; i < MAX_SOCK; i++) {
-    // Close connection and free space
-    if (sock_array[i].revents & POLLHUP) {
-      close(sock_array[i].fd);
-      sock_array[i].fd = -1;
-      sock_array[i].events = 0;
-      sock_array[i].revents = 0;
+static void process_input(struct Connection *conn) {
+  // Responses are sent in order, so wait for a file being streamed back to
+  // finish before handling the next request
+  while (!conn->closing && conn->stream_fd < 0) {
+    const char *data = buffer_data(&conn->in);
+    size_t length = buffer_length(&conn->in);
+
+    switch (conn->state) {
+    case CONN_STATE_MAGIC:
+      if (length < 4)
+        return;
+
+      // Dispatch depending on magic number
+      if (memcmp(data, RPC_MAGIC, 4) == 0)
+        conn->state = CONN_STATE_RPC_HEADER;
+      else
+        conn->state = CONN_STATE_HTTP_HEADERS;
+      break;
+
+    case CONN_STATE_RPC_HEADER: {
+      ssize_t size = wire_message_size(data, length);
+      if (size == 0)
+        return;
+
+      // Peers speaking another version of the protocol can't be understood
+      if (size < 0) {
+        log_msg(LOG_ERROR, "Invalid RPC header on fd %d, closing", conn->fd);
+        conn->closing = true;
+        return;
+      }
+
+      conn->expected = size;
+      conn->state = CONN_STATE_RPC_BODY;
+      break;
     }
 
-    // Handle message from connection
-    if (sock_array[i].revents & POLLIN) {
-      char peek_buf[4] = {0};
-      ssize_t peeked =
-          recv_all_peek(sock_array[i].fd, peek_buf, sizeof(peek_buf));
-
-      if (peeked <= 0) {
-        if (peeked < 0)
-          perror("recv_all_peek");
-        else
-          log_msg(LOG_DEBUG, "Connection closed on fd %d", sock_array[i].fd);
-
-        close(sock_array[i].fd);
-        sock_array[i].fd = -1;
-        sock_array[i].events = 0;
-        sock_array[i].revents = 0;
-        continue;
+    case CONN_STATE_RPC_BODY:
+      if (length < conn->expected)
+        return;
+
+      if (admission_room() == 0) {
+        defer_connection(conn);
+        return;
       }
 
-      // Dispatch depending on magic number
-      if (peeked == 4 && memcmp(peek_buf, RPC_MAGIC, 4) == 0) {
-        size_t packet_size = 0;
-        if (get_rpc_request(&sock_array[i], buf, &packet_size) == 0) {
-          handle_rpc_request(&sock_array[i], buf, packet_size);
+      // Requests over the rate of the peer are dropped unanswered, batched
+      // ones are charged for each of their keys
+      if (admission_admit(&conn->addr,
+                          wire_request_keys(data, conn->expected)))
+        handle_rpc_request(conn, (char *)data, conn->expected);
+      buffer_consume(&conn->in, conn->expected);
+      conn->state = CONN_STATE_MAGIC;
+      break;
+
+    case CONN_STATE_HTTP_HEADERS: {
+      const char *end =
+          memmem(data, length, http_pattern, strlen(http_pattern));
+
+      if (!end) {
+        if (length >= HTTP_HEADER_SIZE) {
+          log_msg(LOG_ERROR, "HTTP headers too large on fd %d, closing",
+                  conn->fd);
+          conn->closing = true;
         }
-      } else
-        get_http_request(&sock_array[i], buf);
+        return;
+      }
+
+      size_t header_len = end - data + strlen(http_pattern);
 
-      sock_array[i].revents = 0;
+      // The HTTP layer switches to CONN_STATE_HTTP_BODY if a body follows
+      conn->state = CONN_STATE_MAGIC;
+      handle_http_request(conn, data, header_len);
+      buffer_consume(&conn->in, header_len);
+      break;
     }
+
+    case CONN_STATE_HTTP_BODY: {
+      if (length == 0)
+        return;
+
+      size_t consumed = handle_http_body(conn, data, length);
+      buffer_consume(&conn->in, consumed);
+      break;
+    }
+    }
+  }
+}
+
+/**
+ * @brief Makes the poller watch for writability only while output is queued
+ *
+ * @param conn The connection to update
+ */
+static void update_interest(struct Connection *conn) {
+  uint32_t wanted = POLLER_IN;
+
+  if (connection_has_output(conn))
+    wanted |= POLLER_OUT;
+
+  if (wanted != conn->events)
+    poller_modify(&poller, conn, wanted);
+}
+
+/**
+ * @brief Called in the network update loop. Reads whatever a connected peer
+ * sent without blocking, handles the complete requests and flushes responses
+ *
+ * @param conn The connection that is ready
+ * @param events The readiness flags reported by the poller
+ */
+static void handle_connected(struct Connection *conn, uint32_t events) {
+  if (events & POLLER_OUT)
+    connection_flush(conn);
+
+  // Completion-based backends already appended the received bytes to the
+  // input buffer, there is nothing left to read
+  if (poller_completes_io(&poller)) {
+    if (events & POLLER_IN)
+      touch_connection(conn);
+
+    process_input(conn);
+
+    if (events & POLLER_HUP)
+      conn->close_after_write = true;
+    if (events & POLLER_ERR)
+      conn->closing = true;
+  }
+
+  // Keep reading until the socket is drained, edge-triggered backends only
+  // notify us once for everything that arrived
+  while (!conn->closing && !poller_completes_io(&poller)) {
+    process_input(conn);
+
+    // Stop reading while a file is being sent back, the flush that completes
+    // it will resume reading. A connection put off to the next round is read
+    // again then
+    if (conn->closing || conn->stream_fd >= 0 || conn->deferred)
+      break;
+
+    ssize_t received = buffer_read_fd(&conn->in, conn->fd, BUF_SIZE);
+
+    if (received > 0) {
+      touch_connection(conn);
+      continue;
+    }
+
+    if (received == 0) {
+      log_msg(LOG_DEBUG, "Connection closed on fd %d", conn->fd);
+      conn->close_after_write = true;
+      break;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      log_msg(LOG_WARN, "Error reading from fd %d: %s", conn->fd,
+              strerror(errno));
+      conn->closing = true;
+    }
+
+    break;
+  }
+
+  if (conn->closing ||
+      (conn->close_after_write && !connection_has_output(conn))) {
+    close_connection(conn);
+    return;
   }
+
+  update_interest(conn);
 }
 
 static void handle_pending() {
@@ -305,10 +955,35 @@ static void handle_pending() {
     log_msg(LOG_DEBUG, "Handling command from P2P client");
 
     switch (cmd->cmd_type) {
-    case CMD_SHOW_STATUS:
+    case CMD_SHOW_STATUS: {
       log_msg(LOG_DEBUG, "Show status");
+
+      struct AdmissionStats stats;
+      admission_get_stats(&stats);
+      log_msg(LOG_INFO,
+              "RPC requests: %llu admitted, %llu rate limited, %llu times "
+              "deferred to the next round",
+              (unsigned long long)stats.admitted,
+              (unsigned long long)stats.rate_limited,
+              (unsigned long long)stats.deferred);
+
+      struct LookupCacheStats cache_stats;
+      lookup_cache_get_stats(&cache_stats);
+      log_msg(LOG_INFO,
+              "Lookup cache: %llu hits, %llu misses, %llu entries dropped "
+              "after a peer failed",
+              (unsigned long long)cache_stats.hits,
+              (unsigned long long)cache_stats.misses,
+              (unsigned long long)cache_stats.invalidated);
+      log_msg(LOG_INFO,
+              "Lookups: %llu traversed the network, %llu joined one in "
+              "flight for the same target",
+              (unsigned long long)cache_stats.lookups,
+              (unsigned long long)cache_stats.coalesced);
+
       cmd->result = true;
       break;
+    }
 
     case CMD_UPLOAD:
       if (cmd->file == NULL) {
@@ -327,6 +1002,14 @@ static void handle_pending() {
       cmd->result = handle_rpc_download(cmd->file);
       break;
 
+    case CMD_UPLOAD_MANY:
+      cmd->result = handle_rpc_upload_many(cmd->files, cmd->file_count);
+      break;
+
+    case CMD_DOWNLOAD_MANY:
+      cmd->result = handle_rpc_download_many(cmd->files, cmd->file_count);
+      break;
+
     default:
       log_msg(LOG_DEBUG, "Unknown command");
       cmd->result = -1;
@@ -344,32 +1027,163 @@ static void handle_pending() {
     log_msg(LOG_DEBUG, "Finished handling commands");
 }
 
+static void create_stop_fd() {
+  stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  die(stop_fd, "eventfd");
+}
+
 /**
- * @brief Called in the network update loop. Handles scheduled tasks
- * peers
+ * @brief Watches a duplicate of an eventfd, so the connection can own and
+ * close its descriptor like any other
  *
+ * @param fd The eventfd to watch
+ * @return struct Connection* Returns the new connection, or NULL if it
+ * couldn't be registered
  */
-static void handle_tasks() {
-  time_t now = time(NULL);
-  for (int i = 0; tasks[i].func != NULL; i++) {
-    if (now >= tasks[i].next_run) {
-      tasks[i].func();
-      tasks[i].next_run = now + tasks[i].interval_secs;
-    }
+static struct Connection *watch_eventfd(int fd) {
+  int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (copy < 0) {
+    perror("fcntl(F_DUPFD_CLOEXEC)");
+    return NULL;
+  }
+
+  struct Connection *conn = connection_open(copy, CONN_NOTIFY, NULL);
+  if (!conn) {
+    close(copy);
+    return NULL;
+  }
+
+  if (poller_add(&poller, conn, POLLER_IN) != 0) {
+    connection_close(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/**
+ * @brief Gets a monotonic timestamp with a finer resolution than timer_now_ms
+ *
+ * @return uint64_t Returns the current time in microseconds
+ */
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Tells the kernel to busy poll the device queue of a socket when a
+ * read finds it empty, instead of sleeping until the next interrupt. Only
+ * applies to devices with NAPI, loopback traffic is unaffected
+ *
+ * @param fd The socket
+ */
+static void set_busy_poll(int fd) {
+  if (busy_poll_us <= 0)
+    return;
+
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us,
+                 sizeof(busy_poll_us)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) != 0)
+    log_msg(LOG_DEBUG, "Busy polling not available on fd %d: %s", fd,
+            strerror(errno));
+}
+
+/**
+ * @brief Reads the busy polling configuration and pins the calling thread to
+ * its CPU
+ *
+ * @param thread_index The index of the network thread
+ */
+static void init_busy_poll(int thread_index) {
+  char *env = getenv("BUSY_POLL");
+  if (!env || strtol(env, NULL, 10) <= 0)
+    return;
+
+  busy_poll_us = (int)strtol(env, NULL, 10);
+
+  // A spinning thread should keep its CPU and its caches, each network thread
+  // gets the next CPU after the configured one
+  env = getenv("BUSY_POLL_CPU");
+  if (!env)
+    return;
+
+  long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  int cpu = (int)((strtol(env, NULL, 10) + thread_index) %
+                  (cpu_count > 0 ? cpu_count : 1));
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0)
+    log_msg(LOG_WARN, "Could not pin network thread %d to CPU %d: %s",
+            thread_index, cpu, strerror(ret));
+  else
+    log_msg(LOG_DEBUG, "Pinned network thread %d to CPU %d", thread_index,
+            cpu);
+}
+
+/**
+ * @brief Waits a little after a busy poll that found nothing, longer the
+ * longer the loop stayed idle. Yielding lets the other threads of the CPU,
+ * like a local client, make progress
+ *
+ */
+static void busy_poll_backoff() {
+  if (++idle_spins >= BUSY_POLL_RELAX_SPINS) {
+    sched_yield();
+    return;
+  }
+
+  for (unsigned i = 0; i < idle_spins; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
   }
 }
 
-void init_network() {
-  log_msg(LOG_DEBUG, "Initializing network stack");
+void init_network(int thread_index) {
+  log_msg(LOG_DEBUG, "Initializing network stack on thread %d", thread_index);
+
+  primary = thread_index == 0;
+
+  // Peers may disconnect at any time, a failed send must not kill the client
+  signal(SIGPIPE, SIG_IGN);
 
-  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  enum PollerBackend backend =
+      poller_parse_backend(getenv("NETWORK_BACKEND"), POLLER_EPOLL);
+
+  int ret = poller_init(&poller, backend);
+  die(ret, "poller_init");
+
+  log_msg(LOG_DEBUG, "Using %s network backend", poller_backend_name(backend));
+
+  timer_wheel_init(&timers, timer_now_ms());
+  admission_init();
+
+  init_busy_poll(thread_index);
+  if (busy_poll_us > 0)
+    log_msg(LOG_DEBUG, "Busy polling for %d us after each event",
+            busy_poll_us);
+
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   die(listen_fd, "socket");
 
   int reuse = 1;
-  int ret =
-      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
   die(ret, "setsockopt(SO_REUSEADDR) failed");
 
+  // Each network thread binds its own listen socket to the server port, the
+  // kernel spreads incoming connections between them
+  ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+  die(ret, "setsockopt(SO_REUSEPORT) failed");
+
   struct sockaddr_in server_addr;
   server_addr.sin_family = AF_INET;
   server_addr.sin_port = htons(SERVER_PORT);
@@ -378,18 +1192,83 @@ void init_network() {
   ret = bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
   die(ret, "bind");
 
-  ret = listen(listen_fd, MAX_WAIT_CON);
+  int backlog = DEFAULT_LISTEN_BACKLOG;
+  char *env = getenv("LISTEN_BACKLOG");
+  if (env && (int)strtol(env, NULL, 10) > 0)
+    backlog = (int)strtol(env, NULL, 10);
+
+  env = getenv("MAX_CONNECTIONS");
+  if (env && strtol(env, NULL, 10) > 0)
+    max_connections = (size_t)strtol(env, NULL, 10);
+
+  ret = listen(listen_fd, backlog);
   die(ret, "listen");
 
+  // Accepted connections inherit the busy polling setting
+  set_busy_poll(listen_fd);
+
+  spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
   log_msg(LOG_DEBUG, "Server is listening on port %d...", SERVER_PORT);
 
   // Initialize listen socket
-  sock_array[0].fd = listen_fd;
-  sock_array[0].events = POLLIN;
-  sock_array[0].revents = 0;
+  struct Connection *listen_conn =
+      connection_open(listen_fd, CONN_LISTEN, NULL);
+  ret = listen_conn ? poller_add(&poller, listen_conn, POLLER_IN) : -1;
+  die(ret, "poller_add listen");
+
+  datagram_batch = malloc(sizeof(struct DatagramBatch));
+  datagram_replies = calloc(1 << DATAGRAM_REPLY_BITS,
+                            sizeof(struct DatagramReply));
+  ret = datagram_batch && datagram_replies ? 0 : -1;
+  die(ret, "malloc datagram buffers");
+
+  // Every thread also serves lookup RPCs over UDP on the server port, the
+  // kernel spreads the clients between them
+  int datagram_fd =
+      socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  die(datagram_fd, "datagram socket");
+
+  ret =
+      setsockopt(datagram_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  die(ret, "setsockopt(SO_REUSEADDR) failed");
+
+  ret =
+      setsockopt(datagram_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+  die(ret, "setsockopt(SO_REUSEPORT) failed");
+
+  ret = bind(datagram_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+  die(ret, "bind datagram");
+
+  set_busy_poll(datagram_fd);
+
+  struct Connection *datagram_conn =
+      connection_open(datagram_fd, CONN_DATAGRAM, NULL);
+  ret = datagram_conn ? poller_add(&poller, datagram_conn, POLLER_IN) : -1;
+  die(ret, "poller_add datagram");
+
+  // Without any timeout in the loop, a stop request must wake us up
+  pthread_once(&stop_fd_once, create_stop_fd);
+  ret = watch_eventfd(stop_fd) ? 0 : -1;
+  die(ret, "poller_add stop eventfd");
+
+  // Discovery traffic is light, only the primary thread listens for it
+  if (!primary)
+    return;
+
+  timer_init(&discovery_timer, broadcast_discovery_request, NULL);
+  timer_start(&timers, &discovery_timer, 0, DISCOVERY_INTERVAL_MS);
+
+  // Outbound connections are only made by the primary thread
+  timer_init(&pool_timer, expire_pooled_connections, NULL);
+  timer_start(&timers, &pool_timer, POOL_IDLE_MS, POOL_IDLE_MS);
+
+  commands_conn = watch_eventfd(commands.event_fd);
+  ret = commands_conn ? 0 : -1;
+  die(ret, "poller_add command queue eventfd");
 
   // Broadcast server init
-  broad_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  broad_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
   die(broad_fd, "broadcast socket");
 
   struct sockaddr_in broadcast_server_addr;
@@ -400,6 +1279,12 @@ void init_network() {
       setsockopt(broad_fd, SOL_SOCKET, SO_BROADCAST, &reuse, sizeof(reuse));
   die(broad_ret, "setsockopt(SO_BROADCAST) failed");
 
+  // Sockets used by io_uring are released asynchronously when a node exits,
+  // a restarted node must still be able to bind the port right away
+  broad_ret =
+      setsockopt(broad_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  die(broad_ret, "setsockopt(SO_REUSEADDR) failed");
+
   broad_ret = bind(broad_fd, (struct sockaddr *)&broadcast_server_addr,
                    sizeof(broadcast_server_addr));
   die(broad_ret, "bind broadcast listen");
@@ -407,70 +1292,270 @@ void init_network() {
   log_msg(LOG_DEBUG, "Server Broadcast is listening on port %d...",
           BROADCAST_PORT);
 
-  // Initialize listen socket
-  sock_array[1].fd = broad_fd;
-  sock_array[1].events = POLLIN;
-  sock_array[1].revents = 0;
+  refresh_own_addr();
+
+  // Initialize broadcast socket
+  broad_conn = connection_open(broad_fd, CONN_BROADCAST, NULL);
+  broad_ret = broad_conn ? poller_add(&poller, broad_conn, POLLER_IN) : -1;
+  die(broad_ret, "poller_add broadcast");
+}
 
-  for (int i = 2; i < MAX_SOCK; i++)
-    sock_array[i].fd = -1;
+/**
+ * @brief Serves the connections put off by the last round, in the order they
+ * were put off. A connection whose requests outlast this round's budget goes
+ * back to the end of the queue, the ones not reached keep their place
+ *
+ */
+static void resume_deferred() {
+  for (size_t count = deferred_count;
+       count > 0 && deferred_head && admission_room() > 0; count--) {
+    struct Connection *conn = deferred_head;
+
+    deferred_head = conn->next_deferred;
+    if (!deferred_head)
+      deferred_tail = NULL;
+    deferred_count--;
+    conn->deferred = false;
+
+    if (conn->kind == CONN_PEER)
+      handle_connected(conn, 0);
+    else
+      handle_datagrams(conn);
+  }
 }
 
 void update_network() {
-  poll(sock_array, MAX_SOCK, 50);
+  struct PollerEvent events[MAX_EVENTS];
 
-  // Handle any pending commands from the frontend
-  handle_pending();
+  // Sleep until a socket is ready, a command is pushed or the next timer is
+  // due. When busy polling, the loop doesn't sleep for a while after an
+  // event, the next request of a busy peer is picked up without a wakeup
+  int timeout = timer_wheel_timeout(&timers, timer_now_ms());
 
-  // Accept any new connections
-  handle_incoming();
+  // Connections put off by the last round have requests waiting already
+  if (deferred_head)
+    timeout = 0;
 
-  // Handle requests from connected peers
-  handle_connected();
+  bool spinning = busy_poll_us > 0 && now_us() < busy_until_us;
+  int ready = poller_wait(&poller, events, MAX_EVENTS, spinning ? 0 : timeout);
 
-  // Check periodic task
-  handle_tasks();
+  if (ready > 0 && busy_poll_us > 0) {
+    busy_until_us = now_us() + (uint64_t)busy_poll_us;
+    idle_spins = 0;
+  } else if (spinning) {
+    busy_poll_backoff();
+  }
+
+  admission_new_round(timer_now_ms());
+
+  for (int i = 0; i < ready; i++) {
+    struct Connection *conn = events[i].conn;
+
+    // Closed by an earlier event of this round, or to make room for a new
+    // connection
+    if (conn->closed)
+      continue;
+
+    switch (conn->kind) {
+    case CONN_LISTEN:
+      // Accept any new connections
+      handle_incoming();
+      break;
+
+    case CONN_BROADCAST:
+    case CONN_DATAGRAM:
+      // Handle discovery packets and RPC requests sent over UDP
+      handle_datagrams(conn);
+      break;
+
+    case CONN_PEER:
+      // Handle requests from connected peers
+      handle_connected(conn, events[i].events);
+      break;
+
+    case CONN_NOTIFY:
+      // Handle any pending commands from the frontend, the stop eventfd has
+      // nothing to handle, it only ends the wait
+      if (conn == commands_conn) {
+        queue_clear_event(&commands);
+        handle_pending();
+      }
+      break;
+    }
+  }
+
+  // Once the ready sockets were served, the connections put off by the last
+  // round get what is left of the budget
+  resume_deferred();
+
+  // Fire the timers that are due
+  timer_wheel_advance(&timers, timer_now_ms());
+
+  // Nothing refers to the connections closed this round anymore
+  connection_recycle_closed();
 }
 
 void stop_network() {
   log_msg(LOG_INFO, "Stopping network stack");
-  for (int i = 0; i < MAX_SOCK && sock_array[i].fd != -1; i++) {
-    close(sock_array[i].fd);
-  }
+
+  // Tear down the poller first, so the kernel no longer uses the buffers of
+  // the connections
+  poller_close(&poller);
+  deferred_head = deferred_tail = NULL;
+  deferred_count = 0;
+  connection_close_all();
+  commands_conn = NULL;
+  timer_cancel(&discovery_timer);
+  timer_cancel(&pool_timer);
+  pool_close_all();
+
+  free(datagram_batch);
+  datagram_batch = NULL;
+  free(datagram_replies);
+  datagram_replies = NULL;
+
+  if (spare_fd >= 0)
+    close(spare_fd);
+  spare_fd = -1;
 }
 
-int connect_to_peer(const struct sockaddr_in *addr) {
-  if (!addr) {
-    log_msg(LOG_ERROR, "connect_to_peer: NULL address");
-    return -1;
-  }
+void wake_network() {
+  if (stop_fd >= 0)
+    eventfd_write(stop_fd, 1);
+}
 
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0) {
-    log_msg(LOG_ERROR, "connect_to_peer: socket() failed: %s", strerror(errno));
-    return -1;
-  }
+/**
+ * @brief Sets up a socket that just connected to a peer for the blocking
+ * exchanges of the client side
+ *
+ * @param sock The connected non-blocking socket
+ * @param addr The address of the peer
+ * @return int Returns the socket
+ */
+static int finish_connect(int sock, const struct sockaddr_in *addr) {
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
 
-  // Set timeouts so we don't entirely block the client if the peer doesn't
-  // respond
-  struct timeval timeout = {.tv_sec = 10, .tv_usec = 0};
+  // A peer that stops answering in the middle of an exchange only holds the
+  // thread for the RPC deadline
+  struct timeval timeout = {.tv_sec = RPC_TIMEOUT_MS / 1000,
+                            .tv_usec = RPC_TIMEOUT_MS % 1000 * 1000};
   setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
   setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-  char ip_str[INET_ADDRSTRLEN] = {0};
-  inet_ntop(AF_INET, &addr->sin_addr, ip_str, sizeof(ip_str));
+  log_msg(LOG_DEBUG, "Connected successfully to %s:%d",
+          inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+
+  return sock;
+}
+
+size_t connect_to_peers(const struct sockaddr_in *addrs, size_t count,
+                        int *out_fds, int timeout_ms) {
+  if (!addrs || !out_fds || count == 0)
+    return 0;
+
+  struct pollfd *pending = calloc(count, sizeof(struct pollfd));
+  die(pending ? 0 : -1, "connect_to_peers calloc error");
+
+  size_t connected = 0;
+  size_t waiting = 0;
+
+  // Start every connection before waiting for any of them
+  for (size_t i = 0; i < count; i++) {
+    out_fds[i] = -1;
+    pending[i].fd = -1;
 
-  log_msg(LOG_DEBUG, "Connecting to peer %s:%d", ip_str, ntohs(addr->sin_port));
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+      log_msg(LOG_ERROR, "connect_to_peers: socket() failed: %s",
+              strerror(errno));
+      continue;
+    }
+
+    log_msg(LOG_DEBUG, "Connecting to peer %s:%d",
+            inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port));
+
+    if (connect(sock, (const struct sockaddr *)&addrs[i], sizeof(addrs[i])) ==
+        0) {
+      out_fds[i] = finish_connect(sock, &addrs[i]);
+      connected++;
+    } else if (errno == EINPROGRESS) {
+      pending[i].fd = sock;
+      pending[i].events = POLLOUT;
+      waiting++;
+    } else {
+      log_msg(LOG_WARN, "connect_to_peers: connect() failed to %s:%d (%s)",
+              inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port),
+              strerror(errno));
+      close(sock);
+    }
+  }
+
+  uint64_t deadline = timer_now_ms() + timeout_ms;
+
+  while (waiting > 0) {
+    uint64_t now = timer_now_ms();
+    if (now >= deadline)
+      break;
+
+    // Sockets already settled have a negative fd and are skipped by poll
+    int ret = poll(pending, count, (int)(deadline - now));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+
+      log_msg(LOG_ERROR, "connect_to_peers: poll() failed: %s",
+              strerror(errno));
+      break;
+    }
+
+    for (size_t i = 0; i < count && ret > 0; i++) {
+      if (pending[i].fd < 0 || pending[i].revents == 0)
+        continue;
+
+      ret--;
+      waiting--;
 
-  if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
-    log_msg(LOG_WARN, "connect_to_peer: connect() failed to %s:%d (%s)", ip_str,
-            ntohs(addr->sin_port), strerror(errno));
-    close(sock);
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+      if (err == 0) {
+        out_fds[i] = finish_connect(pending[i].fd, &addrs[i]);
+        connected++;
+      } else {
+        log_msg(LOG_WARN, "connect_to_peers: connect() failed to %s:%d (%s)",
+                inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port),
+                strerror(err));
+        close(pending[i].fd);
+      }
+
+      pending[i].fd = -1;
+    }
+  }
+
+  // Whatever is still pending missed the deadline
+  for (size_t i = 0; i < count; i++) {
+    if (pending[i].fd < 0)
+      continue;
+
+    log_msg(LOG_WARN, "connect_to_peers: connection to %s:%d timed out",
+            inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port));
+    close(pending[i].fd);
+  }
+
+  free(pending);
+  return connected;
+}
+
+int connect_to_peer(const struct sockaddr_in *addr) {
+  if (!addr) {
+    log_msg(LOG_ERROR, "connect_to_peer: NULL address");
     return -1;
   }
 
-  log_msg(LOG_DEBUG, "Connected successfully to %s:%d", ip_str,
-          ntohs(addr->sin_port));
+  int sock = -1;
+  connect_to_peers(addr, 1, &sock, CONNECT_TIMEOUT_MS);
 
   return sock;
 }
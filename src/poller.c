@@ -0,0 +1,956 @@
+#include "poller.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "log.h"
+#include "shared.h"
+
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+
+/**
+ * @brief The number of submission queue entries of a ring
+ *
+ */
+#define URING_ENTRIES 256
+
+/**
+ * @brief The number of buffers provided to the kernel for receives, must be a
+ * power of 2
+ *
+ */
+#define URING_BUF_COUNT 256
+
+/**
+ * @brief The size of each provided receive buffer
+ *
+ */
+#define URING_BUF_SIZE 8192
+
+/**
+ * @brief The buffer group id of the provided receive buffers
+ *
+ */
+#define URING_BUF_GROUP 0
+
+/**
+ * @brief The operation a completion belongs to, stored in the low bits of the
+ * user data next to the connection pointer
+ *
+ */
+enum UringOp {
+  URING_OP_ACCEPT = 1,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_POLL,
+  URING_OP_POLLOUT,
+};
+
+#define URING_OP_MASK 7
+
+/**
+ * @brief The state of the io_uring backend
+ *
+ */
+struct UringState {
+  struct io_uring ring;
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+
+  /**
+   * @brief Buffers handed back to the kernel since the last advance
+   *
+   */
+  int recycled;
+
+  /**
+   * @brief Sockets accepted but not fetched by the network loop yet
+   *
+   */
+  int *accepted;
+  size_t accepted_head;
+  size_t accepted_count;
+  size_t accepted_capacity;
+};
+
+/**
+ * @brief The io_uring state of a single connection
+ *
+ */
+struct UringConn {
+  /**
+   * @brief The number of operations the kernel hasn't finished yet
+   *
+   */
+  int ops;
+
+  /**
+   * @brief Flags collected for the notification being built
+   *
+   */
+  uint32_t ready;
+
+  bool accept_armed;
+  bool recv_armed;
+  bool send_armed;
+  bool poll_armed;
+  bool pollout_armed;
+
+  /**
+   * @brief Whether every operation on the socket was cancelled
+   *
+   */
+  bool cancelled;
+
+  /**
+   * @brief Whether the network loop removed the connection, it gets closed
+   * once ops reaches 0
+   *
+   */
+  bool removed;
+};
+#endif
+
+enum PollerBackend poller_parse_backend(const char *name,
+                                        enum PollerBackend fallback) {
+  if (!name)
+    return fallback;
+
+  if (strcmp(name, "poll") == 0)
+    return POLLER_POLL;
+
+  if (strcmp(name, "epoll") == 0)
+    return POLLER_EPOLL;
+
+  if (strcmp(name, "io_uring") == 0) {
+#ifdef HAVE_IO_URING
+    return POLLER_URING;
+#else
+    log_msg(LOG_WARN, "io_uring support was not built, using '%s'",
+            poller_backend_name(fallback));
+    return fallback;
+#endif
+  }
+
+  log_msg(LOG_WARN, "Unknown network backend '%s', using '%s'", name,
+          poller_backend_name(fallback));
+
+  return fallback;
+}
+
+const char *poller_backend_name(enum PollerBackend backend) {
+  switch (backend) {
+  case POLLER_POLL:
+    return "poll";
+  case POLLER_EPOLL:
+    return "epoll";
+  case POLLER_URING:
+    return "io_uring";
+  default:
+    return "unknown";
+  }
+}
+
+/**
+ * @brief Converts poller flags to poll() events
+ *
+ * @param events A combination of enum PollerFlags
+ * @return short Returns the matching poll() events
+ */
+static short to_poll_events(uint32_t events) {
+  short out = 0;
+
+  if (events & POLLER_IN)
+    out |= POLLIN;
+  if (events & POLLER_OUT)
+    out |= POLLOUT;
+
+  return out;
+}
+
+/**
+ * @brief Converts poller flags to edge-triggered epoll events
+ *
+ * @param events A combination of enum PollerFlags
+ * @return uint32_t Returns the matching epoll events
+ */
+static uint32_t to_epoll_events(uint32_t events) {
+  uint32_t out = EPOLLET | EPOLLRDHUP;
+
+  if (events & POLLER_IN)
+    out |= EPOLLIN;
+  if (events & POLLER_OUT)
+    out |= EPOLLOUT;
+
+  return out;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * @brief Gets a free submission queue entry, submitting the queued ones if the
+ * queue is full
+ *
+ * @param state The io_uring state
+ * @return struct io_uring_sqe* Returns the entry, or NULL if none could be
+ * freed
+ */
+static struct io_uring_sqe *uring_get_sqe(struct UringState *state) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&state->ring);
+
+  if (!sqe) {
+    io_uring_submit(&state->ring);
+    sqe = io_uring_get_sqe(&state->ring);
+  }
+
+  if (!sqe)
+    log_msg(LOG_ERROR, "uring_get_sqe: submission queue is full");
+
+  return sqe;
+}
+
+/**
+ * @brief Queues an operation for a connection
+ *
+ * @param state The io_uring state
+ * @param conn The connection the operation is for
+ * @return struct io_uring_sqe* Returns the entry to prepare, or NULL if the
+ * queue is full
+ */
+static struct io_uring_sqe *uring_queue_op(struct UringState *state,
+                                           struct Connection *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(state);
+  if (!sqe)
+    return NULL;
+
+  struct UringConn *uc = conn->backend_data;
+  uc->ops++;
+
+  return sqe;
+}
+
+/**
+ * @brief Arms the operations that keep a connection fed with input: accept for
+ * the listen socket, receive for peers and readiness polling for the others
+ *
+ * @param state The io_uring state
+ * @param conn The connection to arm
+ */
+static void uring_arm_input(struct UringState *state, struct Connection *conn) {
+  struct UringConn *uc = conn->backend_data;
+  struct io_uring_sqe *sqe;
+
+  if (uc->removed || uc->cancelled)
+    return;
+
+  switch (conn->kind) {
+  case CONN_LISTEN:
+    if (uc->accept_armed || !(sqe = uring_queue_op(state, conn)))
+      return;
+
+    io_uring_prep_multishot_accept(sqe, conn->fd, NULL, NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, (uintptr_t)conn | URING_OP_ACCEPT);
+    uc->accept_armed = true;
+    break;
+
+  case CONN_PEER:
+    if (uc->recv_armed || !(sqe = uring_queue_op(state, conn)))
+      return;
+
+    io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, (uintptr_t)conn | URING_OP_RECV);
+    uc->recv_armed = true;
+    break;
+
+  default:
+    if (uc->poll_armed || !(conn->events & POLLER_IN) ||
+        !(sqe = uring_queue_op(state, conn)))
+      return;
+
+    io_uring_prep_poll_multishot(sqe, conn->fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, (uintptr_t)conn | URING_OP_POLL);
+    uc->poll_armed = true;
+    break;
+  }
+}
+
+/**
+ * @brief Cancels every operation of a connection
+ *
+ * @param state The io_uring state
+ * @param conn The connection
+ * @param sqe An entry to use for the cancellation, NULL to get a new one
+ */
+static void uring_cancel(struct UringState *state, struct Connection *conn,
+                         struct io_uring_sqe *sqe) {
+  struct UringConn *uc = conn->backend_data;
+
+  if (!sqe && !(sqe = uring_get_sqe(state)))
+    return;
+
+  // The completion of the cancel itself is ignored, it carries no connection
+  io_uring_prep_cancel_fd(sqe, conn->fd, IORING_ASYNC_CANCEL_ALL);
+  io_uring_sqe_set_data64(sqe, 0);
+  uc->cancelled = true;
+}
+
+/**
+ * @brief Submits the bytes in the sending buffer of a connection
+ *
+ * @param state The io_uring state
+ * @param conn The connection to send on
+ */
+static void uring_submit_send(struct UringState *state,
+                              struct Connection *conn) {
+  struct UringConn *uc = conn->backend_data;
+  struct io_uring_sqe *sqe = uring_queue_op(state, conn);
+
+  if (!sqe) {
+    conn->closing = true;
+    return;
+  }
+
+  io_uring_prep_send(sqe, conn->fd, buffer_data(&conn->sending),
+                     buffer_length(&conn->sending), MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, (uintptr_t)conn | URING_OP_SEND);
+  uc->send_armed = true;
+
+  // When this is the last response, the receive is cancelled by a linked
+  // request that only runs once the send went through
+  if (conn->close_after_write && conn->stream_fd < 0 && !uc->cancelled) {
+    struct io_uring_sqe *cancel = uring_get_sqe(state);
+    if (!cancel)
+      return;
+
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_cancel(state, conn, cancel);
+  }
+}
+
+/**
+ * @brief Starts sending the queued output of a connection, or waits for the
+ * socket to be writable if a file is being streamed
+ *
+ * @param state The io_uring state
+ * @param conn The connection to send on
+ */
+static void uring_start_output(struct UringState *state,
+                               struct Connection *conn) {
+  struct UringConn *uc = conn->backend_data;
+
+  if (uc->send_armed || uc->pollout_armed || uc->removed)
+    return;
+
+  if (buffer_length(&conn->out) > 0) {
+    // The output buffer becomes the in-flight buffer, the kernel reads from
+    // it until the send completes while new output is queued in a fresh one
+    struct Buffer tmp = conn->sending;
+    conn->sending = conn->out;
+    conn->out = tmp;
+    uring_submit_send(state, conn);
+    return;
+  }
+
+  struct io_uring_sqe *sqe;
+  if (!(sqe = uring_queue_op(state, conn))) {
+    conn->closing = true;
+    return;
+  }
+
+  io_uring_prep_poll_add(sqe, conn->fd, POLLOUT);
+  io_uring_sqe_set_data64(sqe, (uintptr_t)conn | URING_OP_POLLOUT);
+  uc->pollout_armed = true;
+}
+
+/**
+ * @brief Queues a socket accepted by the kernel until the network loop fetches
+ * it
+ *
+ * @param state The io_uring state
+ * @param fd The accepted socket
+ */
+static void uring_push_accepted(struct UringState *state, int fd) {
+  if (state->accepted_head > 0 &&
+      state->accepted_head == state->accepted_count) {
+    state->accepted_head = 0;
+    state->accepted_count = 0;
+  }
+
+  if (state->accepted_count == state->accepted_capacity) {
+    size_t capacity =
+        state->accepted_capacity ? state->accepted_capacity * 2 : 16;
+    int *accepted = realloc(state->accepted, capacity * sizeof(int));
+    pointer_not_null(accepted, "uring_push_accepted realloc error");
+
+    if (!accepted) {
+      close(fd);
+      return;
+    }
+
+    state->accepted = accepted;
+    state->accepted_capacity = capacity;
+  }
+
+  state->accepted[state->accepted_count++] = fd;
+}
+
+/**
+ * @brief Handles a single completion
+ *
+ * @param state The io_uring state
+ * @param cqe The completion
+ * @param conn The connection the completion belongs to
+ * @param op The operation that completed
+ * @return uint32_t Returns the flags to report for the connection
+ */
+static uint32_t uring_complete(struct UringState *state,
+                               const struct io_uring_cqe *cqe,
+                               struct Connection *conn, enum UringOp op) {
+  struct UringConn *uc = conn->backend_data;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  int res = cqe->res;
+  uint32_t flags = 0;
+
+  if (!more)
+    uc->ops--;
+
+  switch (op) {
+  case URING_OP_ACCEPT:
+    if (res >= 0) {
+      uring_push_accepted(state, res);
+      flags |= POLLER_IN;
+    } else if (res != -ECANCELED) {
+      log_msg(LOG_WARN, "uring_complete: accept failed: %s", strerror(-res));
+    }
+
+    if (!more) {
+      uc->accept_armed = false;
+      uring_arm_input(state, conn);
+    }
+    break;
+
+  case URING_OP_RECV:
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      char *data = state->bufs + (size_t)bid * URING_BUF_SIZE;
+
+      if (res > 0 && buffer_append(&conn->in, data, res) != 0)
+        flags |= POLLER_ERR;
+
+      // The data was copied out, the buffer can be reused right away
+      io_uring_buf_ring_add(state->buf_ring, data, URING_BUF_SIZE, bid,
+                            io_uring_buf_ring_mask(URING_BUF_COUNT),
+                            state->recycled++);
+    }
+
+    if (res > 0)
+      flags |= POLLER_IN;
+    else if (res == 0)
+      flags |= POLLER_HUP;
+    else if (res != -ENOBUFS && res != -ECANCELED)
+      flags |= POLLER_ERR;
+
+    // The receive stops on errors and when every buffer is in use, it is
+    // re-armed unless the peer went away
+    if (!more) {
+      uc->recv_armed = false;
+      if (res > 0 || res == -ENOBUFS)
+        uring_arm_input(state, conn);
+    }
+    break;
+
+  case URING_OP_SEND:
+    uc->send_armed = false;
+
+    if (res < 0) {
+      if (res != -ECANCELED) {
+        log_msg(LOG_WARN, "uring_complete: send failed on fd %d: %s",
+                conn->fd, strerror(-res));
+        flags |= POLLER_ERR;
+      }
+      break;
+    }
+
+    buffer_consume(&conn->sending, res);
+
+    if (buffer_length(&conn->sending) > 0 && !uc->removed) {
+      uring_submit_send(state, conn);
+      break;
+    }
+
+    conn->events &= ~POLLER_OUT;
+    flags |= POLLER_OUT;
+    break;
+
+  case URING_OP_POLL:
+    if (res < 0) {
+      if (res != -ECANCELED)
+        flags |= POLLER_ERR;
+    } else {
+      if (res & POLLIN)
+        flags |= POLLER_IN;
+      if (res & POLLHUP)
+        flags |= POLLER_HUP;
+      if (res & (POLLERR | POLLNVAL))
+        flags |= POLLER_ERR;
+    }
+
+    if (!more) {
+      uc->poll_armed = false;
+      if (res >= 0)
+        uring_arm_input(state, conn);
+    }
+    break;
+
+  case URING_OP_POLLOUT:
+    uc->pollout_armed = false;
+    conn->events &= ~POLLER_OUT;
+
+    if (res < 0 && res != -ECANCELED)
+      flags |= POLLER_ERR;
+    else if (res >= 0)
+      flags |= POLLER_OUT;
+    break;
+  }
+
+  return flags;
+}
+
+/**
+ * @brief Waits for completions and turns them into notifications, each
+ * connection is reported at most once per call
+ *
+ * @param poller The poller to wait on
+ * @param out_events A pointer to memory where the notifications will be stored
+ * @param max_events The maximum number of notifications to return
+ * @param timeout_ms How long to wait at most in milliseconds, -1 to wait
+ * indefinitely
+ * @return int Returns the number of notifications stored, a negative number if
+ * there was an error
+ */
+static int uring_wait(struct Poller *poller, struct PollerEvent *out_events,
+                      int max_events, int timeout_ms) {
+  struct UringState *state = poller->uring;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000,
+                                 .tv_nsec = (timeout_ms % 1000) * 1000000L};
+
+  int ret = io_uring_submit_and_wait_timeout(&state->ring, &cqe, 1,
+                                             timeout_ms < 0 ? NULL : &ts, NULL);
+  if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+    log_msg(LOG_ERROR, "poller_wait: io_uring wait failed: %s",
+            strerror(-ret));
+    return -1;
+  }
+
+  int stored = 0;
+  unsigned head;
+  unsigned seen = 0;
+
+  io_uring_for_each_cqe(&state->ring, head, cqe) {
+    // Leave the rest for the next call once the caller's array is full, a
+    // new connection couldn't be reported
+    if (stored == max_events)
+      break;
+
+    seen++;
+
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    if (data == 0)
+      continue;
+
+    struct Connection *conn = (void *)(uintptr_t)(data & ~URING_OP_MASK);
+    struct UringConn *uc = conn->backend_data;
+    uint32_t flags = uring_complete(state, cqe, conn, data & URING_OP_MASK);
+
+    if (uc->removed) {
+      // The loop dropped the connection, close it once the kernel is done
+      if (uc->ops == 0)
+        connection_close(conn);
+      continue;
+    }
+
+    if (flags == 0)
+      continue;
+
+    if (uc->ready == 0)
+      out_events[stored++].conn = conn;
+    uc->ready |= flags;
+  }
+
+  io_uring_cq_advance(&state->ring, seen);
+
+  if (state->recycled > 0) {
+    io_uring_buf_ring_advance(state->buf_ring, state->recycled);
+    state->recycled = 0;
+  }
+
+  for (int i = 0; i < stored; i++) {
+    struct UringConn *uc = out_events[i].conn->backend_data;
+    out_events[i].events = uc->ready;
+    uc->ready = 0;
+  }
+
+  return stored;
+}
+
+/**
+ * @brief Sets up the ring and the provided receive buffers
+ *
+ * @param poller The poller to initialize
+ * @return int Returns 0 if the ring was set up, a negative number otherwise
+ */
+static int uring_init(struct Poller *poller) {
+  struct UringState *state = calloc(1, sizeof(struct UringState));
+  pointer_not_null(state, "uring_init calloc error");
+  if (!state)
+    return -1;
+
+  int ret = io_uring_queue_init(URING_ENTRIES, &state->ring, 0);
+  if (ret < 0) {
+    log_msg(LOG_ERROR, "poller_init: io_uring_queue_init failed: %s",
+            strerror(-ret));
+    free(state);
+    return -1;
+  }
+
+  state->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+  pointer_not_null(state->bufs, "uring_init malloc error");
+
+  state->buf_ring = io_uring_setup_buf_ring(&state->ring, URING_BUF_COUNT,
+                                            URING_BUF_GROUP, 0, &ret);
+  if (!state->bufs || !state->buf_ring) {
+    log_msg(LOG_ERROR, "poller_init: io_uring_setup_buf_ring failed: %s",
+            strerror(-ret));
+    io_uring_queue_exit(&state->ring);
+    free(state->bufs);
+    free(state);
+    return -1;
+  }
+
+  for (int i = 0; i < URING_BUF_COUNT; i++)
+    io_uring_buf_ring_add(state->buf_ring,
+                          state->bufs + (size_t)i * URING_BUF_SIZE,
+                          URING_BUF_SIZE, i,
+                          io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+  io_uring_buf_ring_advance(state->buf_ring, URING_BUF_COUNT);
+
+  poller->uring = state;
+
+  return 0;
+}
+
+/**
+ * @brief Tears down the ring, the sockets of the connections must be closed by
+ * the caller
+ *
+ * @param poller The poller to clean up
+ */
+static void uring_close(struct Poller *poller) {
+  struct UringState *state = poller->uring;
+
+  io_uring_free_buf_ring(&state->ring, state->buf_ring, URING_BUF_COUNT,
+                         URING_BUF_GROUP);
+  io_uring_queue_exit(&state->ring);
+
+  for (size_t i = state->accepted_head; i < state->accepted_count; i++)
+    close(state->accepted[i]);
+
+  free(state->accepted);
+  free(state->bufs);
+  free(state);
+}
+#endif
+
+int poller_init(struct Poller *poller, enum PollerBackend backend) {
+  if (!poller)
+    return -1;
+
+  memset(poller, 0, sizeof(struct Poller));
+  poller->backend = backend;
+  poller->epoll_fd = -1;
+
+#ifdef HAVE_IO_URING
+  if (backend == POLLER_URING)
+    return uring_init(poller);
+#endif
+
+  if (backend == POLLER_EPOLL) {
+    poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll_fd < 0) {
+      log_msg(LOG_ERROR, "poller_init: epoll_create1 failed: %s",
+              strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int poller_add(struct Poller *poller, struct Connection *conn,
+               uint32_t events) {
+  if (!poller || !conn)
+    return -1;
+
+  conn->events = events;
+
+#ifdef HAVE_IO_URING
+  if (poller->backend == POLLER_URING) {
+    struct UringConn *uc = calloc(1, sizeof(struct UringConn));
+    pointer_not_null(uc, "poller_add calloc error");
+    if (!uc)
+      return -1;
+
+    conn->backend_data = uc;
+    conn->queue_output = conn->kind == CONN_PEER;
+    conn->events &= ~POLLER_OUT;
+
+    uring_arm_input(poller->uring, conn);
+    if (events & POLLER_OUT)
+      return poller_modify(poller, conn, events);
+
+    return 0;
+  }
+#endif
+
+  if (poller->backend == POLLER_EPOLL) {
+    struct epoll_event ev = {.events = to_epoll_events(events),
+                             .data.ptr = conn};
+
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+      log_msg(LOG_ERROR, "poller_add: epoll_ctl failed for fd %d: %s",
+              conn->fd, strerror(errno));
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (poller->count == poller->capacity) {
+    size_t capacity = poller->capacity ? poller->capacity * 2 : 16;
+
+    struct pollfd *fds = realloc(poller->fds, capacity * sizeof(*fds));
+    pointer_not_null(fds, "poller_add realloc error");
+    if (!fds)
+      return -1;
+    poller->fds = fds;
+
+    struct Connection **conns =
+        realloc(poller->conns, capacity * sizeof(*conns));
+    pointer_not_null(conns, "poller_add realloc error");
+    if (!conns)
+      return -1;
+    poller->conns = conns;
+
+    poller->capacity = capacity;
+  }
+
+  conn->poll_index = poller->count;
+  poller->fds[poller->count].fd = conn->fd;
+  poller->fds[poller->count].events = to_poll_events(events);
+  poller->fds[poller->count].revents = 0;
+  poller->conns[poller->count] = conn;
+  poller->count++;
+
+  return 0;
+}
+
+int poller_modify(struct Poller *poller, struct Connection *conn,
+                  uint32_t events) {
+  if (!poller || !conn)
+    return -1;
+
+#ifdef HAVE_IO_URING
+  if (poller->backend == POLLER_URING) {
+    // POLLER_OUT stays set while output is in flight, the completion clears it
+    conn->events = events;
+    if (events & POLLER_OUT)
+      uring_start_output(poller->uring, conn);
+
+    return conn->closing ? -1 : 0;
+  }
+#endif
+
+  conn->events = events;
+
+  if (poller->backend == POLLER_EPOLL) {
+    struct epoll_event ev = {.events = to_epoll_events(events),
+                             .data.ptr = conn};
+
+    if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+      log_msg(LOG_ERROR, "poller_modify: epoll_ctl failed for fd %d: %s",
+              conn->fd, strerror(errno));
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (conn->poll_index < 0 || conn->poll_index >= poller->count)
+    return -1;
+
+  poller->fds[conn->poll_index].events = to_poll_events(events);
+
+  return 0;
+}
+
+bool poller_remove(struct Poller *poller, struct Connection *conn) {
+  if (!poller || !conn)
+    return true;
+
+#ifdef HAVE_IO_URING
+  if (poller->backend == POLLER_URING) {
+    struct UringConn *uc = conn->backend_data;
+    if (!uc || uc->ops == 0)
+      return true;
+
+    // The kernel may still write into the connection buffers, keep them
+    // around until every operation completed
+    uc->removed = true;
+    conn->closing = true;
+    uring_cancel(poller->uring, conn, NULL);
+
+    return false;
+  }
+#endif
+
+  if (poller->backend == POLLER_EPOLL) {
+    epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    return true;
+  }
+
+  int index = conn->poll_index;
+  if (index < 0 || index >= poller->count)
+    return true;
+
+  // Move the last entry into the freed slot to keep the array packed
+  size_t last = poller->count - 1;
+  if (index != last) {
+    poller->fds[index] = poller->fds[last];
+    poller->conns[index] = poller->conns[last];
+    poller->conns[index]->poll_index = index;
+  }
+
+  poller->count--;
+  conn->poll_index = -1;
+
+  return true;
+}
+
+bool poller_completes_io(const struct Poller *poller) {
+  return poller && poller->backend == POLLER_URING;
+}
+
+int poller_next_accepted(struct Poller *poller) {
+#ifdef HAVE_IO_URING
+  struct UringState *state = poller ? poller->uring : NULL;
+
+  if (state && state->accepted_head < state->accepted_count)
+    return state->accepted[state->accepted_head++];
+#endif
+
+  return -1;
+}
+
+int poller_wait(struct Poller *poller, struct PollerEvent *out_events,
+                int max_events, int timeout_ms) {
+  if (!poller || !out_events || max_events <= 0)
+    return -1;
+
+#ifdef HAVE_IO_URING
+  if (poller->backend == POLLER_URING)
+    return uring_wait(poller, out_events, max_events, timeout_ms);
+#endif
+
+  if (poller->backend == POLLER_EPOLL) {
+    struct epoll_event events[max_events];
+
+    int ready = epoll_wait(poller->epoll_fd, events, max_events, timeout_ms);
+    if (ready < 0) {
+      if (errno == EINTR)
+        return 0;
+
+      log_msg(LOG_ERROR, "poller_wait: epoll_wait failed: %s",
+              strerror(errno));
+      return -1;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      uint32_t flags = 0;
+
+      if (events[i].events & EPOLLIN)
+        flags |= POLLER_IN;
+      if (events[i].events & EPOLLOUT)
+        flags |= POLLER_OUT;
+      if (events[i].events & (EPOLLHUP | EPOLLRDHUP))
+        flags |= POLLER_HUP;
+      if (events[i].events & EPOLLERR)
+        flags |= POLLER_ERR;
+
+      out_events[i].conn = events[i].data.ptr;
+      out_events[i].events = flags;
+    }
+
+    return ready;
+  }
+
+  int ready = poll(poller->fds, poller->count, timeout_ms);
+  if (ready < 0) {
+    if (errno == EINTR)
+      return 0;
+
+    log_msg(LOG_ERROR, "poller_wait: poll failed: %s", strerror(errno));
+    return -1;
+  }
+
+  int stored = 0;
+  for (size_t i = 0; i < poller->count && stored < max_events; i++) {
+    short revents = poller->fds[i].revents;
+    if (revents == 0)
+      continue;
+
+    uint32_t flags = 0;
+
+    if (revents & POLLIN)
+      flags |= POLLER_IN;
+    if (revents & POLLOUT)
+      flags |= POLLER_OUT;
+    if (revents & POLLHUP)
+      flags |= POLLER_HUP;
+    if (revents & (POLLERR | POLLNVAL))
+      flags |= POLLER_ERR;
+
+    poller->fds[i].revents = 0;
+    out_events[stored].conn = poller->conns[i];
+    out_events[stored].events = flags;
+    stored++;
+  }
+
+  return stored;
+}
+
+void poller_close(struct Poller *poller) {
+  if (!poller)
+    return;
+
+  if (poller->epoll_fd >= 0)
+    close(poller->epoll_fd);
+
+#ifdef HAVE_IO_URING
+  if (poller->uring)
+    uring_close(poller);
+#endif
+
+  free(poller->fds);
+  free(poller->conns);
+
+  memset(poller, 0, sizeof(struct Poller));
+  poller->epoll_fd = -1;
+}
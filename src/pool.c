@@ -0,0 +1,189 @@
+#include "pool.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "network.h"
+#include "shared.h"
+#include "timer.h"
+
+/**
+ * @brief An idle connection kept in the pool
+ *
+ */
+struct PooledConnection {
+  struct sockaddr_in addr;
+  int fd;
+
+  /**
+   * @brief When the connection was released, in milliseconds of timer_now_ms
+   *
+   */
+  uint64_t idle_since;
+};
+
+/**
+ * @brief The idle connections of the calling thread, in the order they were
+ * released. The pool is small, so it is searched linearly
+ *
+ */
+static __thread struct PooledConnection idle[POOL_MAX_IDLE];
+static __thread size_t idle_count = 0;
+
+/**
+ * @brief Checks whether two addresses designate the same peer
+ *
+ */
+static bool same_peer(const struct sockaddr_in *a,
+                      const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/**
+ * @brief Removes an idle connection from the pool, keeping the others in
+ * release order
+ *
+ * @param index The index of the connection
+ * @return int Returns the socket of the connection
+ */
+static int take(size_t index) {
+  int fd = idle[index].fd;
+
+  for (size_t i = index + 1; i < idle_count; i++)
+    idle[i - 1] = idle[i];
+
+  idle_count--;
+  return fd;
+}
+
+/**
+ * @brief Checks that an idle connection can still carry a request. Nothing is
+ * expected from the peer between two exchanges, so a readable socket was
+ * either closed by the peer or holds stray bytes
+ *
+ * @param fd The socket to check
+ * @return true The connection can be reused
+ * @return false The connection must be closed
+ */
+static bool is_healthy(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+  return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * @brief Finds the most recently released idle connection to a peer that can
+ * still be used, closing the stale ones found on the way
+ *
+ * @param addr The address of the peer
+ * @return ssize_t Returns the index of the connection, -1 if there is none
+ */
+static ssize_t find_idle(const struct sockaddr_in *addr) {
+  uint64_t now = timer_now_ms();
+
+  // The most recently released connections are the most likely to be alive
+  for (size_t i = idle_count; i-- > 0;) {
+    if (!same_peer(&idle[i].addr, addr))
+      continue;
+
+    if (now - idle[i].idle_since < POOL_IDLE_MS && is_healthy(idle[i].fd))
+      return i;
+
+    int fd = take(i);
+    log_msg(LOG_DEBUG, "Discarding stale pooled connection with fd: %d", fd);
+    close(fd);
+  }
+
+  return -1;
+}
+
+int pool_acquire(const struct sockaddr_in *addr, bool *out_reused) {
+  ssize_t index = find_idle(addr);
+
+  if (out_reused)
+    *out_reused = index >= 0;
+
+  if (index >= 0)
+    return take(index);
+
+  return connect_to_peer(addr);
+}
+
+size_t pool_connect(const struct sockaddr_in *addrs, size_t count,
+                    bool *out_reachable, int timeout_ms) {
+  if (!addrs || !out_reachable || count == 0)
+    return 0;
+
+  struct sockaddr_in *missing = calloc(count, sizeof(struct sockaddr_in));
+  size_t *missing_index = calloc(count, sizeof(size_t));
+  int *fds = calloc(count, sizeof(int));
+  die(missing && missing_index && fds ? 0 : -1, "pool_connect calloc error");
+
+  size_t reachable = 0;
+  size_t missing_count = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    out_reachable[i] = find_idle(&addrs[i]) >= 0;
+
+    if (out_reachable[i]) {
+      reachable++;
+      continue;
+    }
+
+    missing[missing_count] = addrs[i];
+    missing_index[missing_count++] = i;
+  }
+
+  connect_to_peers(missing, missing_count, fds, timeout_ms);
+
+  for (size_t i = 0; i < missing_count; i++) {
+    if (fds[i] < 0)
+      continue;
+
+    pool_release(&missing[i], fds[i]);
+    out_reachable[missing_index[i]] = true;
+    reachable++;
+  }
+
+  free(missing);
+  free(missing_index);
+  free(fds);
+
+  return reachable;
+}
+
+void pool_release(const struct sockaddr_in *addr, int fd) {
+  size_t peer_idle = 0;
+  size_t oldest = idle_count;
+
+  for (size_t i = 0; i < idle_count; i++) {
+    if (!same_peer(&idle[i].addr, addr))
+      continue;
+
+    if (peer_idle++ == 0)
+      oldest = i;
+  }
+
+  // Make room by closing the least recently used connection, to this peer if
+  // it already has enough of them
+  if (peer_idle >= POOL_MAX_PER_PEER)
+    close(take(oldest));
+  else if (idle_count == POOL_MAX_IDLE)
+    close(take(0));
+
+  idle[idle_count++] = (struct PooledConnection){
+      .addr = *addr, .fd = fd, .idle_since = timer_now_ms()};
+}
+
+void pool_expire(uint64_t now_ms) {
+  // Connections are in release order, the expired ones are at the front
+  while (idle_count > 0 && now_ms - idle[0].idle_since >= POOL_IDLE_MS)
+    close(take(0));
+}
+
+void pool_close_all() {
+  while (idle_count > 0)
+    close(take(0));
+}
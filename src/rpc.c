@@ -1,15 +1,26 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <memory.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <hash/hashmap.h>
 
 #include "bucket.h"
+#include "call.h"
+#include "connection.h"
 #include "http.h"
 #include "log.h"
+#include "lookup_cache.h"
 #include "magnet.h"
 #include "network.h"
+#include "pool.h"
 #include "rpc.h"
+#include "shortlist.h"
 #include "storage.h"
-#include "vector.h"
+#include "timer.h"
+#include "wire.h"
 
 /**
  * @brief Kademlia neighbor buckets
@@ -17,81 +28,189 @@
  */
 static Buckets buckets = {0};
 
-static void handle_ping(const struct pollfd *sock, struct RPCPing *data) {
+/**
+ * @brief Protects the buckets, RPCs may be handled by several network threads
+ * at once
+ *
+ */
+static pthread_rwlock_t buckets_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * @brief Serializes the peers we know of that are the closest to a target
+ *
+ * @param target The target the peers should be close to
+ * @param out A pointer to memory where the serialized peers should be stored
+ * @param max The maximum number of peers to store
+ * @return int Returns the number of peers that were stored
+ */
+static int serialize_closest_peers(const HashID target, struct RPCPeer *out,
+                                   int max) {
+  int found = 0;
+
+  pthread_rwlock_rdlock(&buckets_lock);
+
+  struct Peer **closest = find_closest_peers(buckets, target, max);
+  if (closest) {
+    for (int i = 0; i < max; i++) {
+      if (closest[i] == NULL)
+        continue;
+
+      serialize_rpc_peer(closest[i], &out[found]);
+      found++;
+    }
+
+    free(closest);
+  }
+
+  pthread_rwlock_unlock(&buckets_lock);
+
+  return found;
+}
+
+/**
+ * @brief Updates our buckets with a peer we interacted with
+ *
+ * @param peer The peer that was interacted with
+ */
+static void learn_peer(struct Peer *peer) {
+  pthread_rwlock_wrlock(&buckets_lock);
+  update_bucket_peers(buckets, peer);
+  pthread_rwlock_unlock(&buckets_lock);
+}
+
+/**
+ * @brief Sends a response, encoded in the version of the request it answers
+ *
+ * @param conn The connection that sent the request
+ * @param response The response structure
+ */
+static void send_response(struct Connection *conn, const void *response) {
+  char data[MAX_RPC_MESSAGE_SIZE];
+  size_t length = wire_encode(response, data, sizeof(data));
+
+  if (length == 0) {
+    log_msg(LOG_ERROR, "send_response: cannot encode the response");
+    return;
+  }
+
+  connection_send(conn, data, length);
+}
+
+static void handle_ping(struct Connection *conn, struct RPCPing *data) {
   log_msg(LOG_DEBUG, "Handling RPC ping");
 
   struct RPCResponse response = {
       .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
                  .call_type = PING_RESPONSE,
+                 .request_id = data->header.request_id,
                  .packet_size = sizeof(struct RPCResponse)},
       .success = true};
 
-  send_all(sock->fd, &response, sizeof(response));
+  send_response(conn, &response);
+}
+
+/**
+ * @brief Gets how long we serve a copy of a key-value pair cached on us by a
+ * lookup passing by. With fewer than K_VALUE peers we know of closer to the
+ * key, we are one of its home nodes and keep it. Otherwise its lifetime
+ * halves with each peer closer to the key than us
+ *
+ * @param key The key of the pair
+ * @return uint64_t Returns the lifetime in milliseconds, 0 if it never expires
+ */
+static uint64_t stored_value_ttl(const HashID key) {
+  HashID own_id;
+  if (get_own_id(own_id) != 0)
+    return 0;
+
+  HashID own_distance;
+  dist_hash(own_distance, own_id, key);
+
+  const int max = K_VALUE + CACHED_VALUE_HALVINGS;
+  int closer = 0;
+
+  pthread_rwlock_rdlock(&buckets_lock);
+
+  struct Peer **closest = find_closest_peers(buckets, key, max);
+  if (closest) {
+    for (int i = 0; i < max; i++) {
+      if (closest[i] == NULL)
+        continue;
+
+      HashID distance;
+      dist_hash(distance, closest[i]->peer_id, key);
+
+      if (compare_hashes(distance, own_distance) < 0)
+        closer++;
+    }
+
+    free(closest);
+  }
+
+  pthread_rwlock_unlock(&buckets_lock);
+
+  if (closer < K_VALUE)
+    return 0;
+
+  return ((uint64_t)CACHED_VALUE_TTL * 1000) >> (closer - K_VALUE);
 }
 
-static void handle_store(const struct pollfd *sock,
+static void handle_store(struct Connection *conn,
                          const struct RPCStore *data) {
   log_msg(LOG_DEBUG, "Handling RPC store");
 
   struct KeyValuePair kvp;
   deserialize_rpc_value(&data->key_value, &kvp);
-  storage_put_value(&kvp);
+
+  // Replicas are kept, only the copies cached along lookup paths expire
+  uint64_t ttl = data->cached ? stored_value_ttl(kvp.key) : 0;
+  if (ttl > 0)
+    log_msg(LOG_DEBUG, "Caching a copy of the key-value pair for %llu s",
+            (unsigned long long)(ttl / 1000));
+
+  storage_put_value(&kvp, ttl);
 
   struct RPCResponse response = {
       .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
                  .call_type = STORE_RESPONSE,
+                 .request_id = data->header.request_id,
                  .packet_size = sizeof(struct RPCResponse)},
       .success = true};
 
-  send_all(sock->fd, &response, sizeof(response));
+  send_response(conn, &response);
 }
 
-static void handle_find_node(const struct pollfd *sock,
+static void handle_find_node(struct Connection *conn,
                              const struct RPCFind *data) {
   log_msg(LOG_DEBUG, "Handling RPC find node");
 
   struct RPCFindNodeResponse response = {
       .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
                  .call_type = FIND_NODE_RESPONSE,
+                 .request_id = data->header.request_id,
                  .packet_size = sizeof(struct RPCFindNodeResponse)},
       .success = true,
       .found_key = false,
       .num_closest = 0,
       .closest = {{{0}}}};
 
-  int count = BUCKET_SIZE;
-  struct Peer **closest = find_closest_peers(buckets, data->key, count);
-
-  if (closest == NULL) {
-    log_msg(LOG_ERROR, "handle_find_node find_closest_peers returned NULL");
-    // Send error response
-    send_all(sock->fd, &response, sizeof(response));
-    return;
-  }
-
-  // Ugly, need to just return number found from find_closest_peers
-  int found = 0;
-  for (int i = 0; i < count; i++) {
-    if (closest[i] == NULL)
-      continue;
-
-    found++;
-    serialize_rpc_peer(closest[i], &response.closest[i]);
-  }
-
-  response.num_closest = found;
-
-  send_all(sock->fd, &response, sizeof(response));
+  response.num_closest =
+      serialize_closest_peers(data->key, response.closest, BUCKET_SIZE);
 
-  free(closest);
+  send_response(conn, &response);
 }
 
-static void handle_find_value(const struct pollfd *sock, struct RPCFind *data) {
+static void handle_find_value(struct Connection *conn, struct RPCFind *data) {
   log_msg(LOG_DEBUG, "Handling RPC find value");
 
   struct RPCFindValueResponse response = {
       .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
                  .call_type = FIND_VALUE_RESPONSE,
+                 .request_id = data->header.request_id,
                  .packet_size = sizeof(struct RPCFindValueResponse)},
       .success = true,
       .found_key = false,
@@ -99,16 +218,16 @@ static void handle_find_value(const struct pollfd *sock, struct RPCFind *data) {
       .num_closest = 0,
       .closest = {{{0}}}};
 
-  const struct KeyValuePair *kvp = storage_get_value(data->key);
+  struct KeyValuePair kvp;
 
-  if (kvp) {
+  if (storage_get_value(data->key, &kvp) == 0) {
     log_msg(
         LOG_DEBUG,
         "We had the key value pair, returning value from our storage to peer");
     response.found_key = true;
-    serialize_rpc_value(kvp, &response.values);
+    serialize_rpc_value(&kvp, &response.values);
 
-    send_all(sock->fd, &response, sizeof(response));
+    send_response(conn, &response);
 
     return;
   }
@@ -116,52 +235,73 @@ static void handle_find_value(const struct pollfd *sock, struct RPCFind *data) {
   log_msg(LOG_DEBUG, "We don't have the key value pair, returning our "
                      "neighbors closest to target");
 
-  int count = BUCKET_SIZE;
-  struct Peer **closest = find_closest_peers(buckets, data->key, count);
+  response.num_closest =
+      serialize_closest_peers(data->key, response.closest, BUCKET_SIZE);
 
-  if (closest == NULL) {
-    log_msg(LOG_ERROR, "handle_find_node find_closest_peers returned NULL");
-    // Send error response
-    send_all(sock->fd, &response, sizeof(response));
-    return;
-  }
+  send_response(conn, &response);
+}
 
-  // Ugly, need to just return number found from find_closest_peers
-  int found = 0;
-  for (int i = 0; i < count; i++) {
-    if (closest[i] == NULL)
-      continue;
+static void handle_store_multi(struct Connection *conn,
+                               const struct RPCStoreMulti *data) {
+  log_msg(LOG_DEBUG, "Handling RPC store of %zu pairs", data->num_values);
 
-    found++;
-    serialize_rpc_peer(closest[i], &response.closest[i]);
+  struct RPCStoreMultiResponse response = {
+      .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
+                 .call_type = STORE_MULTI_RESPONSE,
+                 .request_id = data->header.request_id,
+                 .packet_size = sizeof(struct RPCStoreMultiResponse)},
+      .num_results = data->num_values,
+      .success = {0}};
+
+  for (size_t i = 0; i < data->num_values; i++) {
+    struct KeyValuePair kvp;
+    deserialize_rpc_value(&data->key_values[i], &kvp);
+
+    // Only uploads send batches, their pairs are replicas
+    storage_put_value(&kvp, 0);
+    response.success[i] = true;
   }
 
-  response.num_closest = found;
+  send_response(conn, &response);
+}
+
+static void handle_find_value_multi(struct Connection *conn,
+                                    const struct RPCFindMulti *data) {
+  log_msg(LOG_DEBUG, "Handling RPC find value of %zu keys", data->num_keys);
+
+  struct RPCFindValueMultiResponse response = {
+      .header = {.magic_number = RPC_MAGIC,
+                 .version = data->header.version,
+                 .call_type = FIND_VALUE_MULTI_RESPONSE,
+                 .request_id = data->header.request_id,
+                 .packet_size = sizeof(struct RPCFindValueMultiResponse)},
+      .num_results = data->num_keys,
+      .results = {{0}}};
+
+  for (size_t i = 0; i < data->num_keys; i++) {
+    struct RPCValueResult *result = &response.results[i];
+    struct KeyValuePair kvp;
+
+    if (storage_get_value(data->keys[i], &kvp) == 0) {
+      result->found_key = true;
+      serialize_rpc_value(&kvp, &result->values);
+    }
 
-  send_all(sock->fd, &response, sizeof(response));
+    result->num_closest =
+        serialize_closest_peers(data->keys[i], result->closest, BUCKET_SIZE);
+  }
 
-  free(closest);
+  send_response(conn, &response);
 }
 
-static void handle_broadcast(const struct pollfd *sock,
+static void handle_broadcast(struct Connection *conn,
                              const struct RPCBroadcast *data) {
   struct Peer peer;
   // Get the peer object back
   deserialize_rpc_peer(&data->peer, &peer);
   // Update our buckets with the information from this (potentially new) peer
-  update_bucket_peers(buckets, &peer);
-}
-
-static bool peer_distance_cmp(void *a, void *b, const void *userdata) {
-  struct Peer *p1 = a;
-  struct Peer *p2 = b;
-
-  unsigned char *target = (unsigned char *)userdata;
-  HashID d1, d2;
-  dist_hash(d1, p1->peer_id, target);
-  dist_hash(d2, p2->peer_id, target);
-
-  return memcmp(d1, d2, sizeof(HashID)) < 0;
+  learn_peer(&peer);
 }
 
 /**
@@ -179,10 +319,210 @@ static void free_peer_array(struct Peer **peers, size_t count) {
   }
 }
 
+/**
+ * @brief Connects to the peers a file is exchanged with before talking to them
+ * one after the other. The connections wait in the pool, so unreachable peers
+ * cost a single connection deadline between them
+ *
+ * @param peers The peers, NULL entries are skipped
+ * @param count The number of entries in peers, at most K_VALUE
+ * @param out_reachable Set for each entry to whether a connection is ready
+ */
+static void connect_peers(struct Peer *const *peers, size_t count,
+                          bool *out_reachable) {
+  struct sockaddr_in addrs[K_VALUE];
+  size_t index[K_VALUE];
+  bool reachable[K_VALUE];
+  size_t n = 0;
+
+  for (size_t i = 0; i < count && i < K_VALUE; i++) {
+    out_reachable[i] = false;
+
+    if (peers[i]) {
+      addrs[n] = peers[i]->peer_addr;
+      index[n++] = i;
+    }
+  }
+
+  pool_connect(addrs, n, reachable, CONNECT_TIMEOUT_MS);
+
+  for (size_t i = 0; i < n; i++)
+    out_reachable[index[i]] = reachable[i];
+}
+
+/**
+ * @brief Drops the cached lookup results containing peers we couldn't
+ * connect to
+ *
+ * @param peers The peers, NULL entries are skipped
+ * @param count The number of entries in peers
+ * @param reachable For each entry, whether a connection is ready
+ */
+static void forget_unreachable(struct Peer *const *peers, size_t count,
+                               const bool *reachable) {
+  for (size_t i = 0; i < count; i++) {
+    if (peers[i] && !reachable[i])
+      lookup_cache_forget_peer(peers[i]->peer_id);
+  }
+}
+
+/**
+ * @brief Gets how many lookup RPCs are kept in flight at once
+ *
+ * @return size_t Returns LOOKUP_ALPHA, or DEFAULT_LOOKUP_ALPHA if it is unset
+ * or invalid
+ */
+static size_t lookup_alpha() {
+  char *env = getenv("LOOKUP_ALPHA");
+  if (!env)
+    return DEFAULT_LOOKUP_ALPHA;
+
+  long alpha = strtol(env, NULL, 10);
+  if (alpha < 1 || alpha > CALL_MAX_PENDING) {
+    log_msg(LOG_WARN, "LOOKUP_ALPHA must be between 1 and %d, using %d",
+            CALL_MAX_PENDING, DEFAULT_LOOKUP_ALPHA);
+    return DEFAULT_LOOKUP_ALPHA;
+  }
+
+  return (size_t)alpha;
+}
+
+/**
+ * @brief Adds the peers returned by a lookup RPC to the candidates
+ *
+ * @param list The candidates of the lookup
+ * @param closest The serialized peers
+ * @param count The number of peers
+ * @param hops The number of RPCs in a row that led to the peers
+ */
+static void add_candidates(struct Shortlist *list,
+                           const struct RPCPeer *closest, size_t count,
+                           unsigned hops) {
+  for (size_t j = 0; j < count && j < K_VALUE; j++) {
+    struct Peer peer;
+    deserialize_rpc_peer(&closest[j], &peer);
+
+    // Update our own neighbor lists
+    learn_peer(&peer);
+
+    struct Candidate *candidate = shortlist_add(list, &peer);
+    if (candidate)
+      candidate->hops = hops;
+  }
+}
+
+/**
+ * @brief Marks the RPCs of a lookup that waited too long as stalled
+ *
+ * @param list The candidates of the lookup
+ * @param now The current time in milliseconds of timer_now_ms
+ * @param out_next_stall Set to when the next RPC in flight stalls, UINT64_MAX
+ * if there is none
+ * @return size_t Returns the number of RPCs in flight that aren't stalled
+ */
+static size_t update_stalled(struct Shortlist *list, uint64_t now,
+                             uint64_t *out_next_stall) {
+  size_t active = 0;
+  *out_next_stall = UINT64_MAX;
+
+  for (size_t i = 0; i < list->count; i++) {
+    struct Candidate *candidate = shortlist_get(list, i);
+
+    if (candidate->state != CANDIDATE_IN_FLIGHT)
+      continue;
+
+    if (now >= candidate->stall_at) {
+      candidate->state = CANDIDATE_STALLED;
+      continue;
+    }
+
+    active++;
+    if (candidate->stall_at < *out_next_stall)
+      *out_next_stall = candidate->stall_at;
+  }
+
+  return active;
+}
+
+/**
+ * @brief Stores a key-value pair found by a lookup on the closest peer that
+ * answered it without the value, as Kademlia caches values along the path
+ * to them. Later lookups passing by stop there, a popular key spreads
+ * towards its requesters. The STORE goes over TCP like every STORE. Its
+ * connection and acknowledgement get CACHE_STORE_TIMEOUT_MS at most, so a
+ * download doesn't wait for a slow peer, and an acknowledged STORE leaves its
+ * connection to the pool
+ *
+ * @param list The candidates of the lookup
+ * @param holder The candidate that returned the value
+ * @param value The key-value pair
+ * @param calls The call table of the lookup
+ */
+static void cache_on_path(struct Shortlist *list,
+                          const struct Candidate *holder,
+                          const struct RPCKeyValue *value,
+                          struct CallTable *calls) {
+  for (size_t i = 0; i < list->count; i++) {
+    struct Candidate *candidate = shortlist_get(list, i);
+
+    if (candidate == holder || candidate->state != CANDIDATE_ANSWERED)
+      continue;
+
+    struct RPCStore req = {
+        .header = {.magic_number = RPC_MAGIC,
+                   .version = RPC_VERSION,
+                   .packet_size = sizeof(struct RPCStore),
+                   .call_type = STORE},
+        .key_value = *value,
+        .cached = true};
+
+    log_msg(LOG_DEBUG, "Caching the value on the peer with port %d",
+            ntohs(candidate->peer.peer_addr.sin_port));
+
+    uint64_t deadline = timer_now_ms() + CACHE_STORE_TIMEOUT_MS;
+
+    // Connecting ahead puts the connection in the pool, the STORE takes it
+    // from there instead of connecting with the default timeout
+    bool reachable;
+    pool_connect(&candidate->peer.peer_addr, 1, &reachable,
+                 CACHE_STORE_TIMEOUT_MS);
+    if (!reachable)
+      return;
+
+    struct Call *store = call_start(calls, &candidate->peer.peer_addr, &req,
+                                    sizeof(req), false, NULL);
+
+    // Calls of the lookup still in flight may complete first, they are
+    // dropped
+    while (store && timer_now_ms() < deadline) {
+      struct Call *call =
+          call_wait_timeout(calls, (int)(deadline - timer_now_ms()));
+      if (!call)
+        break;
+
+      if (call == store) {
+        if (call->state != CALL_DONE)
+          log_msg(LOG_DEBUG, "The cached copy wasn't acknowledged");
+
+        store = NULL;
+      }
+
+      call_finish(calls, call);
+    }
+
+    return;
+  }
+}
+
 /**
  * @brief Iterative network traversal to search for the closest peers to a
  * target key
  *
+ * Up to LOOKUP_ALPHA RPCs are in flight at once, always to the closest
+ * candidates not asked yet. Each response refills the window, so a slow or
+ * dead peer only holds one of its slots. The lookup ends once the max_peers
+ * closest candidates that didn't fail have all answered.
+ *
  * @param target_key The key to find the closest peers to
  * @param out_peers Points to a vector that will store the most suitable peers
  * @param max_peers How many peers should be returned at most
@@ -198,397 +538,1260 @@ static int iterative_find_peers(const HashID target_key,
     return -1;
   }
 
-  VectorPtr pending;
-  vector_init(&pending);
-  VectorPtr contacted;
-  vector_init(&contacted);
+  struct Shortlist *list = malloc(sizeof(struct Shortlist));
+  pointer_not_null(list, "iterative_find_peers malloc error");
+  shortlist_init(list, target_key);
 
-  // Find the closest potential peers among those we already know of
+  // Start from the closest peers among those we already know of
+  pthread_rwlock_rdlock(&buckets_lock);
   struct Peer **initial = find_closest_peers(buckets, target_key, K_VALUE);
   if (initial) {
-    for (int i = 0; i < K_VALUE && initial[i]; i++) {
-      // Always make a copy to avoid issues with freeing everything later on
-      struct Peer *copy = malloc(sizeof(struct Peer));
-      pointer_not_null(copy, "iterative_find_peers malloc error");
-
-      memcpy(copy, initial[i], sizeof(struct Peer));
-      vector_push(&pending, copy);
-
-      // Initially not contacted
-      bool *c = calloc(1, sizeof(bool));
-      vector_push(&contacted, c);
-    }
+    for (int i = 0; i < K_VALUE && initial[i]; i++)
+      shortlist_add(list, initial[i]);
     free(initial);
   }
+  pthread_rwlock_unlock(&buckets_lock);
 
-  bool done = false;
-  bool value_found = false;
-
-  // Iterative lookup loop to traverse the network
-  while (!done && (!find_value || !value_found)) {
-    bool any_new_contact = false;
-
-    for (size_t i = 0; i < pending.size; i++) {
-      bool *c = (bool *)vector_get(&contacted, i);
-      struct Peer *p = (struct Peer *)vector_get(&pending, i);
+  struct CallTable calls;
+  if (call_table_init(&calls) != 0) {
+    free(list);
+    return -1;
+  }
 
-      // No peer information or already contacted
-      if (!p || *c)
+  size_t alpha = lookup_alpha();
+  bool value_found = false;
+  struct RPCKeyValue found_value;
+  const struct Candidate *holder = NULL;
+  size_t rpcs = 0;
+  unsigned hops = 0;
+
+  for (size_t i = 0; i < list->count; i++)
+    shortlist_get(list, i)->hops = 1;
+
+  // Iterative lookup loop to traverse the network. It converges once the
+  // closest candidates that respond have all answered: a response that
+  // brings no closer peer starts no new RPC
+  while (!value_found) {
+    uint64_t now = timer_now_ms();
+    uint64_t next_stall;
+
+    // A stalled RPC frees its place in the window and its candidate no longer
+    // counts towards the closest ones, so a dead peer doesn't hold the
+    // lookup. Its response is still used if it arrives
+    size_t active = update_stalled(list, now, &next_stall);
+
+    // Ask the closest candidates not asked yet, as long as the window has
+    // room. Failed candidates don't count towards the closest ones
+    size_t live = 0;
+    for (size_t i = 0; i < list->count && live < max_peers; i++) {
+      struct Candidate *candidate = shortlist_get(list, i);
+
+      if (candidate->state == CANDIDATE_FAILED ||
+          candidate->state == CANDIDATE_STALLED)
         continue;
 
-      *c = true;
-      any_new_contact = true;
+      live++;
 
-      // Try contacting this peer to get their closest known peers to our target
-      int sock = connect_to_peer(&p->peer_addr);
-      if (sock < 0)
+      if (candidate->state != CANDIDATE_NEW || active >= alpha)
         continue;
 
       struct RPCFind req = {
           .header = {.magic_number = RPC_MAGIC,
+                     .version = RPC_VERSION,
                      .call_type = find_value ? FIND_VALUE : FIND_NODE,
                      .packet_size = sizeof(struct RPCFind)}};
 
       memcpy(req.key, target_key, sizeof(HashID));
-      send_all(sock, &req, sizeof(req));
-
-      // Make sure we receive a valid RPC packet back
-      char peek_buf[4] = {0};
-      if (recv_all_peek(sock, peek_buf, sizeof(peek_buf)) <= 0 ||
-          memcmp(peek_buf, RPC_MAGIC, 4) != 0) {
-        close(sock);
-        continue;
-      }
 
-      // Get the entire response contents
-      char buf[MAX_RPC_PACKET_SIZE];
-      size_t packet_size = 0;
-      if (get_rpc_request(&(struct pollfd){.fd = sock}, buf, &packet_size) !=
-          0) {
-        close(sock);
+      // Ask this peer for their closest known peers to our target, over UDP
+      // unless it refuses datagrams
+      if (!call_start(&calls, &candidate->peer.peer_addr, &req, sizeof(req),
+                      true, candidate)) {
+        candidate->state = CANDIDATE_FAILED;
         continue;
       }
 
-      struct RPCMessageHeader *header = (struct RPCMessageHeader *)buf;
-
-      // Handle FIND_VALUE response (for downloads)
-      if (find_value && header->call_type == FIND_VALUE_RESPONSE) {
-        struct RPCFindValueResponse *resp = (struct RPCFindValueResponse *)buf;
-
-        // Peer gave us the value we were looking for
-        if (resp->found_key) {
-          log_msg(LOG_DEBUG, "iterative_find_peers: Found value during lookup");
-          struct KeyValuePair kvp;
-          deserialize_rpc_value(&resp->values, &kvp);
-
-          for (int j = 0; j < kvp.num_values && j < max_peers; j++) {
-            out_peers[j] = malloc(sizeof(struct Peer));
-            memcpy(out_peers[j], &kvp.values[j], sizeof(struct Peer));
-          }
-
-          // Free all remaining peers in pending to avoid leaks
-          // This is also super ugly, theres gotta be a better way
-          for (size_t i = 0; i < pending.size; i++) {
-            struct Peer *p = vector_get(&pending, i);
-            // Skip peers we just moved to out_peers
-            bool skip = false;
-            for (int j = 0; j < kvp.num_values && j < max_peers; j++) {
-              if (p == out_peers[j]) {
-                skip = true;
-                break;
-              }
-            }
-            if (!skip)
-              free(p);
-          }
-
-          value_found = true;
-          break;
-        } else {
-          // They didn't have the key-value pair, get their closest neighbors
-          // instead
-          for (int j = 0; j < resp->num_closest; j++) {
-            struct Peer *new_peer = malloc(sizeof(struct Peer));
-            deserialize_rpc_peer(&resp->closest[j], new_peer);
-            // Update our own neighbor lists
-            update_bucket_peers(buckets, new_peer);
-
-            bool exists = false;
-            // Check that we didn't already store this peer in our list
-            for (size_t s = 0; s < pending.size; s++) {
-              struct Peer *q = (struct Peer *)vector_get(&pending, s);
-              if (memcmp(&q->peer_id, &new_peer->peer_id, sizeof(HashID)) ==
-                  0) {
-                exists = true;
-                break;
-              }
-            }
-            // Add it to our list of peers to contact
-            if (!exists) {
-              vector_push(&pending, new_peer);
-              bool *new_c = calloc(1, sizeof(bool));
-              vector_push(&contacted, new_c);
-            } else {
-              free(new_peer);
-            }
-          }
-        }
-      }
-
-      // Handle FIND_NODE response (for uploads)
-      if (!find_value && header->call_type == FIND_NODE_RESPONSE) {
-        struct RPCFindNodeResponse *resp = (struct RPCFindNodeResponse *)buf;
-        for (int j = 0; j < resp->num_closest; j++) {
-          struct Peer *new_peer = malloc(sizeof(struct Peer));
-          deserialize_rpc_peer(&resp->closest[j], new_peer);
-          // Update our own neighbor lists
-          update_bucket_peers(buckets, new_peer);
-
-          bool exists = false;
-          for (size_t s = 0; s < pending.size; s++) {
-            struct Peer *q = (struct Peer *)vector_get(&pending, s);
-            if (memcmp(&q->peer_id, &new_peer->peer_id, sizeof(HashID)) == 0) {
-              exists = true;
-              break;
-            }
-          }
-          if (!exists) {
-            vector_push(&pending, new_peer);
-            bool *new_c = calloc(1, sizeof(bool));
-            vector_push(&contacted, new_c);
-          } else {
-            free(new_peer);
-          }
-        }
-      }
+      candidate->state = CANDIDATE_IN_FLIGHT;
+      candidate->stall_at = now + LOOKUP_STALL_MS;
+      if (candidate->stall_at < next_stall)
+        next_stall = candidate->stall_at;
 
-      close(sock);
+      active++;
+      rpcs++;
+    }
 
-      if (value_found)
+    // Without RPCs in flight, the closest live candidates have all answered.
+    // If they are too few, the stalled RPCs are waited for, they may bring
+    // the missing ones
+    if (active == 0 && (calls.pending == 0 || live >= max_peers))
+      break;
+
+    int timeout = active > 0 ? (int)(next_stall - now) : -1;
+    struct Call *call = call_wait_timeout(&calls, timeout);
+    if (!call) {
+      // Without a timeout, only a failure of the wait returns nothing
+      if (active == 0)
         break;
+      continue;
     }
 
-    if (!any_new_contact || pending.size >= max_peers)
-      done = true;
-  }
+    struct Candidate *candidate = call->user;
 
-  // In case of FIND_NODE, we sort all the peers we contacted and return the
-  // closest ones encountered
-  if (!find_value) {
-    log_msg(LOG_DEBUG, "Before sort peers:");
+    if (call->state != CALL_DONE) {
+      candidate->state = CANDIDATE_FAILED;
+      call_finish(&calls, call);
+      continue;
+    }
 
-    for (int i = 0; i < pending.size; i++) {
-      struct Peer *p = vector_get(&pending, i);
-      char buf[65] = {0};
-      sha256_to_hex(p->peer_id, buf);
+    candidate->state = CANDIDATE_ANSWERED;
 
-      log_msg(LOG_DEBUG, "pending[%d]->peer_id = %s", i, buf);
-    }
+    char *buf = call->response;
+    struct RPCMessageHeader *header = (struct RPCMessageHeader *)buf;
 
-    vector_sort(&pending, peer_distance_cmp, target_key);
+    // Handle FIND_VALUE response (for downloads)
+    if (find_value && header->call_type == FIND_VALUE_RESPONSE) {
+      struct RPCFindValueResponse *resp = (struct RPCFindValueResponse *)buf;
 
-    log_msg(LOG_DEBUG, "After sort peers:");
-    for (int i = 0; i < pending.size; i++) {
-      struct Peer *p = vector_get(&pending, i);
-      char buf[65] = {0};
-      sha256_to_hex(p->peer_id, buf);
+      // Peer gave us the value we were looking for
+      if (resp->found_key) {
+        log_msg(LOG_DEBUG, "iterative_find_peers: Found value during lookup");
+        struct KeyValuePair kvp;
+        deserialize_rpc_value(&resp->values, &kvp);
 
-      log_msg(LOG_DEBUG, "pending[%d]->peer_id = %s", i, buf);
-    }
+        for (int j = 0; j < kvp.num_values && j < max_peers; j++) {
+          out_peers[j] = malloc(sizeof(struct Peer));
+          pointer_not_null(out_peers[j], "iterative_find_peers malloc error");
+          memcpy(out_peers[j], &kvp.values[j], sizeof(struct Peer));
+        }
 
-    // Fill out_peers with the K closest ones
-    size_t count = (pending.size < max_peers) ? pending.size : max_peers;
-    for (size_t i = 0; i < count; i++) {
-      out_peers[i] = (struct Peer *)vector_get(&pending, i);
+        value_found = true;
+        found_value = resp->values;
+        holder = candidate;
+        hops = candidate->hops;
+      } else {
+        // They didn't have the key-value pair, get their closest neighbors
+        // instead
+        add_candidates(list, resp->closest, resp->num_closest,
+                       candidate->hops + 1);
+      }
     }
 
-    for (size_t i = count; i < pending.size; i++) {
-      struct Peer *p = vector_get(&pending, i);
-      free(p);
+    // Handle FIND_NODE response (for uploads)
+    if (!find_value && header->call_type == FIND_NODE_RESPONSE) {
+      struct RPCFindNodeResponse *resp = (struct RPCFindNodeResponse *)buf;
+      add_candidates(list, resp->closest, resp->num_closest,
+                     candidate->hops + 1);
     }
-  }
 
-  // Caller becomes responsible for freeing the contents
-  vector_free(&pending, false);
-  vector_free(&contacted, true);
+    call_finish(&calls, call);
+  }
 
-  return (find_value && !value_found) ? -1 : 0;
-}
+  // Without the value, the path to the closest peer that answered is the
+  // length of the lookup
+  for (size_t i = 0; i < list->count && !value_found; i++) {
+    struct Candidate *candidate = shortlist_get(list, i);
 
-void handle_rpc_request(const struct pollfd *sock, char *contents,
-                        size_t length) {
-  size_t expected_size = 0;
+    if (candidate->state == CANDIDATE_ANSWERED) {
+      hops = candidate->hops;
+      break;
+    }
+  }
 
-  struct RPCMessageHeader *header = (struct RPCMessageHeader *)contents;
+  log_msg(LOG_INFO, "Lookup %s after %zu RPCs and %u hops",
+          value_found ? "found the value" : "converged", rpcs, hops);
 
-  switch (header->call_type) {
-  case PING:
-    expected_size = sizeof(struct RPCPing);
-    break;
-  case STORE:
-    expected_size = sizeof(struct RPCStore);
-    break;
-  case FIND_NODE:
-    expected_size = sizeof(struct RPCFind);
-    break;
-  case FIND_VALUE:
-    expected_size = sizeof(struct RPCFind);
-    break;
-  case BROADCAST:
-    expected_size = sizeof(struct RPCBroadcast);
-    break;
+  if (value_found)
+    cache_on_path(list, holder, &found_value, &calls);
 
-  case PING_RESPONSE:
-  case STORE_RESPONSE:
-  case FIND_NODE_RESPONSE:
-  case FIND_VALUE_RESPONSE:
-    log_msg(LOG_WARN, "Received a response packet without prior communication");
-    break;
+  // In case of FIND_NODE, return the closest peers that answered
+  if (!find_value) {
+    size_t count = 0;
+    for (size_t i = 0; i < list->count && count < max_peers; i++) {
+      struct Candidate *candidate = shortlist_get(list, i);
 
-  default:
-    log_msg(LOG_ERROR, "Got invalid RPC request!");
-    return;
-  }
+      char buf[65] = {0};
+      sha256_to_hex(candidate->peer.peer_id, buf);
+      log_msg(LOG_DEBUG, "candidate[%zu]->peer_id = %s, state %d", i, buf,
+              candidate->state);
 
-  // log_msg(LOG_DEBUG, "Claimed size is: %d - Expected size is: %ld",
-  // header->packet_size, expected_size);
+      if (candidate->state != CANDIDATE_ANSWERED)
+        continue;
 
-  if (header->packet_size != expected_size) {
-    log_msg(LOG_ERROR,
-            "Claimed size doesn't match expected, discarding packet!");
-    return;
+      out_peers[count] = malloc(sizeof(struct Peer));
+      pointer_not_null(out_peers[count], "iterative_find_peers malloc error");
+      memcpy(out_peers[count++], &candidate->peer, sizeof(struct Peer));
+    }
   }
 
-  switch (header->call_type) {
-  case PING:
-    handle_ping(sock, (struct RPCPing *)contents);
-    break;
-  case STORE:
-    handle_store(sock, (struct RPCStore *)contents);
-    break;
-  case FIND_NODE:
-    handle_find_node(sock, (struct RPCFind *)contents);
-    break;
-  case FIND_VALUE:
-    handle_find_value(sock, (struct RPCFind *)contents);
-    break;
-  case BROADCAST:
-    handle_broadcast(sock, (struct RPCBroadcast *)contents);
-    break;
+  // Calls still in flight are abandoned, they point into the shortlist
+  call_table_free(&calls);
+  free(list);
 
-  default:
-    break;
-  }
+  return (find_value && !value_found) ? -1 : 0;
 }
 
-int handle_rpc_upload(struct FileMagnet *file) {
-  log_msg(LOG_DEBUG, "Start handling RPC upload");
-
-  if (!file) {
-    log_msg(LOG_ERROR, "handle_rpc_upload got NULL file");
-    return -1;
+/**
+ * @brief Copies peers into a vector of peers, like a lookup returns them
+ *
+ * @param out_peers Points to a vector that will store the copies
+ * @param peers The peers to copy
+ * @param count The number of peers
+ */
+static void copy_peers(struct Peer **out_peers, const struct Peer *peers,
+                       size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out_peers[i] = malloc(sizeof(struct Peer));
+    pointer_not_null(out_peers[i], "copy_peers malloc error");
+    memcpy(out_peers[i], &peers[i], sizeof(struct Peer));
   }
+}
 
-  struct KeyValuePair kv = {.key = {0}, .num_values = 1};
-  memcpy(kv.key, file->file_hash, sizeof(HashID));
-  // Create peer with our info in the KeyValuePair
-  create_own_peer(&kv.values[0]);
+/**
+ * @brief Finds the closest peers to a target, or the peers providing it,
+ * without traversing the network if a recent lookup already found them or
+ * another thread is looking for them already
+ *
+ * @param target_key The key to find the closest peers to
+ * @param out_peers Points to a vector that will store the most suitable peers
+ * @param max_peers How many peers should be returned at most
+ * @param find_value FIND_VALUE or FIND_NODE RPC requests
+ * @return int Returns 0 if the search was successful, a negative number
+ * otherwise
+ */
+static int find_peers(const HashID target_key, struct Peer **out_peers,
+                      size_t max_peers, bool find_value) {
+  enum LookupKind kind = find_value ? LOOKUP_PROVIDERS : LOOKUP_CLOSEST;
 
-  kv.values[0].peer_addr.sin_port = htons(SERVER_PORT);
-  storage_put_value(&kv);
+  struct Peer cached[K_VALUE];
+  size_t max_cached = max_peers < K_VALUE ? max_peers : K_VALUE;
+  size_t count = lookup_cache_get(target_key, kind, cached, max_cached);
 
-  struct Peer *out_peers[K_VALUE] = {0};
-  int found = iterative_find_peers(file->file_hash, out_peers, K_VALUE, false);
-  if (found != 0) {
-    log_msg(LOG_WARN,
-            "handle_rpc_upload: no peers available for STORE propagation");
-    return -1;
-  }
+  if (count > 0) {
+    log_msg(LOG_INFO, "Lookup answered from the cache with %zu peers", count);
 
-  char full_path[512] = {0};
-  snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR,
-           file->display_name);
+    copy_peers(out_peers, cached, count);
 
-  FILE *file_handle = fopen(full_path, "r");
-  if (file_handle == NULL) {
-    log_msg(LOG_ERROR,
-            "File does not exist at path '%s'! The uploaded file should have "
-            "been copied there beforehand.\n",
-            full_path);
-    return -1;
+    return 0;
   }
 
-  // Get size, allocate memory and read contents into the buffer
-  fseek(file_handle, 0, SEEK_END);
-  long file_size = ftell(file_handle);
-  fseek(file_handle, 0, SEEK_SET);
+  // Another thread looking for the same target sends the same RPCs to the
+  // same peers, its result is shared instead
+  struct LookupFlight *flight;
+  int ret;
 
-  void *file_contents = malloc(file_size);
+  if (!lookup_flight_join(target_key, kind, &flight, cached, max_cached,
+                          &count, &ret)) {
+    log_msg(LOG_INFO, "Lookup joined the one in flight, %zu peers", count);
 
-  fread(file_contents, file_size, 1, file_handle);
-  fclose(file_handle);
+    copy_peers(out_peers, cached, count);
+
+    return ret;
+  }
+
+  ret = iterative_find_peers(target_key, out_peers, max_peers, find_value);
+  if (ret == 0)
+    lookup_cache_put(target_key, kind, out_peers, max_peers);
+
+  lookup_flight_end(flight, ret, out_peers, max_peers);
+
+  return ret;
+}
+
+/**
+ * @brief A key of a batched lookup
+ *
+ */
+struct BatchKey {
+  struct Shortlist list;
+
+  /**
+   * @brief Whether the lookup of the key ended, with the value or once its
+   * closest candidates all answered
+   *
+   */
+  bool done;
+
+  bool found;
+  struct RPCKeyValue value;
+};
+
+/**
+ * @brief What a batched lookup learned about a peer it asked
+ *
+ */
+struct BatchPeer {
+  struct sockaddr_in addr;
+
+  /**
+   * @brief The peer couldn't be reached or was too slow, it isn't asked for
+   * the other keys it is a candidate for
+   *
+   */
+  bool failed;
+
+  /**
+   * @brief The peer doesn't take batched requests, it is asked for one key
+   * at a time
+   *
+   */
+  bool legacy;
+};
+
+/**
+ * @brief A key to send to a peer, in a batched lookup or a batched STORE
+ *
+ */
+struct BatchEntry {
+  struct sockaddr_in addr;
+
+  /**
+   * @brief The index of the key, or of the key-value pair to store
+   *
+   */
+  size_t key;
+
+  /**
+   * @brief For lookups, the candidate of the key the peer is
+   *
+   */
+  struct Candidate *candidate;
+
+  /**
+   * @brief Whether the key is sent in a request of its own, or batched with
+   * the other keys of the peer
+   *
+   */
+  bool single;
+};
+
+/**
+ * @brief A request of a round of a batched lookup, for one or many keys of
+ * a peer
+ *
+ */
+struct BatchCall {
+  struct sockaddr_in addr;
+  size_t count;
+  size_t keys[RPC_BATCH_MAX];
+  struct Candidate *candidates[RPC_BATCH_MAX];
+
+  /**
+   * @brief Whether the request completed, those that didn't by the end of
+   * their round are given up on
+   *
+   */
+  bool completed;
+};
+
+/**
+ * @brief The lookups of many keys, run together in rounds
+ *
+ */
+struct BatchLookup {
+  struct BatchKey *keys;
+  size_t count;
+  bool find_value;
+  size_t alpha;
+
+  /**
+   * @brief The peers asked so far, struct BatchPeer indexed by address
+   *
+   */
+  struct hashmap *peers;
+
+  /**
+   * @brief When the requests of the current round still pending are given up
+   * on, UINT64_MAX until the first response of the round arrived
+   *
+   */
+  uint64_t stall_at;
+
+  size_t rpcs;
+  size_t rounds;
+};
+
+static int compare_addrs(const struct sockaddr_in *a,
+                         const struct sockaddr_in *b) {
+  if (a->sin_addr.s_addr != b->sin_addr.s_addr)
+    return a->sin_addr.s_addr < b->sin_addr.s_addr ? -1 : 1;
+
+  return (int)a->sin_port - (int)b->sin_port;
+}
+
+static int batch_peer_compare(const void *a, const void *b, void *udata) {
+  return compare_addrs(&((const struct BatchPeer *)a)->addr,
+                       &((const struct BatchPeer *)b)->addr);
+}
+
+static uint64_t batch_peer_hash(const void *item, uint64_t seed0,
+                                uint64_t seed1) {
+  const struct BatchPeer *peer = item;
+  uint64_t addr = ((uint64_t)peer->addr.sin_addr.s_addr << 16) |
+                  peer->addr.sin_port;
+
+  return hashmap_sip(&addr, sizeof(addr), seed0, seed1);
+}
+
+/**
+ * @brief Orders entries by peer, the entries of a peer keep their order
+ *
+ */
+static int compare_entries(const void *a, const void *b) {
+  const struct BatchEntry *ea = a;
+  const struct BatchEntry *eb = b;
+
+  int order = compare_addrs(&ea->addr, &eb->addr);
+  if (order != 0)
+    return order;
+
+  return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+/**
+ * @brief Gets the number of consecutive entries sent to the same peer
+ *
+ * @param entries The entries, sorted by peer
+ * @param count The number of entries
+ * @param start The index of the first entry of the peer
+ * @return size_t Returns the number of entries of the peer
+ */
+static size_t peer_run(const struct BatchEntry *entries, size_t count,
+                       size_t start) {
+  size_t end = start + 1;
+
+  while (end < count &&
+         compare_addrs(&entries[start].addr, &entries[end].addr) == 0)
+    end++;
+
+  return end - start;
+}
+
+/**
+ * @brief Gets what a batched lookup learned about a peer
+ *
+ * @param lookup The batched lookup
+ * @param addr The address of the peer
+ * @return struct BatchPeer Returns a copy of the peer, only its address is
+ * set if it wasn't asked yet
+ */
+static struct BatchPeer get_batch_peer(const struct BatchLookup *lookup,
+                                       const struct sockaddr_in *addr) {
+  struct BatchPeer peer = {.addr = *addr};
+
+  const struct BatchPeer *known = hashmap_get(lookup->peers, &peer);
+  return known ? *known : peer;
+}
+
+/**
+ * @brief Picks the candidates to ask in the next round, the closest ones not
+ * asked yet of each key, and ends the lookups of the keys without any
+ *
+ * @param lookup The batched lookup
+ * @param out_entries A pointer to memory where the keys to ask the peers for
+ * will be stored, with room for alpha entries per key
+ * @return size_t Returns the number of entries stored
+ */
+static size_t select_candidates(struct BatchLookup *lookup,
+                                struct BatchEntry *out_entries) {
+  size_t count = 0;
+
+  for (size_t k = 0; k < lookup->count; k++) {
+    struct BatchKey *key = &lookup->keys[k];
+
+    if (key->done)
+      continue;
+
+    size_t live = 0;
+    size_t asked = 0;
+
+    for (size_t i = 0; i < key->list.count && live < K_VALUE; i++) {
+      struct Candidate *candidate = shortlist_get(&key->list, i);
+
+      if (candidate->state == CANDIDATE_NEW &&
+          get_batch_peer(lookup, &candidate->peer.peer_addr).failed)
+        candidate->state = CANDIDATE_FAILED;
+
+      if (candidate->state == CANDIDATE_FAILED)
+        continue;
+
+      live++;
+
+      if (candidate->state != CANDIDATE_NEW || asked >= lookup->alpha)
+        continue;
+
+      candidate->state = CANDIDATE_IN_FLIGHT;
+      out_entries[count++] = (struct BatchEntry){
+          .addr = candidate->peer.peer_addr, .key = k, .candidate = candidate};
+      asked++;
+    }
+
+    // Without new candidates, the closest live ones all answered
+    if (asked == 0)
+      key->done = true;
+  }
+
+  return count;
+}
+
+/**
+ * @brief Uses the response to a request of a batched lookup
+ *
+ * @param lookup The batched lookup
+ * @param call The completed call, its user data is its struct BatchCall
+ */
+static void handle_batch_call(struct BatchLookup *lookup, struct Call *call) {
+  struct BatchCall *batch = call->user;
+  enum RPCCallType type =
+      ((const struct RPCMessageHeader *)call->request)->call_type;
+
+  batch->completed = true;
+
+  const struct RPCFindValueMultiResponse *multi =
+      (const struct RPCFindValueMultiResponse *)call->response;
+
+  if (call->state != CALL_DONE ||
+      (type == FIND_VALUE_MULTI && multi->num_results != batch->count)) {
+    struct BatchPeer peer = get_batch_peer(lookup, &call->addr);
+
+    // A request that can't be encoded for the peer is a batched one to a
+    // peer speaking only the older version, its keys are asked again one at
+    // a time in the next round
+    bool legacy = call->state == CALL_FAILED && call->error == EINVAL &&
+                  type == FIND_VALUE_MULTI;
+
+    if (legacy)
+      peer.legacy = true;
+    else
+      peer.failed = true;
+
+    hashmap_set(lookup->peers, &peer);
+
+    for (size_t i = 0; i < batch->count; i++)
+      batch->candidates[i]->state = legacy ? CANDIDATE_NEW : CANDIDATE_FAILED;
+
+    return;
+  }
+
+  // The others get a little longer to answer than the first one did
+  if (lookup->stall_at == UINT64_MAX)
+    lookup->stall_at = timer_now_ms() + LOOKUP_STALL_MS;
+
+  for (size_t i = 0; i < batch->count; i++) {
+    struct BatchKey *key = &lookup->keys[batch->keys[i]];
+    struct Candidate *candidate = batch->candidates[i];
+    const struct RPCKeyValue *value = NULL;
+    const struct RPCPeer *closest;
+    size_t num_closest;
+
+    if (type == FIND_VALUE_MULTI) {
+      const struct RPCValueResult *result = &multi->results[i];
+
+      if (result->found_key)
+        value = &result->values;
+      closest = result->closest;
+      num_closest = result->num_closest;
+    } else if (type == FIND_VALUE) {
+      const struct RPCFindValueResponse *response =
+          (const struct RPCFindValueResponse *)call->response;
+
+      if (response->found_key)
+        value = &response->values;
+      closest = response->closest;
+      num_closest = response->num_closest;
+    } else {
+      const struct RPCFindNodeResponse *response =
+          (const struct RPCFindNodeResponse *)call->response;
+
+      closest = response->closest;
+      num_closest = response->num_closest;
+    }
+
+    candidate->state = CANDIDATE_ANSWERED;
+
+    if (lookup->find_value && value && !key->found &&
+        memcmp(value->key, key->list.target, sizeof(HashID)) == 0) {
+      key->found = true;
+      key->done = true;
+      key->value = *value;
+    }
+
+    add_candidates(&key->list, closest, num_closest, candidate->hops + 1);
+  }
+}
+
+/**
+ * @brief Waits for a call of a round and uses its response
+ *
+ * @param lookup The batched lookup
+ * @param calls The call table of the round
+ * @param timeout_ms How long to wait at most in milliseconds, -1 to wait
+ * until a call completes
+ * @return true A call completed
+ * @return false No call completed in time or none is pending
+ */
+static bool handle_next_batch_call(struct BatchLookup *lookup,
+                                   struct CallTable *calls, int timeout_ms) {
+  struct Call *call = call_wait_timeout(calls, timeout_ms);
+  if (!call)
+    return false;
+
+  handle_batch_call(lookup, call);
+  call_finish(calls, call);
+
+  return true;
+}
+
+/**
+ * @brief Sends a request of a round, for one key or many keys of a peer
+ *
+ * @param lookup The batched lookup
+ * @param calls The call table of the round
+ * @param entries The entries of the keys, all to the same peer
+ * @param count The number of entries, at most RPC_BATCH_MAX, 1 for a single
+ * entry
+ * @param batch A pointer to memory where the request will be tracked
+ */
+static void send_batch_call(struct BatchLookup *lookup,
+                            struct CallTable *calls,
+                            const struct BatchEntry *entries, size_t count,
+                            struct BatchCall *batch) {
+  batch->addr = entries[0].addr;
+  batch->count = count;
+  batch->completed = false;
+
+  for (size_t i = 0; i < count; i++) {
+    batch->keys[i] = entries[i].key;
+    batch->candidates[i] = entries[i].candidate;
+  }
+
+  // Every slot of the table may be taken
+  while (calls->pending + calls->done_count >= CALL_MAX_PENDING &&
+         handle_next_batch_call(lookup, calls, -1))
+    ;
+
+  struct Call *call;
+
+  if (entries[0].single) {
+    struct RPCFind req = {
+        .header = {.magic_number = RPC_MAGIC,
+                   .version = RPC_VERSION,
+                   .call_type = lookup->find_value ? FIND_VALUE : FIND_NODE,
+                   .packet_size = sizeof(struct RPCFind)}};
+
+    memcpy(req.key, lookup->keys[entries[0].key].list.target, sizeof(HashID));
+
+    call = call_start(calls, &batch->addr, &req, sizeof(req), true, batch);
+  } else {
+    struct RPCFindMulti req = {
+        .header = {.magic_number = RPC_MAGIC,
+                   .version = RPC_VERSION,
+                   .call_type = FIND_VALUE_MULTI,
+                   .packet_size = sizeof(struct RPCFindMulti)},
+        .num_keys = count};
+
+    for (size_t i = 0; i < count; i++)
+      memcpy(req.keys[i], lookup->keys[entries[i].key].list.target,
+             sizeof(HashID));
+
+    call = call_start(calls, &batch->addr, &req, sizeof(req), false, batch);
+  }
+
+  if (!call) {
+    batch->completed = true;
+
+    for (size_t i = 0; i < count; i++)
+      batch->candidates[i]->state = CANDIDATE_FAILED;
+    return;
+  }
+
+  lookup->rpcs++;
+}
+
+/**
+ * @brief Runs a round of a batched lookup: each peer is asked for all the
+ * keys it was picked for at once. Peers asked for several keys get batched
+ * requests over TCP, connected to in parallel beforehand. The others get the
+ * usual lookup RPC over UDP
+ *
+ * @param lookup The batched lookup
+ * @param entries The keys to ask the peers for
+ * @param count The number of entries
+ */
+static void run_round(struct BatchLookup *lookup, struct BatchEntry *entries,
+                      size_t count) {
+  qsort(entries, count, sizeof(struct BatchEntry), compare_entries);
+
+  struct CallTable calls;
+  struct BatchCall *batches = malloc(count * sizeof(struct BatchCall));
+  pointer_not_null(batches, "run_round malloc error");
+
+  if (call_table_init(&calls) != 0) {
+    for (size_t i = 0; i < count; i++)
+      entries[i].candidate->state = CANDIDATE_FAILED;
+    free(batches);
+    return;
+  }
+
+  lookup->stall_at = UINT64_MAX;
+  lookup->rounds++;
+
+  size_t batch_count = 0;
+  size_t start = 0;
+
+  while (start < count) {
+    // Connect to as many peers as the pool keeps at once, then send them
+    // their requests
+    struct sockaddr_in addrs[POOL_MAX_IDLE];
+    bool reachable[POOL_MAX_IDLE];
+    size_t peer_count = 0;
+    size_t end = start;
+
+    while (end < count && peer_count < POOL_MAX_IDLE) {
+      size_t run = peer_run(entries, count, end);
+      bool single =
+          run == 1 || get_batch_peer(lookup, &entries[end].addr).legacy;
+
+      for (size_t i = end; i < end + run; i++)
+        entries[i].single = single;
+
+      if (!single)
+        addrs[peer_count++] = entries[end].addr;
+
+      end += run;
+    }
+
+    pool_connect(addrs, peer_count, reachable, CONNECT_TIMEOUT_MS);
+
+    size_t connected = 0;
+
+    for (size_t i = start; i < end;) {
+      size_t run = peer_run(entries, count, i);
+
+      if (!entries[i].single && !reachable[connected++]) {
+        struct BatchPeer peer = {.addr = entries[i].addr, .failed = true};
+        hashmap_set(lookup->peers, &peer);
+
+        for (size_t j = i; j < i + run; j++)
+          entries[j].candidate->state = CANDIDATE_FAILED;
+
+        i += run;
+        continue;
+      }
+
+      for (size_t j = i; j < i + run;) {
+        size_t batch = entries[i].single ? 1 : i + run - j;
+        if (batch > RPC_BATCH_MAX)
+          batch = RPC_BATCH_MAX;
+
+        send_batch_call(lookup, &calls, &entries[j], batch,
+                        &batches[batch_count++]);
+        j += batch;
+      }
+
+      i += run;
+    }
+
+    start = end;
+  }
+
+  // Once a peer answered, the others get LOOKUP_STALL_MS more
+  while (true) {
+    int timeout = -1;
+
+    if (lookup->stall_at != UINT64_MAX) {
+      uint64_t now = timer_now_ms();
+      if (now >= lookup->stall_at)
+        break;
+
+      timeout = (int)(lookup->stall_at - now);
+    }
+
+    if (!handle_next_batch_call(lookup, &calls, timeout) &&
+        (timeout < 0 || calls.pending == 0))
+      break;
+  }
+
+  // The peers that didn't answer in time aren't asked again, their requests
+  // are abandoned with the table
+  for (size_t i = 0; i < batch_count; i++) {
+    struct BatchCall *batch = &batches[i];
+
+    if (batch->completed)
+      continue;
+
+    struct BatchPeer peer = get_batch_peer(lookup, &batch->addr);
+    peer.failed = true;
+    hashmap_set(lookup->peers, &peer);
+
+    for (size_t j = 0; j < batch->count; j++)
+      batch->candidates[j]->state = CANDIDATE_FAILED;
+  }
+
+  call_table_free(&calls);
+  free(batches);
+}
+
+/**
+ * @brief Runs the lookups of a batch of keys together, round after round,
+ * until each of them found the value or converged
+ *
+ * @param lookup The batched lookup, its keys ready to be looked up
+ */
+static void run_batch_lookup(struct BatchLookup *lookup) {
+  struct BatchEntry *entries =
+      malloc(lookup->count * lookup->alpha * sizeof(struct BatchEntry));
+  pointer_not_null(entries, "run_batch_lookup malloc error");
+
+  size_t count;
+  while ((count = select_candidates(lookup, entries)) > 0)
+    run_round(lookup, entries, count);
+
+  free(entries);
+}
+
+/**
+ * @brief Copies the result of the lookup of a key of a batched lookup
+ *
+ * @param lookup The batched lookup
+ * @param key The key
+ * @param out_peers Points to a vector of K_VALUE entries that will store the
+ * peers providing the key, or the closest peers to it that answered
+ * @return size_t Returns the number of peers stored
+ */
+static size_t batch_key_result(const struct BatchLookup *lookup,
+                               struct BatchKey *key, struct Peer **out_peers) {
+  size_t count = 0;
+
+  if (lookup->find_value) {
+    if (!key->found)
+      return 0;
+
+    struct KeyValuePair kvp;
+    deserialize_rpc_value(&key->value, &kvp);
+
+    for (; count < kvp.num_values && count < K_VALUE; count++) {
+      out_peers[count] = malloc(sizeof(struct Peer));
+      pointer_not_null(out_peers[count], "batch_key_result malloc error");
+      memcpy(out_peers[count], &kvp.values[count], sizeof(struct Peer));
+    }
+
+    return count;
+  }
+
+  for (size_t i = 0; i < key->list.count && count < K_VALUE; i++) {
+    struct Candidate *candidate = shortlist_get(&key->list, i);
+
+    if (candidate->state != CANDIDATE_ANSWERED)
+      continue;
+
+    out_peers[count] = malloc(sizeof(struct Peer));
+    pointer_not_null(out_peers[count], "batch_key_result malloc error");
+    memcpy(out_peers[count++], &candidate->peer, sizeof(struct Peer));
+  }
+
+  return count;
+}
+
+/**
+ * @brief Finds the closest peers to many targets, or the peers providing
+ * them, like find_peers does for one. The results of recent lookups are
+ * reused, up to LOOKUP_BATCH_KEYS of the other keys are looked up together:
+ * each round, the candidates picked for every key are grouped by peer, and
+ * each peer is asked for all its keys in FIND_VALUE_MULTI requests. Unlike
+ * lookups of single keys, a round waits for its responses before the next
+ * one starts, so that keys are asked for together
+ *
+ * @param keys The keys to look up
+ * @param count The number of keys
+ * @param out_peers Points to a vector of count * K_VALUE entries, the peers
+ * found for each key are stored in its K_VALUE entries, left NULL if its
+ * lookup failed
+ * @param find_value FIND_VALUE or FIND_NODE lookups
+ */
+static void find_peers_many(const HashID *keys, size_t count,
+                            struct Peer **out_peers, bool find_value) {
+  enum LookupKind kind = find_value ? LOOKUP_PROVIDERS : LOOKUP_CLOSEST;
+
+  struct BatchLookup lookup = {.find_value = find_value,
+                               .alpha = lookup_alpha()};
+
+  lookup.keys = malloc(LOOKUP_BATCH_KEYS * sizeof(struct BatchKey));
+  pointer_not_null(lookup.keys, "find_peers_many malloc error");
+
+  size_t *index = malloc(LOOKUP_BATCH_KEYS * sizeof(size_t));
+  pointer_not_null(index, "find_peers_many malloc error");
+
+  size_t cached = 0;
+  size_t found = 0;
+  size_t next = 0;
+
+  while (next < count) {
+    lookup.count = 0;
+    lookup.rpcs = 0;
+    lookup.rounds = 0;
+    lookup.peers = hashmap_new(sizeof(struct BatchPeer), 0, 0, 0,
+                               batch_peer_hash, batch_peer_compare, NULL, NULL);
+    pointer_not_null(lookup.peers, "find_peers_many hashmap error");
+
+    // Keys looked up recently are answered from the cache
+    for (; next < count && lookup.count < LOOKUP_BATCH_KEYS; next++) {
+      struct Peer peers[K_VALUE];
+      size_t peer_count = lookup_cache_get(keys[next], kind, peers, K_VALUE);
+
+      if (peer_count > 0) {
+        copy_peers(&out_peers[next * K_VALUE], peers, peer_count);
+        cached++;
+        continue;
+      }
+
+      struct BatchKey *key = &lookup.keys[lookup.count];
+      shortlist_init(&key->list, keys[next]);
+      key->done = false;
+      key->found = false;
+
+      // Start from the closest peers among those we already know of
+      pthread_rwlock_rdlock(&buckets_lock);
+      struct Peer **initial = find_closest_peers(buckets, keys[next], K_VALUE);
+      if (initial) {
+        for (int i = 0; i < K_VALUE && initial[i]; i++)
+          shortlist_add(&key->list, initial[i]);
+        free(initial);
+      }
+      pthread_rwlock_unlock(&buckets_lock);
+
+      for (size_t i = 0; i < key->list.count; i++)
+        shortlist_get(&key->list, i)->hops = 1;
+
+      index[lookup.count++] = next;
+    }
+
+    run_batch_lookup(&lookup);
+
+    for (size_t i = 0; i < lookup.count; i++) {
+      struct Peer **peers = &out_peers[index[i] * K_VALUE];
+      size_t peer_count = batch_key_result(&lookup, &lookup.keys[i], peers);
+
+      if (peer_count > 0) {
+        lookup_cache_put(keys[index[i]], kind, peers, peer_count);
+        found++;
+      }
+    }
+
+    if (lookup.count > 0)
+      log_msg(LOG_INFO,
+              "Batched lookup of %zu keys after %zu RPCs in %zu rounds",
+              lookup.count, lookup.rpcs, lookup.rounds);
+
+    hashmap_free(lookup.peers);
+  }
+
+  log_msg(LOG_INFO, "Lookups of %zu keys: %zu from the cache, %zu %s",
+          count, cached, found, find_value ? "found" : "converged");
+
+  free(index);
+  free(lookup.keys);
+}
+
+void handle_rpc_request(struct Connection *conn, char *contents,
+                        size_t length) {
+  char message[MAX_RPC_MESSAGE_SIZE];
+
+  // Both versions of the protocol are decoded to the same structures, their
+  // sizes are checked there
+  if (wire_decode(contents, length, message, sizeof(message)) == 0) {
+    log_msg(LOG_ERROR, "Got invalid RPC request!");
+    return;
+  }
+
+  struct RPCMessageHeader *header = (struct RPCMessageHeader *)message;
+
+  switch (header->call_type) {
+  case PING:
+    handle_ping(conn, (struct RPCPing *)message);
+    break;
+  case STORE:
+    handle_store(conn, (struct RPCStore *)message);
+    break;
+  case FIND_NODE:
+    handle_find_node(conn, (struct RPCFind *)message);
+    break;
+  case FIND_VALUE:
+    handle_find_value(conn, (struct RPCFind *)message);
+    break;
+  case BROADCAST:
+    handle_broadcast(conn, (struct RPCBroadcast *)message);
+    break;
+  case STORE_MULTI:
+    handle_store_multi(conn, (struct RPCStoreMulti *)message);
+    break;
+  case FIND_VALUE_MULTI:
+    handle_find_value_multi(conn, (struct RPCFindMulti *)message);
+    break;
+
+  case PING_RESPONSE:
+  case STORE_RESPONSE:
+  case FIND_NODE_RESPONSE:
+  case FIND_VALUE_RESPONSE:
+  case STORE_MULTI_RESPONSE:
+  case FIND_VALUE_MULTI_RESPONSE:
+    log_msg(LOG_WARN, "Received a response packet without prior communication");
+    break;
+  }
+}
+
+/**
+ * @brief The replication of an uploaded file, followed as the uploads to the
+ * peers end
+ *
+ */
+struct Replication {
+  /**
+   * @brief The key-value pair, listing us and the replicas confirmed so far
+   *
+   */
+  struct KeyValuePair kv;
+
+  struct Peer *const *peers;
+
+  /**
+   * @brief The call table the STOREs are sent on, NULL to only build the
+   * key-value pair and leave the STOREs to the caller
+   *
+   */
+  struct CallTable *calls;
+
+  /**
+   * @brief How many providers the key-value pair listed when each peer was
+   * last sent its STORE, 0 if it wasn't sent one
+   *
+   */
+  size_t stored[K_VALUE];
+};
+
+/**
+ * @brief Sends the key-value pair as replicated so far to a peer
+ *
+ * @param replication The replication
+ * @param index The index of the peer
+ */
+static void send_store(struct Replication *replication, size_t index) {
+  struct Peer *peer = replication->peers[index];
 
-  // Prepare the STORE request
   struct RPCStore store_req = {
       .header = {.magic_number = RPC_MAGIC,
+                 .version = RPC_VERSION,
                  .packet_size = sizeof(struct RPCStore),
                  .call_type = STORE}};
+  serialize_rpc_value(&replication->kv, &store_req.key_value);
+
+  log_msg(LOG_DEBUG, "Sending store to closest peer %zu with port %d", index,
+          ntohs(peer->peer_addr.sin_port));
+
+  // The replication usually left a pooled connection to this peer
+  call_start(replication->calls, &peer->peer_addr, &store_req,
+             sizeof(store_req), false, peer);
+  replication->stored[index] = replication->kv.num_values;
+}
+
+/**
+ * @brief Called by upload_http_files as the upload of a replica ends
+ *
+ * @param index The index of the peer
+ * @param success Whether the peer confirmed the upload
+ * @param arg The replication
+ */
+static void on_replicated(size_t index, bool success, void *arg) {
+  struct Replication *replication = arg;
+  struct Peer *peer = replication->peers[index];
 
-  // Replicate at most K - 1 times since we already filled a slot with our info
+  if (!success) {
+    log_msg(LOG_ERROR, "Couldn't replicate file on remote peer");
+    lookup_cache_forget_peer(peer->peer_id);
+    return;
+  }
+
+  // We successfully replicated to this peer, add them to the key-value pair
+  struct KeyValuePair *kv = &replication->kv;
+  memcpy(&kv->values[kv->num_values], peer, sizeof(struct Peer));
+  kv->num_values++;
+
+  if (replication->calls)
+    send_store(replication, index);
+}
+
+/**
+ * @brief Uploads a file to the reachable ones of its closest peers at once
+ *
+ * @param file The file, in UPLOAD_DIR
+ * @param peers The closest peers to the file, K_VALUE entries
+ * @param reachable For each peer, whether a connection is ready
+ * @param replication The replication, the peers that confirmed their replica
+ * are added to its key-value pair
+ * @return int Returns 0 if the file could be read, -1 otherwise
+ */
+static int replicate_file(struct FileMagnet *file, struct Peer *const *peers,
+                          const bool *reachable,
+                          struct Replication *replication) {
+  char full_path[512] = {0};
+  snprintf(full_path, sizeof(full_path), "%s/%s", UPLOAD_DIR,
+           file->display_name);
+
+  int file_fd = open(full_path, O_RDONLY | O_CLOEXEC);
+  if (file_fd < 0) {
+    log_msg(LOG_ERROR,
+            "File does not exist at path '%s'! The uploaded file should have "
+            "been copied there beforehand.\n",
+            full_path);
+    return -1;
+  }
+
+  // The replicas are streamed from the file, memory use doesn't depend on
+  // its size
+  struct stat file_stat;
+  if (fstat(file_fd, &file_stat) != 0) {
+    log_msg(LOG_ERROR, "replicate_file: cannot stat '%s': %s", full_path,
+            strerror(errno));
+    close(file_fd);
+    return -1;
+  }
+
+  posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Replicate at most K - 1 times since we already filled a slot with our
+  // info. The replicas are uploaded at once, each one gets its STORE as soon
+  // as it is confirmed
+  struct Peer *replicas[K_VALUE - 1] = {0};
   for (int i = 0; i < K_VALUE - 1; i++) {
-    if (out_peers[i] == NULL)
+    if (peers[i] == NULL || !reachable[i])
       continue;
 
     log_msg(LOG_DEBUG, "Replicating file to closest peer %d with port %d", i,
-            ntohs(out_peers[i]->peer_addr.sin_port));
+            ntohs(peers[i]->peer_addr.sin_port));
+    replicas[i] = peers[i];
+  }
 
-    // We also do replication on these nodes
-    int res = upload_http_file(out_peers[i], file, file_contents, file_size);
+  upload_http_files(replicas, K_VALUE - 1, file, file_fd,
+                    (size_t)file_stat.st_size, on_replicated, replication);
+  close(file_fd);
 
-    if (res != 0) {
-      log_msg(LOG_ERROR, "Couldn't replicate file on remote peer");
-      continue;
-    }
+  return 0;
+}
 
-    // We successfully replicated to this peer, add them to the key-value pair
-    memcpy(&kv.values[kv.num_values], out_peers[i], sizeof(struct Peer));
-    kv.num_values++;
+int handle_rpc_upload(struct FileMagnet *file) {
+  log_msg(LOG_DEBUG, "Start handling RPC upload");
+
+  if (!file) {
+    log_msg(LOG_ERROR, "handle_rpc_upload got NULL file");
+    return -1;
   }
 
-  struct RPCKeyValue serialized_kv = {0};
-  serialize_rpc_value(&kv, &serialized_kv);
+  struct KeyValuePair kv = {.key = {0}, .num_values = 1};
+  memcpy(kv.key, file->file_hash, sizeof(HashID));
+  // Create peer with our info in the KeyValuePair
+  create_own_peer(&kv.values[0]);
 
-  memcpy(&store_req.key_value, &serialized_kv, sizeof(struct RPCKeyValue));
+  kv.values[0].peer_addr.sin_port = htons(SERVER_PORT);
+  storage_put_value(&kv, 0);
 
+  struct Peer *out_peers[K_VALUE] = {0};
+  int found = find_peers(file->file_hash, out_peers, K_VALUE, false);
+  if (found != 0) {
+    log_msg(LOG_WARN,
+            "handle_rpc_upload: no peers available for STORE propagation");
+    return -1;
+  }
+
+  bool reachable[K_VALUE];
+  connect_peers(out_peers, K_VALUE, reachable);
+  forget_unreachable(out_peers, K_VALUE, reachable);
+
+  struct CallTable calls;
+  if (call_table_init(&calls) != 0) {
+    free_peer_array(out_peers, K_VALUE);
+    return -1;
+  }
+
+  struct Replication replication = {
+      .kv = kv, .peers = out_peers, .calls = &calls, .stored = {0}};
+
+  if (replicate_file(file, out_peers, reachable, &replication) != 0) {
+    call_table_free(&calls);
+    free_peer_array(out_peers, K_VALUE);
+    return -1;
+  }
+
+  // The other peers get the key-value pair with every replica confirmed, and
+  // so do the replicas confirmed early, which merge it with the partial one
   for (int i = 0; i < K_VALUE; i++) {
-    if (out_peers[i] == NULL) {
-      log_msg(LOG_DEBUG, "Skipping NULL peer");
+    if (out_peers[i] == NULL || !reachable[i]) {
+      log_msg(LOG_DEBUG, "Skipping unreachable peer");
       continue;
     }
 
-    log_msg(LOG_DEBUG, "Sending store to closest peer %d with port %d", i,
-            ntohs(out_peers[i]->peer_addr.sin_port));
+    if (replication.stored[i] < replication.kv.num_values)
+      send_store(&replication, i);
+  }
 
-    int sock = connect_to_peer(&out_peers[i]->peer_addr);
-    if (sock < 0) {
-      log_msg(LOG_DEBUG, "Skipping because no connection");
-      continue;
+  // Every STORE is in flight at once, wait for their acknowledgements
+  struct Call *call;
+  while ((call = call_wait(&calls))) {
+    struct Peer *peer = call->user;
+    const struct RPCResponse *response =
+        (const struct RPCResponse *)call->response;
+
+    if (call->state != CALL_DONE ||
+        call->response_length < sizeof(struct RPCResponse) ||
+        !response->success) {
+      log_msg(LOG_WARN, "STORE wasn't acknowledged by peer with port %d",
+              ntohs(peer->peer_addr.sin_port));
+      lookup_cache_forget_peer(peer->peer_id);
     }
 
-    send_all(sock, &store_req, sizeof(store_req));
-
-    close(sock);
+    call_finish(&calls, call);
   }
 
+  call_table_free(&calls);
+
   log_msg(LOG_DEBUG,
           "handle_rpc_upload finished propagating file key to peers");
 
   free_peer_array(out_peers, K_VALUE);
-  free(file_contents);
 
   return 0;
 }
 
+/**
+ * @brief Downloads a file from the first of the peers providing it that
+ * serves it
+ *
+ * @param peers The peers providing the file, K_VALUE entries
+ * @param file The file
+ * @return int Returns 0 if the file was downloaded, -1 otherwise
+ */
+static int download_from_peers(struct Peer *const *peers,
+                               struct FileMagnet *file) {
+  bool reachable[K_VALUE];
+  connect_peers(peers, K_VALUE, reachable);
+  forget_unreachable(peers, K_VALUE, reachable);
+
+  for (int i = 0; i < K_VALUE; i++) {
+    log_msg(LOG_DEBUG, "Trying to download the file from peer %d in the KVP",
+            i);
+    if (!reachable[i])
+      continue;
+
+    if (download_http_file(peers[i], file) == 0)
+      return 0;
+
+    lookup_cache_forget_peer(peers[i]->peer_id);
+  }
+
+  log_msg(LOG_WARN,
+          "None of the owning peers were able to provide us the file");
+
+  return -1;
+}
+
 int handle_rpc_download(struct FileMagnet *file) {
   log_msg(LOG_DEBUG, "Start handling RPC download");
 
@@ -605,16 +1808,26 @@ int handle_rpc_download(struct FileMagnet *file) {
   }
 
   // First check local storage for the key-value pair
-  const struct KeyValuePair *local_kv = storage_get_value(file->file_hash);
-  if (local_kv) {
+  struct KeyValuePair local_kv;
+  if (storage_get_value(file->file_hash, &local_kv) == 0) {
     log_msg(LOG_DEBUG, "Key found locally, downloading from local peers");
-    for (int i = 0; i < local_kv->num_values; i++) {
-      if (compare_hashes(own_id, local_kv->values[i].peer_id) == 0) {
+    struct Peer *owners[K_VALUE] = {0};
+
+    for (size_t i = 0; i < local_kv.num_values; i++) {
+      if (compare_hashes(own_id, local_kv.values[i].peer_id) == 0) {
         log_msg(LOG_INFO, "We are already one of the peers owning this file, "
                           "no need to redownload");
         return 0;
       }
-      if (download_http_file(&local_kv->values[i], file) == 0)
+
+      owners[i] = &local_kv.values[i];
+    }
+
+    bool reachable[K_VALUE];
+    connect_peers(owners, local_kv.num_values, reachable);
+
+    for (size_t i = 0; i < local_kv.num_values; i++) {
+      if (reachable[i] && download_http_file(owners[i], file) == 0)
         return 0;
     }
 
@@ -623,26 +1836,361 @@ int handle_rpc_download(struct FileMagnet *file) {
   }
 
   struct Peer *out_peers[K_VALUE] = {0};
-  int value_found =
-      iterative_find_peers(file->file_hash, out_peers, K_VALUE, true);
+  int value_found = find_peers(file->file_hash, out_peers, K_VALUE, true);
 
   if (value_found < 0) {
     log_msg(LOG_WARN, "File not found on the network");
     return -1;
-  } else {
-    for (int i = 0; i < K_VALUE; i++) {
-      log_msg(LOG_DEBUG, "Trying to download the file from peer %d in the KVP",
-              i);
-      if (out_peers[i] && download_http_file(out_peers[i], file) == 0) {
-        free_peer_array(out_peers, K_VALUE);
-        return 0;
+  }
+
+  int ret = download_from_peers(out_peers, file);
+
+  free_peer_array(out_peers, K_VALUE);
+  return ret;
+}
+
+/**
+ * @brief Checks the acknowledgement of a STORE or STORE_MULTI request sent by
+ * store_many
+ *
+ * @param peers The peers of the pairs, the entries are indexes into them
+ * @param call The completed call, its user data is its first struct
+ * BatchEntry
+ */
+static void handle_store_call(struct Peer *const *peers, struct Call *call) {
+  struct BatchEntry *entries = call->user;
+  enum RPCCallType type =
+      ((const struct RPCMessageHeader *)call->request)->call_type;
+  size_t count = 1;
+
+  if (type == STORE_MULTI)
+    count = ((const struct RPCStoreMulti *)call->request)->num_values;
+
+  // Peers speaking only the older version are sent one STORE per pair
+  if (call->state == CALL_FAILED && call->error == EINVAL &&
+      type == STORE_MULTI) {
+    for (size_t i = 0; i < count; i++)
+      entries[i].single = true;
+    return;
+  }
+
+  const struct RPCStoreMultiResponse *multi =
+      (const struct RPCStoreMultiResponse *)call->response;
+  const struct RPCResponse *response =
+      (const struct RPCResponse *)call->response;
+
+  for (size_t i = 0; i < count; i++) {
+    bool stored;
+
+    if (type == STORE_MULTI)
+      stored = call->state == CALL_DONE && multi->num_results == count &&
+               multi->success[i];
+    else
+      stored = call->state == CALL_DONE &&
+               call->response_length >= sizeof(struct RPCResponse) &&
+               response->success;
+
+    if (!stored) {
+      struct Peer *peer = peers[entries[i].key];
+
+      log_msg(LOG_WARN, "STORE wasn't acknowledged by peer with port %d",
+              ntohs(peer->peer_addr.sin_port));
+      lookup_cache_forget_peer(peer->peer_id);
+    }
+  }
+}
+
+/**
+ * @brief Sends the pairs of some entries to their peer, in a STORE_MULTI
+ * request or a STORE for a single one
+ *
+ * @param calls The call table
+ * @param values The key-value pairs
+ * @param peers The peers of the pairs, K_VALUE per pair
+ * @param entries The entries, all to the same peer
+ * @param count The number of entries, at most RPC_BATCH_MAX
+ */
+static void send_stores(struct CallTable *calls,
+                        const struct KeyValuePair *values,
+                        struct Peer *const *peers, struct BatchEntry *entries,
+                        size_t count) {
+  // Every slot of the table may be taken
+  struct Call *done;
+  while (calls->pending + calls->done_count >= CALL_MAX_PENDING &&
+         (done = call_wait(calls))) {
+    handle_store_call(peers, done);
+    call_finish(calls, done);
+  }
+
+  if (count == 1) {
+    struct RPCStore req = {
+        .header = {.magic_number = RPC_MAGIC,
+                   .version = RPC_VERSION,
+                   .packet_size = sizeof(struct RPCStore),
+                   .call_type = STORE}};
+    serialize_rpc_value(&values[entries[0].key / K_VALUE], &req.key_value);
+
+    call_start(calls, &entries[0].addr, &req, sizeof(req), false, entries);
+    return;
+  }
+
+  struct RPCStoreMulti req = {
+      .header = {.magic_number = RPC_MAGIC,
+                 .version = RPC_VERSION,
+                 .packet_size = sizeof(struct RPCStoreMulti),
+                 .call_type = STORE_MULTI},
+      .num_values = count};
+
+  for (size_t i = 0; i < count; i++)
+    serialize_rpc_value(&values[entries[i].key / K_VALUE],
+                        &req.key_values[i]);
+
+  call_start(calls, &entries[0].addr, &req, sizeof(req), false, entries);
+}
+
+/**
+ * @brief Sends key-value pairs to their peers, grouped by peer: each peer is
+ * sent all its pairs in STORE_MULTI requests, connected to in parallel
+ * beforehand, or in one STORE per pair if it speaks only the older version
+ *
+ * @param values The key-value pairs
+ * @param peers The peers to send each pair to, K_VALUE per pair, NULL entries
+ * are skipped
+ * @param reachable For each peer, whether it is sent its pair
+ * @param count The number of pairs
+ */
+static void store_many(const struct KeyValuePair *values,
+                       struct Peer *const *peers, const bool *reachable,
+                       size_t count) {
+  struct BatchEntry *entries =
+      malloc(count * K_VALUE * sizeof(struct BatchEntry));
+  pointer_not_null(entries, "store_many malloc error");
+
+  size_t entry_count = 0;
+
+  for (size_t i = 0; i < count * K_VALUE; i++) {
+    if (peers[i] && reachable[i])
+      entries[entry_count++] = (struct BatchEntry){
+          .addr = peers[i]->peer_addr, .key = i, .single = false};
+  }
+
+  qsort(entries, entry_count, sizeof(struct BatchEntry), compare_entries);
+
+  struct CallTable calls;
+  if (call_table_init(&calls) != 0) {
+    free(entries);
+    return;
+  }
+
+  size_t requests = 0;
+  size_t start = 0;
+
+  while (start < entry_count) {
+    // The connections the replications left in the pool may have been
+    // replaced since, those missing are established in parallel
+    struct sockaddr_in addrs[POOL_MAX_IDLE];
+    bool connected[POOL_MAX_IDLE];
+    size_t peer_count = 0;
+    size_t end = start;
+
+    while (end < entry_count && peer_count < POOL_MAX_IDLE) {
+      addrs[peer_count++] = entries[end].addr;
+      end += peer_run(entries, entry_count, end);
+    }
+
+    pool_connect(addrs, peer_count, connected, CONNECT_TIMEOUT_MS);
+
+    for (size_t i = start, peer = 0; i < end; peer++) {
+      size_t run = peer_run(entries, entry_count, i);
+
+      if (!connected[peer]) {
+        log_msg(LOG_WARN, "Couldn't connect to peer with port %d to STORE "
+                          "%zu key-value pairs",
+                ntohs(entries[i].addr.sin_port), run);
+        lookup_cache_forget_peer(peers[entries[i].key]->peer_id);
+        i += run;
+        continue;
       }
+
+      for (size_t j = i; j < i + run;) {
+        size_t batch = i + run - j;
+        if (batch > RPC_BATCH_MAX)
+          batch = RPC_BATCH_MAX;
+
+        send_stores(&calls, values, peers, &entries[j], batch);
+        requests++;
+        j += batch;
+      }
+
+      i += run;
     }
+
+    start = end;
   }
 
-  log_msg(LOG_WARN,
-          "None of the owning peers were able to provide us the file");
+  struct Call *call;
+  while ((call = call_wait(&calls))) {
+    handle_store_call(peers, call);
+    call_finish(&calls, call);
+  }
 
-  free_peer_array(out_peers, K_VALUE);
-  return -1;
+  // The pairs batched for peers speaking only the older version
+  for (size_t i = 0; i < entry_count; i++) {
+    if (!entries[i].single)
+      continue;
+
+    send_stores(&calls, values, peers, &entries[i], 1);
+    requests++;
+  }
+
+  while ((call = call_wait(&calls))) {
+    handle_store_call(peers, call);
+    call_finish(&calls, call);
+  }
+
+  call_table_free(&calls);
+
+  log_msg(LOG_INFO, "Sent %zu key-value pairs to peers in %zu requests",
+          entry_count, requests);
+
+  free(entries);
+}
+
+int handle_rpc_upload_many(struct FileMagnet *const *files, size_t count) {
+  log_msg(LOG_DEBUG, "Start handling RPC upload of %zu files", count);
+
+  for (size_t i = 0; i < count; i++) {
+    if (!files[i]) {
+      log_msg(LOG_ERROR, "handle_rpc_upload_many got NULL file");
+      return -1;
+    }
+  }
+
+  struct KeyValuePair *values = malloc(count * sizeof(struct KeyValuePair));
+  HashID *keys = malloc(count * sizeof(HashID));
+  struct Peer **peers = calloc(count * K_VALUE, sizeof(struct Peer *));
+  bool *reachable = calloc(count * K_VALUE, sizeof(bool));
+  pointer_not_null(values, "handle_rpc_upload_many malloc error");
+  pointer_not_null(keys, "handle_rpc_upload_many malloc error");
+  pointer_not_null(peers, "handle_rpc_upload_many malloc error");
+  pointer_not_null(reachable, "handle_rpc_upload_many malloc error");
+
+  for (size_t i = 0; i < count; i++) {
+    struct KeyValuePair *kv = &values[i];
+
+    memset(kv, 0, sizeof(*kv));
+    memcpy(kv->key, files[i]->file_hash, sizeof(HashID));
+    kv->num_values = 1;
+    // Create peer with our info in the KeyValuePair
+    create_own_peer(&kv->values[0]);
+
+    kv->values[0].peer_addr.sin_port = htons(SERVER_PORT);
+    storage_put_value(kv, 0);
+
+    memcpy(keys[i], files[i]->file_hash, sizeof(HashID));
+  }
+
+  find_peers_many(keys, count, peers, false);
+
+  int ret = 0;
+
+  // The files are replicated one after the other, the STOREs wait until
+  // every key-value pair is complete
+  for (size_t i = 0; i < count; i++) {
+    struct Peer **file_peers = &peers[i * K_VALUE];
+    bool *file_reachable = &reachable[i * K_VALUE];
+
+    if (!file_peers[0]) {
+      log_msg(LOG_WARN, "handle_rpc_upload_many: no peers available for "
+                        "STORE propagation of '%s'",
+              files[i]->display_name);
+      ret = -1;
+      continue;
+    }
+
+    connect_peers(file_peers, K_VALUE, file_reachable);
+    forget_unreachable(file_peers, K_VALUE, file_reachable);
+
+    struct Replication replication = {
+        .kv = values[i], .peers = file_peers, .calls = NULL};
+
+    if (replicate_file(files[i], file_peers, file_reachable, &replication) !=
+        0) {
+      memset(file_reachable, 0, K_VALUE * sizeof(bool));
+      ret = -1;
+      continue;
+    }
+
+    values[i] = replication.kv;
+  }
+
+  store_many(values, peers, reachable, count);
+
+  log_msg(LOG_DEBUG,
+          "handle_rpc_upload_many finished propagating file keys to peers");
+
+  free_peer_array(peers, count * K_VALUE);
+  free(reachable);
+  free(peers);
+  free(keys);
+  free(values);
+
+  return ret;
+}
+
+int handle_rpc_download_many(struct FileMagnet *const *files, size_t count) {
+  log_msg(LOG_DEBUG, "Start handling RPC download of %zu files", count);
+
+  HashID *keys = malloc(count * sizeof(HashID));
+  size_t *index = malloc(count * sizeof(size_t));
+  struct Peer **peers = calloc(count * K_VALUE, sizeof(struct Peer *));
+  pointer_not_null(keys, "handle_rpc_download_many malloc error");
+  pointer_not_null(index, "handle_rpc_download_many malloc error");
+  pointer_not_null(peers, "handle_rpc_download_many malloc error");
+
+  int ret = 0;
+  size_t missing = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    if (!files[i]) {
+      log_msg(LOG_ERROR, "handle_rpc_download_many got NULL file");
+      ret = -1;
+      continue;
+    }
+
+    // Keys in local storage need no lookup
+    struct KeyValuePair local_kv;
+    if (storage_get_value(files[i]->file_hash, &local_kv) == 0) {
+      if (handle_rpc_download(files[i]) != 0)
+        ret = -1;
+      continue;
+    }
+
+    memcpy(keys[missing], files[i]->file_hash, sizeof(HashID));
+    index[missing++] = i;
+  }
+
+  if (missing > 0)
+    find_peers_many(keys, missing, peers, true);
+
+  for (size_t i = 0; i < missing; i++) {
+    struct Peer **file_peers = &peers[i * K_VALUE];
+
+    if (!file_peers[0]) {
+      log_msg(LOG_WARN, "File '%s' not found on the network",
+              files[index[i]]->display_name);
+      ret = -1;
+      continue;
+    }
+
+    if (download_from_peers(file_peers, files[index[i]]) != 0)
+      ret = -1;
+  }
+
+  free_peer_array(peers, missing * K_VALUE);
+  free(peers);
+  free(index);
+  free(keys);
+
+  return ret;
 }
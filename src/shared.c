@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <openssl/sha.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,73 +48,6 @@ ssize_t recv_all(int fd, void *dst, size_t len) {
   return ret;
 }
 
-ssize_t recv_all_peek(int fd, void *dst, size_t len) {
-  size_t nb_read = 0;
-  ssize_t ret = 0;
-
-  while (nb_read < len) {
-    ret = recv(fd, (char *)dst + nb_read, len - nb_read, MSG_PEEK);
-
-    if (ret < 0) {
-      // Retry
-      if (errno == EINTR)
-        continue;
-
-      perror("recv(MSG_PEEK)");
-      return -1;
-    }
-
-    // EOF
-    if (ret == 0)
-      break;
-
-    nb_read += ret;
-  }
-
-  return nb_read;
-}
-
-ssize_t recv_until(int fd, void *dst, size_t buf_len, const char *pattern,
-                   size_t pattern_len) {
-  size_t nb_read = 0;
-  ssize_t ret = 0;
-
-  while (nb_read < buf_len) {
-    ret = read(fd, (char *)dst + nb_read, 1);
-
-    if (ret < 0) {
-      // Retry
-      if (errno == EINTR)
-        continue;
-
-      perror("read");
-      return -1;
-    }
-
-    // EOF
-    if (ret == 0)
-      break;
-
-    nb_read += ret;
-
-    if (nb_read >= pattern_len) {
-      bool match = true;
-
-      for (size_t i = 0; i < pattern_len; i++) {
-        if (*((char *)dst + nb_read - pattern_len + i) != pattern[i]) {
-          match = false;
-          break;
-        }
-      }
-
-      if (match)
-        break;
-    }
-  }
-
-  return nb_read;
-}
-
 ssize_t send_all(int fd, const void *src, size_t len) {
   size_t nb_sent = 0;
   ssize_t ret = 0;
@@ -223,18 +157,24 @@ int get_primary_ip(char *ip_buf, size_t buf_size,
   static char cached_ip[INET_ADDRSTRLEN] = {0};
   static struct sockaddr_in cached_addr = {0};
   static bool cached = 0;
+  // Several network threads may need the IP at the same time
+  static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&cache_lock);
 
   // Cache to avoid doing long network queries everytime we need our primary IP
   if (cached) {
     strncpy(ip_buf, cached_ip, buf_size - 1);
     if (out_addr)
       memcpy(out_addr, &cached_addr, sizeof(struct sockaddr_in));
+    pthread_mutex_unlock(&cache_lock);
     return 0;
   }
 
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
     log_msg(LOG_ERROR, "get_primary_ip socket error");
+    pthread_mutex_unlock(&cache_lock);
     return -1;
   }
 
@@ -250,6 +190,7 @@ int get_primary_ip(char *ip_buf, size_t buf_size,
   if (connect(sock, (struct sockaddr *)&serv, sizeof(serv)) < 0) {
     log_msg(LOG_ERROR, "get_primary_ip connect error");
     close(sock);
+    pthread_mutex_unlock(&cache_lock);
     return -1;
   }
 
@@ -259,19 +200,24 @@ int get_primary_ip(char *ip_buf, size_t buf_size,
   if (getsockname(sock, (struct sockaddr *)&name, &name_len) < 0) {
     log_msg(LOG_ERROR, "get_primary_ip getsockname error");
     close(sock);
+    pthread_mutex_unlock(&cache_lock);
     return -1;
   }
 
   close(sock);
 
   const char *result = inet_ntop(AF_INET, &name.sin_addr, ip_buf, buf_size);
-  if (!result)
+  if (!result) {
+    pthread_mutex_unlock(&cache_lock);
     return -1;
+  }
 
   strncpy(cached_ip, ip_buf, buf_size - 1);
   cached_addr = name;
   cached = true;
 
+  pthread_mutex_unlock(&cache_lock);
+
   if (out_addr)
     memcpy(out_addr, &name, sizeof(struct sockaddr_in));
 
@@ -281,24 +227,25 @@ int get_primary_ip(char *ip_buf, size_t buf_size,
 int get_own_id(HashID out) {
   static HashID own_id = {0};
   static bool cached = false;
+  static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
   if (!out) {
     log_msg(LOG_ERROR, "get_own_id got NULL in out");
     return -1;
   }
 
+  pthread_mutex_lock(&cache_lock);
+
   if (cached) {
     memcpy(out, own_id, sizeof(HashID));
-
-    char hash_str[sizeof(HashID) * 2 + 1] = {0};
-    sha256_to_hex(own_id, hash_str);
-    // log_msg(LOG_DEBUG, "Hash (cached): %s", hash_str);
+    pthread_mutex_unlock(&cache_lock);
     return 0;
   }
 
   char ip[INET_ADDRSTRLEN] = {0};
   if (get_primary_ip(ip, sizeof(ip), NULL) != 0) {
     log_msg(LOG_ERROR, "get_own_id get_primary_ip error");
+    pthread_mutex_unlock(&cache_lock);
     return -1;
   }
 
@@ -314,6 +261,8 @@ int get_own_id(HashID out) {
   cached = true;
   memcpy(out, own_id, sizeof(HashID));
 
+  pthread_mutex_unlock(&cache_lock);
+
   return 0;
 }
 
@@ -339,6 +288,22 @@ int create_own_peer(struct Peer *out_peer) {
   return 0;
 }
 
+void dist_hash(HashID result, const HashID id1, const HashID id2) {
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    result[i] = id1[i] ^ id2[i];
+  }
+}
+
+int compare_hashes(const HashID dist1, const HashID dist2) {
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    if (dist1[i] < dist2[i])
+      return -1;
+    if (dist1[i] > dist2[i])
+      return 1;
+  }
+  return 0;
+}
+
 void sha256_to_hex(const HashID hash, char *str_buf) {
   for (int i = 0; i < sizeof(HashID); i++) {
     sprintf(str_buf + (i * 2), "%02x", hash[i]);
@@ -0,0 +1,149 @@
+#include "shortlist.h"
+
+#include <string.h>
+
+#define SHORTLIST_SEEN_SIZE (1 << SHORTLIST_SEEN_BITS)
+
+/**
+ * @brief Gets the first slot of the probe sequence of an ID in the set of
+ * IDs already seen
+ *
+ */
+static size_t seen_index(const HashID id) {
+  uint64_t hash;
+  memcpy(&hash, id, sizeof(hash));
+
+  // IDs are hashes already, mixing them again only guards against peers
+  // choosing theirs
+  hash *= 0x9E3779B97F4A7C15ull;
+
+  return hash >> (64 - SHORTLIST_SEEN_BITS);
+}
+
+static bool is_free(const HashID id) {
+  static const HashID zero = {0};
+  return memcmp(id, zero, sizeof(HashID)) == 0;
+}
+
+/**
+ * @brief Records an ID in the set of IDs already seen
+ *
+ * @param list The shortlist
+ * @param id The ID
+ * @return true The ID is new
+ * @return false The ID was already seen
+ */
+static bool mark_seen(struct Shortlist *list, const HashID id) {
+  size_t index = seen_index(id);
+
+  for (size_t i = 0; i < SHORTLIST_SEEN_SIZE; i++) {
+    HashID *entry = &list->seen[(index + i) & (SHORTLIST_SEEN_SIZE - 1)];
+
+    if (is_free(*entry)) {
+      // Past three quarters full, probe sequences get too long. The IDs
+      // aren't recorded anymore, the candidates are searched instead
+      if (list->seen_count >= SHORTLIST_SEEN_SIZE / 4 * 3)
+        break;
+
+      memcpy(*entry, id, sizeof(HashID));
+      list->seen_count++;
+      return true;
+    }
+
+    if (memcmp(*entry, id, sizeof(HashID)) == 0)
+      return false;
+  }
+
+  for (size_t i = 0; i < list->count; i++) {
+    if (memcmp(shortlist_get(list, i)->peer.peer_id, id, sizeof(HashID)) == 0)
+      return false;
+  }
+
+  return true;
+}
+
+void shortlist_init(struct Shortlist *list, const HashID target) {
+  memset(list, 0, sizeof(*list));
+  memcpy(list->target, target, sizeof(HashID));
+}
+
+struct Candidate *shortlist_get(struct Shortlist *list, size_t rank) {
+  return &list->slots[list->order[rank]];
+}
+
+/**
+ * @brief Finds the rank a distance would have among the candidates
+ *
+ * @param list The shortlist
+ * @param distance The distance to the target
+ * @return size_t Returns the number of candidates closer than the distance
+ */
+static size_t find_rank(struct Shortlist *list, const HashID distance) {
+  size_t low = 0;
+  size_t high = list->count;
+
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+
+    if (compare_hashes(shortlist_get(list, mid)->distance, distance) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+static bool is_waiting(const struct Candidate *candidate) {
+  return candidate->state == CANDIDATE_IN_FLIGHT ||
+         candidate->state == CANDIDATE_STALLED;
+}
+
+struct Candidate *shortlist_add(struct Shortlist *list,
+                                const struct Peer *peer) {
+  // A zeroed ID marks a free entry of the set, no real peer has one
+  if (is_free(peer->peer_id))
+    return NULL;
+
+  HashID distance;
+  dist_hash(distance, peer->peer_id, list->target);
+
+  size_t rank = find_rank(list, distance);
+  size_t used = list->count;
+  uint8_t slot;
+
+  if (used < SHORTLIST_CAPACITY) {
+    if (!mark_seen(list, peer->peer_id))
+      return NULL;
+
+    slot = (uint8_t)used;
+  } else {
+    // Make room by dropping the farthest candidate that is farther than the
+    // peer and isn't waiting for a response. The slot of a candidate waiting
+    // for a response is still referenced by its RPC
+    size_t victim = used;
+    while (victim > rank && is_waiting(shortlist_get(list, victim - 1)))
+      victim--;
+
+    if (victim == rank || !mark_seen(list, peer->peer_id))
+      return NULL;
+
+    victim--;
+    slot = list->order[victim];
+
+    memmove(&list->order[victim], &list->order[victim + 1],
+            used - victim - 1);
+    used--;
+  }
+
+  memmove(&list->order[rank + 1], &list->order[rank], used - rank);
+  list->order[rank] = slot;
+  list->count = used + 1;
+
+  struct Candidate *candidate = &list->slots[slot];
+  candidate->peer = *peer;
+  memcpy(candidate->distance, distance, sizeof(HashID));
+  candidate->state = CANDIDATE_NEW;
+
+  return candidate;
+}
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -5,11 +6,33 @@
 
 #include "log.h"
 #include "storage.h"
+#include "timer.h"
 
-static bool storage_ready = false;
+/**
+ * @brief A key-value pair as kept in the storage
+ *
+ */
+struct StoredValue {
+  struct KeyValuePair pair;
+
+  /**
+   * @brief When the pair stops being served, in milliseconds of timer_now_ms,
+   * 0 if it never does
+   *
+   */
+  uint64_t expires;
+};
+
+static pthread_once_t storage_ready = PTHREAD_ONCE_INIT;
 
 static struct hashmap *storage_map = NULL;
 
+/**
+ * @brief Protects storage_map, it is shared by every network thread
+ *
+ */
+static pthread_rwlock_t storage_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 /**
  * @brief Defines a comparator for two hashmap items
  *
@@ -19,10 +42,10 @@ static struct hashmap *storage_map = NULL;
  * @return int 0 if they are the same items, any other value otherwise
  */
 static int storage_compare(const void *a, const void *b, void *udata) {
-  const struct KeyValuePair *ua = a;
-  const struct KeyValuePair *ub = b;
+  const struct StoredValue *ua = a;
+  const struct StoredValue *ub = b;
 
-  return memcmp(ua->key, ub->key, sizeof(ua->key));
+  return memcmp(ua->pair.key, ub->pair.key, sizeof(ua->pair.key));
 }
 
 /**
@@ -34,7 +57,7 @@ static int storage_compare(const void *a, const void *b, void *udata) {
  * @return false Never returned
  */
 static bool storage_iter(const void *item, const void *udata) {
-  const struct KeyValuePair *pair = item;
+  const struct StoredValue *stored = item;
 
   log_msg(LOG_DEBUG, "Print out storage item data...");
 
@@ -50,8 +73,8 @@ static bool storage_iter(const void *item, const void *udata) {
  * @return uint64_t Returns an uint64_t hash of the item
  */
 static uint64_t storage_hash(const void *item, uint64_t seed0, uint64_t seed1) {
-  const struct KeyValuePair *pair = item;
-  return hashmap_sip(pair->key, sizeof(pair->key), seed0, seed1);
+  const struct StoredValue *stored = item;
+  return hashmap_sip(stored->pair.key, sizeof(stored->pair.key), seed0, seed1);
 }
 
 /**
@@ -61,36 +84,94 @@ static uint64_t storage_hash(const void *item, uint64_t seed0, uint64_t seed1) {
 static void storage_init() {
   log_msg(LOG_DEBUG, "Initializing client storage");
 
-  storage_map = hashmap_new(sizeof(struct KeyValuePair), 0, 0, 0, storage_hash,
+  storage_map = hashmap_new(sizeof(struct StoredValue), 0, 0, 0, storage_hash,
                             storage_compare, NULL, NULL);
+}
 
-  storage_ready = true;
+/**
+ * @brief Tells whether a stored pair expired
+ *
+ * @param stored The stored pair
+ * @param now The current time in milliseconds of timer_now_ms
+ * @return true The pair expired and must not be served anymore
+ * @return false The pair is still valid
+ */
+static bool is_expired(const struct StoredValue *stored, uint64_t now) {
+  return stored->expires != 0 && stored->expires <= now;
 }
 
-const struct KeyValuePair *storage_get_value(HashID key) {
-  if (!storage_ready)
-    storage_init();
+/**
+ * @brief Adds the providers of a pair that another pair of the same key doesn't
+ * list yet, as long as it has room for them
+ *
+ * @param into The pair receiving the providers
+ * @param from The pair whose providers are added
+ */
+static void merge_providers(struct KeyValuePair *into,
+                            const struct KeyValuePair *from) {
+  for (size_t i = 0; i < from->num_values && into->num_values < K_VALUE; i++) {
+    bool known = false;
+
+    for (size_t j = 0; j < into->num_values && !known; j++)
+      known = memcmp(into->values[j].peer_id, from->values[i].peer_id,
+                     sizeof(HashID)) == 0;
+
+    if (!known)
+      into->values[into->num_values++] = from->values[i];
+  }
+}
+
+int storage_get_value(const HashID key, struct KeyValuePair *out) {
+  pthread_once(&storage_ready, storage_init);
 
   log_msg(LOG_DEBUG, "storage_get_value");
 
-  struct KeyValuePair find = {0};
-  memcpy(find.key, key, sizeof(find.key));
+  struct StoredValue find = {0};
+  memcpy(find.pair.key, key, sizeof(find.pair.key));
+
+  pthread_rwlock_rdlock(&storage_lock);
+
+  const struct StoredValue *found = hashmap_get(storage_map, &find);
+  if (found && is_expired(found, timer_now_ms()))
+    found = NULL;
+
+  if (found && out)
+    memcpy(out, &found->pair, sizeof(struct KeyValuePair));
 
-  return hashmap_get(storage_map, &find);
+  pthread_rwlock_unlock(&storage_lock);
+
+  return found ? 0 : -1;
 }
 
-void storage_put_value(const struct KeyValuePair *value) {
-  if (!storage_ready)
-    storage_init();
+void storage_put_value(const struct KeyValuePair *value, uint64_t ttl_ms) {
+  pthread_once(&storage_ready, storage_init);
 
   log_msg(LOG_DEBUG, "storage_put_value");
 
-  if (hashmap_get(storage_map, value)) {
-    log_msg(LOG_WARN, "Got store on existing key-value pair");
-    return;
+  uint64_t now = timer_now_ms();
+  struct StoredValue stored = {.pair = *value,
+                               .expires = ttl_ms > 0 ? now + ttl_ms : 0};
+
+  pthread_rwlock_wrlock(&storage_lock);
+
+  const struct StoredValue *found = hashmap_get(storage_map, &stored);
+
+  if (found && !is_expired(found, now)) {
+    // The pair we have only grows, in providers and in lifetime
+    struct StoredValue merged = *found;
+    merge_providers(&merged.pair, value);
+
+    if (found->expires != 0 &&
+        (stored.expires == 0 || stored.expires > found->expires))
+      merged.expires = stored.expires;
+
+    stored = merged;
+    log_msg(LOG_DEBUG, "Merged store into existing key-value pair");
   }
 
-  hashmap_set(storage_map, value);
+  hashmap_set(storage_map, &stored);
+
+  pthread_rwlock_unlock(&storage_lock);
 }
 
 int serialize_rpc_value(const struct KeyValuePair *value,
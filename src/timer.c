@@ -0,0 +1,235 @@
+#include "timer.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+/**
+ * @brief The delay covered by the whole wheel, timers further away are parked
+ * in the last slot that can hold them
+ *
+ */
+#define TIMER_RANGE (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+/**
+ * @brief Links a timer at the head of a slot list
+ *
+ * @param wheel The wheel the slot belongs to
+ * @param timer The timer to link
+ * @param slot The head of the slot list
+ */
+static void link_timer(struct TimerWheel *wheel, struct Timer *timer,
+                       struct Timer **slot) {
+  timer->wheel = wheel;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = *slot;
+
+  if (*slot)
+    (*slot)->prev = timer;
+
+  *slot = timer;
+  wheel->count++;
+}
+
+/**
+ * @brief Unlinks a timer from its slot list
+ *
+ * @param timer The timer to unlink
+ */
+static void unlink_timer(struct Timer *timer) {
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    *timer->slot = timer->next;
+
+  if (timer->next)
+    timer->next->prev = timer->prev;
+
+  timer->wheel->count--;
+  timer->slot = NULL;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/**
+ * @brief Sorts a timer into the slot matching its expiry: the closer it is, the
+ * lower the level
+ *
+ * @param wheel The wheel to insert the timer in
+ * @param timer The timer to insert
+ */
+static void place_timer(struct TimerWheel *wheel, struct Timer *timer) {
+  uint64_t expires = timer->expires;
+
+  // Expired timers go into the slot processed next
+  if (expires < wheel->now)
+    expires = wheel->now;
+
+  if (expires - wheel->now >= TIMER_RANGE)
+    expires = wheel->now + TIMER_RANGE - 1;
+
+  uint64_t delta = expires - wheel->now;
+  int level = 0;
+
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= 1ULL << (TIMER_LEVEL_BITS * (level + 1)))
+    level++;
+
+  size_t index = (expires >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK;
+  link_timer(wheel, timer, &wheel->slots[level][index]);
+}
+
+/**
+ * @brief Moves the timers of a slot of a higher level into the lower levels,
+ * called when time reaches the range covered by the slot
+ *
+ * @param wheel The wheel to cascade
+ * @param level The level of the slot
+ * @param index The index of the slot
+ */
+static void cascade(struct TimerWheel *wheel, int level, size_t index) {
+  struct Timer **slot = &wheel->slots[level][index];
+
+  while (*slot) {
+    struct Timer *timer = *slot;
+
+    unlink_timer(timer);
+    place_timer(wheel, timer);
+  }
+}
+
+void timer_wheel_init(struct TimerWheel *wheel, uint64_t now_ms) {
+  if (!wheel)
+    return;
+
+  memset(wheel, 0, sizeof(struct TimerWheel));
+  wheel->now = now_ms;
+}
+
+void timer_init(struct Timer *timer, TimerFunc *func, void *arg) {
+  if (!timer)
+    return;
+
+  memset(timer, 0, sizeof(struct Timer));
+  timer->func = func;
+  timer->arg = arg;
+}
+
+void timer_start(struct TimerWheel *wheel, struct Timer *timer,
+                 uint64_t delay_ms, uint64_t interval_ms) {
+  if (!wheel || !timer)
+    return;
+
+  if (timer->slot)
+    unlink_timer(timer);
+
+  // The wheel may lag behind while the loop is busy, expiries are based on the
+  // clock so they don't fire early
+  timer->expires = timer_now_ms() + delay_ms;
+  timer->interval = interval_ms;
+
+  place_timer(wheel, timer);
+}
+
+void timer_cancel(struct Timer *timer) {
+  if (!timer || !timer->slot)
+    return;
+
+  unlink_timer(timer);
+}
+
+bool timer_pending(const struct Timer *timer) {
+  return timer && timer->slot != NULL;
+}
+
+void timer_wheel_advance(struct TimerWheel *wheel, uint64_t now_ms) {
+  if (!wheel)
+    return;
+
+  // Nothing can expire, skip the elapsed time at once
+  if (wheel->count == 0) {
+    if (now_ms >= wheel->now)
+      wheel->now = now_ms + 1;
+    return;
+  }
+
+  while (wheel->now <= now_ms) {
+    uint64_t tick = wheel->now;
+
+    // Each time a level wraps around, the next slot of the level above is due
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+      uint64_t low_bits = (1ULL << (TIMER_LEVEL_BITS * level)) - 1;
+      if ((tick & low_bits) != 0)
+        break;
+
+      cascade(wheel, level, (tick >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK);
+    }
+
+    // Timers started from a callback land in the following slots
+    wheel->now = tick + 1;
+
+    struct Timer **slot = &wheel->slots[0][tick & TIMER_MASK];
+    while (*slot) {
+      struct Timer *timer = *slot;
+      unlink_timer(timer);
+
+      // Periodic timers are rescheduled before the call, so the callback can
+      // still cancel them
+      if (timer->interval > 0) {
+        timer->expires += timer->interval;
+        if (timer->expires <= tick)
+          timer->expires = tick + timer->interval;
+
+        place_timer(wheel, timer);
+      }
+
+      timer->func(timer, timer->arg);
+    }
+  }
+}
+
+int timer_wheel_timeout(const struct TimerWheel *wheel, uint64_t now_ms) {
+  if (!wheel || wheel->count == 0)
+    return -1;
+
+  uint64_t next = UINT64_MAX;
+
+  for (int level = 0; level < TIMER_LEVELS; level++) {
+    int shift = TIMER_LEVEL_BITS * level;
+    size_t current = (wheel->now >> shift) & TIMER_MASK;
+
+    // The current slot of a higher level was already cascaded unless the level
+    // is just about to turn, what it holds now belongs to the next round
+    int first = 0;
+    if (level > 0 && (wheel->now & ((1ULL << shift) - 1)) != 0)
+      first = 1;
+
+    for (int i = first; i <= TIMER_SLOTS; i++) {
+      const struct Timer *timer =
+          wheel->slots[level][(current + i) & TIMER_MASK];
+
+      if (!timer)
+        continue;
+
+      // Slots of the same level are visited in expiry order, the first
+      // non-empty one holds the earliest timers of this level
+      for (; timer; timer = timer->next) {
+        if (timer->expires < next)
+          next = timer->expires;
+      }
+
+      break;
+    }
+  }
+
+  if (next <= now_ms)
+    return 0;
+
+  if (next - now_ms > INT_MAX)
+    return INT_MAX;
+
+  return (int)(next - now_ms);
+}
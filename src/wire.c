@@ -0,0 +1,660 @@
+#include "wire.h"
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Bytes being appended to a buffer
+ *
+ */
+struct Writer {
+  char *data;
+  size_t length;
+  size_t max;
+
+  /**
+   * @brief Set once something didn't fit, later writes are ignored
+   *
+   */
+  bool overflow;
+};
+
+/**
+ * @brief Bytes being consumed from a message
+ *
+ */
+struct Reader {
+  const char *data;
+  size_t length;
+  size_t offset;
+
+  /**
+   * @brief Set once the message ended early or held an invalid field, later
+   * reads return zeroes
+   *
+   */
+  bool error;
+};
+
+static void put_bytes(struct Writer *writer, const void *bytes, size_t n) {
+  if (writer->overflow || writer->max - writer->length < n) {
+    writer->overflow = true;
+    return;
+  }
+
+  memcpy(writer->data + writer->length, bytes, n);
+  writer->length += n;
+}
+
+static void put_u8(struct Writer *writer, uint8_t value) {
+  put_bytes(writer, &value, 1);
+}
+
+/**
+ * @brief Appends an unsigned integer 7 bits at a time, the lowest bits first,
+ * each byte but the last having its high bit set
+ *
+ */
+static void put_varint(struct Writer *writer, uint64_t value) {
+  while (value >= 0x80) {
+    put_u8(writer, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+
+  put_u8(writer, (uint8_t)value);
+}
+
+/**
+ * @brief Appends the count of the entries of a batched message, which must not
+ * exceed what its structure holds
+ *
+ */
+static void put_count(struct Writer *writer, size_t count, size_t max) {
+  if (count > max) {
+    writer->overflow = true;
+    return;
+  }
+
+  put_varint(writer, count);
+}
+
+static void get_bytes(struct Reader *reader, void *out, size_t n) {
+  if (reader->error || reader->length - reader->offset < n) {
+    reader->error = true;
+    memset(out, 0, n);
+    return;
+  }
+
+  memcpy(out, reader->data + reader->offset, n);
+  reader->offset += n;
+}
+
+static uint8_t get_u8(struct Reader *reader) {
+  uint8_t value;
+  get_bytes(reader, &value, 1);
+  return value;
+}
+
+static uint64_t get_varint(struct Reader *reader) {
+  uint64_t value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = get_u8(reader);
+    value |= (uint64_t)(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80))
+      return value;
+  }
+
+  reader->error = true;
+  return 0;
+}
+
+/**
+ * @brief Reads a count, which must not exceed what its structure holds
+ *
+ */
+static size_t get_count(struct Reader *reader, size_t max) {
+  uint64_t count = get_varint(reader);
+
+  if (count > max) {
+    reader->error = true;
+    return 0;
+  }
+
+  return count;
+}
+
+static bool has_key(const struct RPCPeer *peer) {
+  static const PubKey zero = {0};
+  return memcmp(peer->peer_key, zero, sizeof(PubKey)) != 0;
+}
+
+static bool any_key(const struct RPCPeer *peers, size_t count) {
+  for (size_t i = 0; i < count && i < K_VALUE; i++) {
+    if (has_key(&peers[i]))
+      return true;
+  }
+
+  return false;
+}
+
+static void put_peer(struct Writer *writer, const struct RPCPeer *peer,
+                     bool keys) {
+  put_bytes(writer, peer->peer_id, sizeof(HashID));
+
+  // Both are already in network byte order
+  put_bytes(writer, &peer->peer_addr.sin_addr.s_addr, 4);
+  put_bytes(writer, &peer->peer_addr.sin_port, 2);
+
+  if (keys)
+    put_bytes(writer, peer->peer_key, sizeof(PubKey));
+}
+
+static void get_peer(struct Reader *reader, struct RPCPeer *peer, bool keys) {
+  get_bytes(reader, peer->peer_id, sizeof(HashID));
+
+  peer->peer_addr.sin_family = AF_INET;
+  get_bytes(reader, &peer->peer_addr.sin_addr.s_addr, 4);
+  get_bytes(reader, &peer->peer_addr.sin_port, 2);
+
+  if (keys)
+    get_bytes(reader, peer->peer_key, sizeof(PubKey));
+}
+
+static void put_peers(struct Writer *writer, const struct RPCPeer *peers,
+                      size_t count, bool keys) {
+  if (count > K_VALUE) {
+    writer->overflow = true;
+    return;
+  }
+
+  put_varint(writer, count);
+
+  for (size_t i = 0; i < count; i++)
+    put_peer(writer, &peers[i], keys);
+}
+
+static size_t get_peers(struct Reader *reader, struct RPCPeer *peers,
+                        bool keys) {
+  size_t count = get_count(reader, K_VALUE);
+
+  for (size_t i = 0; i < count; i++)
+    get_peer(reader, &peers[i], keys);
+
+  return count;
+}
+
+static void put_key_value(struct Writer *writer,
+                          const struct RPCKeyValue *value, bool keys) {
+  put_bytes(writer, value->key, sizeof(HashID));
+  put_peers(writer, value->values, value->num_values, keys);
+}
+
+static void get_key_value(struct Reader *reader, struct RPCKeyValue *value,
+                          bool keys) {
+  get_bytes(reader, value->key, sizeof(HashID));
+  value->num_values = get_peers(reader, value->values, keys);
+}
+
+size_t wire_structure_size(enum RPCCallType type) {
+  switch (type) {
+  case PING:
+    return sizeof(struct RPCPing);
+  case STORE:
+    return sizeof(struct RPCStore);
+  case FIND_NODE:
+  case FIND_VALUE:
+    return sizeof(struct RPCFind);
+  case PING_RESPONSE:
+  case STORE_RESPONSE:
+    return sizeof(struct RPCResponse);
+  case FIND_NODE_RESPONSE:
+    return sizeof(struct RPCFindNodeResponse);
+  case FIND_VALUE_RESPONSE:
+    return sizeof(struct RPCFindValueResponse);
+  case BROADCAST:
+    return sizeof(struct RPCBroadcast);
+  case STORE_MULTI:
+    return sizeof(struct RPCStoreMulti);
+  case FIND_VALUE_MULTI:
+    return sizeof(struct RPCFindMulti);
+  case STORE_MULTI_RESPONSE:
+    return sizeof(struct RPCStoreMultiResponse);
+  case FIND_VALUE_MULTI_RESPONSE:
+    return sizeof(struct RPCFindValueMultiResponse);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Checks whether a message type is a batched one, which only exists in
+ * RPC_VERSION
+ *
+ */
+static bool is_batched(enum RPCCallType type) {
+  return type == STORE_MULTI || type == FIND_VALUE_MULTI ||
+         type == STORE_MULTI_RESPONSE || type == FIND_VALUE_MULTI_RESPONSE;
+}
+
+ssize_t wire_message_size(const char *data, size_t length) {
+  if (length < 5)
+    return 0;
+
+  if (memcmp(data, RPC_MAGIC, 4) != 0)
+    return -1;
+
+  uint8_t version = data[4];
+
+  if (version == RPC_LEGACY_VERSION) {
+    if (length < sizeof(struct RPCMessageHeader))
+      return 0;
+
+    const struct RPCMessageHeader *header =
+        (const struct RPCMessageHeader *)data;
+
+    if (header->packet_size < (int)sizeof(struct RPCMessageHeader) ||
+        header->packet_size > MAX_RPC_PACKET_SIZE)
+      return -1;
+
+    return header->packet_size;
+  }
+
+  if (version != RPC_VERSION)
+    return -1;
+
+  if (length < WIRE_HEADER_SIZE)
+    return 0;
+
+  uint16_t size;
+  memcpy(&size, data + 7, sizeof(size));
+  size = ntohs(size);
+
+  if (size < WIRE_HEADER_SIZE || size > MAX_RPC_MESSAGE_SIZE)
+    return -1;
+
+  return size;
+}
+
+bool wire_read_header(const char *data, size_t length,
+                      struct RPCMessageHeader *out) {
+  ssize_t size = wire_message_size(data, length);
+  if (size <= 0 || (size_t)size > length)
+    return false;
+
+  if (data[4] == RPC_LEGACY_VERSION) {
+    memcpy(out, data, sizeof(struct RPCMessageHeader));
+    return true;
+  }
+
+  // Only single bits are call types
+  uint8_t type = data[5];
+  if (type > 15)
+    return false;
+
+  uint32_t request_id;
+  memcpy(&request_id, data + 9, sizeof(request_id));
+
+  memcpy(out->magic_number, RPC_MAGIC, 4);
+  out->version = RPC_VERSION;
+  out->packet_size = (int)size;
+  out->call_type = 1 << type;
+  out->request_id = ntohl(request_id);
+
+  return true;
+}
+
+size_t wire_request_keys(const char *data, size_t length) {
+  struct RPCMessageHeader header;
+  if (!wire_read_header(data, length, &header) ||
+      header.version != RPC_VERSION ||
+      (header.call_type != STORE_MULTI && header.call_type != FIND_VALUE_MULTI))
+    return 1;
+
+  // Both batched requests start with their count, a malformed one is
+  // rejected when it is decoded
+  struct Reader reader = {
+      .data = data, .length = length, .offset = WIRE_HEADER_SIZE};
+  size_t count = get_count(&reader, RPC_BATCH_MAX);
+
+  return count > 0 ? count : 1;
+}
+
+/**
+ * @brief Checks the counts of a version 1 message, which are native integers
+ * taken as they came
+ *
+ * @param message The message structure
+ * @return true The counts fit in the structure
+ * @return false A count is too large
+ */
+static bool legacy_counts_valid(const void *message) {
+  const struct RPCMessageHeader *header = message;
+
+  switch (header->call_type) {
+  case STORE:
+    return ((const struct RPCStore *)message)->key_value.num_values <= K_VALUE;
+
+  case FIND_NODE_RESPONSE:
+    return ((const struct RPCFindNodeResponse *)message)->num_closest <=
+           K_VALUE;
+
+  case FIND_VALUE_RESPONSE: {
+    const struct RPCFindValueResponse *response = message;
+    return response->values.num_values <= K_VALUE &&
+           response->num_closest <= K_VALUE;
+  }
+
+  default:
+    return true;
+  }
+}
+
+size_t wire_encode(const void *message, char *out, size_t max) {
+  const struct RPCMessageHeader *header = message;
+  size_t size = wire_structure_size(header->call_type);
+
+  if (size == 0 || header->packet_size != (int)size)
+    return 0;
+
+  if (header->version == RPC_LEGACY_VERSION) {
+    if (size > max || is_batched(header->call_type))
+      return 0;
+
+    memcpy(out, message, size);
+    return size;
+  }
+
+  // The header is written last, the writer doesn't check it fits
+  if (header->version != RPC_VERSION || max < WIRE_HEADER_SIZE)
+    return 0;
+
+  struct Writer writer = {.data = out, .length = WIRE_HEADER_SIZE, .max = max};
+  uint8_t flags = 0;
+
+  switch (header->call_type) {
+  case PING:
+    break;
+
+  case STORE: {
+    const struct RPCStore *store = message;
+    const struct RPCKeyValue *value = &store->key_value;
+
+    if (any_key(value->values, value->num_values))
+      flags |= WIRE_FLAG_PEER_KEYS;
+    if (store->cached)
+      flags |= WIRE_FLAG_CACHED;
+
+    put_key_value(&writer, value, flags & WIRE_FLAG_PEER_KEYS);
+    break;
+  }
+
+  case FIND_NODE:
+  case FIND_VALUE:
+    put_bytes(&writer, ((const struct RPCFind *)message)->key, sizeof(HashID));
+    break;
+
+  case PING_RESPONSE:
+  case STORE_RESPONSE:
+    if (((const struct RPCResponse *)message)->success)
+      flags |= WIRE_FLAG_SUCCESS;
+    break;
+
+  case FIND_NODE_RESPONSE: {
+    const struct RPCFindNodeResponse *response = message;
+
+    if (response->success)
+      flags |= WIRE_FLAG_SUCCESS;
+    if (response->found_key)
+      flags |= WIRE_FLAG_FOUND_KEY;
+    if (any_key(response->closest, response->num_closest))
+      flags |= WIRE_FLAG_PEER_KEYS;
+
+    put_peers(&writer, response->closest, response->num_closest,
+              flags & WIRE_FLAG_PEER_KEYS);
+    break;
+  }
+
+  case FIND_VALUE_RESPONSE: {
+    const struct RPCFindValueResponse *response = message;
+    const struct RPCKeyValue *value = &response->values;
+
+    if (response->success)
+      flags |= WIRE_FLAG_SUCCESS;
+    if (response->found_key)
+      flags |= WIRE_FLAG_FOUND_KEY;
+    if ((response->found_key && any_key(value->values, value->num_values)) ||
+        any_key(response->closest, response->num_closest))
+      flags |= WIRE_FLAG_PEER_KEYS;
+
+    // A miss doesn't carry the empty value
+    if (response->found_key)
+      put_key_value(&writer, value, flags & WIRE_FLAG_PEER_KEYS);
+
+    put_peers(&writer, response->closest, response->num_closest,
+              flags & WIRE_FLAG_PEER_KEYS);
+    break;
+  }
+
+  case BROADCAST: {
+    const struct RPCPeer *peer = &((const struct RPCBroadcast *)message)->peer;
+
+    if (has_key(peer))
+      flags |= WIRE_FLAG_PEER_KEYS;
+
+    put_peer(&writer, peer, flags & WIRE_FLAG_PEER_KEYS);
+    break;
+  }
+
+  case STORE_MULTI: {
+    const struct RPCStoreMulti *store = message;
+
+    for (size_t i = 0; i < store->num_values && i < RPC_BATCH_MAX; i++) {
+      const struct RPCKeyValue *value = &store->key_values[i];
+
+      if (any_key(value->values, value->num_values))
+        flags |= WIRE_FLAG_PEER_KEYS;
+    }
+
+    put_count(&writer, store->num_values, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < store->num_values && !writer.overflow; i++)
+      put_key_value(&writer, &store->key_values[i],
+                    flags & WIRE_FLAG_PEER_KEYS);
+    break;
+  }
+
+  case FIND_VALUE_MULTI: {
+    const struct RPCFindMulti *find = message;
+
+    put_count(&writer, find->num_keys, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < find->num_keys && !writer.overflow; i++)
+      put_bytes(&writer, find->keys[i], sizeof(HashID));
+    break;
+  }
+
+  case STORE_MULTI_RESPONSE: {
+    const struct RPCStoreMultiResponse *response = message;
+
+    put_count(&writer, response->num_results, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < response->num_results && !writer.overflow; i++)
+      put_u8(&writer, response->success[i] ? WIRE_FLAG_SUCCESS : 0);
+    break;
+  }
+
+  case FIND_VALUE_MULTI_RESPONSE: {
+    const struct RPCFindValueMultiResponse *response = message;
+
+    for (size_t i = 0; i < response->num_results && i < RPC_BATCH_MAX; i++) {
+      const struct RPCValueResult *result = &response->results[i];
+      const struct RPCKeyValue *value = &result->values;
+
+      if ((result->found_key && any_key(value->values, value->num_values)) ||
+          any_key(result->closest, result->num_closest))
+        flags |= WIRE_FLAG_PEER_KEYS;
+    }
+
+    put_count(&writer, response->num_results, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < response->num_results && !writer.overflow; i++) {
+      const struct RPCValueResult *result = &response->results[i];
+
+      put_u8(&writer, result->found_key ? WIRE_FLAG_FOUND_KEY : 0);
+
+      if (result->found_key)
+        put_key_value(&writer, &result->values, flags & WIRE_FLAG_PEER_KEYS);
+
+      put_peers(&writer, result->closest, result->num_closest,
+                flags & WIRE_FLAG_PEER_KEYS);
+    }
+    break;
+  }
+  }
+
+  if (writer.overflow || writer.length < WIRE_HEADER_SIZE)
+    return 0;
+
+  uint16_t length = htons((uint16_t)writer.length);
+  uint32_t request_id = htonl(header->request_id);
+
+  memcpy(out, RPC_MAGIC, 4);
+  out[4] = RPC_VERSION;
+  out[5] = (char)__builtin_ctz(header->call_type);
+  out[6] = (char)flags;
+  memcpy(out + 7, &length, sizeof(length));
+  memcpy(out + 9, &request_id, sizeof(request_id));
+
+  return writer.length;
+}
+
+size_t wire_decode(const char *data, size_t length, void *out, size_t max) {
+  struct RPCMessageHeader header;
+  if (!wire_read_header(data, length, &header) ||
+      (size_t)header.packet_size != length)
+    return 0;
+
+  size_t size = wire_structure_size(header.call_type);
+  if (size == 0 || size > max)
+    return 0;
+
+  if (header.version == RPC_LEGACY_VERSION) {
+    if (length != size || is_batched(header.call_type))
+      return 0;
+
+    memcpy(out, data, size);
+    return legacy_counts_valid(out) ? size : 0;
+  }
+
+  memset(out, 0, size);
+  header.packet_size = (int)size;
+  memcpy(out, &header, sizeof(header));
+
+  struct Reader reader = {
+      .data = data, .length = length, .offset = WIRE_HEADER_SIZE};
+  uint8_t flags = data[6];
+  bool keys = flags & WIRE_FLAG_PEER_KEYS;
+
+  switch (header.call_type) {
+  case PING:
+    break;
+
+  case STORE:
+    get_key_value(&reader, &((struct RPCStore *)out)->key_value, keys);
+    ((struct RPCStore *)out)->cached = (flags & WIRE_FLAG_CACHED) != 0;
+    break;
+
+  case FIND_NODE:
+  case FIND_VALUE:
+    get_bytes(&reader, ((struct RPCFind *)out)->key, sizeof(HashID));
+    break;
+
+  case PING_RESPONSE:
+  case STORE_RESPONSE:
+    ((struct RPCResponse *)out)->success = flags & WIRE_FLAG_SUCCESS;
+    break;
+
+  case FIND_NODE_RESPONSE: {
+    struct RPCFindNodeResponse *response = out;
+
+    response->success = flags & WIRE_FLAG_SUCCESS;
+    response->found_key = (flags & WIRE_FLAG_FOUND_KEY) != 0;
+    response->num_closest = get_peers(&reader, response->closest, keys);
+    break;
+  }
+
+  case FIND_VALUE_RESPONSE: {
+    struct RPCFindValueResponse *response = out;
+
+    response->success = flags & WIRE_FLAG_SUCCESS;
+    response->found_key = (flags & WIRE_FLAG_FOUND_KEY) != 0;
+
+    if (response->found_key)
+      get_key_value(&reader, &response->values, keys);
+
+    response->num_closest = get_peers(&reader, response->closest, keys);
+    break;
+  }
+
+  case BROADCAST:
+    get_peer(&reader, &((struct RPCBroadcast *)out)->peer, keys);
+    break;
+
+  case STORE_MULTI: {
+    struct RPCStoreMulti *store = out;
+
+    store->num_values = get_count(&reader, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < store->num_values; i++)
+      get_key_value(&reader, &store->key_values[i], keys);
+    break;
+  }
+
+  case FIND_VALUE_MULTI: {
+    struct RPCFindMulti *find = out;
+
+    find->num_keys = get_count(&reader, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < find->num_keys; i++)
+      get_bytes(&reader, find->keys[i], sizeof(HashID));
+    break;
+  }
+
+  case STORE_MULTI_RESPONSE: {
+    struct RPCStoreMultiResponse *response = out;
+
+    response->num_results = get_count(&reader, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < response->num_results; i++)
+      response->success[i] = get_u8(&reader) & WIRE_FLAG_SUCCESS;
+    break;
+  }
+
+  case FIND_VALUE_MULTI_RESPONSE: {
+    struct RPCFindValueMultiResponse *response = out;
+
+    response->num_results = get_count(&reader, RPC_BATCH_MAX);
+
+    for (size_t i = 0; i < response->num_results; i++) {
+      struct RPCValueResult *result = &response->results[i];
+
+      result->found_key = (get_u8(&reader) & WIRE_FLAG_FOUND_KEY) != 0;
+
+      if (result->found_key)
+        get_key_value(&reader, &result->values, keys);
+
+      result->num_closest = get_peers(&reader, result->closest, keys);
+    }
+    break;
+  }
+  }
+
+  // Every byte must belong to a field
+  if (reader.error || reader.offset != length)
+    return 0;
+
+  return size;
+}
@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "network.h"
+#include "rpc.h"
+#include "wire.h"
+
+/**
+ * @file admission_test.c
+ * @brief Checks the rate of each source, the budget of each round and the
+ * order deferred connections are served in
+ *
+ * The buckets are refilled from the time a round starts at, which the test
+ * passes in directly. The deferred connections are checked on a network
+ * thread serving a single request per round to clients pipelining several.
+ *
+ */
+
+/**
+ * @brief The number of clients pipelining requests to the network thread
+ *
+ */
+#define CLIENTS 3
+
+/**
+ * @brief The number of requests each client pipelines
+ *
+ */
+#define REQUESTS 4
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if (!condition)
+    failures++;
+}
+
+static struct sockaddr_in source(uint32_t host) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(host)};
+  return addr;
+}
+
+/**
+ * @brief Admits requests of one key from a source until it is rate limited
+ *
+ * @return int Returns the number of requests admitted
+ */
+static int admit_all(const struct sockaddr_in *from) {
+  int admitted = 0;
+
+  while (admitted < 1000 && admission_admit(from, 1))
+    admitted++;
+
+  return admitted;
+}
+
+/**
+ * @brief Checks the buckets refill at RPC_RATE tokens per second up to
+ * RPC_BURST, and batched requests take a token per key
+ *
+ */
+static void test_refill() {
+  setenv("RPC_RATE", "10", 1);
+  setenv("RPC_BURST", "5", 1);
+  setenv("RPC_ROUND_BUDGET", "0", 1);
+  admission_init();
+
+  struct sockaddr_in a = source(0x0A000001);
+  struct sockaddr_in b = source(0x0A000002);
+  uint64_t now = 1000000;
+
+  admission_new_round(now);
+  check(admit_all(&a) == 5, "new source starts with a full bucket");
+  check(admit_all(&b) == 5, "sources have buckets of their own");
+
+  admission_new_round(now += 50);
+  check(admit_all(&a) == 0, "half a token isn't enough");
+
+  admission_new_round(now += 50);
+  check(admit_all(&a) == 1, "fractions of a token add up");
+
+  admission_new_round(now += 250);
+  check(admit_all(&a) == 2, "bucket refills at the rate");
+
+  admission_new_round(now += 60000);
+  check(admit_all(&a) == 5, "bucket holds at most the burst");
+
+  admission_new_round(now += 300);
+  check(!admission_admit(&a, 4) && admission_admit(&a, 3) &&
+            !admission_admit(&a, 1),
+        "batched request takes a token per key");
+
+  admission_new_round(now += 60000);
+  check(admission_admit(&a, 50) && !admission_admit(&a, 1),
+        "batch larger than the burst takes the full bucket");
+
+  admission_new_round(now += 400);
+  check(!admission_admit(&a, 50), "batch larger than the burst waits for a "
+                                  "full bucket");
+
+  setenv("RPC_RATE", "0", 1);
+  admission_init();
+  admission_new_round(now);
+  check(admit_all(&a) == 1000, "rate 0 doesn't limit sources");
+}
+
+static void test_round_budget() {
+  setenv("RPC_RATE", "0", 1);
+  setenv("RPC_ROUND_BUDGET", "4", 1);
+  admission_init();
+
+  struct sockaddr_in a = source(0x0A000001);
+
+  admission_new_round(2000000);
+  check(admission_room() == 4, "round starts with the budget");
+
+  admission_admit(&a, 1);
+  admission_admit(&a, 2);
+  check(admission_room() == 1, "requests take a key each from the budget");
+
+  admission_admit(&a, 3);
+  check(admission_room() == 0,
+        "batch larger than the room left ends the round");
+
+  admission_new_round(2000001);
+  check(admission_room() == 4, "next round restores the budget");
+
+  setenv("RPC_ROUND_BUDGET", "0", 1);
+  admission_init();
+  admission_new_round(2000002);
+  for (int i = 0; i < 1000; i++)
+    admission_admit(&a, 1000);
+  check(admission_room() > 0, "budget 0 doesn't limit rounds");
+}
+
+/**
+ * @brief Counts the responses that arrived on a client socket
+ *
+ * @param fd The client socket
+ * @param pending The bytes of a response received partially, kept between
+ * calls
+ * @param pending_len The number of bytes in pending
+ * @return int Returns the number of complete responses received
+ */
+static int receive_responses(int fd, char *pending, size_t *pending_len) {
+  int count = 0;
+
+  ssize_t received = recv(fd, pending + *pending_len,
+                          MAX_RPC_PACKET_SIZE - *pending_len, MSG_DONTWAIT);
+  if (received > 0)
+    *pending_len += received;
+
+  while (true) {
+    ssize_t size = wire_message_size(pending, *pending_len);
+    if (size <= 0 || (size_t)size > *pending_len)
+      break;
+
+    memmove(pending, pending + size, *pending_len - size);
+    *pending_len -= size;
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * @brief Checks that clients with requests left once the round budget is
+ * spent are served in turn, none of them twice before the others once
+ *
+ */
+static void test_deferred_order() {
+  setenv("RPC_RATE", "0", 1);
+  setenv("RPC_ROUND_BUDGET", "1", 1);
+
+  // A secondary thread, it doesn't broadcast nor handle commands
+  init_network(1);
+
+  struct sockaddr_in server = {.sin_family = AF_INET,
+                               .sin_port = htons(SERVER_PORT),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int clients[CLIENTS];
+
+  for (int c = 0; c < CLIENTS; c++) {
+    clients[c] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(clients[c], (struct sockaddr *)&server, sizeof(server)) != 0) {
+      perror("connect");
+      failures++;
+      return;
+    }
+
+    char data[REQUESTS * MAX_RPC_PACKET_SIZE];
+    size_t length = 0;
+
+    for (int i = 0; i < REQUESTS; i++) {
+      struct RPCPing ping = {.header = {.magic_number = RPC_MAGIC,
+                                        .version = RPC_VERSION,
+                                        .packet_size = sizeof(struct RPCPing),
+                                        .call_type = PING,
+                                        .request_id = c * REQUESTS + i}};
+      length += wire_encode(&ping, data + length, sizeof(data) - length);
+    }
+
+    // The requests arrive together, they are read in a single round
+    if (write(clients[c], data, length) != (ssize_t)length) {
+      perror("write");
+      failures++;
+      return;
+    }
+  }
+
+  static char pending[CLIENTS][MAX_RPC_PACKET_SIZE];
+  size_t pending_len[CLIENTS] = {0};
+  int served[CLIENTS * REQUESTS];
+  int total = 0;
+  bool one_per_round = true;
+
+  for (int round = 0; round < 100 && total < CLIENTS * REQUESTS; round++) {
+    update_network();
+
+    int answered = 0;
+    for (int c = 0; c < CLIENTS; c++) {
+      int count = receive_responses(clients[c], pending[c], &pending_len[c]);
+
+      for (int i = 0; i < count && total < CLIENTS * REQUESTS; i++)
+        served[total++] = c;
+      answered += count;
+    }
+
+    one_per_round &= answered <= 1;
+  }
+
+  check(total == CLIENTS * REQUESTS, "every request is answered");
+  check(one_per_round, "a round answers no more requests than its budget");
+
+  // The first response comes from the ready sockets, every client is put off
+  // after it. While they all have requests left, each one is then served
+  // before any is served again
+  bool in_turn = total == CLIENTS * REQUESTS;
+  for (int i = 2; i <= CLIENTS && in_turn; i++) {
+    for (int j = 1; j < i; j++)
+      in_turn &= served[i] != served[j];
+  }
+  for (int i = 1 + CLIENTS;i < 1 + CLIENTS * (REQUESTS - 1) && in_turn; i++)
+    in_turn = served[i] == served[i - CLIENTS];
+
+  check(in_turn, "deferred clients are served in turn");
+
+  for (int c = 0; c < CLIENTS; c++)
+    close(clients[c]);
+
+  stop_network();
+}
+
+int main() {
+  test_refill();
+  test_round_budget();
+  test_deferred_order();
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shortlist.h"
+
+/**
+ * @file shortlist_test.c
+ * @brief Checks how a shortlist recognizes peers and makes room for closer
+ * ones
+ *
+ * The target is the zero ID, so the distance of a peer is its ID. IDs sharing
+ * their first 8 bytes start their probe sequence in the same entry of the
+ * set of IDs already seen.
+ *
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if (!condition)
+    failures++;
+}
+
+/**
+ * @brief Makes a peer whose ID starts with a given prefix, the rest of the ID
+ * telling peers of the same prefix apart
+ *
+ */
+static struct Peer make_peer(uint64_t prefix, uint32_t rest) {
+  struct Peer peer;
+  memset(&peer, 0, sizeof(peer));
+
+  memcpy(peer.peer_id, &prefix, sizeof(prefix));
+  memcpy(peer.peer_id + sizeof(HashID) - sizeof(rest), &rest, sizeof(rest));
+
+  return peer;
+}
+
+/**
+ * @brief Makes a peer whose distance to the zero target grows with its rank
+ *
+ */
+static struct Peer ranked_peer(uint32_t rank) {
+  struct Peer peer;
+  memset(&peer, 0, sizeof(peer));
+
+  // Big endian, so that IDs compare like their ranks
+  peer.peer_id[0] = 1;
+  peer.peer_id[1] = (uint8_t)(rank >> 16);
+  peer.peer_id[2] = (uint8_t)(rank >> 8);
+  peer.peer_id[3] = (uint8_t)rank;
+
+  return peer;
+}
+
+/**
+ * @brief Gets the entry of the set of IDs already seen an ID probes first,
+ * computed like the shortlist does
+ *
+ */
+static size_t first_entry(uint64_t prefix) {
+  return (prefix * 0x9E3779B97F4A7C15ull) >> (64 - SHORTLIST_SEEN_BITS);
+}
+
+static bool is_sorted(struct Shortlist *list) {
+  for (size_t i = 1; i < list->count; i++) {
+    if (compare_hashes(shortlist_get(list, i - 1)->distance,
+                       shortlist_get(list, i)->distance) >= 0)
+      return false;
+  }
+
+  return true;
+}
+
+static bool contains(struct Shortlist *list, const struct Peer *peer) {
+  for (size_t i = 0; i < list->count; i++) {
+    if (memcmp(shortlist_get(list, i)->peer.peer_id, peer->peer_id,
+               sizeof(HashID)) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * @brief Fills a shortlist with the peers of ranks first to first +
+ * SHORTLIST_CAPACITY - 1
+ *
+ */
+static void fill(struct Shortlist *list, uint32_t first) {
+  static const HashID target = {0};
+
+  shortlist_init(list, target);
+
+  for (uint32_t i = 0; i < SHORTLIST_CAPACITY; i++) {
+    struct Peer peer = ranked_peer(first + i);
+    shortlist_add(list, &peer);
+  }
+}
+
+/**
+ * @brief Sets the state of the candidates of ranks from to to, included
+ *
+ */
+static void set_state(struct Shortlist *list, uint32_t from, uint32_t to,
+                      enum CandidateState state) {
+  for (uint32_t i = from; i <= to; i++)
+    shortlist_get(list, i)->state = state;
+}
+
+static void test_seen_probing() {
+  static struct Shortlist list;
+  static const HashID target = {0};
+  static const HashID zero = {0};
+  const size_t last = (1 << SHORTLIST_SEEN_BITS) - 1;
+
+  // A prefix probing the last entry first, so its sequence wraps around
+  uint64_t prefix = 1;
+  while (first_entry(prefix) != last)
+    prefix++;
+
+  shortlist_init(&list, target);
+
+  struct Peer zero_peer = make_peer(0, 0);
+  check(shortlist_add(&list, &zero_peer) == NULL && list.seen_count == 0,
+        "zero ID isn't added");
+
+  bool added = true;
+  for (uint32_t i = 1; i <= 8; i++) {
+    struct Peer peer = make_peer(prefix, i);
+    added &= shortlist_add(&list, &peer) != NULL;
+  }
+  check(added && list.count == 8 && list.seen_count == 8 && is_sorted(&list),
+        "IDs probing the same entry are all added");
+  check(memcmp(list.seen[last], zero, sizeof(HashID)) != 0 &&
+            memcmp(list.seen[6], zero, sizeof(HashID)) != 0,
+        "probe sequence wraps around the end of the set");
+
+  bool rejected = true;
+  for (uint32_t i = 1; i <= 8; i++) {
+    struct Peer peer = make_peer(prefix, i);
+    rejected &= shortlist_add(&list, &peer) == NULL;
+  }
+  check(rejected && list.count == 8 && list.seen_count == 8,
+        "IDs found after wrapping around are recognized");
+
+  struct Peer other = make_peer(prefix, 9);
+  check(shortlist_add(&list, &other) != NULL && list.count == 9,
+        "ID of the same prefix not seen yet is added");
+}
+
+/**
+ * @brief Checks that a peer pushed out of the shortlist is still recognized
+ * once it would fit again
+ *
+ */
+static void test_seen_after_eviction() {
+  static struct Shortlist list;
+
+  fill(&list, 100);
+
+  // The candidates of ranks 120 to 131 wait for a response, so 119 is the
+  // farthest one that can make room for 50
+  set_state(&list, 20, 31, CANDIDATE_IN_FLIGHT);
+
+  struct Peer closer = ranked_peer(50);
+  struct Peer evicted = ranked_peer(119);
+
+  check(shortlist_add(&list, &closer) != NULL && !contains(&list, &evicted),
+        "closer peer replaces the farthest candidate not waiting");
+
+  // 131 answered, 119 would fit again in its place
+  set_state(&list, 31, 31, CANDIDATE_ANSWERED);
+
+  check(shortlist_add(&list, &evicted) == NULL &&
+            list.count == SHORTLIST_CAPACITY && !contains(&list, &evicted),
+        "peer pushed out of the shortlist isn't added again");
+}
+
+/**
+ * @brief Checks that a shortlist keeps recognizing its candidates once the set
+ * of IDs already seen stopped recording them
+ *
+ */
+static void test_seen_full() {
+  static struct Shortlist list;
+  const size_t limit = (1 << SHORTLIST_SEEN_BITS) / 4 * 3;
+
+  fill(&list, 100000);
+
+  // Every peer is closer than the others, so each one pushes out the farthest
+  for (uint32_t rank = 99999; list.seen_count < limit; rank--) {
+    struct Peer peer = ranked_peer(rank);
+    shortlist_add(&list, &peer);
+  }
+
+  struct Peer peer = ranked_peer(10);
+  check(shortlist_add(&list, &peer) != NULL && list.seen_count == limit,
+        "new peer is added once the set stopped recording");
+
+  struct Peer again = ranked_peer(10);
+  check(shortlist_add(&list, &again) == NULL,
+        "candidate not recorded in the set is recognized");
+
+  check(list.count == SHORTLIST_CAPACITY && is_sorted(&list),
+        "shortlist stays full and sorted");
+}
+
+static void test_eviction_skips_waiting() {
+  static struct Shortlist list;
+
+  fill(&list, 100);
+
+  // The farthest candidate is stalled and the one before waits for a
+  // response, the third farthest must make room
+  set_state(&list, 31, 31, CANDIDATE_STALLED);
+  set_state(&list, 30, 30, CANDIDATE_IN_FLIGHT);
+
+  struct Candidate *stalled = shortlist_get(&list, 31);
+  struct Candidate *in_flight = shortlist_get(&list, 30);
+  struct Peer evicted = ranked_peer(129);
+
+  struct Peer closer = ranked_peer(50);
+  check(shortlist_add(&list, &closer) != NULL && !contains(&list, &evicted),
+        "closer peer replaces the farthest candidate not waiting");
+  check(shortlist_get(&list, 31) == stalled &&
+            shortlist_get(&list, 30) == in_flight &&
+            stalled->state == CANDIDATE_STALLED &&
+            in_flight->state == CANDIDATE_IN_FLIGHT &&
+            list.count == SHORTLIST_CAPACITY && is_sorted(&list),
+        "waiting candidates keep their slots");
+
+  // Between 129 and 130, only waiting candidates are farther
+  struct Peer between = ranked_peer(129);
+  between.peer_id[4] = 1;
+  check(shortlist_add(&list, &between) == NULL,
+        "peer isn't added when every farther candidate waits");
+
+  struct Peer farther = ranked_peer(1000);
+  check(shortlist_add(&list, &farther) == NULL,
+        "peer farther than a full shortlist isn't added");
+
+  // Once a response arrives, the peer turned away finds room
+  set_state(&list, 30, 30, CANDIDATE_ANSWERED);
+  check(shortlist_add(&list, &between) != NULL && contains(&list, &between) &&
+            is_sorted(&list),
+        "peer turned away is added once room is made");
+}
+
+int main() {
+  test_seen_probing();
+  test_seen_after_eviction();
+  test_seen_full();
+  test_eviction_skips_waiting();
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "network.h"
+#include "rpc.h"
+#include "shared.h"
+#include "storage.h"
+#include "wire.h"
+
+/**
+ * @file store_ttl_test.c
+ * @brief Checks the lifetime a node gives the key-value pairs it is sent
+ *
+ * The node is made to know K_VALUE peers closer to a key than itself, as a
+ * node far from the key would. A replica STORE of the key must be kept
+ * forever, while a copy cached along a lookup path expires. The clock of the
+ * storage is moved forward by linking with --wrap=timer_now_ms.
+ *
+ */
+
+/**
+ * @brief How far the clock of the storage was moved forward in milliseconds
+ *
+ */
+static uint64_t clock_offset_ms = 0;
+
+uint64_t __real_timer_now_ms();
+
+uint64_t __wrap_timer_now_ms() {
+  return __real_timer_now_ms() + clock_offset_ms;
+}
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if (!condition)
+    failures++;
+}
+
+/**
+ * @brief Encodes a message in version 2 and hands it to the RPC handler like
+ * the network loop would
+ *
+ * @param conn The connection the message arrives on
+ * @param message The message structure
+ */
+static void deliver(struct Connection *conn, const void *message) {
+  char data[MAX_RPC_PACKET_SIZE];
+  size_t length = wire_encode(message, data, sizeof(data));
+
+  handle_rpc_request(conn, data, length);
+}
+
+/**
+ * @brief Sends a STORE of a key, listing a single provider
+ *
+ * @param conn The connection the STORE arrives on
+ * @param key The key
+ * @param cached Whether the STORE caches a copy along a lookup path
+ */
+static void deliver_store(struct Connection *conn, const HashID key,
+                          bool cached) {
+  struct RPCStore store = {
+      .header = {.magic_number = RPC_MAGIC,
+                 .version = RPC_VERSION,
+                 .packet_size = sizeof(struct RPCStore),
+                 .call_type = STORE},
+      .key_value = {.num_values = 1},
+      .cached = cached};
+
+  memcpy(store.key_value.key, key, sizeof(HashID));
+  memset(store.key_value.values[0].peer_id, 0x5A, sizeof(HashID));
+  store.key_value.values[0].peer_addr.sin_family = AF_INET;
+  store.key_value.values[0].peer_addr.sin_port = htons(SERVER_PORT);
+
+  deliver(conn, &store);
+}
+
+int main() {
+  HashID own_id;
+  if (get_own_id(own_id) != 0) {
+    printf("FAIL: get_own_id\n");
+    return 1;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+
+  struct Connection *conn = connection_open(fds[0], CONN_PEER, NULL);
+
+  // The keys are as far from us as can be, the peers we learn share all but
+  // their last byte with them
+  HashID replica_key, cached_key;
+  memcpy(replica_key, own_id, sizeof(HashID));
+  replica_key[0] ^= 0x80;
+  memcpy(cached_key, replica_key, sizeof(HashID));
+  cached_key[sizeof(HashID) - 1] ^= 0xF0;
+
+  for (int i = 0; i < K_VALUE; i++) {
+    struct RPCBroadcast broadcast = {
+        .header = {.magic_number = RPC_MAGIC,
+                   .version = RPC_VERSION,
+                   .packet_size = sizeof(struct RPCBroadcast),
+                   .call_type = BROADCAST}};
+
+    memcpy(broadcast.peer.peer_id, replica_key, sizeof(HashID));
+    broadcast.peer.peer_id[sizeof(HashID) - 1] ^= (uint8_t)(i + 1);
+    broadcast.peer.peer_addr.sin_family = AF_INET;
+    broadcast.peer.peer_addr.sin_port = htons(SERVER_PORT);
+    broadcast.peer.peer_addr.sin_addr.s_addr = htonl(0x0A000001 + i);
+
+    deliver(conn, &broadcast);
+  }
+
+  deliver_store(conn, replica_key, false);
+  deliver_store(conn, cached_key, true);
+
+  check(storage_get_value(replica_key, NULL) == 0, "replica stored");
+  check(storage_get_value(cached_key, NULL) == 0, "cached copy stored");
+
+  clock_offset_ms = (uint64_t)CACHED_VALUE_TTL * 1000 * 2;
+
+  check(storage_get_value(replica_key, NULL) == 0,
+        "replica on a far node doesn't expire");
+  check(storage_get_value(cached_key, NULL) != 0, "cached copy expires");
+
+  connection_close(conn);
+  connection_recycle_closed();
+  close(fds[1]);
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,352 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer.h"
+
+/**
+ * @file timer_test.c
+ * @brief Checks that the timers of the wheel fire on their exact millisecond
+ *
+ * The clock is faked by linking with --wrap=timer_now_ms, the wheel is
+ * advanced to the fake time like the network loop would. Timers are placed on
+ * the boundaries of the levels, cancelled and restarted, set further away
+ * than the wheel spans, and finally started at random.
+ *
+ */
+
+/**
+ * @brief The delay covered by the whole wheel
+ *
+ */
+#define WHEEL_SPAN (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+static uint64_t fake_now = 0;
+
+uint64_t __wrap_timer_now_ms() { return fake_now; }
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+  if (!condition)
+    failures++;
+}
+
+/**
+ * @brief A timer recording when it fired
+ *
+ */
+struct TestTimer {
+  struct Timer timer;
+
+  /**
+   * @brief How many times the timer fired
+   *
+   */
+  int fired;
+
+  /**
+   * @brief Whether a firing happened on another millisecond than expected
+   *
+   */
+  bool late;
+
+  /**
+   * @brief The millisecond the timer is expected to fire at next
+   *
+   */
+  uint64_t due;
+
+  /**
+   * @brief For periodic timers, how many times it fires before cancelling
+   * itself, 0 to keep it running
+   *
+   */
+  int limit;
+
+  /**
+   * @brief A timer cancelled when this one fires
+   *
+   */
+  struct Timer *victim;
+};
+
+static void on_fire(struct Timer *timer, void *arg) {
+  struct TestTimer *test = arg;
+
+  // The wheel already moved to the millisecond after the one being fired
+  uint64_t tick = timer->wheel->now - 1;
+
+  if (tick != test->due)
+    test->late = true;
+
+  test->fired++;
+  test->due += timer->interval;
+
+  if (test->victim)
+    timer_cancel(test->victim);
+
+  if (test->limit > 0 && test->fired == test->limit)
+    timer_cancel(timer);
+}
+
+/**
+ * @brief Starts a test timer, or restarts it if it was started before
+ *
+ */
+static void start(struct TimerWheel *wheel, struct TestTimer *test,
+                  uint64_t delay, uint64_t interval) {
+  if (!test->timer.func)
+    timer_init(&test->timer, on_fire, test);
+
+  test->due = fake_now + delay;
+  timer_start(wheel, &test->timer, delay, interval);
+}
+
+/**
+ * @brief Moves the fake clock and the wheel forward
+ *
+ */
+static void advance_to(struct TimerWheel *wheel, uint64_t now) {
+  fake_now = now;
+  timer_wheel_advance(wheel, now);
+}
+
+/**
+ * @brief Checks that timers on either side of every level boundary fire on
+ * time, starting from a time aligned on every level and from one that isn't
+ *
+ */
+static void test_cascade_boundaries(uint64_t origin) {
+  static const uint64_t boundaries[] = {
+      1ULL << TIMER_LEVEL_BITS, 1ULL << (2 * TIMER_LEVEL_BITS),
+      1ULL << (3 * TIMER_LEVEL_BITS), WHEEL_SPAN};
+  const size_t count = sizeof(boundaries) / sizeof(boundaries[0]);
+
+  struct TimerWheel wheel;
+  struct TestTimer timers[3 * sizeof(boundaries) / sizeof(boundaries[0])] = {
+      0};
+
+  fake_now = origin;
+  timer_wheel_init(&wheel, origin);
+
+  for (size_t i = 0; i < count; i++) {
+    start(&wheel, &timers[3 * i], boundaries[i] - 1, 0);
+    start(&wheel, &timers[3 * i + 1], boundaries[i], 0);
+    start(&wheel, &timers[3 * i + 2], boundaries[i] + 1, 0);
+  }
+
+  bool on_time = true;
+  bool timeout_exact = true;
+
+  // Jump from one expiry to the next, as a loop only woken by timers would
+  while (wheel.count > 0) {
+    int timeout = timer_wheel_timeout(&wheel, fake_now);
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < 3 * count; i++) {
+      if (timer_pending(&timers[i].timer) && timers[i].due < next)
+        next = timers[i].due;
+    }
+
+    // A timer left behind would never fire
+    if (next <= fake_now) {
+      on_time = false;
+      break;
+    }
+
+    if (timeout < 0 || fake_now + (uint64_t)timeout != next)
+      timeout_exact = false;
+
+    advance_to(&wheel, next - 1);
+    advance_to(&wheel, next);
+  }
+
+  for (size_t i = 0; i < 3 * count; i++)
+    on_time &= timers[i].fired == 1 && !timers[i].late;
+
+  char what[128];
+  snprintf(what, sizeof(what),
+           "timers around the level boundaries fire on time from %llu",
+           (unsigned long long)origin);
+  check(on_time, what);
+
+  snprintf(what, sizeof(what),
+           "timeout is the delay to the next expiry from %llu",
+           (unsigned long long)origin);
+  check(timeout_exact, what);
+}
+
+/**
+ * @brief Checks the timeout when the current slot of a level holds timers of
+ * its next turn, which must not hide nearer timers of the following slots
+ *
+ */
+static void test_timeout_next_turn() {
+  struct TimerWheel wheel;
+  struct TestTimer next_turn = {0}, near = {0};
+  const uint64_t slot_span = 1ULL << TIMER_LEVEL_BITS;
+
+  // Not aligned on a first level turn, so its slot of the second level was
+  // already cascaded
+  fake_now = (1ULL << 30) + 37;
+  timer_wheel_init(&wheel, fake_now);
+
+  // Lands in the current slot of the second level, one turn later
+  start(&wheel, &next_turn, TIMER_SLOTS * slot_span - 37 + 5, 0);
+  start(&wheel, &near, 200, 0);
+
+  check(timer_wheel_timeout(&wheel, fake_now) == 200,
+        "timeout skips the timers of the next turn of the current slot");
+
+  advance_to(&wheel, fake_now + 200);
+  check(near.fired == 1 && !near.late && next_turn.fired == 0,
+        "only the near timer fired");
+
+  advance_to(&wheel, next_turn.due);
+  check(next_turn.fired == 1 && !next_turn.late,
+        "timer of the next turn fires on time");
+}
+
+static void test_cancel_and_reschedule() {
+  struct TimerWheel wheel;
+  struct TestTimer cancelled = {0}, restarted = {0}, pulled = {0},
+                   periodic = {0}, first = {0}, second = {0};
+
+  fake_now = 5000;
+  timer_wheel_init(&wheel, fake_now);
+
+  // Cancelled while parked in a higher level
+  start(&wheel, &cancelled, 70000, 0);
+  timer_cancel(&cancelled.timer);
+  timer_cancel(&cancelled.timer);
+  check(!timer_pending(&cancelled.timer) && wheel.count == 0,
+        "cancelled timer leaves the wheel, cancelling twice is harmless");
+
+  // Restarted closer, then further away, only the last start counts
+  start(&wheel, &restarted, 10, 0);
+  start(&wheel, &restarted, 300000, 0);
+  start(&wheel, &pulled, 300000, 0);
+  start(&wheel, &pulled, 3, 0);
+  check(wheel.count == 2, "restarting a pending timer doesn't duplicate it");
+
+  // Fires every 100 ms three times, then cancels itself from its callback
+  start(&wheel, &periodic, 100, 100);
+  periodic.limit = 3;
+
+  // Two timers of the same millisecond, whichever fires first cancels the
+  // other
+  start(&wheel, &first, 200, 0);
+  start(&wheel, &second, 200, 0);
+  first.victim = &second.timer;
+  second.victim = &first.timer;
+
+  advance_to(&wheel, 5000 + 150000);
+
+  check(cancelled.fired == 0, "cancelled timer never fires");
+  check(restarted.fired == 0, "timer restarted further away waits");
+  check(pulled.fired == 1 && !pulled.late,
+        "timer restarted closer fires at its new time");
+  check(periodic.fired == 3 && !periodic.late &&
+            !timer_pending(&periodic.timer),
+        "periodic timer fires on every interval until it cancels itself");
+
+  check(first.fired + second.fired == 1,
+        "timer cancelled from a callback of the same millisecond doesn't fire");
+
+  advance_to(&wheel, 5000 + 300000);
+  check(restarted.fired == 1 && !restarted.late,
+        "timer restarted further away fires at its new time");
+  check(wheel.count == 0 && timer_wheel_timeout(&wheel, fake_now) == -1,
+        "empty wheel has no timeout");
+}
+
+static void test_beyond_span() {
+  struct TimerWheel wheel;
+  struct TestTimer far = {0}, farther = {0}, periodic = {0};
+
+  fake_now = 123456;
+  timer_wheel_init(&wheel, fake_now);
+
+  start(&wheel, &far, WHEEL_SPAN + 17, 0);
+  start(&wheel, &farther, 2 * WHEEL_SPAN + 4097, 0);
+  start(&wheel, &periodic, WHEEL_SPAN + 1, WHEEL_SPAN + 1);
+
+  // Advance in steps of about an hour, never past a due time
+  while (fake_now < farther.due) {
+    uint64_t step = 3600 * 1000 + (uint64_t)(rand() % 1000);
+    uint64_t next = fake_now + step;
+
+    int timeout = timer_wheel_timeout(&wheel, fake_now);
+    if (timeout >= 0 && fake_now + (uint64_t)timeout < next)
+      next = fake_now + (uint64_t)timeout;
+
+    advance_to(&wheel, next < farther.due ? next : farther.due);
+  }
+
+  check(far.fired == 1 && !far.late, "timer beyond the span fires on time");
+  check(farther.fired == 1 && !farther.late,
+        "timer two spans out fires on time");
+  check(periodic.fired == 2 && !periodic.late,
+        "periodic timer longer than the span fires on every interval");
+}
+
+/**
+ * @brief Starts many timers at random, some periodic, and checks none of them
+ * fires off time while the wheel is advanced in random steps
+ *
+ */
+static void test_random() {
+  enum { COUNT = 2000 };
+  static struct TestTimer timers[COUNT];
+  struct TimerWheel wheel;
+
+  fake_now = 987654321;
+  timer_wheel_init(&wheel, fake_now);
+
+  for (int i = 0; i < COUNT; i++) {
+    // Mostly short delays, some up to twice the span
+    uint64_t delay = i % 10 == 0 ? (uint64_t)rand() % (2 * WHEEL_SPAN)
+                                 : (uint64_t)rand() % 100000;
+    uint64_t interval = i % 7 == 0 ? 1 + (uint64_t)rand() % 50000 : 0;
+
+    start(&wheel, &timers[i], delay, interval);
+  }
+
+  uint64_t end = fake_now + 2 * WHEEL_SPAN;
+  bool on_time = true;
+
+  while (fake_now < end) {
+    advance_to(&wheel, fake_now + 1 + (uint64_t)rand() % 20000);
+
+    // Restart a few timers as owners would
+    int i = rand() % COUNT;
+    if (timers[i].timer.interval == 0)
+      start(&wheel, &timers[i], (uint64_t)rand() % 300000, 0);
+  }
+
+  int fired = 0;
+  for (int i = 0; i < COUNT; i++) {
+    on_time &= !timers[i].late;
+    fired += timers[i].fired;
+  }
+
+  printf("%d expiries\n", fired);
+  check(on_time, "randomly started timers fire on their exact millisecond");
+}
+
+int main() {
+  srand(7);
+
+  test_cascade_boundaries(1ULL << 30);
+  test_cascade_boundaries((1ULL << 30) + 4096 + 64 + 37);
+  test_timeout_next_turn();
+  test_cancel_and_reschedule();
+  test_beyond_span();
+  test_random();
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,430 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rpc.h"
+#include "wire.h"
+
+/**
+ * @file wire_test.c
+ * @brief Checks the encoding of the RPC messages in both protocol versions
+ *
+ * Every message type is encoded and decoded back in each version it exists
+ * in, and must come out unchanged. Messages cut short, with counts larger
+ * than their structure holds or with bytes left after their last field must
+ * be rejected.
+ *
+ */
+
+static int failures = 0;
+
+static void check(bool condition, const char *what, const char *type,
+                  int version) {
+  if (!condition) {
+    printf("FAIL: %s (%s, version %d)\n", what, type, version);
+    failures++;
+  }
+}
+
+/**
+ * @brief Fills a peer with values depending on its index
+ *
+ * @param peer The peer
+ * @param index The index of the peer
+ * @param key Whether the peer has a public key
+ */
+static void fill_peer(struct RPCPeer *peer, int index, bool key) {
+  memset(peer->peer_id, 0x10 + index, sizeof(HashID));
+  peer->peer_addr.sin_family = AF_INET;
+  peer->peer_addr.sin_addr.s_addr = htonl(0x0A000001 + index);
+  peer->peer_addr.sin_port = htons(8182 + index);
+
+  if (key)
+    memset(peer->peer_key, 0xA0 + index, sizeof(PubKey));
+}
+
+static void fill_key_value(struct RPCKeyValue *value, int index, size_t count,
+                           bool keys) {
+  memset(value->key, 0x40 + index, sizeof(HashID));
+  value->num_values = count;
+
+  for (size_t i = 0; i < count; i++)
+    fill_peer(&value->values[i], index + (int)i, keys && i == 0);
+}
+
+static void fill_header(void *message, enum RPCCallType type,
+                        uint8_t version) {
+  struct RPCMessageHeader *header = message;
+
+  memcpy(header->magic_number, RPC_MAGIC, 4);
+  header->version = version;
+  header->call_type = type;
+  header->packet_size = (int)wire_structure_size(type);
+  header->request_id = 0xC0FFEE00u | type;
+}
+
+/**
+ * @brief Builds a message of a type with every field set, keys telling
+ * whether some of its peers have a public key
+ *
+ * @param type The call type
+ * @param version The protocol version
+ * @param keys Whether some peers have a public key
+ * @param out A pointer to zeroed memory of MAX_RPC_MESSAGE_SIZE bytes
+ */
+static void build_message(enum RPCCallType type, uint8_t version, bool keys,
+                          void *out) {
+  fill_header(out, type, version);
+
+  switch (type) {
+  case PING:
+    break;
+
+  case STORE: {
+    struct RPCStore *store = out;
+    fill_key_value(&store->key_value, 1, K_VALUE, keys);
+    store->cached = true;
+    break;
+  }
+
+  case FIND_NODE:
+  case FIND_VALUE:
+    memset(((struct RPCFind *)out)->key, 0x33, sizeof(HashID));
+    break;
+
+  case PING_RESPONSE:
+  case STORE_RESPONSE:
+    ((struct RPCResponse *)out)->success = true;
+    break;
+
+  case FIND_NODE_RESPONSE: {
+    struct RPCFindNodeResponse *response = out;
+    response->success = true;
+    response->num_closest = K_VALUE - 1;
+
+    for (size_t i = 0; i < response->num_closest; i++)
+      fill_peer(&response->closest[i], (int)i, keys && i == 1);
+    break;
+  }
+
+  case FIND_VALUE_RESPONSE: {
+    struct RPCFindValueResponse *response = out;
+    response->success = true;
+    response->found_key = true;
+    fill_key_value(&response->values, 2, 2, keys);
+    response->num_closest = K_VALUE;
+
+    for (size_t i = 0; i < response->num_closest; i++)
+      fill_peer(&response->closest[i], 8 + (int)i, false);
+    break;
+  }
+
+  case BROADCAST:
+    fill_peer(&((struct RPCBroadcast *)out)->peer, 7, keys);
+    break;
+
+  case STORE_MULTI: {
+    struct RPCStoreMulti *store = out;
+    store->num_values = RPC_BATCH_MAX;
+
+    for (size_t i = 0; i < store->num_values; i++)
+      fill_key_value(&store->key_values[i], (int)i, i % (K_VALUE + 1), keys);
+    break;
+  }
+
+  case FIND_VALUE_MULTI: {
+    struct RPCFindMulti *find = out;
+    find->num_keys = RPC_BATCH_MAX - 1;
+
+    for (size_t i = 0; i < find->num_keys; i++)
+      memset(find->keys[i], (int)i, sizeof(HashID));
+    break;
+  }
+
+  case STORE_MULTI_RESPONSE: {
+    struct RPCStoreMultiResponse *response = out;
+    response->num_results = 5;
+
+    for (size_t i = 0; i < response->num_results; i++)
+      response->success[i] = i % 2;
+    break;
+  }
+
+  case FIND_VALUE_MULTI_RESPONSE: {
+    struct RPCFindValueMultiResponse *response = out;
+    response->num_results = RPC_BATCH_MAX;
+
+    for (size_t i = 0; i < response->num_results; i++) {
+      struct RPCValueResult *result = &response->results[i];
+
+      // Found and missing keys alternate
+      if (i % 2 == 0) {
+        result->found_key = true;
+        fill_key_value(&result->values, (int)i, 1 + i % K_VALUE, keys);
+      }
+
+      result->num_closest = i % (K_VALUE + 1);
+      for (size_t j = 0; j < result->num_closest; j++)
+        fill_peer(&result->closest[j], (int)(i + j), false);
+    }
+    break;
+  }
+  }
+}
+
+static const struct {
+  enum RPCCallType type;
+  const char *name;
+  bool batched;
+} types[] = {
+    {PING, "PING", false},
+    {STORE, "STORE", false},
+    {FIND_NODE, "FIND_NODE", false},
+    {FIND_VALUE, "FIND_VALUE", false},
+    {PING_RESPONSE, "PING_RESPONSE", false},
+    {STORE_RESPONSE, "STORE_RESPONSE", false},
+    {FIND_NODE_RESPONSE, "FIND_NODE_RESPONSE", false},
+    {FIND_VALUE_RESPONSE, "FIND_VALUE_RESPONSE", false},
+    {BROADCAST, "BROADCAST", false},
+    {STORE_MULTI, "STORE_MULTI", true},
+    {FIND_VALUE_MULTI, "FIND_VALUE_MULTI", true},
+    {STORE_MULTI_RESPONSE, "STORE_MULTI_RESPONSE", true},
+    {FIND_VALUE_MULTI_RESPONSE, "FIND_VALUE_MULTI_RESPONSE", true},
+};
+
+/**
+ * @brief Sets the length of a version 2 message in its header
+ *
+ */
+static void set_length(char *data, size_t length) {
+  uint16_t value = htons((uint16_t)length);
+  memcpy(data + 7, &value, sizeof(value));
+}
+
+/**
+ * @brief Sets the size of a version 1 message in its header
+ *
+ */
+static void set_packet_size(char *data, size_t length) {
+  ((struct RPCMessageHeader *)data)->packet_size = (int)length;
+}
+
+/**
+ * @brief Encodes a message type in a version, decodes it back and checks
+ * that malformed variants of the encoding are rejected
+ *
+ */
+static void check_type(size_t index, uint8_t version, bool keys) {
+  enum RPCCallType type = types[index].type;
+  const char *name = types[index].name;
+  size_t size = wire_structure_size(type);
+
+  char *message = calloc(1, MAX_RPC_MESSAGE_SIZE);
+  char *decoded = calloc(1, MAX_RPC_MESSAGE_SIZE);
+  char *data = calloc(1, MAX_RPC_MESSAGE_SIZE + 1);
+
+  build_message(type, version, keys, message);
+  size_t length = wire_encode(message, data, MAX_RPC_MESSAGE_SIZE);
+
+  // Batched messages don't exist in version 1
+  if (version == RPC_LEGACY_VERSION && types[index].batched) {
+    check(length == 0, "batched message isn't encoded", name, version);
+    goto out;
+  }
+
+  check(length > 0, "message is encoded", name, version);
+  check(wire_message_size(data, length) == (ssize_t)length,
+        "size is read from the header", name, version);
+  check(wire_decode(data, length, decoded, MAX_RPC_MESSAGE_SIZE) == size,
+        "message is decoded", name, version);
+  check(memcmp(message, decoded, size) == 0, "round-trip is exact", name,
+        version);
+
+  check(wire_decode(data, length, decoded, size - 1) == 0,
+        "decoding into a short structure fails", name, version);
+  check(wire_encode(message, decoded, length - 1) == 0,
+        "encoding into a short buffer fails", name, version);
+
+  // Cut anywhere, with the header left as is
+  bool truncated = true;
+  for (size_t cut = 0; cut < length; cut++)
+    truncated &= wire_decode(data, cut, decoded, MAX_RPC_MESSAGE_SIZE) == 0;
+  check(truncated, "truncated message is rejected", name, version);
+
+  // Cut in the body, with a header agreeing with the cut
+  if (version == RPC_VERSION) {
+    bool cut_body = true;
+    for (size_t cut = WIRE_HEADER_SIZE; cut < length; cut++) {
+      set_length(data, cut);
+      cut_body &= wire_decode(data, cut, decoded, MAX_RPC_MESSAGE_SIZE) == 0;
+    }
+    set_length(data, length);
+    check(cut_body, "message ending early is rejected", name, version);
+  }
+
+  // A byte after the last field, with and without the header counting it
+  data[length] = 0;
+  check(wire_decode(data, length + 1, decoded, MAX_RPC_MESSAGE_SIZE) == 0,
+        "trailing byte is rejected", name, version);
+
+  if (version == RPC_VERSION)
+    set_length(data, length + 1);
+  else
+    set_packet_size(data, length + 1);
+
+  check(wire_decode(data, length + 1, decoded, MAX_RPC_MESSAGE_SIZE) == 0,
+        "trailing byte counted by the header is rejected", name, version);
+
+out:
+  free(message);
+  free(decoded);
+  free(data);
+}
+
+/**
+ * @brief Writes the header of a version 2 message
+ *
+ * @return size_t Returns the size of the header
+ */
+static size_t put_header(char *data, enum RPCCallType type, uint8_t flags) {
+  memcpy(data, RPC_MAGIC, 4);
+  data[4] = RPC_VERSION;
+  data[5] = (char)__builtin_ctz(type);
+  data[6] = (char)flags;
+  memset(data + 9, 0, 4);
+
+  return WIRE_HEADER_SIZE;
+}
+
+/**
+ * @brief Builds a version 2 message whose first field is a count followed by
+ * that many entries of a given size, and tells whether it is decoded
+ *
+ */
+static bool decodes_with_count(enum RPCCallType type, uint8_t flags,
+                               size_t count, size_t entry_size) {
+  char *data = calloc(1, MAX_RPC_MESSAGE_SIZE + 4096);
+  char *decoded = calloc(1, MAX_RPC_MESSAGE_SIZE);
+
+  size_t length = put_header(data, type, flags);
+  data[length++] = (char)count;
+  length += count * entry_size;
+  set_length(data, length);
+
+  bool decoded_ok =
+      wire_decode(data, length, decoded, MAX_RPC_MESSAGE_SIZE) != 0;
+
+  free(data);
+  free(decoded);
+  return decoded_ok;
+}
+
+static void check_counts() {
+  const size_t peer_size = sizeof(HashID) + 6;
+
+  check(decodes_with_count(FIND_NODE_RESPONSE, 0, K_VALUE, peer_size),
+        "K_VALUE closest peers are accepted", "FIND_NODE_RESPONSE",
+        RPC_VERSION);
+  check(!decodes_with_count(FIND_NODE_RESPONSE, 0, K_VALUE + 1, peer_size),
+        "more than K_VALUE closest peers are rejected", "FIND_NODE_RESPONSE",
+        RPC_VERSION);
+
+  check(decodes_with_count(FIND_VALUE_MULTI, 0, RPC_BATCH_MAX, sizeof(HashID)),
+        "RPC_BATCH_MAX keys are accepted", "FIND_VALUE_MULTI", RPC_VERSION);
+  check(!decodes_with_count(FIND_VALUE_MULTI, 0, RPC_BATCH_MAX + 1,
+                            sizeof(HashID)),
+        "more than RPC_BATCH_MAX keys are rejected", "FIND_VALUE_MULTI",
+        RPC_VERSION);
+  check(!decodes_with_count(STORE_MULTI_RESPONSE, 0, RPC_BATCH_MAX + 1, 1),
+        "more than RPC_BATCH_MAX results are rejected", "STORE_MULTI_RESPONSE",
+        RPC_VERSION);
+
+  // A count of 300 as a varint, whatever follows
+  char data[64] = {0};
+  char decoded[sizeof(struct RPCFindMulti)];
+  size_t length = put_header(data, FIND_VALUE_MULTI, 0);
+  data[length++] = (char)0xAC;
+  data[length++] = 0x02;
+  set_length(data, length);
+  check(wire_decode(data, length, decoded, sizeof(decoded)) == 0,
+        "multi-byte count is checked", "FIND_VALUE_MULTI", RPC_VERSION);
+
+  // Version 1 counts are native integers taken as they came
+  struct RPCStore store = {0};
+  build_message(STORE, RPC_LEGACY_VERSION, false, &store);
+  store.key_value.num_values = K_VALUE + 1;
+  check(wire_decode((const char *)&store, sizeof(store), decoded,
+                    sizeof(decoded)) == 0,
+        "more than K_VALUE providers are rejected", "STORE",
+        RPC_LEGACY_VERSION);
+
+  struct RPCFindNodeResponse response = {0};
+  build_message(FIND_NODE_RESPONSE, RPC_LEGACY_VERSION, false, &response);
+  response.num_closest = (size_t)-1;
+  check(wire_decode((const char *)&response, sizeof(response), decoded,
+                    sizeof(decoded)) == 0,
+        "huge count of closest peers is rejected", "FIND_NODE_RESPONSE",
+        RPC_LEGACY_VERSION);
+
+  // Encoding never writes counts the structures can't hold
+  response.header.version = RPC_VERSION;
+  response.num_closest = K_VALUE + 1;
+  check(wire_encode(&response, data, sizeof(data)) == 0,
+        "oversized count isn't encoded", "FIND_NODE_RESPONSE", RPC_VERSION);
+}
+
+static void check_headers() {
+  char data[WIRE_HEADER_SIZE] = {0};
+  put_header(data, PING, 0);
+  set_length(data, WIRE_HEADER_SIZE);
+
+  for (size_t cut = 0; cut < WIRE_HEADER_SIZE; cut++)
+    check(wire_message_size(data, cut) <= 0, "partial header has no size",
+          "PING", RPC_VERSION);
+
+  data[4] = RPC_VERSION + 1;
+  check(wire_message_size(data, sizeof(data)) < 0,
+        "unknown version is rejected", "PING", RPC_VERSION + 1);
+
+  data[4] = RPC_VERSION;
+  memcpy(data, "XXXX", 4);
+  check(wire_message_size(data, sizeof(data)) < 0,
+        "wrong magic number is rejected", "PING", RPC_VERSION);
+}
+
+static void check_request_keys() {
+  char *message = calloc(1, MAX_RPC_MESSAGE_SIZE);
+  char *data = calloc(1, MAX_RPC_MESSAGE_SIZE);
+
+  build_message(FIND_VALUE_MULTI, RPC_VERSION, false, message);
+  size_t length = wire_encode(message, data, MAX_RPC_MESSAGE_SIZE);
+  check(wire_request_keys(data, length) == RPC_BATCH_MAX - 1,
+        "batched request counts its keys", "FIND_VALUE_MULTI", RPC_VERSION);
+
+  memset(message, 0, MAX_RPC_MESSAGE_SIZE);
+  build_message(PING, RPC_VERSION, false, message);
+  length = wire_encode(message, data, MAX_RPC_MESSAGE_SIZE);
+  check(wire_request_keys(data, length) == 1, "single request counts one key",
+        "PING", RPC_VERSION);
+
+  free(message);
+  free(data);
+}
+
+int main() {
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    check_type(i, RPC_LEGACY_VERSION, false);
+    check_type(i, RPC_VERSION, false);
+    check_type(i, RPC_VERSION, true);
+  }
+
+  check_counts();
+  check_headers();
+  check_request_keys();
+
+  printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+  return failures == 0 ? 0 : 1;
+}